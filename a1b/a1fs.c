@@ -20,7 +20,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -28,9 +27,10 @@
 
 #include "a1fs.h"
 #include "fs_ctx.h"
+#include "fs_ops.h"
 #include "options.h"
-#include "map.h"
 #include "helpers.h"
+#include "handle.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -57,14 +57,24 @@
  */
 static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 {
-	// Nothing to initialize if only printing help
-	if (opts->help) return true;
-
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image) return false;
+	return mount_image(opts, fs);
+}
 
-	return fs_ctx_init(fs, image, size);
+/**
+ * Start the background threads of the file system.
+ *
+ * This is the FUSE init() callback (see start_fs_threads()).
+ *
+ * @param conn  the capabilities of the connection.
+ * @return      the file system context, kept as the FUSE private data.
+ */
+static void *a1fs_start(struct fuse_conn_info *conn)
+{
+	// splice written data from /dev/fuse (see a1fs_write_buf())
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+	fs_ctx *fs = (fs_ctx*)fuse_get_context()->private_data;
+	start_fs_threads(fs);
+	return fs;
 }
 
 /**
@@ -75,11 +85,7 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
  */
 static void a1fs_destroy(void *ctx)
 {
-	fs_ctx *fs = (fs_ctx*)ctx;
-	if (fs->image) {
-		munmap(fs->image, fs->size);
-		fs_ctx_destroy(fs);
-	}
+	unmount_image((fs_ctx*)ctx);
 }
 
 /** Get file system context. */
@@ -88,187 +94,41 @@ static fs_ctx *get_fs(void)
 	return (fs_ctx*)fuse_get_context()->private_data;
 }
 
-// helper functions
-static int a1fs_truncate(const char *path, off_t size); // so that helper function does not compain
-
 /**
- * write the provided dir_entry to the fs under the given target_inode/parent directory
+ * Resolve the parent directory of path
  *
- * NOTE: Can assume that parent path exists and is a directory
- *
- * @param path  					the abolute path of the parent
- * @param new_dir_dentry  the entry we have to add to the parent
- * @param fs  						file system struct
- * @return       					0 on success and -error
- */
-int add_dir_entry(char *path, a1fs_dentry *new_dir_dentry, fs_ctx *fs, bool is_dir){
-	long inode_num = path_lookup(path, fs); // don't have to error check due to precondition
-	a1fs_inode *parent_inode = (a1fs_inode *)(fs->image + fs->inode_table.start *\
-		A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-
-	// otherwise we are going to have allocate another block, maybe another extent and maybe even indirect
-	// block, so we use out truncate method as it does that for us
-	int res = a1fs_truncate(path, parent_inode->size + sizeof(a1fs_dentry));
-	if(res < 0){
-		return res; // we could not allocate space for whatever reason(inode table full, block table full)
-	}
-
-	// we want to grab it again since we made some changes to its fields
-	parent_inode = (a1fs_inode *)(fs->image + fs->inode_table.start *\
-		A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode)); 
-
-	// since we did truncate, there is space for this dentry
-	a1fs_extent *last_extent = get_final_extent(parent_inode, fs);
-	uint32_t last_block = last_extent->start + last_extent->count - 1; 
-	uint32_t offset_into_last_block = (parent_inode->size - sizeof(a1fs_dentry)) % A1FS_BLOCK_SIZE;
-
-	memcpy(fs->image + last_block * A1FS_BLOCK_SIZE + offset_into_last_block, new_dir_dentry, sizeof(a1fs_dentry));
-
-	if(is_dir){
-		parent_inode->links += 1; // this should only be done if dentry is a dir 
-		memcpy(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * \
-			sizeof(a1fs_inode), parent_inode, sizeof(a1fs_inode));
-	}
-
-	return 0;
-}
-
-/**
- * Given the parent node number, remove the directory with name target name
- * and deallocate the inode number of the sub file/dir 
- * 
- * @param inode_num		the inode number of the parent directory
- * @param target_name the name of the target file or directory
- * @param is_dir 			true iff the target_name is a dir and not a file(effects parent inode modification)
- * @param fs					the file system struct
- * 
- * NOTE: we can assume that target_name exists
- * @return      	0 
+ * @param path	the absolute path of a file or directory
+ * @param fs		the file system struct
+ * @return			the inode number of the parent; -errno on error
  */
-int remove_dir_entry(char *path, char *target_name, bool is_dir, fs_ctx *fs){
-	// return 0;
-	// We can calculate the number of entries this directory has
-	long inode_num = path_lookup(path, fs); // don't have to error check due to precondition
-	a1fs_inode* inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-	a1fs_extent *curr_extent; 
-	a1fs_dentry *curr_dentry; // The current entry we are looking at
-
-	// First we check the 10 direct extent blocks then the indirect block 
-	// We are checking 522 which is more than needed
-	for(uint32_t i = 0; i < inode->num_extents; i++){
-		if(i < 10)
-			curr_extent = &inode->extents[i];
-		else
-			curr_extent = (a1fs_extent *) (fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (i - 10) * sizeof(a1fs_extent));
-		// if the count is <= 0 is implies that there is no in use extent in that location
-
-		if(curr_extent->count > 0){
-			// this extent is valid and is not empty
-			for (a1fs_blk_t j = curr_extent->start; j < curr_extent->start + curr_extent->count; j ++){
-				// Each block can fit a max of 16 dentries. Need to check if any match the target
-				for(int k = 0; k < 16; k ++){
-					curr_dentry = (a1fs_dentry *) (fs->image + j * A1FS_BLOCK_SIZE + k * sizeof(a1fs_dentry));
-					
-					if(curr_dentry->ino > 0 && strcmp(target_name, curr_dentry->name) == 0){
-						uint32_t entries_in_last_block = inode->size % A1FS_BLOCK_SIZE == 0 ? \
-							A1FS_BLOCK_SIZE / sizeof(a1fs_dentry) : (inode->size % A1FS_BLOCK_SIZE) / sizeof(a1fs_dentry);
-						a1fs_extent *last_extent = get_final_extent(inode, fs);
-						uint32_t last_block = last_extent->start + last_extent->count - 1;
-						a1fs_dentry *last_dentry = (a1fs_dentry *) (fs->image + last_block * A1FS_BLOCK_SIZE + (entries_in_last_block - 1) * sizeof(a1fs_dentry));
-
-						// we replace the dentry with the last dentry. Think we shrink the inode size 
-						if(last_dentry->ino != curr_dentry->ino)
-							memcpy(fs->image + j * A1FS_BLOCK_SIZE + k * sizeof(a1fs_dentry), last_dentry, sizeof(a1fs_dentry));
-						
-						last_dentry->ino = 0; // we are going to rewrite this back so that we don't read it during readdir
-						memcpy(fs->image + last_block * A1FS_BLOCK_SIZE +  (entries_in_last_block - 1)\
-							 * sizeof(a1fs_dentry), last_dentry, sizeof(a1fs_dentry));
-
-						a1fs_truncate(path, inode->size - sizeof(a1fs_dentry)); // this should not fail in cases where we are decreasing size
-							
-						// we want to grab it again since we made some changes to its fields
-						inode = (a1fs_inode *)(fs->image + fs->inode_table.start *\
-							A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode)); 
-
-						if(is_dir){
-							inode->links -= 1; // this should only be done if dentry is a dir 
-							memcpy(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * \
-								sizeof(a1fs_inode), inode, sizeof(a1fs_inode));
-						}
-				
-						return 0;
-					}
-
-				}
-
-			}
-		}
-	}
-
-	return -1; // could not find the dentry. This is not possible due to precondition
+static long parent_lookup(const char *path, fs_ctx *fs)
+{
+	char parent_path[strlen(path) + 1];
+	strcpy(parent_path, path);
+	set_parent_path(parent_path);
+	return path_lookup(parent_path, fs);
 }
 
-
 /**
- * Helper function which intializes and creates an inode wether that be a directory or 
- * a file
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" doesn't exist.
- *   The parent directory of "path" exists and is a directory.
- *   "path" and its components are not too long.
+ * Create the file or directory at path
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a malloc() call failed).
- *   ENOSPC  not enough free space in the file system.
- *
- * @param path  path to the directory or file which we have to create
- * @return      0 on success; -errno on error.
+ * @return	the inode number of the new file or directory; -errno on error
  */
-int init_inode(const char *path, mode_t mode, fs_ctx *fs){
-
-	a1fs_inode *inode = calloc(1, sizeof(a1fs_inode));
-	if(inode == NULL)
-		return -ENOMEM;
-	bool is_dir =  S_ISREG(mode) ? false : true;
-	inode->mode = mode;
-	inode->links = S_ISREG(mode) ? 1 : 2; // default links for a file or directory
-	inode->size = 0;
-	clock_gettime(CLOCK_REALTIME, &inode->mtime);
-	inode->indirect = 0;
-	inode->num_extents = 0;
-
-	long res = allocate_inode(fs); // will allocate the first empty inode in inode_bitmap
-	if(res < 0){
-		free(inode);
-		return -ENOSPC; // can't allocate an inode as all inodes are allocated
-	}	
-
-	// Get the parent dir inode, modify links value and add a dir entry
-	char *last_component = get_last_component(path);
-	a1fs_dentry *new_dir_dentry = calloc(1, sizeof(a1fs_dentry));
-	strcpy(new_dir_dentry->name, last_component);
-	new_dir_dentry->ino = res;
-
-	char parent_path[strlen(path)];
-	strcpy(parent_path, path);
-	set_parent_path(parent_path);
-
-	if(add_dir_entry(parent_path, new_dir_dentry, fs, is_dir) < 0){
-		free(inode);
-		free(new_dir_dentry);
-		return -ENOSPC; // couldn't allocate a dir_entry
-	}
-	
-	// all operation successful, it is now safe to write to the disk
-	set_bitmap(fs->sb->inode_bitmap.start, res, fs, 1);
-	memcpy(fs->image + fs->sb->inode_table.start * A1FS_BLOCK_SIZE +  res * sizeof(a1fs_inode), inode, sizeof(a1fs_inode));
-	memcpy(fs->image, fs->sb, sizeof(a1fs_superblock));
-
-	free(new_dir_dentry);
-	free(inode);
+static long create_path(const char *path, mode_t mode, fs_ctx *fs)
+{
+	long parent_ino = parent_lookup(path, fs);
+	if(parent_ino < 0)
+		return parent_ino;
+	return create_inode(parent_ino, get_last_component(path), mode, path, fs);
+}
 
-	return 0;
+/** Remove the file or directory at path */
+static int remove_path(const char *path, bool is_dir, fs_ctx *fs)
+{
+	long parent_ino = parent_lookup(path, fs);
+	if(parent_ino < 0)
+		return parent_ino;
+	return remove_inode(parent_ino, get_last_component(path), is_dir, path, fs);
 }
 
 
@@ -290,23 +150,8 @@ int init_inode(const char *path, mode_t mode, fs_ctx *fs){
 static int a1fs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path;// unused
-	fs_ctx *fs = get_fs();
-
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
-	//TODO: fill in the rest of required fields based on the information stored
-	// in the superblock
-
-	st->f_blocks = fs->size / A1FS_BLOCK_SIZE; // size of file system in fragment size units
-	st->f_bfree = fs->sb->free_blocks_count;
-	st->f_bavail = st->f_bfree; // They are the same
-	st->f_files = fs->sb->inodes_count;
-	st->f_ffree = fs->sb->free_inodes_count;
-	st->f_favail = st->f_ffree; // They are the same
-
-	st->f_namemax = A1FS_NAME_MAX;
-	return 0; // in which case do we return errno?
+	stat_fs(st, get_fs());
+	return 0;
 }
 
 /**
@@ -339,83 +184,57 @@ static int a1fs_getattr(const char *path, struct stat *st)
 	if(curr_node < 0)
 		return curr_node; // path_lookup returned an error
 
-	// Now we update the stat struct
-	a1fs_inode *final_inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + curr_node * sizeof(a1fs_inode));
-	st->st_mode = final_inode->mode;
-	st->st_nlink = final_inode->links;
-	st->st_size = final_inode->size; // does size include inode
-	st->st_blocks = (final_inode->num_extents > 0 + ceil_integer_division(st->st_size, A1FS_BLOCK_SIZE))* A1FS_BLOCK_SIZE / 512;
-	st->st_mtim = final_inode->mtime; 
+	return stat_inode(curr_node, st, fs);
+}
 
-	return 0; 
+/**
+ * Get attributes of an open file.
+ *
+ * Implements the fstat() system call. Same as a1fs_getattr(), but the file is
+ * found through the handle that a1fs_open() or a1fs_create() stored in fi.
+ *
+ * @param path  unused.
+ * @param st    pointer to the struct stat that receives the result.
+ * @param fi    the open file.
+ * @return      0 on success; -errno on error;
+ */
+static int a1fs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	a1fs_handle *fh = (a1fs_handle *)fi->fh;
+	return stat_inode(fh->ino, st, get_fs());
 }
 
 
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
- * for each directory entry. See fuse.h in libfuse source code for details.
+ * Implements the readdir() system call. Entries are passed to filler() with
+ * their offsets, so the kernel reads a large directory a buffer at a time and
+ * continues from the offset of the last entry it got (see read_dir()).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
  * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ * @param offset  offset of the last entry returned by the previous call; 0 to start over.
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset; // unused
 	(void)fi; // unused
-
-	//NOTE: This is just a placeholder that allows the file system to be mounted
-	// without errors. You should remove this from your implementation.
-	// if (strcmp(path, "/") == 0) {
-	// 	filler(buf, "." , NULL, 0);
-	// 	filler(buf, "..", NULL, 0);
-	// 	return 0;
-	// }
-
-	filler(buf, "." , NULL, 0);
-	filler(buf, "..", NULL, 0);
-
 	fs_ctx *fs = get_fs();
 	long curr_node = path_lookup(path, fs); // can assume that path exists
-
-	// We have a valid inode. Now we iterate over it's dentries
-	a1fs_inode *final_inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + curr_node * sizeof(a1fs_inode));
-	a1fs_extent *curr_extent; 
-	a1fs_dentry *curr_dentry;
-	uint32_t num_entries_in_block = 16; // default amount unless we in the last block of the last extent
-
-	for(uint32_t i = 0; i < final_inode->num_extents; i++){
-		if(i < 10)
-			curr_extent = &final_inode->extents[i];
-		else
-			curr_extent = (a1fs_extent *) (fs->image + final_inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (i - 10) * sizeof(a1fs_extent));
-
-		// this extent is valid
-		for (a1fs_blk_t j = curr_extent->start; j < curr_extent->start + curr_extent->count; j ++){
-			for(uint32_t k = 0; k < num_entries_in_block; k ++){
-				curr_dentry = (a1fs_dentry *) (fs->image + j * A1FS_BLOCK_SIZE + k * sizeof(a1fs_dentry));
-				
-				if(curr_dentry->ino > 0){ // valid entry
-					filler(buf, curr_dentry->name , NULL, 0);
-				}
-			}
-		}
-	}
-
-	return 0;
+	if(curr_node < 0)
+		return curr_node;
+	return read_dir(curr_node, offset, filler, buf, fs);
 }
 
 
@@ -440,8 +259,8 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int a1fs_mkdir(const char *path, mode_t mode)
 {
 	mode = mode | S_IFDIR;
-	fs_ctx *fs = get_fs();
-	return init_inode(path, mode, fs);
+	long res = create_path(path, mode, get_fs());
+	return res < 0 ? res : 0;
 }
 
 /**
@@ -460,21 +279,7 @@ static int a1fs_mkdir(const char *path, mode_t mode)
  */
 static int a1fs_rmdir(const char *path)
 {
-	fs_ctx *fs = get_fs();
-	int dir_ino = path_lookup(path, fs); // can assume this succeeds due to precondition
-	a1fs_inode* inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + dir_ino * sizeof(a1fs_inode));
-
-	if(inode->size != 0)
-		return -ENOTEMPTY;
-
-	set_bitmap(fs->sb->inode_bitmap.start, dir_ino, fs, false); // deallocate the inode
-
-	// now we have to remove this file from it's parent as a dentry and 
-	char parent_path[strlen(path)];
-	strcpy(parent_path, path);
-	set_parent_path(parent_path); // set the parent_path to the path of the parent
-	char *file_name = get_last_component(path); // gets the relative name of the dir we want to remove	
-	return remove_dir_entry(parent_path, file_name, true, fs);
+	return remove_path(path, true, get_fs());
 }
 
 
@@ -494,16 +299,71 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    receives the handle of the new open file.
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
 
-	return init_inode(path, mode, fs);
+	long res = create_path(path, mode, fs);
+	if(res < 0)
+		return res;
+	a1fs_handle *fh;
+	res = open_inode(res, &fh, fs);
+	if(res < 0)
+		return res;
+	fi->fh = (uint64_t)(uintptr_t)fh;
+	return 0;
+}
+
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. Resolves the path once and keeps the
+ * inode number in a handle so that reads and writes skip path resolution.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOENT  the file was removed after FUSE looked it up.
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    receives the handle of the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	long inode_num = path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+
+	a1fs_handle *fh;
+	int res = open_inode(inode_num, &fh, fs);
+	if(res < 0)
+		return res;
+	fi->fh = (uint64_t)(uintptr_t)fh;
+	return 0;
+}
+
+/**
+ * Release an open file.
+ *
+ * Called once the last file descriptor of an open file is closed.
+ *
+ * @param path  unused.
+ * @param fi    the open file.
+ * @return      0 (the return value is ignored by FUSE).
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	release_file((a1fs_handle *)fi->fh, get_fs());
+	return 0;
 }
 
 /**
@@ -521,19 +381,7 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */
 static int a1fs_unlink(const char *path)
 {
-	fs_ctx *fs = get_fs();
-	a1fs_truncate(path, 0); // will deallocate any blocks associated with this file
-	int dir_ino = path_lookup(path, fs); // can assume this succeeds due to precondition
-	set_bitmap(fs->sb->inode_bitmap.start, dir_ino, fs, false); // deallocate the inode
-
-	// now we have to remove this file from it's parent as a dentry and 
-	char parent_path[strlen(path)];
-	strcpy(parent_path, path);
-	set_parent_path(parent_path); // set the parent_path to the path of the parent
-	char *file_name = get_last_component(path); // gets the relative name of the dir we want to remove	
-	remove_dir_entry(parent_path, file_name, false, fs);
-	return 0;
-
+	return remove_path(path, false, get_fs());
 }
 
 
@@ -556,21 +404,11 @@ static int a1fs_unlink(const char *path)
  */
 static int a1fs_utimens(const char *path, const struct timespec times[2])
 {
-
 	fs_ctx *fs = get_fs();
-
-	uint32_t file_inode_num = path_lookup(path, fs);
-	a1fs_inode *file_inode = (a1fs_inode *)(fs->image + fs->inode_table.start* A1FS_BLOCK_SIZE + file_inode_num* sizeof(a1fs_inode));
-
-	if(times == NULL || times[1].tv_nsec == UTIME_NOW)
-		clock_gettime(CLOCK_REALTIME, &file_inode->mtime);
-	
-	else if(times[1].tv_nsec != UTIME_OMIT)
-		file_inode->mtime = times[1];
-	
-	// write the updated file inode back to the disk
-	memcpy(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + file_inode_num * sizeof(a1fs_inode), file_inode, sizeof(a1fs_inode));
-	return 0;
+	long file_inode_num = path_lookup(path, fs);
+	if(file_inode_num < 0)
+		return file_inode_num;
+	return set_mtime(file_inode_num, times == NULL ? NULL : &times[1], fs);
 }
 
 /**
@@ -594,83 +432,58 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 static int a1fs_truncate(const char *path, off_t size)
 {
 	fs_ctx *fs = get_fs();
-	uint32_t file_inode_num = path_lookup(path, fs);
-	a1fs_inode *file_inode = (a1fs_inode *)(fs->image + fs->inode_table.start* A1FS_BLOCK_SIZE + file_inode_num* sizeof(a1fs_inode));
-	a1fs_extent *final_extent; 
-	
-	if((uint64_t)size == file_inode->size)
-		return 0; // no modification should be made
-
-	if((uint64_t)size < file_inode->size){
-		uint32_t bytes_in_last_block = file_inode->size % A1FS_BLOCK_SIZE == 0 ? A1FS_BLOCK_SIZE : file_inode->size % A1FS_BLOCK_SIZE;
-		uint32_t target_num_removed_blocks = file_inode->size < (uint64_t)size + bytes_in_last_block ? 0:\
-		(file_inode->size - size - bytes_in_last_block) / A1FS_BLOCK_SIZE + 1; // +1 for the last block
-		
-		if(target_num_removed_blocks > 0){
-			while(target_num_removed_blocks > 0){
-				target_num_removed_blocks -= deallocate_block(file_inode, fs);
-			}
-			// it can be that case that the indirect block is not longer in use
-			if(file_inode->num_extents <= 10 && file_inode->indirect != 0){
-				set_bitmap(fs->sb->block_bitmap.start, file_inode->indirect, fs, false);
-				file_inode->indirect = 0; // not using an indirect block
-			}
-		}
-	}
-	
-	// have to extend the file size
-	else{
-		uint32_t bytes_in_last_block = file_inode->size % A1FS_BLOCK_SIZE == 0 && \
-			file_inode->size != 0 ? A1FS_BLOCK_SIZE : file_inode->size % A1FS_BLOCK_SIZE;
-		uint32_t nonallocated_bytes_last_block = file_inode->size == 0 ? 0: A1FS_BLOCK_SIZE - bytes_in_last_block;
-		uint32_t total_additional_bytes = size - file_inode->size;
-		uint32_t additional_blocks = total_additional_bytes <= nonallocated_bytes_last_block ? 0:\
-		 ceil_integer_division(total_additional_bytes - nonallocated_bytes_last_block, A1FS_BLOCK_SIZE);
-
-		uint32_t copy_additional_blocks = additional_blocks;
-
-		if(additional_blocks > fs->sb->free_blocks_count)
-			return -ENOSPC; // not enough data blocks for the new size of file
-
-		if(file_inode->size == 0){
-			long res = allocate_extent(additional_blocks, file_inode, fs);
-			if(res < 0)
-				return res; // error could not allocate an extent or block for extent
-
-			additional_blocks -= res;
-		}
-
-		final_extent = get_final_extent(file_inode, fs); // the final extent
-		memset(fs->image + (final_extent->start + final_extent->count - 1) * A1FS_BLOCK_SIZE + bytes_in_last_block, 0,\
-			min(total_additional_bytes, nonallocated_bytes_last_block));
-
-
-		if (additional_blocks != 0){
-				// first we try to extend the last block as much as possible
-			uint32_t max_extentsion = extend_extent(additional_blocks, file_inode, final_extent, fs);
-			additional_blocks -= max_extentsion;	
-			// now we allocate the new extents
-			while(additional_blocks > 0){
-				// edge cases needs to be tested
-				if((file_inode->num_extents + 1 == 10 && additional_blocks + 1 > fs->sb->free_blocks_count) || file_inode->num_extents + 1 > 512){
-						// have to reverse the changes we made by calling truncate recrusively
-						file_inode->size = file_inode->size + (copy_additional_blocks - additional_blocks) * A1FS_BLOCK_SIZE + nonallocated_bytes_last_block;
-						memcpy(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + file_inode_num * sizeof(a1fs_inode), file_inode, sizeof(a1fs_inode));
-						a1fs_truncate(path, file_inode->size - (copy_additional_blocks - additional_blocks) * A1FS_BLOCK_SIZE - nonallocated_bytes_last_block);
-						return -ENOSPC;
-				}
-
-				additional_blocks -= allocate_extent(additional_blocks, file_inode, fs);
-			}
-		}
-	}
-	
-	file_inode->size = size;
-	clock_gettime(CLOCK_REALTIME, &file_inode->mtime); // update the modification time
-	memcpy(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + file_inode_num * \
-		sizeof(a1fs_inode), file_inode, sizeof(a1fs_inode));
+	long file_inode_num = path_lookup(path, fs);
+	if(file_inode_num < 0)
+		return file_inode_num;
+	return resize_file(file_inode_num, size, fs);
+}
 
-	return 0;
+/**
+ * Change the size of an open file.
+ *
+ * Implements the ftruncate() system call. Same as a1fs_truncate(), but the
+ * file is found through its handle.
+ *
+ * @param path  unused.
+ * @param size  new file size in bytes.
+ * @param fi    the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	return resize_file(((a1fs_handle *)fi->fh)->ino, size, get_fs());
+}
+
+/**
+ * Allocate space for a range of a file.
+ *
+ * Implements the fallocate() system call (modes 0 and FALLOC_FL_KEEP_SIZE). The
+ * blocks for [offset, offset + len) are allocated, so writes to the range
+ * can't fail with ENOSPC. With FALLOC_FL_KEEP_SIZE the blocks past the end of
+ * the file are allocated without being zeroed and the size is not changed;
+ * they are zeroed when a write or truncate makes them part of the file.
+ * Otherwise a file that ends before offset + len is extended as by truncate()
+ * (a1fs has no unwritten extents, so the new range is zeroed right away).
+ *
+ * Errors:
+ *   EINVAL      offset is negative or len is not positive.
+ *   EFBIG       offset + len is beyond the largest possible file.
+ *   ENOSPC      not enough free space in the file system.
+ *   EOPNOTSUPP  mode has other flags than FALLOC_FL_KEEP_SIZE.
+ *
+ * @param path    unused.
+ * @param mode    FALLOC_FL_* flags.
+ * @param offset  start of the range.
+ * @param len     length of the range.
+ * @param fi      the open file.
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                          struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	return allocate_file_range(((a1fs_handle *)fi->fh)->ino, mode, offset, len, get_fs());
 }
 
 
@@ -679,65 +492,36 @@ static int a1fs_truncate(const char *path, off_t size)
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The byte range from
+ * offset to offset + size may span any number of blocks and extents.
+ *
+ * The data is copied into buf under the file's lock. There is no read_buf():
+ * libfuse replies after it returns, when the file is unlocked, so the data on
+ * disk can't be spliced from the image file; a1fs_ll_read() can.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
  * Errors: none
  *
- * @param path    path to the file to read from.
+ * @param path    path to the file to read from; unused if fi holds a handle.
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      the open file.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
+	a1fs_handle *fh = fi == NULL ? NULL : (a1fs_handle *)fi->fh;
 
-	long inode_num = path_lookup(path, fs); // don't have to error check due to precondition
-	a1fs_inode* inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-	uint32_t block_offset = offset / A1FS_BLOCK_SIZE;
-	uint32_t byte_offset = offset % A1FS_BLOCK_SIZE;
-	a1fs_extent *curr_extent; 
-	uint32_t count = 0; // will keep track of which how many blocks are have passed
-	uint32_t starting_block_num = 0; // default value
-
-	inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-	for(uint32_t i = 0; i < inode->num_extents; i++){
-		if(i < 10)
-			curr_extent = &inode->extents[i];
-		else
-			curr_extent = (a1fs_extent *) (fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (i - 10) * sizeof(a1fs_extent));
-
-		// if the count is <= 0 is implies that there is no in use extent in that location
-		if (count + curr_extent->count - 1 >= block_offset){
-			starting_block_num = curr_extent->start + block_offset - count;
-			count = block_offset;
-			break;
-		}
-		else
-			count += curr_extent->count;
-	}
-	if(starting_block_num == 0){
-		memset(buf, 0, size); // read was called beyond the bounds of the file
-		return 0;
-	}
-
-	else{
-		// we read as much as possible and fill the rest of the buffer up with 0s;
-		memcpy(buf, fs->image + starting_block_num * A1FS_BLOCK_SIZE + byte_offset, \
-			min(A1FS_BLOCK_SIZE - byte_offset, size));
-		memset(buf + min(A1FS_BLOCK_SIZE - byte_offset, size), 0, size - min(A1FS_BLOCK_SIZE - byte_offset, size));
-	}
-
-	return min(A1FS_BLOCK_SIZE - byte_offset, size); // how much we read
+	long inode_num = fh != NULL ? (long)fh->ino : path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+	return read_file(inode_num, fh, buf, size, offset, fs);
 }
 
 /**
@@ -746,8 +530,8 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must filled with zeros. The byte range from
+ * offset to offset + size may span any number of blocks and extents.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -755,74 +539,176 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- *   ENOSPC  too many extents (a1fs only needs to support 512 extents per file)
  *
- * @param path    path to the file to write to.
+ * @param path    path to the file to write to; unused if fi holds a handle.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      the open file.
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
+	a1fs_handle *fh = fi == NULL ? NULL : (a1fs_handle *)fi->fh;
 
+	long inode_num = fh != NULL ? (long)fh->ino : path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+	return write_file(inode_num, fh, buf, size, offset, fs);
+}
 
-	long inode_num = path_lookup(path, fs); // don't have to error check due to precondition
-	a1fs_inode* inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
+/**
+ * Write data to a file from libfuse's buffers.
+ *
+ * Same as a1fs_write(). When the kernel supports it, libfuse splices a write
+ * request into a pipe instead of reading it into memory, and the data is read
+ * from the pipe straight into the image (see write_file_buf()).
+ *
+ * @param path    path to the file to write to; unused if fi holds a handle.
+ * @param buf     the data.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      the open file.
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int a1fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                          struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	a1fs_handle *fh = fi == NULL ? NULL : (a1fs_handle *)fi->fh;
 
-	// can assume that end up allocating at most one more block
-	// can also assume that the offset(start of writing) + size will be within the same block
-	if(offset + size > inode->size){
-			long res = a1fs_truncate(path, offset + size);
-			if (res < 0)
-				return res; // error. prob a ENOSPC error 
-	}
-	uint32_t block_offset = offset / A1FS_BLOCK_SIZE;
-	uint32_t byte_offset = offset % A1FS_BLOCK_SIZE;
-	a1fs_extent *curr_extent; 
-	uint32_t count = 0; // will keep track of which how many blocks are have passed
-	uint32_t starting_block_num;
-
-	// load inode again because possible changes were made due to truncate
-	inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-
-	for(uint32_t i = 0; i < inode->num_extents; i++){
-		if(i < 10)
-			curr_extent = &inode->extents[i];
-		else
-			curr_extent = (a1fs_extent *) (fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (i - 10) * sizeof(a1fs_extent));
-
-		// if the count is <= 0 is implies that there is no in use extent in that location
-		if (count + curr_extent->count - 1 >= block_offset){
-			starting_block_num = curr_extent->start + block_offset - count;
-			count = block_offset;
-			break;
-		}
-		else
-			count += curr_extent->count;
-	}
+	long inode_num = fh != NULL ? (long)fh->ino : path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+	return write_file_buf(inode_num, fh, buf, offset, fs);
+}
+
+/**
+ * Flush an open file.
+ *
+ * Called on every close() of a file descriptor. Writes the data written to
+ * the file since its last flush or fsync back to the disk; the rest of the
+ * image is left to the normal writeback (see bdev.h).
+ *
+ * @param path  path to the file; unused if fi holds a handle.
+ * @param fi    the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	a1fs_handle *fh = fi == NULL ? NULL : (a1fs_handle *)fi->fh;
+	long inode_num = fh != NULL ? (long)fh->ino : path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+	return flush_file(inode_num, fs);
+}
+
+/**
+ * Synchronize a file's contents and metadata with the disk.
+ *
+ * Implements the fsync() and fdatasync() system calls. Only the data blocks
+ * written to this file and the metadata blocks changed since the last sync
+ * (see journal_commit()) are written, not the whole image.
+ *
+ * @param path      path to the file; unused if fi holds a handle.
+ * @param datasync  unused; the size and extents of a file that fdatasync()
+ *                  must also persist are metadata anyway.
+ * @param fi        the open file.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	fs_ctx *fs = get_fs();
+	a1fs_handle *fh = fi == NULL ? NULL : (a1fs_handle *)fi->fh;
+	long inode_num = fh != NULL ? (long)fh->ino : path_lookup(path, fs);
+	if(inode_num < 0)
+		return inode_num;
+	return sync_file(inode_num, fs);
+}
 
-	memcpy(fs->image +  starting_block_num * A1FS_BLOCK_SIZE + byte_offset, buf, size);
-	return size;
+/**
+ * Synchronize a directory with the disk.
+ *
+ * Implements fsync() on a directory. Directory blocks are metadata, so this
+ * writes the metadata blocks changed since the last sync.
+ *
+ * @param path      unused.
+ * @param datasync  unused.
+ * @param fi        unused.
+ * @return          0 on success; -EIO if the journal failed.
+ */
+static int a1fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	(void)datasync;// unused
+	(void)fi;// unused
+	return journal_commit(&get_fs()->journal);
+}
+
+/**
+ * Handle an a1fs specific ioctl on an open file.
+ *
+ * FUSE 2.9 does not pass lseek() to the file system, so SEEK_DATA and
+ * SEEK_HOLE are offered as A1FS_IOC_SEEK_DATA and A1FS_IOC_SEEK_HOLE: data
+ * points to the offset to search from, and receives the result.
+ *
+ * Errors:
+ *   ENXIO   the offset is past the end of the file, or (SEEK_DATA) there is
+ *           no data past it.
+ *   ENOTTY  unknown cmd, or the file is a directory (which has no handle).
+ *
+ * @param path   unused.
+ * @param cmd    the ioctl command.
+ * @param arg    unused; the argument is copied in and out through data.
+ * @param fi     the open file.
+ * @param flags  FUSE_IOCTL_* flags; FUSE_IOCTL_DIR on a directory.
+ * @param data   the argument of the command.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                      unsigned int flags, void *data)
+{
+	(void)path;// unused
+	(void)arg;// unused
+	if((unsigned int)cmd != A1FS_IOC_SEEK_DATA && (unsigned int)cmd != A1FS_IOC_SEEK_HOLE)
+		return -ENOTTY;
+	if((flags & FUSE_IOCTL_DIR) || fi->fh == 0)
+		return -ENOTTY; // opendir() does not set up a handle
+	int64_t *offset = data;
+	int64_t res = seek_file(((a1fs_handle *)fi->fh)->ino, *offset, (unsigned int)cmd == A1FS_IOC_SEEK_HOLE, get_fs());
+	if(res < 0)
+		return res;
+	*offset = res;
+	return 0;
 }
 
 static struct fuse_operations a1fs_ops = {
+	.init     = a1fs_start,
 	.destroy  = a1fs_destroy,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
+	.fgetattr = a1fs_fgetattr,
 	.readdir  = a1fs_readdir,
 	.mkdir    = a1fs_mkdir,
 	.rmdir    = a1fs_rmdir,
 	.create   = a1fs_create,
+	.open     = a1fs_open,
+	.release  = a1fs_release,
 	.unlink   = a1fs_unlink,
 	.utimens  = a1fs_utimens,
 	.truncate = a1fs_truncate,
+	.ftruncate = a1fs_ftruncate,
+	.fallocate = a1fs_fallocate,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.write_buf = a1fs_write_buf,
+	.flush    = a1fs_flush,
+	.fsync    = a1fs_fsync,
+	.fsyncdir = a1fs_fsyncdir,
+	.ioctl    = a1fs_ioctl,
 };
 
 int main(int argc, char *argv[])
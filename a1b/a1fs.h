@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 
@@ -72,9 +73,14 @@ typedef struct a1fs_superblock {
 	uint32_t free_blocks_count; /* Free blocks count */
 	uint32_t free_inodes_count; /* Free inodes count */
 	uint32_t first_data_block;  /* First Data Block */
-	a1fs_extent inode_table;    /* Inodes table block */
-	a1fs_extent block_bitmap;   /* Blocks bitmap block */
-	a1fs_extent inode_bitmap;   /* Inodes bitmap block */
+	uint32_t blocks_per_group;  /* Blocks in each allocation group (the last one may have fewer) */
+	uint32_t inodes_per_group;  /* Inodes in each allocation group */
+	uint32_t groups_count;      /* Number of allocation groups */
+	a1fs_extent group_table;    /* Group descriptors (see a1fs_group_desc) */
+	uint32_t features;          /* A1FS_FEATURE_* flags chosen by mkfs */
+	uint32_t hash_seed;         /* Seed for directory index name hashes */
+	a1fs_extent journal;        /* Metadata journal (count is 0 if there is none) */
+	uint32_t orphans_count;     /* Removed inodes still in use; freed at mount if nonzero (see inode_refs.h) */
 
 	/* This informaion is useful for a variety of important operations that our file system
 	will do including the basic operations of read,write,open along with other things like 
@@ -82,10 +88,94 @@ typedef struct a1fs_superblock {
 
 } a1fs_superblock;
 
+/** Directories that outgrow one block are converted to hash-indexed directories. */
+#define A1FS_FEATURE_DIR_INDEX 0x1
+/** Metadata updates are logged to the journal region before they are checkpointed. */
+#define A1FS_FEATURE_JOURNAL 0x2
+/** New regular files keep their data in the inode until they grow too large (see A1FS_INODE_INLINE). */
+#define A1FS_FEATURE_INLINE_DATA 0x4
+/** Directories hold variable length a1fs_dirent records instead of fixed size a1fs_dentry slots. */
+#define A1FS_FEATURE_DIRENT 0x8
+
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
+/**
+ * Allocation group descriptor.
+ *
+ * The image is divided into groups of blocks_per_group blocks. Each group
+ * starts with its own block bitmap (bit i is block i of the group), inode
+ * bitmap and inode table, which holds inodes_per_group inodes: inode i lives
+ * in group i / inodes_per_group. Group 0 also holds the superblock and the
+ * group table before them, and the journal after them.
+ *
+ * New inodes go to the group of their parent directory and file data to the
+ * group of its inode when there is room, so related inodes and data stay close
+ * on disk, and threads that allocate in different groups don't contend.
+ */
+typedef struct a1fs_group_desc {
+	a1fs_blk_t block_bitmap;    /* First block of the block bitmap */
+	a1fs_blk_t inode_bitmap;    /* First block of the inode bitmap */
+	a1fs_blk_t inode_table;     /* First block of the inode table */
+	uint32_t free_blocks_count; /* Free blocks in the group */
+	uint32_t free_inodes_count; /* Free inodes in the group */
+	uint32_t reserved[3];
+
+} a1fs_group_desc;
+
+static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_group_desc) == 0, "invalid group descriptor size");
+
+
+#define A1FS_JOURNAL_MAGIC 0xA1F5108Fu
+
+/**
+ * First block of the journal region.
+ *
+ * The rest of the region is the log. The log holds at most one transaction,
+ * which always starts at the first log block: a descriptor block, the block
+ * images it lists, more descriptors and images as needed, then a commit block.
+ * Every block of the transaction carries the transaction's sequence number; a
+ * transaction is replayed at mount only if its sequence number equals the one
+ * in the header and its commit block made it to disk. Once a transaction has
+ * been checkpointed (its blocks written in place) the header sequence number
+ * is incremented, which discards it.
+ */
+typedef struct a1fs_journal_header {
+	uint32_t magic;
+	uint32_t reserved;
+	/** Sequence number of the transaction the log may hold. */
+	uint64_t sequence;
+
+} a1fs_journal_header;
+
+/** Types of log blocks. */
+#define A1FS_JOURNAL_DESCRIPTOR 1
+#define A1FS_JOURNAL_COMMIT     2
+
+/** A log block that starts with a descriptor lists where the images that follow it belong. */
+typedef struct a1fs_journal_descriptor {
+	uint32_t magic;
+	/** A1FS_JOURNAL_DESCRIPTOR or A1FS_JOURNAL_COMMIT. */
+	uint32_t type;
+	uint64_t sequence;
+	/** Number of block images that follow (0 in a commit block). */
+	uint32_t count;
+	/** Home block number of each image. */
+	uint32_t blocks[];
+
+} a1fs_journal_descriptor;
+
+/** Number of images one descriptor block can describe. */
+#define A1FS_JOURNAL_DESC_MAX ((A1FS_BLOCK_SIZE - sizeof(a1fs_journal_descriptor)) / sizeof(uint32_t))
+
+/**
+ * Smallest journal region (header included). A transaction never outgrows the
+ * log, so the log needs room for the blocks a few operations dirty before one
+ * of them has to continue in the next transaction (see journal.h).
+ */
+#define A1FS_JOURNAL_MIN_BLOCKS 128
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -117,15 +207,79 @@ typedef struct a1fs_inode {
 
 	/* Creation time is one of the key metadata which should be known and will be displayed when the stat command is used.  */
 	a1fs_extent extents[10];
-	uint32_t indirect; // points to an block which will contain exactly 512 extents
+	uint32_t indirect; // points to an block which will contain exactly 512 extents (0 with an extent tree)
 	uint32_t num_extents;
+	uint32_t flags; // A1FS_INODE_* flags
 
 	/* pointer to the indirect block(we only need 1 for 512 extents)
 	total of 10 + 512 = 524 extents which is > 512 which is a little more than we need which is fine */
-	char padding[7];
+	uint32_t generation; // bumped whenever the inode number is reused, so that old references can tell
 
 } a1fs_inode;
 
+/** Directory data is a hash index (see a1fs_dx_root) rather than a flat dentry array. */
+#define A1FS_INODE_INDEXED 0x1
+/**
+ * File data is stored in place of the extents array of the inode instead of in data blocks; the
+ * file has no extents. Only used for regular files of at most A1FS_INLINE_MAX bytes.
+ */
+#define A1FS_INODE_INLINE 0x2
+
+/**
+ * The extents array of the inode holds the root of an extent tree (see a1fs_et_header) instead of
+ * the first 10 extents, and indirect is unused. Set once a file outgrows A1FS_MAX_EXTENTS extents.
+ */
+#define A1FS_INODE_EXTENT_TREE 0x4
+
+/** Largest file that can keep its data in the inode. */
+#define A1FS_INLINE_MAX sizeof(((a1fs_inode *)0)->extents)
+
+/** Most extents an inode without an extent tree can have: 10 in the inode and 512 in the indirect block. */
+#define A1FS_MAX_EXTENTS (10 + A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+
+
+/** Magic value at the start of every extent tree node. */
+#define A1FS_ET_MAGIC 0xE7A1
+
+/**
+ * Extent tree node header. The root node lives in the extents array of an inode with
+ * A1FS_INODE_EXTENT_TREE, the other nodes take a block each.
+ *
+ * The header is followed by entries sorted by file_block: a1fs_et_leaf entries
+ * in a leaf (depth 0), a1fs_et_index entries in an index node. An index entry
+ * covers every file block >= its file_block (and below the file_block of the
+ * next entry), so a lookup reads one node per level.
+ */
+typedef struct a1fs_et_header {
+	/** Must match A1FS_ET_MAGIC. */
+	uint16_t magic;
+	/** Number of entries in use. */
+	uint16_t entries;
+	/** Maximum number of entries. */
+	uint16_t max;
+	/** Number of index levels below this node; 0 in a leaf. */
+	uint16_t depth;
+
+} a1fs_et_header;
+
+/** Extent tree leaf entry: an extent and the number of blocks into the file where it starts. */
+typedef struct a1fs_et_leaf {
+	uint32_t file_block;
+	a1fs_extent extent;
+
+} a1fs_et_leaf;
+
+/** Extent tree index entry. */
+typedef struct a1fs_et_index {
+	/** First file block covered by the child. The first entry of a node also covers the blocks before it. */
+	uint32_t file_block;
+	/** Block number of the child node. */
+	a1fs_blk_t child;
+
+} a1fs_et_index;
+
+static_assert(sizeof(a1fs_et_header) == 8, "invalid extent tree header size");
+
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
@@ -147,3 +301,102 @@ typedef struct a1fs_dentry {
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
 
+/** Values of a1fs_dirent.file_type. */
+#define A1FS_FT_UNKNOWN 0
+#define A1FS_FT_REG     1
+#define A1FS_FT_DIR     2
+
+/**
+ * Variable length directory entry, used instead of a1fs_dentry on file systems
+ * formatted with A1FS_FEATURE_DIRENT.
+ *
+ * The records of a directory block cover the whole block: each record is
+ * followed by the next one rec_len bytes later, and the last one ends at the
+ * end of the block. A record with ino 0 is free space. Records are 4-byte
+ * aligned and never cross a block boundary, so the size of such a directory
+ * is always a whole number of blocks.
+ */
+typedef struct a1fs_dirent {
+	/** Inode number; 0 if the record is unused. */
+	a1fs_ino_t ino;
+	/** Distance in bytes to the next record (or to the end of the block). */
+	uint16_t rec_len;
+	/** Length of the name, not including the null terminator. */
+	uint8_t name_len;
+	/** A1FS_FT_* type of the file, so readdir() doesn't have to read its inode. */
+	uint8_t file_type;
+	/** File name. A null-terminated string. */
+	char name[];
+
+} a1fs_dirent;
+
+static_assert(sizeof(a1fs_dirent) == 8, "invalid dirent size");
+
+/** Space taken by a dirent with a name of name_len bytes. */
+#define A1FS_DIRENT_LEN(name_len) ((sizeof(a1fs_dirent) + (name_len) + 1 + 3) & ~(size_t)3)
+
+
+/** Magic value at the start of directory index root and node blocks. */
+#define A1FS_DX_MAGIC 0xD1D1A1F5u
+
+/**
+ * Directory index entry. Maps every name hash >= hash (and below the hash of
+ * the next entry) to a block of the directory.
+ */
+typedef struct a1fs_dx_entry {
+	/** Lowest name hash covered by the block. Always 0 for the first entry. */
+	uint32_t hash;
+	/** Logical block number within the directory. */
+	uint32_t block;
+
+} a1fs_dx_entry;
+
+/**
+ * Directory index root. Lives in logical block 0 of an indexed directory.
+ *
+ * With levels == 0 the entries point at leaf blocks, each holding an array of
+ * A1FS_BLOCK_SIZE / sizeof(a1fs_dentry) dentries (ino 0 marks a free slot), or
+ * a1fs_dirent records with A1FS_FEATURE_DIRENT.
+ * With levels == 1 the entries point at a1fs_dx_node blocks that in turn point
+ * at leaf blocks, so a lookup never reads more than three directory blocks.
+ */
+typedef struct a1fs_dx_root {
+	/** Must match A1FS_DX_MAGIC. */
+	uint32_t magic;
+	/** Number of a1fs_dx_node levels below the root (0 or 1). */
+	uint32_t levels;
+	/** Number of entries in use. */
+	uint32_t count;
+	/** Maximum number of entries. */
+	uint32_t limit;
+	/** Number of dentries stored in the directory. */
+	uint32_t num_entries;
+	uint32_t reserved[3];
+	a1fs_dx_entry entries[];
+
+} a1fs_dx_root;
+
+/** Second level directory index block. */
+typedef struct a1fs_dx_node {
+	/** Must match A1FS_DX_MAGIC. */
+	uint32_t magic;
+	/** Number of entries in use. */
+	uint32_t count;
+	/** Maximum number of entries. */
+	uint32_t limit;
+	uint32_t reserved;
+	a1fs_dx_entry entries[];
+
+} a1fs_dx_node;
+
+#define A1FS_DX_ROOT_LIMIT ((A1FS_BLOCK_SIZE - sizeof(a1fs_dx_root)) / sizeof(a1fs_dx_entry))
+#define A1FS_DX_NODE_LIMIT ((A1FS_BLOCK_SIZE - sizeof(a1fs_dx_node)) / sizeof(a1fs_dx_entry))
+
+
+/**
+ * ioctl commands for SEEK_DATA and SEEK_HOLE (FUSE 2.9 has no lseek hook).
+ * The argument is an int64_t file offset to search from, which is replaced by
+ * the offset of the next data or hole.
+ */
+#define A1FS_IOC_SEEK_DATA _IOWR('a', 1, int64_t)
+#define A1FS_IOC_SEEK_HOLE _IOWR('a', 2, int64_t)
@@ -0,0 +1,482 @@
+/**
+ * CSC369 Assignment 1 - a1fs driver on the FUSE low-level API.
+ *
+ * Same file system as a1fs.c, but served through fuse_lowlevel_ops: the
+ * kernel looks every name up once with lookup(), keeps the inode number it got
+ * and passes it with every later request, so no request resolves a path. The
+ * callbacks are thin wrappers around fs_ops.h, which a1fs.c shares.
+ *
+ * FUSE numbers the root directory FUSE_ROOT_ID (1), and a1fs numbers it 0, so
+ * the inode numbers that the kernel sees are the a1fs ones plus 1.
+ *
+ * Every entry reply takes a lookup reference to the inode (see ref_inode()),
+ * which forget() drops, so a file removed while the kernel still knows it
+ * stays an orphan until then instead of its inode number being reused under
+ * it. When a number is reused, the new file has a new generation.
+ *
+ * The kernel caches entries and attributes for A1FS_LL_TIMEOUT seconds. Every
+ * change goes through this daemon, so the cache only goes stale when another
+ * thread changes a file between our reply and the kernel caching it, which is
+ * the same window the high-level API has.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "fs_ops.h"
+#include "options.h"
+#include "helpers.h"
+#include "handle.h"
+
+/** Seconds the kernel may cache an entry or its attributes. */
+#define A1FS_LL_TIMEOUT 1.0
+
+/** Convert an a1fs inode number to the one the kernel sees, and back. */
+#define TO_FUSE_INO(ino)   ((fuse_ino_t)(ino) + 1)
+#define FROM_FUSE_INO(ino) ((uint32_t)((ino) - 1))
+/**
+ * Inode number of a directory entry whose inode is not known, as the high-level
+ * API passes them (FUSE_UNKNOWN_INO in fuse.c); the kernel looks the name up.
+ */
+#define UNKNOWN_FUSE_INO 0xffffffff
+
+
+/** Get file system context. */
+static fs_ctx *get_fs(fuse_req_t req)
+{
+	return (fs_ctx*)fuse_req_userdata(req);
+}
+
+/** Get the handle that a1fs_ll_open() or a1fs_ll_create() stored in fi. */
+static a1fs_handle *get_handle(struct fuse_file_info *fi)
+{
+	return fi == NULL ? NULL : (a1fs_handle *)fi->fh;
+}
+
+/** Reply to req with res, which is 0 or -errno. */
+static void reply_res(fuse_req_t req, long res)
+{
+	fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+/**
+ * Reply to a lookup(), mkdir() or create() with the attributes of ino, and
+ * take the lookup reference that the kernel gets with the entry.
+ *
+ * @param fi  the open file for create(); NULL otherwise.
+ */
+static void reply_entry(fuse_req_t req, long ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	uint32_t generation = 0;
+	int res = ino < 0 ? ino : ref_inode(ino, &generation, fs);
+	if (res == 0) {
+		res = stat_inode(ino, &e.attr, fs);
+		if (res < 0) forget_inode(ino, 1, fs);
+	}
+	if (res < 0) {
+		if (fi != NULL) release_file(get_handle(fi), fs);
+		reply_res(req, res);
+		return;
+	}
+	e.ino = TO_FUSE_INO(ino);
+	e.attr.st_ino = e.ino;
+	e.generation = generation;
+	e.attr_timeout = A1FS_LL_TIMEOUT;
+	e.entry_timeout = A1FS_LL_TIMEOUT;
+	res = fi != NULL ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e);
+	if (res != 0) {
+		// the kernel didn't get the entry (e.g. the request was interrupted), so it won't forget it
+		forget_inode(ino, 1, fs);
+		if (fi != NULL) release_file(get_handle(fi), fs);
+	}
+}
+
+/** Reply to a getattr() or setattr() with the attributes of ino. */
+static void reply_attr(fuse_req_t req, uint32_t ino)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	int res = stat_inode(ino, &st, get_fs(req));
+	if (res < 0) {
+		reply_res(req, res);
+		return;
+	}
+	st.st_ino = TO_FUSE_INO(ino);
+	fuse_reply_attr(req, &st, A1FS_LL_TIMEOUT);
+}
+
+
+/**
+ * Start the background threads of the file system (see start_fs_threads()).
+ *
+ * @param userdata  the file system context.
+ * @param conn      the capabilities of the connection.
+ */
+static void a1fs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	// splice file data to and from /dev/fuse (see a1fs_ll_read() and a1fs_ll_write_buf())
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	start_fs_threads((fs_ctx*)userdata);
+}
+
+/** Cleanup the file system when it is unmounted. */
+static void a1fs_ll_destroy(void *userdata)
+{
+	unmount_image((fs_ctx*)userdata);
+}
+
+/**
+ * Look up a directory entry by name and get its attributes.
+ *
+ * Errors: ENOENT, ENAMETOOLONG.
+ *
+ * @param parent  the directory.
+ * @param name    the name to look up.
+ */
+static void a1fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	if (strlen(name) >= A1FS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	reply_entry(req, lookup_name(FROM_FUSE_INO(parent), name, get_fs(req)), NULL);
+}
+
+/**
+ * Forget about an inode.
+ *
+ * The kernel drops nlookup of its lookup references to an inode (see
+ * reply_entry()); a removed inode is freed with the last one.
+ */
+static void a1fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	forget_inode(FROM_FUSE_INO(ino), nlookup, get_fs(req));
+	fuse_reply_none(req);
+}
+
+/** Get file or directory attributes (see a1fs_getattr()). */
+static void a1fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	reply_attr(req, FROM_FUSE_INO(ino));
+}
+
+/**
+ * Set file attributes.
+ *
+ * Implements truncate() (FUSE_SET_ATTR_SIZE) and utimensat() (the modification
+ * time); the access time is not stored. The owner and mode can't be changed,
+ * like with the high-level API.
+ *
+ * Errors: ENOSYS, and those of a1fs_truncate() and a1fs_utimens().
+ *
+ * @param attr    the new attributes.
+ * @param to_set  FUSE_SET_ATTR_* flags of the attributes to change.
+ */
+static void a1fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	uint32_t inode_num = FROM_FUSE_INO(ino);
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	int res = 0;
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		res = resize_file(inode_num, attr->st_size, fs);
+	if (res == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW))
+		res = set_mtime(inode_num, NULL, fs);
+	else if (res == 0 && (to_set & FUSE_SET_ATTR_MTIME))
+		res = set_mtime(inode_num, &attr->st_mtim, fs);
+	if (res < 0) {
+		reply_res(req, res);
+		return;
+	}
+	reply_attr(req, inode_num);
+}
+
+/**
+ * Create a directory (see a1fs_mkdir()).
+ *
+ * @param parent  the directory to create it in.
+ * @param name    the name of the new directory.
+ */
+static void a1fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	long res = create_inode(FROM_FUSE_INO(parent), name, mode | S_IFDIR, NULL, get_fs(req));
+	reply_entry(req, res, NULL);
+}
+
+/** Remove a directory (see a1fs_rmdir()). */
+static void a1fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	reply_res(req, remove_inode(FROM_FUSE_INO(parent), name, true, NULL, get_fs(req)));
+}
+
+/** Create and open a file (see a1fs_create()). */
+static void a1fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	long res = create_inode(FROM_FUSE_INO(parent), name, mode, NULL, fs);
+	a1fs_handle *fh;
+	if (res >= 0) {
+		int err = open_inode(res, &fh, fs);
+		if (err < 0) {
+			reply_res(req, err);
+			return;
+		}
+		fi->fh = (uint64_t)(uintptr_t)fh;
+	}
+	reply_entry(req, res, res < 0 ? NULL : fi);// releases fh on error
+}
+
+/** Open a file (see a1fs_open()). */
+static void a1fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_handle *fh;
+	int res = open_inode(FROM_FUSE_INO(ino), &fh, fs);
+	if (res < 0) {
+		reply_res(req, res);
+		return;
+	}
+	fi->fh = (uint64_t)(uintptr_t)fh;
+	if (fuse_reply_open(req, fi) != 0)
+		release_file(fh, fs);// the kernel won't release a file it didn't get
+}
+
+/** Release an open file (see a1fs_release()). */
+static void a1fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	release_file(get_handle(fi), get_fs(req));
+	fuse_reply_err(req, 0);
+}
+
+/** Remove a file (see a1fs_unlink()). */
+static void a1fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	reply_res(req, remove_inode(FROM_FUSE_INO(parent), name, false, NULL, get_fs(req)));
+}
+
+/** Allocate a range of a file (see a1fs_fallocate()). */
+static void a1fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	reply_res(req, allocate_file_range(FROM_FUSE_INO(ino), mode, offset, length, get_fs(req)));
+}
+
+/**
+ * Read data from a file (see a1fs_read()).
+ *
+ * The data is spliced to the kernel straight from the image file (see
+ * read_file_buf()). The reply is sent before the file is unlocked, so the
+ * blocks can't be freed and reused before they are read.
+ */
+static void a1fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	uint32_t inode_num = FROM_FUSE_INO(ino);
+	struct fuse_bufvec *bufv;
+	inode_rdlock(fs, inode_num);
+	long res = read_file_buf(inode_num, get_handle(fi), size, off, &bufv, fs);
+	if (res < 0) reply_res(req, res);
+	else fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	inode_unlock(fs, inode_num);
+	if (res >= 0) free_file_buf(bufv);
+}
+
+/** Write data to a file from libfuse's buffers (see a1fs_write_buf()). */
+static void a1fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi)
+{
+	long res = write_file_buf(FROM_FUSE_INO(ino), get_handle(fi), bufv, off, get_fs(req));
+	if (res < 0) reply_res(req, res);
+	else fuse_reply_write(req, res);
+}
+
+/** Flush an open file (see a1fs_flush()). */
+static void a1fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	reply_res(req, flush_file(FROM_FUSE_INO(ino), get_fs(req)));
+}
+
+/** Synchronize a file (see a1fs_fsync()). */
+static void a1fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	(void)fi;// unused
+	reply_res(req, sync_file(FROM_FUSE_INO(ino), get_fs(req)));
+}
+
+/** Synchronize a directory (see a1fs_fsyncdir()). */
+static void a1fs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	(void)datasync;// unused
+	(void)fi;// unused
+	fuse_reply_err(req, -journal_commit(&get_fs(req)->journal));
+}
+
+/** The reply buffer that a1fs_ll_readdir() fills through readdir_fill(). */
+typedef struct readdir_reply {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+
+} readdir_reply;
+
+/** dir_filler that adds an entry to a readdir_reply, with the kernel's inode number. */
+static int readdir_fill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	readdir_reply *reply = (readdir_reply *)buf;
+	struct stat entry_st = *st;
+	// ".." comes as 0 since the parent is not recorded, and 0 would be the root
+	entry_st.st_ino = strcmp(name, "..") == 0 ? UNKNOWN_FUSE_INO : TO_FUSE_INO(st->st_ino);
+	size_t len = fuse_add_direntry(reply->req, reply->buf + reply->used,
+	                               reply->size - reply->used, name, &entry_st, off);
+	if (len > reply->size - reply->used)
+		return 1;// doesn't fit; the kernel asks for it again with this offset
+	reply->used += len;
+	return 0;
+}
+
+/**
+ * Read a directory (see a1fs_readdir()).
+ *
+ * Fills up to size bytes of entries, starting after the one at offset off.
+ */
+static void a1fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	readdir_reply reply = { .req = req, .buf = malloc(size), .size = size, .used = 0 };
+	if (reply.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int res = read_dir(FROM_FUSE_INO(ino), off, readdir_fill, &reply, get_fs(req));
+	if (res < 0) reply_res(req, res);
+	else fuse_reply_buf(req, reply.buf, reply.used);
+	free(reply.buf);
+}
+
+/** Get file system statistics (see a1fs_statfs()). */
+static void a1fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino;// unused
+	struct statvfs st;
+	stat_fs(&st, get_fs(req));
+	fuse_reply_statfs(req, &st);
+}
+
+/**
+ * Find data and holes in a file (see a1fs_ioctl()).
+ *
+ * @param in_buf  the int64_t offset to start at.
+ */
+static void a1fs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	(void)arg;// unused
+	(void)fi;// unused
+	if (((unsigned int)cmd != A1FS_IOC_SEEK_DATA && (unsigned int)cmd != A1FS_IOC_SEEK_HOLE) ||
+	    (flags & FUSE_IOCTL_DIR)) {
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+	if (in_bufsz < sizeof(int64_t) || out_bufsz < sizeof(int64_t)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	int64_t offset;
+	memcpy(&offset, in_buf, sizeof(offset));
+	offset = seek_file(FROM_FUSE_INO(ino), offset, (unsigned int)cmd == A1FS_IOC_SEEK_HOLE, get_fs(req));
+	if (offset < 0) reply_res(req, offset);
+	else fuse_reply_ioctl(req, 0, &offset, sizeof(offset));
+}
+
+static struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init      = a1fs_ll_init,
+	.destroy   = a1fs_ll_destroy,
+	.lookup    = a1fs_ll_lookup,
+	.forget    = a1fs_ll_forget,
+	.getattr   = a1fs_ll_getattr,
+	.setattr   = a1fs_ll_setattr,
+	.mkdir     = a1fs_ll_mkdir,
+	.rmdir     = a1fs_ll_rmdir,
+	.create    = a1fs_ll_create,
+	.open      = a1fs_ll_open,
+	.release   = a1fs_ll_release,
+	.unlink    = a1fs_ll_unlink,
+	.fallocate = a1fs_ll_fallocate,
+	.read      = a1fs_ll_read,
+	.write_buf = a1fs_ll_write_buf,
+	.flush     = a1fs_ll_flush,
+	.fsync     = a1fs_ll_fsync,
+	.fsyncdir  = a1fs_ll_fsyncdir,
+	.readdir   = a1fs_ll_readdir,
+	.statfs    = a1fs_ll_statfs,
+	.ioctl     = a1fs_ll_ioctl,
+};
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0};// defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts)) return 1;
+
+	fs_ctx fs = {0};
+	if (!mount_image(&opts, &fs)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	int err = -1;
+	struct fuse_chan *ch;
+	// With -h, fuse_mount() prints the mount options and fails
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(&args, &a1fs_ll_ops, sizeof(a1fs_ll_ops), &fs);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1)
+					err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);// calls a1fs_ll_destroy() once init() has been called
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+
+	unmount_image(&fs);// does nothing if a1fs_ll_destroy() already did it
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
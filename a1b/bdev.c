@@ -0,0 +1,971 @@
+/**
+ * Block device layer implementation.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "map.h"
+
+
+/** Longest run of blocks one read or write transfers (1MB), so a big batch keeps the device queue busy. */
+#define BDEV_MAX_RUN 256
+/** Size of the io_uring submission queue. */
+#define BDEV_URING_ENTRIES 256
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // Linux 5.14
+#endif
+
+static uint8_t *block_addr(bdev *dev, uint32_t block)
+{
+	return dev->base + (size_t)block * A1FS_BLOCK_SIZE;
+}
+
+static bool is_resident(bdev *dev, uint32_t block)
+{
+	return __atomic_load_n(&dev->resident[block / 64], __ATOMIC_ACQUIRE) & (1ull << (block % 64));
+}
+
+/** Publish a metadata block once its contents are in memory. */
+static void set_resident(bdev *dev, uint32_t block)
+{
+	__atomic_fetch_or(&dev->resident[block / 64], 1ull << (block % 64), __ATOMIC_RELEASE);
+}
+
+/** A freed metadata block is not one any more. */
+static void clear_resident(bdev *dev, uint32_t block)
+{
+	__atomic_fetch_and(&dev->resident[block / 64], ~(1ull << (block % 64)), __ATOMIC_RELEASE);
+}
+
+/** Read blocks [block, block + count) from the file into their place in memory. */
+static bool read_blocks(bdev *dev, uint32_t block, uint32_t count)
+{
+	size_t len = (size_t)count * A1FS_BLOCK_SIZE;
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(dev->io_fd, block_addr(dev, block) + done, len - done,
+		                  (off_t)block * A1FS_BLOCK_SIZE + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("pread");
+			memset(block_addr(dev, block) + done, 0, len - done);
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+/** Write the contents of blocks [block, block + count), which are at src, to the file. */
+static bool write_blocks(bdev *dev, uint32_t block, uint32_t count, const uint8_t *src)
+{
+	size_t len = (size_t)count * A1FS_BLOCK_SIZE;
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pwrite(dev->io_fd, src + done, len - done,
+		                   (off_t)block * A1FS_BLOCK_SIZE + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("pwrite");
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+/** A run of consecutive blocks to read or write. */
+typedef struct io_run {
+	uint32_t block;
+	uint32_t count;
+	/** Where the data to write is; NULL for the blocks themselves. */
+	const uint8_t *src;
+
+} io_run;
+
+/**
+ * Read or write runs of blocks and, if sync is true, wait until they are on
+ * disk. With the io_uring engine the whole batch, fdatasync() included, is
+ * one submission; what it fails to transfer, or everything without the
+ * engine, is done with pread()/pwrite() one run at a time.
+ *
+ * @return  true on success; false if any run failed.
+ */
+static bool transfer(bdev *dev, bool write, const io_run *runs, uint32_t n, bool sync)
+{
+	uring_req *reqs = NULL;
+	bool synced = false;
+	if (dev->ring.fd >= 0 && n + sync > 0)
+		reqs = calloc(n + sync, sizeof(uring_req));
+	if (reqs != NULL) {
+		for (uint32_t i = 0; i < n; i++) {
+			reqs[i].op = write ? URING_WRITE : URING_READ;
+			reqs[i].buf = runs[i].src != NULL ? (uint8_t *)runs[i].src : block_addr(dev, runs[i].block);
+			reqs[i].len = (size_t)runs[i].count * A1FS_BLOCK_SIZE;
+			reqs[i].off = (uint64_t)runs[i].block * A1FS_BLOCK_SIZE;
+		}
+		if (sync)
+			reqs[n].op = URING_FSYNC;
+		synced = uring_submit_wait(&dev->ring, reqs, n + sync);
+	}
+
+	bool ok = true;
+	for (uint32_t i = 0; i < n; i++) {
+		if (reqs != NULL && reqs[i].res >= 0 && (size_t)reqs[i].res == reqs[i].len)
+			continue;
+		// an error or a short transfer: have another go the synchronous way
+		if (write)
+			ok &= write_blocks(dev, runs[i].block, runs[i].count,
+			                   runs[i].src != NULL ? runs[i].src : block_addr(dev, runs[i].block));
+		else
+			ok &= read_blocks(dev, runs[i].block, runs[i].count);
+	}
+	free(reqs);
+	if (sync && !synced && fdatasync(dev->io_fd) < 0) {
+		perror("fdatasync");
+		ok = false;
+	}
+	return ok;
+}
+
+/**
+ * Split a sorted list of blocks into runs of consecutive block numbers.
+ *
+ * @param images  contents of the blocks, one after another; NULL to write the
+ *                blocks themselves.
+ * @param runs    receives the runs; room for n of them.
+ * @return        the number of runs.
+ */
+static uint32_t make_runs(const uint32_t *blocks, uint32_t n, const char *images, io_run *runs)
+{
+	uint32_t nruns = 0;
+	uint32_t i = 0;
+	while (i < n) {
+		uint32_t run = 1;
+		while (i + run < n && run < BDEV_MAX_RUN && blocks[i + run] == blocks[i] + run)
+			run++;
+		runs[nruns].block = blocks[i];
+		runs[nruns].count = run;
+		runs[nruns].src = images != NULL ? (const uint8_t *)images + (size_t)i * A1FS_BLOCK_SIZE : NULL;
+		nruns++;
+		i += run;
+	}
+	return nruns;
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Write a list of blocks, one write per run of consecutive block numbers, and
+ * if sync is true wait until they are on disk. Sorts the list.
+ *
+ * @return  true on success; false if any write failed.
+ */
+static bool write_list(bdev *dev, uint32_t *blocks, uint32_t n, bool sync)
+{
+	qsort(blocks, n, sizeof(uint32_t), block_cmp);
+	io_run *runs = malloc((n > 0 ? n : 1) * sizeof(io_run));
+	if (runs == NULL) {
+		bool ok = true;
+		for (uint32_t i = 0; i < n; i++)
+			ok &= write_blocks(dev, blocks[i], 1, block_addr(dev, blocks[i]));
+		if (sync && fdatasync(dev->io_fd) < 0) {
+			perror("fdatasync");
+			ok = false;
+		}
+		return ok;
+	}
+	bool ok = transfer(dev, true, runs, make_runs(blocks, n, NULL, runs), sync);
+	free(runs);
+	return ok;
+}
+
+static uint32_t hash_block(bdev *dev, uint32_t block)
+{
+	return (block * 2654435761u) & (dev->hash_cap - 1);
+}
+
+/** The slot (index + 1) that holds a data block; 0 if it is not cached. The caller holds dev->lock. */
+static uint32_t find_slot(bdev *dev, uint32_t block)
+{
+	uint32_t i = dev->hash[hash_block(dev, block)];
+	while (i != 0 && dev->slots[i - 1].block != block)
+		i = dev->slots[i - 1].next;
+	return i;
+}
+
+/** Drop a slot from the cache, giving its memory back to the system if discard is true. */
+static void free_slot(bdev *dev, uint32_t i, bool discard)
+{
+	bdev_slot *s = &dev->slots[i - 1];
+	uint32_t *link = &dev->hash[hash_block(dev, s->block)];
+	while (*link != i)
+		link = &dev->slots[*link - 1].next;
+	*link = s->next;
+
+	if (s->dirty)
+		dev->ndirty--;
+	if (discard)
+		madvise(block_addr(dev, s->block), A1FS_BLOCK_SIZE, MADV_DONTNEED);
+	memset(s, 0, sizeof(bdev_slot));
+	s->next = dev->free_list;
+	dev->free_list = i;
+	dev->used--;
+}
+
+/**
+ * Evict one clean, unpinned slot, giving the ones used since the clock hand
+ * last passed a second chance.
+ *
+ * @return  true if a slot was freed; false if none can be.
+ */
+static bool evict_one(bdev *dev)
+{
+	for (uint32_t n = 0; n < 2 * dev->nslots; n++) {
+		uint32_t i = dev->hand;
+		bdev_slot *s = &dev->slots[i];
+		dev->hand = (i + 1) % dev->nslots;
+		if (!s->used || s->pins > 0 || s->loading || s->dirty)
+			continue;
+		if (s->ref) {
+			s->ref = false;
+			continue;
+		}
+		free_slot(dev, i + 1, true);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Take a free slot for a block and pin it, evicting another block if the
+ * cache is full, or growing the cache if nothing can be evicted.
+ *
+ * @return  the slot (index + 1); 0 if out of memory.
+ */
+static uint32_t alloc_slot(bdev *dev, uint32_t block)
+{
+	if (dev->used >= dev->capacity)
+		evict_one(dev);
+	if (dev->free_list == 0) {
+		// every slot is pinned, loading or dirty: grow rather than wait
+		uint32_t nslots = 2 * dev->nslots;
+		bdev_slot *slots = realloc(dev->slots, nslots * sizeof(bdev_slot));
+		if (slots == NULL)
+			return 0;
+		memset(slots + dev->nslots, 0, (nslots - dev->nslots) * sizeof(bdev_slot));
+		for (uint32_t i = dev->nslots; i < nslots; i++)
+			slots[i].next = i + 1 < nslots ? i + 2 : 0;
+		dev->free_list = dev->nslots + 1;
+		dev->slots = slots;
+		dev->nslots = nslots;
+	}
+
+	uint32_t i = dev->free_list;
+	bdev_slot *s = &dev->slots[i - 1];
+	dev->free_list = s->next;
+	s->block = block;
+	s->used = true;
+	s->ref = true;
+	s->pins = 1;
+	uint32_t *head = &dev->hash[hash_block(dev, block)];
+	s->next = *head;
+	*head = i;
+	dev->used++;
+	return i;
+}
+
+/**
+ * Write back the dirty slots that nobody has pinned. They stay pinned while
+ * they are written, so they are not evicted under the write, and are dirty
+ * again if they are modified meanwhile.
+ */
+static void write_back(bdev *dev)
+{
+	pthread_mutex_lock(&dev->lock);
+	uint32_t *blocks = dev->ndirty > 0 ? malloc(dev->ndirty * sizeof(uint32_t)) : NULL;
+	uint32_t n = 0;
+	for (uint32_t i = 0; blocks != NULL && i < dev->nslots; i++) {
+		bdev_slot *s = &dev->slots[i];
+		if (s->used && s->dirty && s->pins == 0 && !s->loading) {
+			s->dirty = false;
+			s->pins = 1;
+			dev->ndirty--;
+			blocks[n++] = s->block;
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+	if (n == 0) {
+		free(blocks);
+		return;
+	}
+
+	bool ok = write_list(dev, blocks, n, false);
+
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t k = 0; k < n; k++) {
+		uint32_t i = find_slot(dev, blocks[k]);
+		if (i == 0)
+			continue; // taken over by bdev_block()
+		bdev_slot *s = &dev->slots[i - 1];
+		s->pins--;
+		if (!ok && !s->dirty) {
+			// try again next time rather than lose the data
+			s->dirty = true;
+			dev->ndirty++;
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+	free(blocks);
+}
+
+static void *writeback_thread(void *arg)
+{
+	bdev *dev = arg;
+	pthread_mutex_lock(&dev->lock);
+	while (!dev->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += dev->interval_ms / 1000;
+		deadline.tv_nsec += (long)(dev->interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&dev->wakeup, &dev->lock, &deadline);
+		bool work = dev->ndirty > 0 && !dev->stopping;
+		pthread_mutex_unlock(&dev->lock);
+		if (work)
+			write_back(dev);
+		pthread_mutex_lock(&dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return NULL;
+}
+
+/** Set up the pread backend on an open image file. */
+static bool cache_init(bdev *dev, const char *path, size_t cache_size, bool direct)
+{
+	dev->io_fd = dev->fd;
+	if (direct) {
+		// not every file system supports O_DIRECT (tmpfs doesn't)
+		dev->io_fd = open(path, O_RDWR | O_DIRECT);
+		if (dev->io_fd < 0) {
+			perror("O_DIRECT");
+			return false;
+		}
+	}
+
+	// The blocks are read into the same place they would be in a mapping of
+	// the file; the reservation costs memory only for the blocks that are in
+	void *base = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	dev->base = base;
+
+	dev->capacity = cache_size / A1FS_BLOCK_SIZE;
+	dev->nslots = dev->capacity;
+	dev->hash_cap = 1;
+	while (dev->hash_cap < 2 * dev->capacity)
+		dev->hash_cap *= 2;
+	dev->resident = calloc((dev->blocks_count + 63) / 64, sizeof(uint64_t));
+	dev->slots = calloc(dev->nslots, sizeof(bdev_slot));
+	dev->hash = calloc(dev->hash_cap, sizeof(uint32_t));
+	if (dev->resident == NULL || dev->slots == NULL || dev->hash == NULL) {
+		free(dev->resident);
+		free(dev->slots);
+		free(dev->hash);
+		munmap(dev->base, dev->size);
+		return false;
+	}
+	for (uint32_t i = 0; i < dev->nslots; i++)
+		dev->slots[i].next = i + 1 < dev->nslots ? i + 2 : 0;
+	dev->free_list = 1;
+
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->changed, NULL);
+	pthread_cond_init(&dev->wakeup, NULL);
+	return true;
+}
+
+
+/** Check whether a file is on a hugetlbfs mount. */
+static bool on_hugetlbfs(int fd)
+{
+	struct statfs st;
+	return fstatfs(fd, &st) == 0 && st.f_type == HUGETLBFS_MAGIC;
+}
+
+bool bdev_open(bdev *dev, const char *path, size_t cache_size, bool direct, bool use_uring)
+{
+	memset(dev, 0, sizeof(bdev));
+	dev->fd = -1;
+	dev->io_fd = -1;
+	dev->ring.fd = -1;
+	if (cache_size == 0) {
+		dev->backend = BDEV_MMAP;
+		dev->base = map_file(path, A1FS_BLOCK_SIZE, &dev->size, &dev->fd);
+		if (dev->base == NULL)
+			return false;
+		dev->io_fd = dev->fd;
+		dev->blocks_count = dev->size / A1FS_BLOCK_SIZE;
+		dev->hugetlb = on_hugetlbfs(dev->fd);
+		return true;
+	}
+
+	dev->backend = BDEV_PREAD;
+	dev->use_uring = use_uring;
+	dev->fd = open_file(path, A1FS_BLOCK_SIZE, &dev->size);
+	if (dev->fd < 0)
+		return false;
+	if (on_hugetlbfs(dev->fd)) {
+		fprintf(stderr, "An image on hugetlbfs can only be mapped (no cache option)\n");
+		close(dev->fd);
+		return false;
+	}
+	dev->blocks_count = dev->size / A1FS_BLOCK_SIZE;
+	if (!cache_init(dev, path, cache_size, direct)) {
+		if (dev->io_fd >= 0 && dev->io_fd != dev->fd)
+			close(dev->io_fd);
+		close(dev->fd);
+		dev->base = NULL;
+		return false;
+	}
+	return true;
+}
+
+#ifndef NDEBUG
+/** Check that no metadata block in memory differs from the disk, i.e. was modified without journal_dirty(). */
+static void check_checkpointed(bdev *dev)
+{
+	uint8_t block[A1FS_BLOCK_SIZE];
+	for (uint32_t b = 0; b < dev->blocks_count; b++) {
+		if (!is_resident(dev, b) || pread(dev->fd, block, A1FS_BLOCK_SIZE, (off_t)b * A1FS_BLOCK_SIZE) != A1FS_BLOCK_SIZE)
+			continue;
+		if (memcmp(block, block_addr(dev, b), A1FS_BLOCK_SIZE) != 0)
+			fprintf(stderr, "Metadata block %u was modified without journal_dirty()\n", b);
+	}
+}
+#endif
+
+void bdev_close(bdev *dev)
+{
+	if (dev->base == NULL)
+		return;
+	if (dev->backend == BDEV_MMAP) {
+		munmap(dev->base, dev->size);
+		close(dev->fd);
+		dev->base = NULL;
+		return;
+	}
+
+	if (dev->thread_running) {
+		pthread_mutex_lock(&dev->lock);
+		dev->stopping = true;
+		pthread_cond_signal(&dev->wakeup);
+		pthread_mutex_unlock(&dev->lock);
+		pthread_join(dev->thread, NULL);
+		dev->thread_running = false;
+	}
+	write_back(dev);
+	// metadata blocks are already on disk, the journal checkpoints wrote them
+	if (fdatasync(dev->io_fd) < 0)
+		perror("fdatasync");
+#ifndef NDEBUG
+	check_checkpointed(dev);
+#endif
+	// waits for prefetches still in flight, whose completion needs the slots
+	uring_destroy(&dev->ring);
+
+	free(dev->resident);
+	free(dev->slots);
+	free(dev->hash);
+	pthread_mutex_destroy(&dev->lock);
+	pthread_cond_destroy(&dev->changed);
+	pthread_cond_destroy(&dev->wakeup);
+	munmap(dev->base, dev->size);
+	if (dev->io_fd != dev->fd)
+		close(dev->io_fd);
+	close(dev->fd);
+	dev->base = NULL;
+}
+
+bool bdev_start_thread(bdev *dev, unsigned int interval_ms)
+{
+	if (dev->backend != BDEV_PREAD)
+		return true;
+	// The ring is set up here rather than in bdev_open() so that it belongs to
+	// the process that serves requests, not the one FUSE forked it from
+	if (dev->use_uring && !uring_init(&dev->ring, BDEV_URING_ENTRIES, dev->io_fd))
+		fprintf(stderr, "io_uring is not available, using pread()/pwrite()\n");
+	dev->interval_ms = interval_ms;
+	if (pthread_create(&dev->thread, NULL, writeback_thread, dev) != 0)
+		return false;
+	dev->thread_running = true;
+	return true;
+}
+
+void *bdev_block(bdev *dev, uint32_t block)
+{
+	if (dev->backend == BDEV_MMAP || is_resident(dev, block))
+		return block_addr(dev, block);
+
+	pthread_mutex_lock(&dev->lock);
+	while (!is_resident(dev, block)) {
+		uint32_t i = find_slot(dev, block);
+		if (i != 0 && dev->slots[i - 1].loading) {
+			pthread_cond_wait(&dev->changed, &dev->lock);
+			continue;
+		}
+		if (i != 0) {
+			// a freed data block reused as metadata: keep what is in memory,
+			// the journal writes it once it is modified
+			free_slot(dev, i, false);
+		} else {
+			read_blocks(dev, block, 1);
+		}
+		set_resident(dev, block);
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return block_addr(dev, block);
+}
+
+void *bdev_blocks(bdev *dev, uint32_t block, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		bdev_block(dev, block + i);
+	return block_addr(dev, block);
+}
+
+void bdev_release(bdev *dev, uint32_t block, uint32_t count)
+{
+	if (dev->backend == BDEV_MMAP)
+		return;
+
+	pthread_mutex_lock(&dev->lock);
+	uint32_t b = block;
+	while (b < block + count) {
+		if (!is_resident(dev, b)) {
+			b++;
+			continue;
+		}
+		// give the memory of each run of freed metadata blocks back at once
+		uint32_t run = 0;
+		while (b + run < block + count && is_resident(dev, b + run)) {
+			clear_resident(dev, b + run);
+			run++;
+		}
+		madvise(block_addr(dev, b), (size_t)run * A1FS_BLOCK_SIZE, MADV_DONTNEED);
+		b += run;
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+uint32_t bdev_block_num(bdev *dev, const void *addr)
+{
+	return ((const uint8_t *)addr - dev->base) / A1FS_BLOCK_SIZE;
+}
+
+/** Unpin blocks; the caller holds dev->lock. */
+static void unpin(bdev *dev, uint32_t block, uint32_t count, bool dirty)
+{
+	for (uint32_t b = block; b < block + count; b++) {
+		uint32_t i = is_resident(dev, b) ? 0 : find_slot(dev, b);
+		if (i == 0)
+			continue; // freed and taken over by bdev_block() as metadata while pinned
+		bdev_slot *s = &dev->slots[i - 1];
+		if (s->pins > 0)
+			s->pins--;
+		if (dirty && !s->dirty) {
+			s->dirty = true;
+			dev->ndirty++;
+		}
+	}
+}
+
+void *bdev_get(bdev *dev, uint32_t block, uint32_t count, bool fill)
+{
+	if (dev->backend == BDEV_MMAP)
+		return block_addr(dev, block);
+
+	pthread_mutex_lock(&dev->lock);
+	// Wait until no block of the range is being read in by someone else
+	uint32_t b = block;
+	while (b < block + count) {
+		uint32_t i = is_resident(dev, b) ? 0 : find_slot(dev, b);
+		if (i != 0 && dev->slots[i - 1].loading) {
+			pthread_cond_wait(&dev->changed, &dev->lock);
+			b = block;
+			continue;
+		}
+		b++;
+	}
+
+	// Pin the cached blocks and take slots for the missing ones
+	bool *missing = NULL;
+	bool ok = true;
+	for (b = block; b < block + count; b++) {
+		if (is_resident(dev, b))
+			continue;
+		uint32_t i = find_slot(dev, b);
+		if (i != 0) {
+			dev->slots[i - 1].pins++;
+			dev->slots[i - 1].ref = true;
+			continue;
+		}
+		if (missing == NULL && (missing = calloc(count, sizeof(bool))) == NULL) {
+			ok = false;
+			break;
+		}
+		i = alloc_slot(dev, b);
+		if (i == 0) {
+			ok = false;
+			break;
+		}
+		dev->slots[i - 1].loading = fill;
+		missing[b - block] = true;
+	}
+	if (!ok) {
+		// undo what the loop did before it ran out of memory
+		for (uint32_t k = block; k < b; k++) {
+			if (missing != NULL && missing[k - block])
+				free_slot(dev, find_slot(dev, k), false);
+			else
+				unpin(dev, k, 1, false);
+		}
+		pthread_mutex_unlock(&dev->lock);
+		free(missing);
+		return NULL;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	if (missing == NULL || !fill) {
+		free(missing);
+		return block_addr(dev, block);
+	}
+
+	// Read the missing runs without the lock, all in one batch; the slots are
+	// marked loading, so nobody else uses them meanwhile
+	io_run *runs = malloc(count * sizeof(io_run));
+	uint32_t nruns = 0;
+	for (b = 0; b < count; b++) {
+		if (!missing[b])
+			continue;
+		uint32_t run = 1;
+		while (b + run < count && run < BDEV_MAX_RUN && missing[b + run])
+			run++;
+		if (runs != NULL)
+			runs[nruns++] = (io_run){ .block = block + b, .count = run };
+		else
+			ok &= read_blocks(dev, block + b, run);
+		b += run - 1;
+	}
+	if (runs != NULL)
+		ok = transfer(dev, false, runs, nruns, false);
+	free(runs);
+
+	pthread_mutex_lock(&dev->lock);
+	for (b = 0; b < count; b++) {
+		if (missing[b])
+			dev->slots[find_slot(dev, block + b) - 1].loading = false;
+	}
+	if (!ok) {
+		unpin(dev, block, count, false);
+		for (b = 0; b < count; b++) {
+			uint32_t i = missing[b] ? find_slot(dev, block + b) : 0;
+			if (i != 0 && dev->slots[i - 1].pins == 0)
+				free_slot(dev, i, true);
+		}
+	}
+	pthread_cond_broadcast(&dev->changed);
+	pthread_mutex_unlock(&dev->lock);
+	free(missing);
+	return ok ? block_addr(dev, block) : NULL;
+}
+
+void bdev_put(bdev *dev, uint32_t block, uint32_t count, bool dirty)
+{
+	if (dev->backend == BDEV_MMAP)
+		return;
+
+	pthread_mutex_lock(&dev->lock);
+	unpin(dev, block, count, dirty);
+	// give back what alloc_slot() took past the capacity while everything was pinned
+	while (dev->used > dev->capacity && evict_one(dev))
+		;
+	// start writing back early, and make a writer that gets too far ahead do it itself
+	if (dev->ndirty > dev->capacity / 4)
+		pthread_cond_signal(&dev->wakeup);
+	bool throttle = dev->ndirty > dev->capacity / 2;
+	pthread_mutex_unlock(&dev->lock);
+	if (throttle)
+		write_back(dev);
+}
+
+/** Completion of a read that bdev_prefetch() started: the blocks are ready, or are dropped if it failed. */
+static void prefetch_done(uring_req *req)
+{
+	bdev *dev = req->arg;
+	uint32_t block = req->off / A1FS_BLOCK_SIZE;
+	uint32_t count = req->len / A1FS_BLOCK_SIZE;
+	bool ok = req->res >= 0 && (size_t)req->res == req->len;
+
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t b = block; b < block + count; b++) {
+		uint32_t i = find_slot(dev, b);
+		bdev_slot *s = &dev->slots[i - 1];
+		s->loading = false;
+		s->pins--;
+		// whoever needs the block next reads it again
+		if (!ok && s->pins == 0)
+			free_slot(dev, i, true);
+	}
+	pthread_cond_broadcast(&dev->changed);
+	pthread_mutex_unlock(&dev->lock);
+	free(req);
+}
+
+void bdev_prefetch(bdev *dev, uint32_t block, uint32_t count)
+{
+	if (dev->backend == BDEV_MMAP) {
+		madvise(block_addr(dev, block), (size_t)count * A1FS_BLOCK_SIZE, MADV_WILLNEED);
+		return;
+	}
+	if (dev->ring.fd < 0) {
+		// O_DIRECT reads bypass the page cache, so there is nothing to read ahead into
+		if (dev->io_fd == dev->fd)
+			posix_fadvise(dev->fd, (off_t)block * A1FS_BLOCK_SIZE, (off_t)count * A1FS_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	// Take slots for the runs of blocks that are not in memory, marked loading
+	// until prefetch_done(), and start reading them. A hint doesn't evict dirty
+	// or pinned blocks or grow the cache, so it stops when it runs out of slots.
+	pthread_mutex_lock(&dev->lock);
+	uint32_t b = block;
+	while (b < block + count) {
+		if (is_resident(dev, b) || find_slot(dev, b) != 0) {
+			b++;
+			continue;
+		}
+		uring_req *req = calloc(1, sizeof(uring_req));
+		if (req == NULL)
+			break;
+		uint32_t run = 0;
+		while (b < block + count && run < BDEV_MAX_RUN && !is_resident(dev, b) && find_slot(dev, b) == 0) {
+			if (dev->used >= dev->capacity && !evict_one(dev))
+				break;
+			uint32_t i = alloc_slot(dev, b);
+			if (i == 0)
+				break;
+			dev->slots[i - 1].loading = true;
+			run++;
+			b++;
+		}
+		if (run == 0) {
+			free(req);
+			break;
+		}
+		req->op = URING_READ;
+		req->buf = block_addr(dev, b - run);
+		req->len = (size_t)run * A1FS_BLOCK_SIZE;
+		req->off = (uint64_t)(b - run) * A1FS_BLOCK_SIZE;
+		req->done = prefetch_done;
+		req->arg = dev;
+		// the completion takes dev->lock, so don't hold it while the submission may wait
+		pthread_mutex_unlock(&dev->lock);
+		uring_submit(&dev->ring, req);
+		pthread_mutex_lock(&dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/** Fault pages in by reading a byte of each, for kernels without MADV_POPULATE_READ. */
+static void touch_pages(const uint8_t *addr, size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t off = 0; off < len; off += page)
+		(void)*(const volatile uint8_t *)(addr + off);
+}
+
+/** Read the blocks of a range that are not in memory yet in as metadata blocks. */
+static void populate(bdev *dev, uint32_t block, uint32_t count)
+{
+	pthread_mutex_lock(&dev->lock);
+	uint32_t b = block;
+	while (b < block + count) {
+		// a cached data block is left to bdev_block()
+		if (is_resident(dev, b) || find_slot(dev, b) != 0) {
+			b++;
+			continue;
+		}
+		uint32_t run = 1;
+		while (b + run < block + count && run < BDEV_MAX_RUN && !is_resident(dev, b + run) &&
+		       find_slot(dev, b + run) == 0)
+			run++;
+		read_blocks(dev, b, run);
+		for (uint32_t k = 0; k < run; k++)
+			set_resident(dev, b + k);
+		b += run;
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+void bdev_advise(bdev *dev, uint32_t block, uint32_t count, bdev_advice advice)
+{
+	uint8_t *addr = block_addr(dev, block);
+	size_t len = (size_t)count * A1FS_BLOCK_SIZE;
+	static const int madv[] = {
+		[BDEV_NORMAL]     = MADV_NORMAL,
+		[BDEV_RANDOM]     = MADV_RANDOM,
+		[BDEV_SEQUENTIAL] = MADV_SEQUENTIAL,
+		[BDEV_WILLNEED]   = MADV_WILLNEED,
+		[BDEV_HUGEPAGE]   = MADV_HUGEPAGE,
+		[BDEV_POPULATE]   = MADV_POPULATE_READ,
+	};
+
+	if (dev->backend == BDEV_PREAD) {
+		if (advice == BDEV_POPULATE) {
+			populate(dev, block, count);
+		} else if (advice == BDEV_HUGEPAGE) {
+			if (madvise(addr, len, MADV_HUGEPAGE) < 0)
+				perror("MADV_HUGEPAGE");
+		} else if (dev->io_fd == dev->fd) {
+			static const int fadv[] = {
+				[BDEV_NORMAL]     = POSIX_FADV_NORMAL,
+				[BDEV_RANDOM]     = POSIX_FADV_RANDOM,
+				[BDEV_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+				[BDEV_WILLNEED]   = POSIX_FADV_WILLNEED,
+			};
+			posix_fadvise(dev->fd, (off_t)block * A1FS_BLOCK_SIZE, len, fadv[advice]);
+		}
+		return;
+	}
+
+	// hugetlbfs pages are huge already
+	if (advice == BDEV_HUGEPAGE && dev->hugetlb)
+		return;
+	if (madvise(addr, len, madv[advice]) == 0)
+		return;
+	if (advice == BDEV_POPULATE && errno == EINVAL)
+		touch_pages(addr, len);
+	else
+		perror("madvise");
+}
+
+bool bdev_dirty(bdev *dev, uint32_t block, uint32_t count)
+{
+	if (dev->backend == BDEV_MMAP)
+		return false;
+
+	bool dirty = false;
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t b = block; b < block + count && !dirty; b++) {
+		if (is_resident(dev, b)) {
+			dirty = true;
+			continue;
+		}
+		// a pinned block may be in the middle of being written back
+		uint32_t i = find_slot(dev, b);
+		dirty = i != 0 && (dev->slots[i - 1].dirty || dev->slots[i - 1].pins > 0);
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return dirty;
+}
+
+void bdev_sync(bdev *dev, uint32_t block, uint32_t count)
+{
+	if (dev->backend == BDEV_MMAP) {
+		sync_mapping(block_addr(dev, block), (size_t)count * A1FS_BLOCK_SIZE);
+		return;
+	}
+
+	uint32_t *blocks = malloc(count * sizeof(uint32_t));
+	if (blocks == NULL) {
+		write_back(dev); // writes the data blocks at least
+		fdatasync(dev->io_fd);
+		return;
+	}
+	uint32_t n = 0;
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t b = block; b < block + count; b++) {
+		if (is_resident(dev, b)) {
+			blocks[n++] = b;
+			continue;
+		}
+		uint32_t i = find_slot(dev, b);
+		bdev_slot *s = i != 0 ? &dev->slots[i - 1] : NULL;
+		if (s != NULL && s->dirty && !s->loading) {
+			// pinned like in write_back()
+			s->dirty = false;
+			s->pins++;
+			dev->ndirty--;
+			blocks[n++] = b;
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	bool ok = write_list(dev, blocks, n, true);
+
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t k = 0; k < n; k++) {
+		uint32_t i = is_resident(dev, blocks[k]) ? 0 : find_slot(dev, blocks[k]);
+		if (i == 0)
+			continue;
+		bdev_slot *s = &dev->slots[i - 1];
+		s->pins--;
+		if (!ok && !s->dirty) {
+			s->dirty = true;
+			dev->ndirty++;
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+	free(blocks);
+}
+
+void bdev_checkpoint(bdev *dev, const uint32_t *blocks, const char *images, uint32_t n)
+{
+	if (dev->backend == BDEV_PREAD) {
+		io_run *runs = n > 0 ? malloc(n * sizeof(io_run)) : NULL;
+		if (runs != NULL) {
+			transfer(dev, true, runs, make_runs(blocks, n, images, runs), true);
+			free(runs);
+			return;
+		}
+	}
+
+	uint32_t i = 0;
+	while (i < n) {
+		uint32_t run = 1;
+		while (i + run < n && blocks[i + run] == blocks[i] + run)
+			run++;
+		if (dev->backend == BDEV_MMAP)
+			sync_mapping(block_addr(dev, blocks[i]), (size_t)run * A1FS_BLOCK_SIZE);
+		else
+			write_blocks(dev, blocks[i], run, (const uint8_t *)images + (size_t)i * A1FS_BLOCK_SIZE);
+		i += run;
+	}
+	if (dev->backend == BDEV_PREAD && n > 0 && fdatasync(dev->io_fd) < 0)
+		perror("fdatasync");
+}
@@ -0,0 +1,265 @@
+/**
+ * Block device layer: how the mounted image is read and written.
+ *
+ * Everything above this layer addresses the image by block number and gets a
+ * pointer to the block's bytes from it. There are two backends:
+ *
+ * - mmap (the default): the image file is mapped MAP_SHARED and the kernel
+ *   pages blocks in and writes them back on its own schedule.
+ *
+ * - pread (the cache option): blocks are read with pread() (O_DIRECT with the
+ *   direct option) into an anonymous reservation the size of the image, at
+ *   the same offset they would have in the mapping, so a block never moves
+ *   and its number can still be derived from its address. Nothing reaches the
+ *   file until it is written with pwrite(): dirty data blocks by the writeback
+ *   thread or by bdev_sync(), metadata blocks only when the journal flushes
+ *   them (see journal_commit()).
+ *
+ * In the pread backend, blocks fall into two classes:
+ *
+ * - Metadata blocks, i.e. everything reached through bdev_block(). The
+ *   callers keep pointers into them (inodes, directory entries, extent tree
+ *   nodes) for as long as they like. So once read, these blocks stay in
+ *   memory until they are freed (see bdev_release()) or the image is
+ *   unmounted. Their number is bounded by the metadata of the image.
+ *
+ * - File data blocks, reached through bdev_get()/bdev_put(). They live in a
+ *   cache of a fixed number of slots. It is evicted with the CLOCK
+ *   (second-chance) algorithm: a slot that was used since the clock hand last
+ *   passed gets another round. Slots that are pinned (between bdev_get() and
+ *   bdev_put()), being read in, or dirty are never evicted. If every slot is
+ *   pinned, the cache grows instead of waiting. A writer that leaves too many
+ *   slots dirty writes them back itself.
+ *
+ * With the uring option the pread backend does its I/O through io_uring (see
+ * uring.h): the missing runs of a bdev_get(), a writeback pass, or a journal
+ * flush with its fdatasync() are each one submission, and bdev_prefetch()
+ * reads blocks into the cache in the background instead of only hinting the
+ * kernel. The engine starts with bdev_start_thread(), i.e. after FUSE has
+ * forked into the background; until then, and if io_uring is not available,
+ * the backend uses pread()/pwrite().
+ *
+ * With the mmap backend all of these are thin wrappers around the mapping.
+ * An image on a hugetlbfs mount is mapped with huge pages; the file can then
+ * only be read and written through the mapping (see bdev.hugetlb).
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "uring.h"
+
+
+typedef enum bdev_backend {
+	BDEV_MMAP,
+	BDEV_PREAD,
+
+} bdev_backend;
+
+/** Expected access pattern of a range of the image (see bdev_advise()). */
+typedef enum bdev_advice {
+	BDEV_NORMAL,
+	BDEV_RANDOM,
+	BDEV_SEQUENTIAL,
+	/** Read the range ahead now. */
+	BDEV_WILLNEED,
+	/** Back the range with (transparent) huge pages. */
+	BDEV_HUGEPAGE,
+	/** Fault the range in now, so that accessing it doesn't fault. */
+	BDEV_POPULATE,
+
+} bdev_advice;
+
+/** A file data block in the cache of the pread backend. */
+typedef struct bdev_slot {
+	uint32_t block;
+	/** Number of bdev_get() calls that have not been matched by bdev_put() yet. */
+	uint32_t pins;
+	/** Index + 1 of the next slot in the same hash chain (or the free list); 0 ends it. */
+	uint32_t next;
+	bool used;
+	/** Used since the clock hand last passed (the CLOCK reference bit). */
+	bool ref;
+	/** Modified and not written back yet. */
+	bool dirty;
+	/** Being read in by a bdev_get() that released the lock; wait on bdev.changed. */
+	bool loading;
+
+} bdev_slot;
+
+typedef struct bdev {
+	bdev_backend backend;
+	/** Start of the image in memory (the mapping, or the reservation of the pread backend). */
+	uint8_t *base;
+	/** Image size in bytes. */
+	size_t size;
+	uint32_t blocks_count;
+	/** The image file; file data is spliced from it (see read_file_buf()). */
+	int fd;
+	/** The descriptor blocks are read and written through: an O_DIRECT one with the direct option, fd otherwise. */
+	int io_fd;
+	/** The image is on hugetlbfs, which supports neither splice() nor write(); the mmap backend only. */
+	bool hugetlb;
+
+	// The rest is only used by the pread backend
+
+	/** Bitmap of metadata blocks that are in memory for good, until bdev_release(). */
+	uint64_t *resident;
+	/** Protects the slots and the hash. Innermost lock. */
+	pthread_mutex_t lock;
+	/** Signalled when slots finish loading. */
+	pthread_cond_t changed;
+	/** Wakes the writeback thread early, when many slots are dirty or at close. */
+	pthread_cond_t wakeup;
+	bdev_slot *slots;
+	/** Number of slots allocated, used, and allowed before eviction starts. */
+	uint32_t nslots;
+	uint32_t used;
+	uint32_t capacity;
+	uint32_t ndirty;
+	/** Where the clock hand is. */
+	uint32_t hand;
+	/** Head (index + 1) of the list of unused slots. */
+	uint32_t free_list;
+	/** Hash chains of block number -> slot (index + 1); hash_cap is a power of 2. */
+	uint32_t *hash;
+	uint32_t hash_cap;
+
+	/** Writeback thread and how often it runs. */
+	pthread_t thread;
+	bool thread_running;
+	bool stopping;
+	unsigned int interval_ms;
+
+	/** Do I/O through io_uring once the threads start. */
+	bool use_uring;
+	/** The io_uring engine; ring.fd is -1 while it is not running. */
+	uring ring;
+
+} bdev;
+
+/**
+ * Open an image file. The file size must be a non-zero multiple of the block
+ * size.
+ *
+ * @param path        the image file.
+ * @param cache_size  size in bytes of the data block cache of the pread
+ *                    backend; 0 to map the image (the mmap backend).
+ * @param direct      read and write with O_DIRECT (pread backend only).
+ * @param use_uring   read and write through io_uring (pread backend only).
+ * @return            true on success; false on failure, which is reported on
+ *                    stderr.
+ */
+bool bdev_open(bdev *dev, const char *path, size_t cache_size, bool direct, bool use_uring);
+
+/**
+ * Write the dirty data blocks back, wait until they are on disk and close the
+ * image. Stops the writeback thread. Metadata blocks are not written: the
+ * journal has checkpointed them (the caller commits it first), which debug
+ * builds check.
+ */
+void bdev_close(bdev *dev);
+
+/**
+ * Start the thread that writes dirty data blocks back every interval_ms
+ * milliseconds, and the io_uring engine with the uring option. Does nothing
+ * in the mmap backend, where the kernel does it.
+ *
+ * @return  true on success; false if the thread can't be started (dirty
+ *          blocks are then written back when the cache fills up, on
+ *          bdev_sync() and at close).
+ */
+bool bdev_start_thread(bdev *dev, unsigned int interval_ms);
+
+/**
+ * Get a metadata block, reading it in if needed. The pointer stays valid
+ * until the image is closed; modifications go through the journal (see
+ * journal_dirty()) and reach the disk when it flushes them (see
+ * bdev_checkpoint()).
+ *
+ * NOTE: an I/O error is reported on stderr and the block reads as zeros (the
+ * mmap backend would raise SIGBUS instead).
+ */
+void *bdev_block(bdev *dev, uint32_t block);
+
+/** bdev_block() for count consecutive blocks; returns the first. */
+void *bdev_blocks(bdev *dev, uint32_t block, uint32_t count);
+
+/**
+ * Forget the contents of blocks that were freed. A metadata block stops being
+ * one, so a new owner that uses it for file data goes through the cache (and
+ * its writes are written back), and one that uses it for metadata reads it
+ * again. Must not be called while the journal may still write the blocks in
+ * place, i.e. before the transaction that freed them is checkpointed.
+ */
+void bdev_release(bdev *dev, uint32_t block, uint32_t count);
+
+/** The number of the block that addr (a pointer into a block) belongs to. */
+uint32_t bdev_block_num(bdev *dev, const void *addr);
+
+/**
+ * Pin count consecutive file data blocks in memory, reading them in unless
+ * fill is false (the caller is about to overwrite all of them).
+ *
+ * @return  pointer to the first block, valid until bdev_put(); NULL on an I/O
+ *          error.
+ */
+void *bdev_get(bdev *dev, uint32_t block, uint32_t count, bool fill);
+
+/**
+ * Unpin blocks pinned by bdev_get().
+ *
+ * @param dirty  true if the caller modified them.
+ */
+void bdev_put(bdev *dev, uint32_t block, uint32_t count, bool dirty);
+
+/**
+ * Hint that blocks [block, block + count) will be read soon. With io_uring,
+ * the pread backend starts reading the ones that are not in memory into the
+ * cache (as long as it has slots to spare); bdev_get() of such a block waits
+ * for its read.
+ */
+void bdev_prefetch(bdev *dev, uint32_t block, uint32_t count);
+
+/**
+ * Advise the backend how a range of blocks will be used: madvise() for the
+ * mapping. The pread backend only keeps metadata blocks in memory for good,
+ * so there BDEV_POPULATE reads the range in as metadata and BDEV_HUGEPAGE
+ * applies to the reservation; the other advice goes to the page cache of the
+ * file (with posix_fadvise(), except with O_DIRECT). Errors are reported on
+ * stderr; the advice is only a hint, so they are not fatal.
+ */
+void bdev_advise(bdev *dev, uint32_t block, uint32_t count, bdev_advice advice);
+
+/**
+ * Check whether the file may hold stale contents of some of the blocks, i.e.
+ * blocks that are modified in memory and not written back yet. Always false
+ * with the mmap backend, where the file and the memory are the same pages.
+ */
+bool bdev_dirty(bdev *dev, uint32_t block, uint32_t count);
+
+/**
+ * Write blocks [block, block + count) to the image file and wait until they
+ * are on disk. In the pread backend this writes the metadata blocks in the
+ * range and the dirty data blocks; blocks that are not in memory are already
+ * on disk.
+ */
+void bdev_sync(bdev *dev, uint32_t block, uint32_t count);
+
+/**
+ * Write metadata blocks in place from copies of their contents and wait until
+ * they are on disk (the journal checkpoint). The pread backend writes the
+ * copies, so changes made after they were taken stay in memory; the mmap
+ * backend can only flush the blocks as they are now.
+ *
+ * @param blocks  the block numbers, sorted.
+ * @param images  the contents of the blocks, one after another; aligned to
+ *                A1FS_BLOCK_SIZE for O_DIRECT.
+ * @param n       the number of blocks.
+ */
+void bdev_checkpoint(bdev *dev, const uint32_t *blocks, const char *images, uint32_t n);
@@ -0,0 +1,153 @@
+/**
+ * Bitmap search implementation.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+
+/** Load the 64 bits starting at byte offset; bits past the end of the bitmap read as 0. */
+static uint64_t load_word(const uint8_t *bitmap, uint32_t nbytes, uint32_t offset)
+{
+	uint64_t word = 0;
+	uint32_t len = nbytes - offset < 8 ? nbytes - offset : 8;
+	memcpy(&word, bitmap + offset, len);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word); // bit i of the bitmap must be bit i of the word
+#endif
+	return word;
+}
+
+#if defined(__x86_64__)
+/**
+ * Skip 32 byte chunks that contain no match. Returns the byte offset of the
+ * first chunk that might contain one (or of the tail that is too short for a
+ * whole chunk).
+ */
+__attribute__((target("avx2")))
+static uint32_t skip_chunks_avx2(const uint8_t *bitmap, uint32_t nbytes, uint32_t offset, bool set)
+{
+	const __m256i ones = _mm256_set1_epi8((char)0xff);
+	while (offset + 32 <= nbytes) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + offset));
+		// looking for a set bit: skip all-zero chunks; for a clear bit: skip all-ones chunks
+		if (set ? !_mm256_testz_si256(chunk, chunk) : !_mm256_testc_si256(chunk, ones))
+			break;
+		offset += 32;
+	}
+	return offset;
+}
+
+/** Whether to use skip_chunks_avx2(); -1 until the CPU is asked. */
+static int use_avx2 = -1;
+
+static bool have_avx2(void)
+{
+	// racing threads all compute the same answer
+	if (use_avx2 < 0)
+		use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return use_avx2;
+}
+#endif
+
+/** Index of the first bit in [from, nbits) equal to set; -1 if none. */
+static long next_bit(const uint8_t *bitmap, uint32_t nbits, uint32_t from, bool set)
+{
+	if (from >= nbits)
+		return -1;
+	uint32_t nbytes = (nbits + 7) / 8;
+	uint32_t offset = from / 64 * 8;
+
+	// The first word may start before from
+	uint64_t word = load_word(bitmap, nbytes, offset);
+	uint64_t match = (set ? word : ~word) & (~0ull << (from % 64));
+
+	while (true) {
+		if (match != 0) {
+			long bit = (long)offset * 8 + __builtin_ctzll(match);
+			return bit < nbits ? bit : -1;
+		}
+		offset += 8;
+		if (offset >= nbytes)
+			return -1;
+#if defined(__x86_64__)
+		if (offset % 32 == 0 && have_avx2())
+			offset = skip_chunks_avx2(bitmap, nbytes, offset, set);
+		if (offset >= nbytes)
+			return -1;
+#endif
+		word = load_word(bitmap, nbytes, offset);
+		match = set ? word : ~word;
+	}
+}
+
+void bitmap_use_avx2(bool enable)
+{
+#if defined(__x86_64__)
+	use_avx2 = enable && __builtin_cpu_supports("avx2");
+#else
+	(void)enable;
+#endif
+}
+
+long bitmap_next_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t from)
+{
+	return next_bit(bitmap, nbits, from, false);
+}
+
+long bitmap_next_set(const uint8_t *bitmap, uint32_t nbits, uint32_t from)
+{
+	return next_bit(bitmap, nbits, from, true);
+}
+
+long bitmap_find_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t hint)
+{
+	if (hint >= nbits)
+		hint = 0;
+	long bit = next_bit(bitmap, nbits, hint, false);
+	if (bit < 0 && hint > 0) {
+		// wrap around; bits past hint are already known to be set
+		bit = next_bit(bitmap, hint, 0, false);
+	}
+	return bit;
+}
+
+/** Set or clear bits [start, start + count): partial bytes bit by bit, whole bytes with memset. */
+static void fill_range(uint8_t *bitmap, uint32_t start, uint32_t count, bool set)
+{
+	uint32_t end = start + count;
+	while (start < end && start % 8 != 0) {
+		if (set)
+			bitmap[start / 8] |= 1 << (start % 8);
+		else
+			bitmap[start / 8] &= ~(1 << (start % 8));
+		start++;
+	}
+	if (end - start >= 8) {
+		memset(bitmap + start / 8, set ? 0xff : 0, (end - start) / 8);
+		start += (end - start) / 8 * 8;
+	}
+	while (start < end) {
+		if (set)
+			bitmap[start / 8] |= 1 << (start % 8);
+		else
+			bitmap[start / 8] &= ~(1 << (start % 8));
+		start++;
+	}
+}
+
+void bitmap_set_range(uint8_t *bitmap, uint32_t start, uint32_t count)
+{
+	fill_range(bitmap, start, count, true);
+}
+
+void bitmap_clear_range(uint8_t *bitmap, uint32_t start, uint32_t count)
+{
+	fill_range(bitmap, start, count, false);
+}
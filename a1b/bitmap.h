@@ -0,0 +1,50 @@
+/**
+ * Bitmap search shared by the inode and block allocators.
+ *
+ * Bit i of a bitmap is bit (i % 8) of byte (i / 8), as in the on-disk inode
+ * and block bitmaps. Searches look at 64 bits at a time, and at 256 bits at a
+ * time on CPUs with AVX2, so skipping over a long run of used entries costs a
+ * few instructions per 32 bytes of bitmap.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Turn the 256 bit search off, or back on on CPUs with AVX2 (it is on by
+ * default), e.g. to check it against the 64 bit one.
+ */
+void bitmap_use_avx2(bool enable);
+
+/**
+ * Find the first clear bit at or after from.
+ *
+ * @param bitmap  the bitmap.
+ * @param nbits   number of valid bits in the bitmap.
+ * @param from    first bit to look at.
+ * @return        index of the bit; -1 if every bit in [from, nbits) is set.
+ */
+long bitmap_next_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t from);
+
+/**
+ * Find the first set bit at or after from.
+ *
+ * @return  index of the bit; -1 if every bit in [from, nbits) is clear.
+ */
+long bitmap_next_set(const uint8_t *bitmap, uint32_t nbits, uint32_t from);
+
+/**
+ * Find a clear bit, starting at hint and wrapping around to bit 0.
+ *
+ * @return  index of the bit; -1 if the bitmap is full.
+ */
+long bitmap_find_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t hint);
+
+/** Set bits [start, start + count). */
+void bitmap_set_range(uint8_t *bitmap, uint32_t start, uint32_t count);
+
+/** Clear bits [start, start + count). */
+void bitmap_clear_range(uint8_t *bitmap, uint32_t start, uint32_t count);
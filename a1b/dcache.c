@@ -0,0 +1,224 @@
+/**
+ * In-memory directory entry cache implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+
+#define DCACHE_INIT_BUCKETS 256
+
+/** FNV-1a hash of the name, seeded with the parent inode number. */
+static uint64_t dcache_hash(a1fs_ino_t parent, const char *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int i = 0; i < 4; i++) {
+		hash ^= (parent >> (i * 8)) & 0xff;
+		hash *= 0x100000001b3ull;
+	}
+	for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static bool table_init(dcache_table *t, size_t nbuckets)
+{
+	t->buckets = calloc(nbuckets, sizeof(dcache_entry *));
+	if (t->buckets == NULL)
+		return false;
+	t->nbuckets = nbuckets;
+	t->count = 0;
+	return true;
+}
+
+/** Free every entry but keep the bucket array. */
+static void table_clear(dcache_table *t)
+{
+	for (size_t i = 0; i < t->nbuckets; i++) {
+		dcache_entry *e = t->buckets[i];
+		while (e != NULL) {
+			dcache_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+		t->buckets[i] = NULL;
+	}
+	t->count = 0;
+}
+
+static void table_destroy(dcache_table *t)
+{
+	if (t->buckets == NULL)
+		return;
+	table_clear(t);
+	free(t->buckets);
+	t->buckets = NULL;
+	t->nbuckets = 0;
+}
+
+/** Double the number of buckets. On allocation failure the table is left as is. */
+static void table_grow(dcache_table *t)
+{
+	size_t nbuckets = t->nbuckets * 2;
+	dcache_entry **buckets = calloc(nbuckets, sizeof(dcache_entry *));
+	if (buckets == NULL)
+		return; // keep using the smaller table, lookups are still correct
+
+	for (size_t i = 0; i < t->nbuckets; i++) {
+		dcache_entry *e = t->buckets[i];
+		while (e != NULL) {
+			dcache_entry *next = e->next;
+			size_t b = e->hash & (nbuckets - 1);
+			e->next = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nbuckets = nbuckets;
+}
+
+/** Return the address of the link that points at the matching entry (or at NULL). */
+static dcache_entry **table_find(dcache_table *t, uint64_t hash, a1fs_ino_t parent, const char *key)
+{
+	dcache_entry **link = &t->buckets[hash & (t->nbuckets - 1)];
+	while (*link != NULL) {
+		dcache_entry *e = *link;
+		if (e->hash == hash && e->parent == parent && strcmp(e->key, key) == 0)
+			break;
+		link = &e->next;
+	}
+	return link;
+}
+
+static long table_lookup(dcache_table *t, a1fs_ino_t parent, const char *key)
+{
+	dcache_entry *e = *table_find(t, dcache_hash(parent, key), parent, key);
+	return e == NULL ? -1 : (long)e->ino;
+}
+
+static void table_insert(dcache *dc, dcache_table *t, a1fs_ino_t parent, const char *key, a1fs_ino_t ino)
+{
+	uint64_t hash = dcache_hash(parent, key);
+	dcache_entry **link = table_find(t, hash, parent, key);
+	if (*link != NULL) {
+		(*link)->ino = ino;
+		return;
+	}
+
+	// The cache is only an accelerator; when it gets too big we simply start over
+	if (t->count >= dc->max_entries)
+		table_clear(t);
+	else if (t->count >= t->nbuckets)
+		table_grow(t);
+
+	size_t len = strlen(key);
+	dcache_entry *e = malloc(sizeof(dcache_entry) + len + 1);
+	if (e == NULL)
+		return; // not caching is always safe
+	e->hash = hash;
+	e->parent = parent;
+	e->ino = ino;
+	memcpy(e->key, key, len + 1);
+
+	size_t b = hash & (t->nbuckets - 1);
+	e->next = t->buckets[b];
+	t->buckets[b] = e;
+	t->count += 1;
+}
+
+static void table_remove(dcache_table *t, a1fs_ino_t parent, const char *key)
+{
+	dcache_entry **link = table_find(t, dcache_hash(parent, key), parent, key);
+	dcache_entry *e = *link;
+	if (e == NULL)
+		return;
+	*link = e->next;
+	free(e);
+	t->count -= 1;
+}
+
+
+bool dcache_init(dcache *dc, size_t max_entries)
+{
+	dc->max_entries = max_entries;
+	dc->generation = 0;
+	if (!table_init(&dc->names, DCACHE_INIT_BUCKETS))
+		return false;
+	if (!table_init(&dc->paths, DCACHE_INIT_BUCKETS)) {
+		table_destroy(&dc->names);
+		return false;
+	}
+	pthread_rwlock_init(&dc->lock, NULL);
+	return true;
+}
+
+void dcache_destroy(dcache *dc)
+{
+	table_destroy(&dc->names);
+	table_destroy(&dc->paths);
+	pthread_rwlock_destroy(&dc->lock);
+}
+
+long dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+	pthread_rwlock_rdlock(&dc->lock);
+	long ino = table_lookup(&dc->names, parent, name);
+	pthread_rwlock_unlock(&dc->lock);
+	return ino;
+}
+
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino)
+{
+	pthread_rwlock_wrlock(&dc->lock);
+	table_insert(dc, &dc->names, parent, name, ino);
+	pthread_rwlock_unlock(&dc->lock);
+}
+
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+	pthread_rwlock_wrlock(&dc->lock);
+	table_remove(&dc->names, parent, name);
+	dc->generation += 1;
+	pthread_rwlock_unlock(&dc->lock);
+}
+
+// Paths are absolute, so the path table uses 0 as the "parent" of every key
+
+long dcache_lookup_path(dcache *dc, const char *path, uint64_t *generation)
+{
+	pthread_rwlock_rdlock(&dc->lock);
+	long ino = table_lookup(&dc->paths, 0, path);
+	*generation = dc->generation;
+	pthread_rwlock_unlock(&dc->lock);
+	return ino;
+}
+
+void dcache_insert_path(dcache *dc, const char *path, a1fs_ino_t ino, uint64_t generation)
+{
+	pthread_rwlock_wrlock(&dc->lock);
+	if (dc->generation == generation)
+		table_insert(dc, &dc->paths, 0, path, ino);
+	pthread_rwlock_unlock(&dc->lock);
+}
+
+void dcache_remove_path(dcache *dc, const char *path)
+{
+	pthread_rwlock_wrlock(&dc->lock);
+	table_remove(&dc->paths, 0, path);
+	dc->generation += 1;
+	pthread_rwlock_unlock(&dc->lock);
+}
+
+uint64_t dcache_generation(dcache *dc)
+{
+	pthread_rwlock_rdlock(&dc->lock);
+	uint64_t generation = dc->generation;
+	pthread_rwlock_unlock(&dc->lock);
+	return generation;
+}
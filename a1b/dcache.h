@@ -0,0 +1,109 @@
+/**
+ * In-memory directory entry cache.
+ *
+ * Caches two kinds of mappings so that path_lookup() does not have to re-scan
+ * directory blocks on every FUSE callback:
+ *   (parent inode number, name) -> child inode number
+ *   full absolute path          -> inode number
+ *
+ * The cache only holds positive entries. It is kept coherent by the code that
+ * adds and removes directory entries (create_inode, add_dir_entry and
+ * remove_dir_entry), so a hit is always authoritative.
+ *
+ * All functions are thread safe. The cache lock is the innermost lock in the
+ * file system lock hierarchy (see fs_ctx).
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** A single cached mapping. Used for both the name and the path tables. */
+typedef struct dcache_entry {
+	struct dcache_entry *next;
+	/** Full hash of the key (used to skip strcmp on mismatches and to rehash). */
+	uint64_t hash;
+	/** Parent directory inode number (unused in the path table). */
+	a1fs_ino_t parent;
+	/** Inode number the key resolves to. */
+	a1fs_ino_t ino;
+	/** Null-terminated name or path. */
+	char key[];
+
+} dcache_entry;
+
+/** Chained hash table with a power of 2 number of buckets. */
+typedef struct dcache_table {
+	dcache_entry **buckets;
+	size_t nbuckets;
+	size_t count;
+
+} dcache_table;
+
+/** Directory entry cache; hung off the fs context. */
+typedef struct dcache {
+	/** (parent, name) -> ino */
+	dcache_table names;
+	/** absolute path -> ino */
+	dcache_table paths;
+	/** Maximum number of entries in each table before it is flushed. */
+	size_t max_entries;
+	/** Incremented by every removal; see dcache_insert_path(). */
+	uint64_t generation;
+	pthread_rwlock_t lock;
+
+} dcache;
+
+/**
+ * Initialize the cache.
+ *
+ * @param dc           pointer to the cache to initialize.
+ * @param max_entries  maximum number of entries per table.
+ * @return             true on success; false if out of memory.
+ */
+bool dcache_init(dcache *dc, size_t max_entries);
+
+/** Free all the memory held by the cache. */
+void dcache_destroy(dcache *dc);
+
+/**
+ * Look up a name in a directory.
+ *
+ * @return  the inode number of the entry; -1 if not cached.
+ */
+long dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name);
+
+/** Cache (parent, name) -> ino. Replaces an existing mapping for the same key. */
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino);
+
+/** Drop the (parent, name) mapping if it is cached. */
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name);
+
+/**
+ * Look up a full absolute path.
+ *
+ * @param generation  on a miss, receives the value to pass to
+ *                    dcache_insert_path() once the path is resolved.
+ * @return            the inode number of the path; -1 if not cached.
+ */
+long dcache_lookup_path(dcache *dc, const char *path, uint64_t *generation);
+
+/**
+ * Cache path -> ino. Replaces an existing mapping for the same path.
+ *
+ * Does nothing if any entry was removed since generation was read, because
+ * the path may have been resolved through a name that no longer exists.
+ */
+void dcache_insert_path(dcache *dc, const char *path, a1fs_ino_t ino, uint64_t generation);
+
+/** Drop the mapping for path if it is cached. */
+void dcache_remove_path(dcache *dc, const char *path);
+
+/** Current generation, for paths resolved while the affected directory is locked. */
+uint64_t dcache_generation(dcache *dc);
@@ -0,0 +1,111 @@
+/**
+ * Delayed allocation staging buffer implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "delalloc.h"
+
+
+static delalloc_buf **find_slot(delalloc *da, uint32_t ino)
+{
+	delalloc_buf **slot = &da->buckets[ino % DELALLOC_BUCKETS];
+	while (*slot != NULL && (*slot)->ino != ino)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+
+void delalloc_init(delalloc *da)
+{
+	pthread_mutex_init(&da->lock, NULL);
+	for (int i = 0; i < DELALLOC_BUCKETS; i++)
+		da->buckets[i] = NULL;
+}
+
+void delalloc_destroy(delalloc *da)
+{
+	for (int i = 0; i < DELALLOC_BUCKETS; i++) {
+		delalloc_buf *buf = da->buckets[i];
+		while (buf != NULL) {
+			delalloc_buf *next = buf->next;
+			free(buf->data);
+			free(buf);
+			buf = next;
+		}
+	}
+	pthread_mutex_destroy(&da->lock);
+}
+
+delalloc_buf *delalloc_get(delalloc *da, uint32_t ino)
+{
+	pthread_mutex_lock(&da->lock);
+	delalloc_buf *buf = *find_slot(da, ino);
+	pthread_mutex_unlock(&da->lock);
+	return buf;
+}
+
+delalloc_buf *delalloc_any(delalloc *da)
+{
+	delalloc_buf *buf = NULL;
+	pthread_mutex_lock(&da->lock);
+	for (int i = 0; i < DELALLOC_BUCKETS && buf == NULL; i++)
+		buf = da->buckets[i];
+	pthread_mutex_unlock(&da->lock);
+	return buf;
+}
+
+delalloc_buf *delalloc_create(delalloc *da, uint32_t ino, uint64_t start)
+{
+	delalloc_buf *buf = calloc(1, sizeof(delalloc_buf));
+	if (buf == NULL)
+		return NULL;
+	buf->ino = ino;
+	buf->start = start;
+
+	pthread_mutex_lock(&da->lock);
+	delalloc_buf **slot = &da->buckets[ino % DELALLOC_BUCKETS];
+	buf->next = *slot;
+	*slot = buf;
+	pthread_mutex_unlock(&da->lock);
+	return buf;
+}
+
+void delalloc_remove(delalloc *da, delalloc_buf *buf)
+{
+	pthread_mutex_lock(&da->lock);
+	delalloc_buf **slot = find_slot(da, buf->ino);
+	*slot = buf->next;
+	pthread_mutex_unlock(&da->lock);
+	free(buf->data);
+	free(buf);
+}
+
+bool delalloc_stage(delalloc_buf *buf, const char *data, size_t size, uint64_t offset)
+{
+	uint64_t end = offset - buf->start + size;
+	if (end > buf->cap) {
+		size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+		while (cap < end)
+			cap *= 2;
+		char *grown = realloc(buf->data, cap);
+		if (grown == NULL)
+			return false;
+		buf->data = grown;
+		buf->cap = cap;
+	}
+	if (offset - buf->start > buf->len)
+		memset(buf->data + buf->len, 0, offset - buf->start - buf->len); // a hole
+	memcpy(buf->data + (offset - buf->start), data, size);
+	if (end > buf->len)
+		buf->len = end;
+	return true;
+}
+
+void delalloc_consume(delalloc_buf *buf, size_t size)
+{
+	memmove(buf->data, buf->data + size, buf->len - size);
+	buf->start += size;
+	buf->len -= size;
+}
@@ -0,0 +1,98 @@
+/**
+ * Staging buffers for delayed allocation.
+ *
+ * With -o delalloc, data written past the allocated end of a file is kept in a
+ * per-inode buffer instead of getting blocks right away. The blocks are
+ * allocated when the file is flushed, synced, released or truncated, once its
+ * final size is known, so a file written in many small appends gets one (or a
+ * few) extents instead of a new extent whenever the blocks after its last one
+ * were taken by another file in the meantime.
+ *
+ * This module only keeps the table of buffers. The contents of a buffer are
+ * protected by the lock of its inode; delalloc.lock protects the table itself
+ * and is an innermost lock.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Number of hash buckets (buffers are chained within a bucket). */
+#define DELALLOC_BUCKETS 256
+
+/** Data staged for one file. */
+typedef struct delalloc_buf {
+	uint32_t ino;
+	/** File offset of the first staged byte: the allocated size of the file. */
+	uint64_t start;
+	/** Number of staged bytes; the size of the file is start + len. */
+	uint64_t len;
+	size_t cap;
+	char *data;
+	/** Blocks reserved for the staged data (see fs_ctx.reserved_blocks). */
+	uint32_t reserved;
+	/**
+	 * While the buffer is flushed, the part of reserved left for the indirect
+	 * block and tree nodes of the allocation (see reserve_metadata()); 0
+	 * otherwise.
+	 */
+	uint32_t meta;
+	struct delalloc_buf *next;
+
+} delalloc_buf;
+
+typedef struct delalloc {
+	pthread_mutex_t lock;
+	delalloc_buf *buckets[DELALLOC_BUCKETS];
+
+} delalloc;
+
+/** Initialize an empty table. */
+void delalloc_init(delalloc *da);
+
+/** Free every buffer (without writing it anywhere). */
+void delalloc_destroy(delalloc *da);
+
+/**
+ * Find the buffer of a file.
+ *
+ * @return  the buffer; NULL if nothing is staged for the file.
+ */
+delalloc_buf *delalloc_get(delalloc *da, uint32_t ino);
+
+/**
+ * Find any buffer, e.g. to flush them all at unmount.
+ *
+ * @return  a buffer; NULL if the table is empty.
+ */
+delalloc_buf *delalloc_any(delalloc *da);
+
+/**
+ * Add an empty buffer for a file that has none.
+ *
+ * @param start  allocated size of the file.
+ * @return       the buffer; NULL if out of memory.
+ */
+delalloc_buf *delalloc_create(delalloc *da, uint32_t ino, uint64_t start);
+
+/** Remove a buffer from the table and free it. */
+void delalloc_remove(delalloc *da, delalloc_buf *buf);
+
+/**
+ * Copy data into a buffer. Bytes between the end of the staged data and
+ * offset read as zeros.
+ *
+ * @param offset  file offset of the data; must be at least buf->start.
+ * @return        true on success; false if out of memory.
+ */
+bool delalloc_stage(delalloc_buf *buf, const char *data, size_t size, uint64_t offset);
+
+/**
+ * Drop the first size bytes of a buffer, which are now in allocated blocks of
+ * the file; the buffer starts after them.
+ */
+void delalloc_consume(delalloc_buf *buf, size_t size);
@@ -0,0 +1,101 @@
+/**
+ * Variable length directory entry implementation.
+ */
+
+#include <string.h>
+
+#include "dir_entry.h"
+
+
+/** The record rec_len bytes after d; NULL at the end of the block (or if d is corrupt). */
+static a1fs_dirent *record_after(void *block, a1fs_dirent *d)
+{
+	if (d->rec_len < sizeof(a1fs_dirent))
+		return NULL; // would loop forever
+	char *next = (char *)d + d->rec_len;
+	if (next + sizeof(a1fs_dirent) > (char *)block + A1FS_BLOCK_SIZE)
+		return NULL;
+	return (a1fs_dirent *)next;
+}
+
+static void fill(a1fs_dirent *d, uint32_t ino, const char *name, size_t name_len, uint8_t file_type)
+{
+	d->ino = ino;
+	d->name_len = name_len;
+	d->file_type = file_type;
+	memcpy(d->name, name, name_len + 1);
+}
+
+
+void dirent_init_block(void *block)
+{
+	memset(block, 0, A1FS_BLOCK_SIZE);
+	((a1fs_dirent *)block)->rec_len = A1FS_BLOCK_SIZE;
+}
+
+a1fs_dirent *dirent_next(void *block, a1fs_dirent *prev)
+{
+	a1fs_dirent *d = prev == NULL ? block : record_after(block, prev);
+	while (d != NULL && d->ino == 0)
+		d = record_after(block, d);
+	return d;
+}
+
+a1fs_dirent *dirent_find(void *block, const char *name)
+{
+	size_t name_len = strlen(name);
+	for (a1fs_dirent *d = dirent_next(block, NULL); d != NULL; d = dirent_next(block, d)) {
+		// comparing the lengths first skips most non-matching names without reading them
+		if (d->name_len == name_len && memcmp(d->name, name, name_len) == 0)
+			return d;
+	}
+	return NULL;
+}
+
+bool dirent_insert(void *block, uint32_t ino, const char *name, uint8_t file_type)
+{
+	size_t name_len = strlen(name);
+	size_t needed = A1FS_DIRENT_LEN(name_len);
+	for (a1fs_dirent *d = block; d != NULL; d = record_after(block, d)) {
+		size_t used = d->ino == 0 ? 0 : A1FS_DIRENT_LEN(d->name_len);
+		if (d->rec_len < used + needed)
+			continue;
+		if (used == 0) {
+			fill(d, ino, name, name_len, file_type); // reuse the free record as a whole
+		} else {
+			// split the slack at the end of d off into a new record
+			a1fs_dirent *new_d = (a1fs_dirent *)((char *)d + used);
+			new_d->rec_len = d->rec_len - used;
+			d->rec_len = used;
+			fill(new_d, ino, name, name_len, file_type);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool dirent_remove(void *block, const char *name)
+{
+	size_t name_len = strlen(name);
+	a1fs_dirent *prev = NULL;
+	for (a1fs_dirent *d = block; d != NULL; prev = d, d = record_after(block, d)) {
+		if (d->ino == 0 || d->name_len != name_len || memcmp(d->name, name, name_len) != 0)
+			continue;
+		if (prev != NULL) {
+			prev->rec_len += d->rec_len; // the previous record takes over the space
+		} else {
+			d->ino = 0; // the first record stays as free space
+			d->name_len = 0;
+		}
+		return true;
+	}
+	return false;
+}
+
+uint32_t dirent_count(void *block)
+{
+	uint32_t count = 0;
+	for (a1fs_dirent *d = dirent_next(block, NULL); d != NULL; d = dirent_next(block, d))
+		count += 1;
+	return count;
+}
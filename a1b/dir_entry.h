@@ -0,0 +1,56 @@
+/**
+ * Operations on the directory blocks of file systems formatted with
+ * A1FS_FEATURE_DIRENT (see a1fs_dirent).
+ *
+ * A name takes A1FS_DIRENT_LEN(strlen(name)) bytes instead of a full 256
+ * byte a1fs_dentry, so a block of typical short names holds 100+ entries
+ * instead of 16, and a lookup or readdir touches that much less memory.
+ * Freed records are merged into the record before them, so free space is
+ * reused by later inserts without compacting the block.
+ *
+ * Both flat and hash-indexed directories (leaf blocks) use these. None of
+ * the functions lock anything; the caller holds the directory's lock.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Make a block hold no entries: one unused record that spans it. */
+void dirent_init_block(void *block);
+
+/**
+ * Get the next entry of a block.
+ *
+ * @param prev  the previous entry; NULL to get the first one.
+ * @return      the next record in use; NULL if there is none.
+ */
+a1fs_dirent *dirent_next(void *block, a1fs_dirent *prev);
+
+/**
+ * Find a name in a block.
+ *
+ * @return  the entry; NULL if the name is not in the block.
+ */
+a1fs_dirent *dirent_find(void *block, const char *name);
+
+/**
+ * Add an entry to a block, in the first free space large enough for it.
+ *
+ * @return  true on success; false if the block has no room for the name.
+ */
+bool dirent_insert(void *block, uint32_t ino, const char *name, uint8_t file_type);
+
+/**
+ * Remove a name from a block.
+ *
+ * @return  true on success; false if the name is not in the block.
+ */
+bool dirent_remove(void *block, const char *name);
+
+/** Count the entries in a block. */
+uint32_t dirent_count(void *block);
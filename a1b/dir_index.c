@@ -0,0 +1,487 @@
+/**
+ * Hash-indexed directory implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir_entry.h"
+#include "dir_index.h"
+#include "helpers.h"
+
+
+#define DENTRIES_PER_BLOCK (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry))
+
+/** Most entries a leaf can hold (names of one byte in a1fs_dirent records). */
+#define LEAF_MAX_ENTRIES (A1FS_BLOCK_SIZE / A1FS_DIRENT_LEN(1))
+
+/** The index blocks and leaf that cover one name hash. */
+typedef struct dx_path {
+	a1fs_dx_root *root;
+	uint32_t root_index;
+	/** NULL if the index has no second level. */
+	a1fs_dx_node *node;
+	uint32_t node_index;
+	/** Logical block number of the leaf within the directory. */
+	uint32_t leaf_block;
+	/** An array of a1fs_dentry, or a1fs_dirent records with A1FS_FEATURE_DIRENT. */
+	void *leaf;
+
+} dx_path;
+
+/** Used to sort the entries of a leaf by hash when it is split, and by position when it is listed. */
+typedef struct dx_slot {
+	uint32_t hash;
+	/** Low 16 bits of the position (see dx_minor_hash()); only set when listing. */
+	uint16_t minor;
+	uint32_t ino;
+	uint8_t file_type;
+	const char *name;
+
+} dx_slot;
+
+
+uint32_t dx_hash(const char *name, fs_ctx *fs)
+{
+	// FNV-1a, seeded per file system so that collisions can't be precomputed
+	uint32_t hash = 2166136261u ^ fs->sb->hash_seed;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Second hash of a name, for the low 16 bits of its position: a different
+ * function from dx_hash() (Jenkins one-at-a-time), so that names that share a
+ * hash almost never share this one.
+ */
+static uint16_t dx_minor_hash(const char *name, fs_ctx *fs)
+{
+	uint32_t hash = ~fs->sb->hash_seed;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash += *c;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash ^ (hash >> 16);
+}
+
+/** Get a pointer to a logical block of a directory. */
+static void *dir_block(a1fs_inode *dir, uint32_t file_block, fs_ctx *fs)
+{
+	long block = get_physical_block(dir, file_block, fs);
+	assert(block > 0);
+	return bdev_block(&fs->dev, block);
+}
+
+/** Check if leaves hold a1fs_dirent records rather than a1fs_dentry slots. */
+static bool compact_leaves(fs_ctx *fs)
+{
+	return fs->sb->features & A1FS_FEATURE_DIRENT;
+}
+
+/** Make a leaf hold no entries. */
+static void leaf_init(void *leaf, fs_ctx *fs)
+{
+	if (compact_leaves(fs))
+		dirent_init_block(leaf);
+	else
+		memset(leaf, 0, A1FS_BLOCK_SIZE);
+}
+
+/** Find a name in a leaf; -ENOENT if it is not there. */
+static long leaf_find(void *leaf, const char *name, fs_ctx *fs)
+{
+	if (compact_leaves(fs)) {
+		a1fs_dirent *d = dirent_find(leaf, name);
+		return d != NULL ? (long)d->ino : -ENOENT;
+	}
+	a1fs_dentry *dentries = leaf;
+	for (uint32_t k = 0; k < DENTRIES_PER_BLOCK; k++) {
+		if (dentries[k].ino > 0 && strcmp(name, dentries[k].name) == 0)
+			return dentries[k].ino;
+	}
+	return -ENOENT;
+}
+
+/** Add an entry to a leaf; false if the leaf has no room for it. */
+static bool leaf_insert(void *leaf, uint32_t ino, const char *name, uint8_t file_type, fs_ctx *fs)
+{
+	if (compact_leaves(fs))
+		return dirent_insert(leaf, ino, name, file_type);
+	a1fs_dentry *dentries = leaf;
+	for (uint32_t k = 0; k < DENTRIES_PER_BLOCK; k++) {
+		if (dentries[k].ino == 0) {
+			dentries[k].ino = ino;
+			strcpy(dentries[k].name, name);
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Remove a name from a leaf; false if it is not there. */
+static bool leaf_remove(void *leaf, const char *name, fs_ctx *fs)
+{
+	if (compact_leaves(fs))
+		return dirent_remove(leaf, name);
+	a1fs_dentry *dentries = leaf;
+	for (uint32_t k = 0; k < DENTRIES_PER_BLOCK; k++) {
+		if (dentries[k].ino > 0 && strcmp(name, dentries[k].name) == 0) {
+			memset(&dentries[k], 0, sizeof(a1fs_dentry));
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Collect the entries of a leaf (names point into the leaf).
+ *
+ * @return  the number of entries; at most LEAF_MAX_ENTRIES.
+ */
+static uint32_t leaf_entries(void *leaf, dx_slot *slots, fs_ctx *fs)
+{
+	uint32_t n = 0;
+	if (compact_leaves(fs)) {
+		for (a1fs_dirent *d = dirent_next(leaf, NULL); d != NULL; d = dirent_next(leaf, d)) {
+			slots[n].ino = d->ino;
+			slots[n].file_type = d->file_type;
+			slots[n].name = d->name;
+			n += 1;
+		}
+		return n;
+	}
+	a1fs_dentry *dentries = leaf;
+	for (uint32_t k = 0; k < DENTRIES_PER_BLOCK; k++) {
+		if (dentries[k].ino > 0) {
+			slots[n].ino = dentries[k].ino;
+			slots[n].file_type = A1FS_FT_UNKNOWN;
+			slots[n].name = dentries[k].name;
+			n += 1;
+		}
+	}
+	return n;
+}
+
+/** Record a directory block that is about to be modified in the running journal transaction. */
+static void dir_block_dirty(void *block, fs_ctx *fs)
+{
+	journal_dirty(&fs->journal, bdev_block_num(&fs->dev, block));
+}
+
+/**
+ * Add one zeroed block to the end of a directory.
+ *
+ * @return  the logical block number of the new block; -errno on error.
+ */
+static long dir_grow(uint32_t dir_ino, fs_ctx *fs)
+{
+	a1fs_inode *dir = get_inode(dir_ino, fs);
+	uint32_t new_block = dir->size / A1FS_BLOCK_SIZE;
+	int res = truncate_inode(dir_ino, dir->size + A1FS_BLOCK_SIZE, fs);
+	if (res < 0)
+		return res;
+	return new_block;
+}
+
+/** Index of the last entry with hash <= hash. entries[0] covers everything below entries[1]. */
+static uint32_t dx_search(a1fs_dx_entry *entries, uint32_t count, uint32_t hash)
+{
+	uint32_t lo = 0;
+	uint32_t hi = count;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (entries[mid].hash <= hash)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Insert a new index entry at position pos, shifting the following ones up. */
+static void dx_insert_at(a1fs_dx_entry *entries, uint32_t *count, uint32_t pos,
+                         uint32_t hash, uint32_t block)
+{
+	memmove(&entries[pos + 1], &entries[pos], (*count - pos) * sizeof(a1fs_dx_entry));
+	entries[pos].hash = hash;
+	entries[pos].block = block;
+	*count += 1;
+}
+
+/** Find the index blocks and leaf responsible for a hash. */
+static void dx_walk(a1fs_inode *dir, uint32_t hash, dx_path *p, fs_ctx *fs)
+{
+	p->root = dir_block(dir, 0, fs);
+	assert(p->root->magic == A1FS_DX_MAGIC);
+	p->root_index = dx_search(p->root->entries, p->root->count, hash);
+	p->leaf_block = p->root->entries[p->root_index].block;
+	p->node = NULL;
+
+	if (p->root->levels > 0) {
+		p->node = dir_block(dir, p->leaf_block, fs);
+		p->node_index = dx_search(p->node->entries, p->node->count, hash);
+		p->leaf_block = p->node->entries[p->node_index].block;
+	}
+	p->leaf = dir_block(dir, p->leaf_block, fs);
+}
+
+/** Move all the root entries into a new node so that the root can index nodes. */
+static int dx_add_level(uint32_t dir_ino, a1fs_dx_root *root, fs_ctx *fs)
+{
+	long new_block = dir_grow(dir_ino, fs);
+	if (new_block < 0)
+		return new_block;
+
+	a1fs_dx_node *node = dir_block(get_inode(dir_ino, fs), new_block, fs);
+	dir_block_dirty(node, fs);
+	dir_block_dirty(root, fs);
+	node->magic = A1FS_DX_MAGIC;
+	node->limit = A1FS_DX_NODE_LIMIT;
+	node->count = root->count;
+	memcpy(node->entries, root->entries, root->count * sizeof(a1fs_dx_entry));
+
+	root->levels = 1;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = new_block;
+	return 0;
+}
+
+/** Move the upper half of a full node into a new node. */
+static int dx_split_node(uint32_t dir_ino, dx_path *p, fs_ctx *fs)
+{
+	if (p->root->count == p->root->limit)
+		return -ENOSPC; // both index levels are full
+
+	long new_block = dir_grow(dir_ino, fs);
+	if (new_block < 0)
+		return new_block;
+
+	a1fs_dx_node *node = p->node;
+	a1fs_dx_node *new_node = dir_block(get_inode(dir_ino, fs), new_block, fs);
+	dir_block_dirty(node, fs);
+	dir_block_dirty(new_node, fs);
+	dir_block_dirty(p->root, fs);
+	uint32_t half = node->count / 2;
+	new_node->magic = A1FS_DX_MAGIC;
+	new_node->limit = A1FS_DX_NODE_LIMIT;
+	new_node->count = node->count - half;
+	memcpy(new_node->entries, &node->entries[half], new_node->count * sizeof(a1fs_dx_entry));
+	node->count = half;
+
+	dx_insert_at(p->root->entries, &p->root->count, p->root_index + 1,
+	             new_node->entries[0].hash, new_block);
+	return 0;
+}
+
+static int dx_slot_cmp(const void *a, const void *b)
+{
+	uint32_t ha = ((const dx_slot *)a)->hash;
+	uint32_t hb = ((const dx_slot *)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+/**
+ * Move the upper half (by hash) of a full leaf into a new leaf. Entries with
+ * equal hashes always stay in the same leaf.
+ */
+static int dx_split_leaf(uint32_t dir_ino, dx_path *p, fs_ctx *fs)
+{
+	// The leaf is rebuilt from a copy, which also packs the records of a compact leaf
+	char copy[A1FS_BLOCK_SIZE];
+	memcpy(copy, p->leaf, A1FS_BLOCK_SIZE);
+	dx_slot slots[LEAF_MAX_ENTRIES];
+	uint32_t n = leaf_entries(copy, slots, fs);
+	for (uint32_t k = 0; k < n; k++)
+		slots[k].hash = dx_hash(slots[k].name, fs);
+	qsort(slots, n, sizeof(dx_slot), dx_slot_cmp);
+
+	// Pick the hash boundary closest to the middle of the leaf
+	uint32_t split = 0;
+	for (uint32_t d = 0; d < n / 2 && split == 0; d++) {
+		uint32_t up = n / 2 + d;
+		uint32_t down = n / 2 - d;
+		if (up < n && slots[up].hash != slots[up - 1].hash)
+			split = up;
+		else if (down > 0 && slots[down].hash != slots[down - 1].hash)
+			split = down;
+	}
+	if (split == 0)
+		return -ENOSPC; // every name in the leaf has the same hash
+
+	long new_block = dir_grow(dir_ino, fs);
+	if (new_block < 0)
+		return new_block;
+
+	void *new_leaf = dir_block(get_inode(dir_ino, fs), new_block, fs);
+	dir_block_dirty(p->leaf, fs);
+	dir_block_dirty(new_leaf, fs);
+	dir_block_dirty(p->node != NULL ? (void *)p->node : (void *)p->root, fs);
+	leaf_init(p->leaf, fs);
+	leaf_init(new_leaf, fs);
+	// each half takes no more space than the whole leaf did, so these can't fail
+	for (uint32_t k = 0; k < n; k++)
+		leaf_insert(k < split ? p->leaf : new_leaf, slots[k].ino, slots[k].name, slots[k].file_type, fs);
+
+	if (p->node != NULL)
+		dx_insert_at(p->node->entries, &p->node->count, p->node_index + 1, slots[split].hash, new_block);
+	else
+		dx_insert_at(p->root->entries, &p->root->count, p->root_index + 1, slots[split].hash, new_block);
+	return 0;
+}
+
+
+int dx_convert(uint32_t dir_ino, fs_ctx *fs)
+{
+	a1fs_inode *dir = get_inode(dir_ino, fs);
+	assert(dir->size == A1FS_BLOCK_SIZE);
+
+	int res = truncate_inode(dir_ino, 2 * A1FS_BLOCK_SIZE, fs);
+	if (res < 0)
+		return res;
+
+	// The existing entries become the first (and only) leaf
+	a1fs_dx_root *root = dir_block(dir, 0, fs);
+	void *leaf = dir_block(dir, 1, fs);
+	dir_block_dirty(root, fs);
+	dir_block_dirty(leaf, fs);
+	memcpy(leaf, root, A1FS_BLOCK_SIZE);
+
+	memset(root, 0, A1FS_BLOCK_SIZE);
+	root->magic = A1FS_DX_MAGIC;
+	root->levels = 0;
+	root->limit = A1FS_DX_ROOT_LIMIT;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = 1;
+	dx_slot slots[LEAF_MAX_ENTRIES];
+	root->num_entries = leaf_entries(leaf, slots, fs);
+
+	dir->flags |= A1FS_INODE_INDEXED;
+	return 0;
+}
+
+long dx_find_entry(a1fs_inode *dir, const char *name, fs_ctx *fs)
+{
+	dx_path p;
+	dx_walk(dir, dx_hash(name, fs), &p, fs);
+	return leaf_find(p.leaf, name, fs);
+}
+
+int dx_add_entry(uint32_t dir_ino, a1fs_dentry *dentry, uint8_t file_type, fs_ctx *fs)
+{
+	a1fs_inode *dir = get_inode(dir_ino, fs);
+	uint32_t hash = dx_hash(dentry->name, fs);
+	dx_path p;
+
+	while (true) {
+		dx_walk(dir, hash, &p, fs);
+		dir_block_dirty(p.leaf, fs);
+		if (leaf_insert(p.leaf, dentry->ino, dentry->name, file_type, fs)) {
+			dir_block_dirty(p.root, fs);
+			p.root->num_entries += 1;
+			return 0;
+		}
+
+		// The leaf is full. Make sure the index block above it can take one
+		// more entry, then split the leaf and try again.
+		int res;
+		if (p.node == NULL && p.root->count == p.root->limit)
+			res = dx_add_level(dir_ino, p.root, fs);
+		else if (p.node != NULL && p.node->count == p.node->limit)
+			res = dx_split_node(dir_ino, &p, fs);
+		else
+			res = dx_split_leaf(dir_ino, &p, fs);
+
+		if (res < 0)
+			return res;
+	}
+}
+
+int dx_remove_entry(uint32_t dir_ino, const char *name, fs_ctx *fs)
+{
+	dx_path p;
+	dx_walk(get_inode(dir_ino, fs), dx_hash(name, fs), &p, fs);
+
+	dir_block_dirty(p.leaf, fs);
+	if (!leaf_remove(p.leaf, name, fs))
+		return -ENOENT;
+	dir_block_dirty(p.root, fs);
+	p.root->num_entries -= 1;
+	return 0;
+}
+
+/** Orders leaf entries by position: by hash, then by minor hash, and names with both the same by name. */
+static int dx_pos_cmp(const void *a, const void *b)
+{
+	const dx_slot *x = a;
+	const dx_slot *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->minor != y->minor)
+		return x->minor < y->minor ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+/** Call cb for the entries of one leaf block at positions >= start. */
+static int dx_iterate_leaf(a1fs_inode *dir, uint32_t leaf_block, uint64_t start,
+                           dx_iterate_cb cb, void *arg, fs_ctx *fs)
+{
+	dx_slot slots[LEAF_MAX_ENTRIES];
+	uint32_t n = leaf_entries(dir_block(dir, leaf_block, fs), slots, fs);
+	for (uint32_t k = 0; k < n; k++) {
+		slots[k].hash = dx_hash(slots[k].name, fs);
+		slots[k].minor = dx_minor_hash(slots[k].name, fs);
+	}
+	qsort(slots, n, sizeof(dx_slot), dx_pos_cmp);
+
+	uint64_t prev = 0;
+	for (uint32_t k = 0; k < n; k++) {
+		uint64_t pos = ((uint64_t)slots[k].hash << 16) | slots[k].minor;
+		// a name that shares both hashes with the one before takes the next free position
+		if (k > 0 && slots[k].hash == slots[k - 1].hash && pos <= prev && (prev & 0xffff) < 0xffff)
+			pos = prev + 1;
+		prev = pos;
+		if (pos < start)
+			continue;
+		int res = cb(slots[k].name, slots[k].ino, slots[k].file_type, pos, arg);
+		if (res != 0)
+			return res;
+	}
+	return 0;
+}
+
+int dx_iterate(a1fs_inode *dir, uint64_t start, dx_iterate_cb cb, void *arg, fs_ctx *fs)
+{
+	// Leaves cover increasing hash ranges, so start at the one that holds start
+	dx_path p;
+	dx_walk(dir, start >> 16, &p, fs);
+	a1fs_dx_root *root = p.root;
+	for (uint32_t i = p.root_index; i < root->count; i++) {
+		int res = 0;
+		if (root->levels == 0) {
+			res = dx_iterate_leaf(dir, root->entries[i].block, start, cb, arg, fs);
+		} else {
+			a1fs_dx_node *node = dir_block(dir, root->entries[i].block, fs);
+			for (uint32_t j = i == p.root_index ? p.node_index : 0; j < node->count && res == 0; j++)
+				res = dx_iterate_leaf(dir, node->entries[j].block, start, cb, arg, fs);
+		}
+		if (res != 0)
+			return res;
+	}
+	return 0;
+}
+
+bool dx_is_empty(a1fs_inode *dir, fs_ctx *fs)
+{
+	a1fs_dx_root *root = dir_block(dir, 0, fs);
+	return root->num_entries == 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Hash-indexed directories.
+ *
+ * On a file system formatted with A1FS_FEATURE_DIR_INDEX, a directory that
+ * outgrows its first block is converted into an indexed directory: logical
+ * block 0 becomes an a1fs_dx_root that maps name hashes to leaf blocks of
+ * dentries (optionally through one level of a1fs_dx_node blocks). Leaves have
+ * the same format as the blocks of a flat directory: fixed size a1fs_dentry
+ * slots, or a1fs_dirent records with A1FS_FEATURE_DIRENT.
+ * Lookups, inserts and removals then touch at most three directory blocks no
+ * matter how many entries the directory holds.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Callback for dx_iterate(). Returns 0 to continue or non-zero to stop.
+ * file_type is A1FS_FT_UNKNOWN unless the file system uses a1fs_dirent. pos is
+ * the position of the entry in the directory, which a later iteration can
+ * start from.
+ */
+typedef int (*dx_iterate_cb)(const char *name, uint32_t ino, uint8_t file_type, uint64_t pos, void *arg);
+
+/** Hash of a file name as used by the directory index. */
+uint32_t dx_hash(const char *name, fs_ctx *fs);
+
+/**
+ * Convert a flat directory whose only block is full into an indexed directory.
+ *
+ * @param dir_ino  inode number of the directory.
+ * @param fs       the file system struct
+ * @return         0 on success; -ENOSPC if the directory can't be grown.
+ */
+int dx_convert(uint32_t dir_ino, fs_ctx *fs);
+
+/**
+ * Find a name in an indexed directory.
+ *
+ * @return  the inode number of the entry; -ENOENT if it does not exist.
+ */
+long dx_find_entry(a1fs_inode *dir, const char *name, fs_ctx *fs);
+
+/**
+ * Add a dentry to an indexed directory, splitting leaves and index blocks as
+ * needed. Can assume that the name is not already in the directory.
+ *
+ * @param file_type  A1FS_FT_* type stored with the name if leaves hold a1fs_dirent records.
+ * @return           0 on success; -ENOSPC if the directory or the disk is full.
+ */
+int dx_add_entry(uint32_t dir_ino, a1fs_dentry *dentry, uint8_t file_type, fs_ctx *fs);
+
+/**
+ * Remove a name from an indexed directory. Blocks are never freed; an indexed
+ * directory only shrinks when it is removed.
+ *
+ * @return  0 on success; -ENOENT if the name does not exist.
+ */
+int dx_remove_entry(uint32_t dir_ino, const char *name, fs_ctx *fs);
+
+/**
+ * Call cb for the dentries of an indexed directory at positions >= start, in
+ * position order. The position of an entry is its name hash followed by a
+ * second, 16-bit hash of the name, so that it changes neither when leaves are
+ * split nor when other names are added or removed, and a listing resumed from
+ * it skips or repeats nothing. Only names that share both hashes (a 48-bit
+ * collision) are told apart by their order: the later one takes the next free
+ * position, so adding or removing one of those between two calls can still
+ * make a resumed listing skip or repeat the other.
+ *
+ * @param start  0 to visit every entry.
+ * @return       0 once every entry is visited, otherwise the first non-zero cb result.
+ */
+int dx_iterate(a1fs_inode *dir, uint64_t start, dx_iterate_cb cb, void *arg, fs_ctx *fs);
+
+/** Check if an indexed directory has no entries. */
+bool dx_is_empty(a1fs_inode *dir, fs_ctx *fs);
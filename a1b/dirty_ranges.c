@@ -0,0 +1,162 @@
+/**
+ * Dirty data range tracking implementation.
+ */
+
+#include <stdlib.h>
+
+#include "dirty_ranges.h"
+
+
+#define DIRTY_RANGES_INIT_CAP 16
+
+static dirty_inode **find_slot(dirty_ranges *dr, uint32_t ino)
+{
+	dirty_inode **slot = &dr->buckets[ino % DIRTY_RANGES_BUCKETS];
+	while (*slot != NULL && (*slot)->ino != ino)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+/** Unlink an inode's ranges from the table; NULL if it has none. */
+static dirty_inode *take(dirty_ranges *dr, uint32_t ino)
+{
+	pthread_mutex_lock(&dr->lock);
+	dirty_inode **slot = find_slot(dr, ino);
+	dirty_inode *di = *slot;
+	if (di != NULL)
+		*slot = di->next;
+	pthread_mutex_unlock(&dr->lock);
+	return di;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const a1fs_extent *)a)->start;
+	uint32_t y = ((const a1fs_extent *)b)->start;
+	return x < y ? -1 : x > y;
+}
+
+/** Sort the ranges and merge the ones that overlap or touch. */
+static void coalesce(dirty_inode *di)
+{
+	if (di->count == 0)
+		return;
+	qsort(di->ranges, di->count, sizeof(a1fs_extent), range_cmp);
+	uint32_t n = 0;
+	for (uint32_t i = 1; i < di->count; i++) {
+		a1fs_extent *last = &di->ranges[n];
+		a1fs_extent *r = &di->ranges[i];
+		if (r->start <= last->start + last->count) {
+			uint32_t end = r->start + r->count;
+			if (end > last->start + last->count)
+				last->count = end - last->start;
+		} else {
+			di->ranges[++n] = *r;
+		}
+	}
+	di->count = n + 1;
+}
+
+static void sync_range(dirty_ranges *dr, uint32_t start, uint32_t count)
+{
+	bdev_sync(dr->dev, start, count);
+}
+
+
+void dirty_ranges_init(dirty_ranges *dr, bdev *dev)
+{
+	dr->dev = dev;
+	pthread_mutex_init(&dr->lock, NULL);
+	for (int i = 0; i < DIRTY_RANGES_BUCKETS; i++)
+		dr->buckets[i] = NULL;
+	for (int i = 0; i < DIRTY_RANGES_SYNC_LOCKS; i++)
+		pthread_mutex_init(&dr->sync_locks[i], NULL);
+}
+
+void dirty_ranges_destroy(dirty_ranges *dr)
+{
+	for (int i = 0; i < DIRTY_RANGES_BUCKETS; i++) {
+		dirty_inode *di = dr->buckets[i];
+		while (di != NULL) {
+			dirty_inode *next = di->next;
+			free(di->ranges);
+			free(di);
+			di = next;
+		}
+	}
+	pthread_mutex_destroy(&dr->lock);
+	for (int i = 0; i < DIRTY_RANGES_SYNC_LOCKS; i++)
+		pthread_mutex_destroy(&dr->sync_locks[i]);
+}
+
+void dirty_ranges_add(dirty_ranges *dr, uint32_t ino, uint32_t start, uint32_t count)
+{
+	pthread_mutex_lock(&dr->lock);
+	dirty_inode **slot = find_slot(dr, ino);
+	dirty_inode *di = *slot;
+	if (di == NULL) {
+		di = calloc(1, sizeof(dirty_inode));
+		if (di == NULL)
+			goto nomem;
+		di->ino = ino;
+		*slot = di;
+	}
+
+	// Sequential writes extend the range they continue
+	if (di->count > 0) {
+		a1fs_extent *last = &di->ranges[di->count - 1];
+		if (start >= last->start && start <= last->start + last->count) {
+			uint32_t end = start + count;
+			if (end > last->start + last->count)
+				last->count = end - last->start;
+			pthread_mutex_unlock(&dr->lock);
+			return;
+		}
+	}
+
+	if (di->count == di->cap) {
+		coalesce(di);
+		// only grow if merging didn't free up a good part of the list
+		if (di->count > di->cap / 2 || di->cap == 0) {
+			uint32_t cap = di->cap == 0 ? DIRTY_RANGES_INIT_CAP : 2 * di->cap;
+			a1fs_extent *ranges = realloc(di->ranges, cap * sizeof(a1fs_extent));
+			if (ranges == NULL)
+				goto nomem;
+			di->ranges = ranges;
+			di->cap = cap;
+		}
+	}
+	di->ranges[di->count].start = start;
+	di->ranges[di->count].count = count;
+	di->count += 1;
+	pthread_mutex_unlock(&dr->lock);
+	return;
+
+nomem:
+	pthread_mutex_unlock(&dr->lock);
+	sync_range(dr, start, count);
+}
+
+void dirty_ranges_sync(dirty_ranges *dr, uint32_t ino)
+{
+	pthread_mutex_t *sync_lock = &dr->sync_locks[ino % DIRTY_RANGES_SYNC_LOCKS];
+	pthread_mutex_lock(sync_lock);
+	dirty_inode *di = take(dr, ino);
+	if (di != NULL) {
+		coalesce(di);
+		for (uint32_t i = 0; i < di->count; i++)
+			sync_range(dr, di->ranges[i].start, di->ranges[i].count);
+		free(di->ranges);
+		free(di);
+	}
+	pthread_mutex_unlock(sync_lock);
+}
+
+void dirty_ranges_forget(dirty_ranges *dr, uint32_t ino)
+{
+	dirty_inode *di = take(dr, ino);
+	if (di != NULL) {
+		free(di->ranges);
+		free(di);
+	}
+}
@@ -0,0 +1,74 @@
+/**
+ * Per-inode tracking of file data blocks written since the last fsync().
+ *
+ * write_file() records the disk blocks it copies data into; fsync() and
+ * flush() then write back only those blocks instead of the whole image. Metadata
+ * blocks are tracked separately by the journal (see journal_dirty()).
+ *
+ * Ranges are appended as they are written and merged with the previous range
+ * when they are adjacent, so sequential writes cost one range per extent. The
+ * list is sorted and coalesced whenever it has to grow.
+ *
+ * All functions are thread safe. dirty_ranges.lock is an innermost lock; the
+ * sync locks are only taken by dirty_ranges_sync(), with no other lock held.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "bdev.h"
+
+
+/** Number of hash buckets (inodes with dirty data are chained within a bucket). */
+#define DIRTY_RANGES_BUCKETS 1024
+
+/** Number of stripes of the lock that serializes syncs of the same inode. */
+#define DIRTY_RANGES_SYNC_LOCKS 64
+
+/** The dirty data blocks of one inode. */
+typedef struct dirty_inode {
+	uint32_t ino;
+	uint32_t count;
+	uint32_t cap;
+	/** Disk block ranges, in the order they were written. */
+	a1fs_extent *ranges;
+	struct dirty_inode *next;
+
+} dirty_inode;
+
+typedef struct dirty_ranges {
+	/** The image the blocks are in. */
+	bdev *dev;
+	/** Protects the buckets and every dirty_inode. */
+	pthread_mutex_t lock;
+	dirty_inode *buckets[DIRTY_RANGES_BUCKETS];
+	/**
+	 * Held while an inode's ranges are flushed, so a second fsync() of the
+	 * same inode waits for the first instead of returning before the data
+	 * the first one took is on disk.
+	 */
+	pthread_mutex_t sync_locks[DIRTY_RANGES_SYNC_LOCKS];
+
+} dirty_ranges;
+
+/** Initialize an empty tracker for the given image. */
+void dirty_ranges_init(dirty_ranges *dr, bdev *dev);
+
+/** Free all the tracked ranges (without flushing them). */
+void dirty_ranges_destroy(dirty_ranges *dr);
+
+/**
+ * Record that data was written to blocks [start, start + count) of a file.
+ * If there is no memory to record the range, it is flushed right away.
+ */
+void dirty_ranges_add(dirty_ranges *dr, uint32_t ino, uint32_t start, uint32_t count);
+
+/** Flush the recorded ranges of a file and wait until they are on disk. */
+void dirty_ranges_sync(dirty_ranges *dr, uint32_t ino);
+
+/** Drop the recorded ranges of a file that was removed. */
+void dirty_ranges_forget(dirty_ranges *dr, uint32_t ino);
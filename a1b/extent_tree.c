@@ -0,0 +1,446 @@
+/**
+ * Extent tree implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "extent_tree.h"
+#include "helpers.h"
+
+
+/** Most entries of each kind the root in the inode can hold. */
+#define ROOT_MAX_LEAF  ((A1FS_INLINE_MAX - sizeof(a1fs_et_header)) / sizeof(a1fs_et_leaf))
+#define ROOT_MAX_INDEX ((A1FS_INLINE_MAX - sizeof(a1fs_et_header)) / sizeof(a1fs_et_index))
+
+/** Most entries of each kind a node block can hold. */
+#define NODE_MAX_LEAF  ((A1FS_BLOCK_SIZE - sizeof(a1fs_et_header)) / sizeof(a1fs_et_leaf))
+#define NODE_MAX_INDEX ((A1FS_BLOCK_SIZE - sizeof(a1fs_et_header)) / sizeof(a1fs_et_index))
+
+/** Most levels a tree can have: 9 * 511^3 * 340 leaf entries are more than 2^32 blocks. */
+#define MAX_LEVELS 5
+
+/** The nodes from the root down to a leaf. Level 0 is the root. */
+typedef struct et_path {
+	uint32_t levels;
+	a1fs_et_header *node[MAX_LEVELS];
+	/** Block of each node; 0 for the root, which is in the inode. */
+	a1fs_blk_t block[MAX_LEVELS];
+	/** Entry of each index node that leads to the next level. */
+	uint32_t index[MAX_LEVELS];
+
+} et_path;
+
+
+static a1fs_et_header *root_of(a1fs_inode *inode)
+{
+	return (a1fs_et_header *)inode->extents;
+}
+
+static a1fs_et_header *node_at(a1fs_blk_t block, fs_ctx *fs)
+{
+	return bdev_block(&fs->dev, block);
+}
+
+static size_t entry_size(const a1fs_et_header *node)
+{
+	return node->depth == 0 ? sizeof(a1fs_et_leaf) : sizeof(a1fs_et_index);
+}
+
+static void *entry_at(a1fs_et_header *node, uint32_t i)
+{
+	return (char *)(node + 1) + i * entry_size(node);
+}
+
+static uint32_t key_at(a1fs_et_header *node, uint32_t i)
+{
+	// both kinds of entries start with file_block
+	return ((a1fs_et_index *)entry_at(node, i))->file_block;
+}
+
+static a1fs_blk_t child_at(a1fs_et_header *node, uint32_t i)
+{
+	return ((a1fs_et_index *)entry_at(node, i))->child;
+}
+
+/** Make the root in an inode an empty node of the given depth. */
+static void init_root(a1fs_inode *inode, uint16_t depth)
+{
+	a1fs_et_header *root = root_of(inode);
+	root->magic = A1FS_ET_MAGIC;
+	root->entries = 0;
+	root->max = depth == 0 ? ROOT_MAX_LEAF : ROOT_MAX_INDEX;
+	root->depth = depth;
+}
+
+/** Record a node as modified; the root is written with the inode. */
+static void dirty_node(a1fs_blk_t block, fs_ctx *fs)
+{
+	if (block != 0)
+		journal_dirty(&fs->journal, block);
+}
+
+/**
+ * Allocate a block for an empty node, in the group of the inode if there is room.
+ *
+ * NOTE: the caller has reserved the block.
+ */
+static a1fs_blk_t new_node(uint16_t depth, a1fs_inode *inode, fs_ctx *fs)
+{
+	a1fs_blk_t block = allocate_block(inode, fs);
+	journal_dirty(&fs->journal, block);
+
+	a1fs_et_header *node = node_at(block, fs);
+	node->magic = A1FS_ET_MAGIC;
+	node->entries = 0;
+	node->max = depth == 0 ? NODE_MAX_LEAF : NODE_MAX_INDEX;
+	node->depth = depth;
+	return block;
+}
+
+static void free_node(a1fs_blk_t block, fs_ctx *fs)
+{
+	free_block_range(block, 1, fs);
+}
+
+/** Index of the last entry with a file_block <= file_block; 0 if there is none. */
+static uint32_t search(a1fs_et_header *node, uint32_t file_block)
+{
+	uint32_t lo = 0;
+	uint32_t hi = node->entries;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (key_at(node, mid) <= file_block)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Find the leaf that holds (or would hold) file_block. */
+static void find_path(a1fs_inode *inode, uint32_t file_block, et_path *path, fs_ctx *fs)
+{
+	a1fs_et_header *node = root_of(inode);
+	a1fs_blk_t block = 0;
+	uint32_t level = 0;
+	for (;;) {
+		path->node[level] = node;
+		path->block[level] = block;
+		path->index[level] = search(node, file_block);
+		if (node->depth == 0)
+			break;
+		block = child_at(node, path->index[level]);
+		node = node_at(block, fs);
+		level++;
+	}
+	path->levels = level + 1;
+}
+
+/** Insert an entry at position pos of a node that has room for it. */
+static void insert_entry(a1fs_et_header *node, uint32_t pos, const void *entry)
+{
+	size_t size = entry_size(node);
+	memmove(entry_at(node, pos + 1), entry_at(node, pos), (node->entries - pos) * size);
+	memcpy(entry_at(node, pos), entry, size);
+	node->entries++;
+}
+
+
+int extent_tree_convert(a1fs_inode *inode, fs_ctx *fs)
+{
+	// the insertions below fill leaf blocks (once the extents don't fit in the root)
+	uint32_t leaves = (inode->num_extents + NODE_MAX_LEAF - 1) / NODE_MAX_LEAF;
+	if (inode->num_extents <= ROOT_MAX_LEAF)
+		leaves = 0;
+	if (!reserve_metadata(inode, leaves, fs))
+		return -ENOSPC;
+
+	a1fs_extent extents[A1FS_MAX_EXTENTS];
+	uint32_t count = inode->num_extents;
+	for (uint32_t i = 0; i < count; i++)
+		extents[i] = *get_extent(inode, i, fs);
+	if (inode->indirect != 0)
+		free_node(inode->indirect, fs);
+	inode->indirect = 0;
+
+	inode->flags |= A1FS_INODE_EXTENT_TREE;
+	init_root(inode, 0);
+	uint32_t file_block = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		extent_tree_insert(inode, file_block, &extents[i], fs);
+		file_block += extents[i].count;
+	}
+	// the extent map cache only holds inodes without a tree
+	invalidate_extent_map(get_inode_num(inode, fs), fs);
+	return 0;
+}
+
+long extent_tree_lookup(a1fs_inode *inode, uint32_t file_block, uint32_t *contig, fs_ctx *fs)
+{
+	a1fs_et_header *node = root_of(inode);
+	while (node->depth > 0) {
+		if (node->entries == 0)
+			return -1;
+		node = node_at(child_at(node, search(node, file_block)), fs);
+		if (node->magic != A1FS_ET_MAGIC)
+			return -1; // corrupt tree
+	}
+	if (node->entries == 0)
+		return -1;
+
+	a1fs_et_leaf *leaf = entry_at(node, search(node, file_block));
+	if (file_block < leaf->file_block || file_block - leaf->file_block >= leaf->extent.count)
+		return -1;
+	if (contig != NULL)
+		*contig = leaf->extent.count - (file_block - leaf->file_block);
+	return leaf->extent.start + (file_block - leaf->file_block);
+}
+
+a1fs_et_leaf *extent_tree_find(a1fs_inode *inode, uint32_t file_block, a1fs_blk_t *leaf_block, fs_ctx *fs)
+{
+	et_path path;
+	find_path(inode, file_block, &path, fs);
+	a1fs_et_header *leaf = path.node[path.levels - 1];
+	uint32_t i = path.index[path.levels - 1];
+	if (leaf_block != NULL)
+		*leaf_block = path.block[path.levels - 1];
+	if (leaf->entries == 0 || key_at(leaf, i) > file_block)
+		return NULL;
+	return entry_at(leaf, i);
+}
+
+long extent_tree_next(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs)
+{
+	et_path path;
+	find_path(inode, file_block, &path, fs);
+	a1fs_et_header *leaf = path.node[path.levels - 1];
+	uint32_t i = path.index[path.levels - 1];
+	if (leaf->entries == 0)
+		return -1;
+	a1fs_et_leaf *entry = entry_at(leaf, i);
+	if (entry->file_block > file_block)
+		return entry->file_block; // file_block is before the first extent
+	if (file_block - entry->file_block < entry->extent.count)
+		return file_block;
+	if (i + 1 < leaf->entries)
+		return key_at(leaf, i + 1);
+
+	// the first entry of the next leaf, under the closest ancestor that has a next entry
+	for (int level = path.levels - 2; level >= 0; level--) {
+		if (path.index[level] + 1 < path.node[level]->entries) {
+			a1fs_et_header *node = node_at(child_at(path.node[level], path.index[level] + 1), fs);
+			while (node->depth > 0)
+				node = node_at(child_at(node, 0), fs);
+			return key_at(node, 0);
+		}
+	}
+	return -1;
+}
+
+a1fs_et_leaf *extent_tree_last(a1fs_inode *inode, a1fs_blk_t *leaf_block, fs_ctx *fs)
+{
+	a1fs_et_header *node = root_of(inode);
+	a1fs_blk_t block = 0;
+	while (node->depth > 0 && node->entries > 0) {
+		block = child_at(node, node->entries - 1);
+		node = node_at(block, fs);
+	}
+	if (leaf_block != NULL)
+		*leaf_block = block;
+	return node->depth == 0 && node->entries > 0 ? entry_at(node, node->entries - 1) : NULL;
+}
+
+/** Count the nodes an insertion along a path allocates. */
+static uint32_t count_splits(const et_path *path)
+{
+	// every full node from the leaf up is split (or, for the root, moved down a level)
+	uint32_t needed = 0;
+	for (int level = path->levels - 1; level >= 0 && path->node[level]->entries == path->node[level]->max; level--)
+		needed++;
+	return needed;
+}
+
+uint32_t extent_tree_insert_blocks(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs)
+{
+	et_path path;
+	find_path(inode, file_block, &path, fs);
+	return count_splits(&path);
+}
+
+/** Bound the nodes that extents more extents appended to a tree of the given number of levels allocate. */
+static uint32_t worst_splits(uint32_t levels, uint32_t extents)
+{
+	if (extents == 0)
+		return 0;
+	// the first one may split the node at every level, the root included
+	uint32_t needed = levels;
+	// after that, a node split in the middle has room for half of its entries again, and every
+	// new node adds an entry to the level above, up to a root that keeps growing
+	uint32_t entries = extents - 1;
+	for (uint32_t level = 0; level < MAX_LEVELS && entries > 0; level++) {
+		uint32_t half = (level == 0 ? NODE_MAX_LEAF : NODE_MAX_INDEX) / 2;
+		entries = (entries + half - 1) / half;
+		needed += entries;
+	}
+	return needed;
+}
+
+uint32_t extent_tree_worst_blocks(a1fs_inode *inode, uint32_t extents)
+{
+	if (inode->flags & A1FS_INODE_EXTENT_TREE)
+		return worst_splits(root_of(inode)->depth + 1, extents);
+
+	uint32_t total = inode->num_extents + extents;
+	if (total <= 10)
+		return 0; // they all fit in the inode
+	uint32_t needed = inode->indirect == 0;
+	if (total <= A1FS_MAX_EXTENTS)
+		return needed;
+	// the conversion puts A1FS_MAX_EXTENTS extents in leaves under the root, the rest go into that tree
+	needed += (A1FS_MAX_EXTENTS + NODE_MAX_LEAF - 1) / NODE_MAX_LEAF;
+	return needed + worst_splits(2, total - A1FS_MAX_EXTENTS);
+}
+
+void extent_tree_insert(a1fs_inode *inode, uint32_t file_block, const a1fs_extent *extent, fs_ctx *fs)
+{
+	et_path path;
+	find_path(inode, file_block, &path, fs);
+
+	a1fs_et_header *leaf = path.node[path.levels - 1];
+	uint32_t pos = leaf->entries > 0 && key_at(leaf, path.index[path.levels - 1]) <= file_block ?
+		path.index[path.levels - 1] + 1 : 0;
+	a1fs_et_leaf leaf_entry = { .file_block = file_block, .extent = *extent };
+	a1fs_et_index index_entry;
+	const void *entry = &leaf_entry;
+
+	for (int level = path.levels - 1; ; level--) {
+		a1fs_et_header *node = path.node[level];
+		dirty_node(path.block[level], fs);
+		if (node->entries < node->max) {
+			insert_entry(node, pos, entry);
+			return;
+		}
+
+		if (level == 0) {
+			// move the entries of the root to a block; it always has room for one more
+			a1fs_blk_t block = new_node(node->depth, inode, fs);
+			a1fs_et_header *child = node_at(block, fs);
+			memcpy(entry_at(child, 0), entry_at(node, 0), node->entries * entry_size(node));
+			child->entries = node->entries;
+			insert_entry(child, pos, entry);
+
+			init_root(inode, child->depth + 1);
+			index_entry.file_block = key_at(child, 0);
+			index_entry.child = block;
+			insert_entry(node, 0, &index_entry);
+			return;
+		}
+
+		// Split the node. Appends (the common case) leave it full and start an empty sibling,
+		// so the nodes of a file that only grows stay packed; otherwise each half gets half.
+		uint32_t at = pos == node->entries ? pos : node->entries / 2;
+		a1fs_blk_t block = new_node(node->depth, inode, fs);
+		a1fs_et_header *sibling = node_at(block, fs);
+		memcpy(entry_at(sibling, 0), entry_at(node, at), (node->entries - at) * entry_size(node));
+		sibling->entries = node->entries - at;
+		node->entries = at;
+		if (pos < at)
+			insert_entry(node, pos, entry);
+		else
+			insert_entry(sibling, pos - at, entry);
+
+		// and the sibling goes into the parent after the node
+		index_entry.file_block = key_at(sibling, 0);
+		index_entry.child = block;
+		entry = &index_entry;
+		pos = path.index[level - 1] + 1;
+	}
+}
+
+void extent_tree_remove_last(a1fs_inode *inode, fs_ctx *fs)
+{
+	a1fs_et_header *node = root_of(inode);
+	a1fs_blk_t block = 0;
+	et_path path;
+	path.levels = 0;
+	for (;;) {
+		path.node[path.levels] = node;
+		path.block[path.levels] = block;
+		path.levels++;
+		if (node->depth == 0 || node->entries == 0)
+			break;
+		block = child_at(node, node->entries - 1);
+		node = node_at(block, fs);
+	}
+
+	// remove the entry, and the entries of the nodes that it leaves empty
+	for (int level = path.levels - 1; level >= 0; level--) {
+		dirty_node(path.block[level], fs);
+		if (path.node[level]->entries > 0)
+			path.node[level]->entries--;
+		if (level == 0 || path.node[level]->entries > 0)
+			break;
+		free_node(path.block[level], fs);
+	}
+
+	a1fs_et_header *root = root_of(inode);
+	while (root->depth > 0) {
+		if (root->entries == 0) {
+			init_root(inode, 0);
+			break;
+		}
+		if (root->entries > 1)
+			break;
+		block = child_at(root, 0);
+		a1fs_et_header *child = node_at(block, fs);
+		uint16_t max = child->depth == 0 ? ROOT_MAX_LEAF : ROOT_MAX_INDEX;
+		if (child->entries > max)
+			break;
+		// the only child fits in the inode
+		memcpy(root + 1, child + 1, child->entries * entry_size(child));
+		root->entries = child->entries;
+		root->max = max;
+		root->depth = child->depth;
+		free_node(block, fs);
+	}
+
+	if (root->depth == 0 && root->entries == 0) {
+		memset(inode->extents, 0, sizeof(inode->extents));
+		inode->flags &= ~A1FS_INODE_EXTENT_TREE;
+	}
+}
+
+static uint32_t count_nodes(a1fs_et_header *node, fs_ctx *fs)
+{
+	if (node->depth == 0)
+		return 0;
+	uint32_t count = node->entries;
+	if (node->depth > 1) {
+		for (uint32_t i = 0; i < node->entries; i++)
+			count += count_nodes(node_at(child_at(node, i), fs), fs);
+	}
+	return count;
+}
+
+uint32_t extent_tree_nodes(a1fs_inode *inode, fs_ctx *fs)
+{
+	return count_nodes(root_of(inode), fs);
+}
+
+static uint32_t count_blocks(a1fs_et_header *node, fs_ctx *fs)
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < node->entries; i++) {
+		if (node->depth == 0)
+			count += ((a1fs_et_leaf *)entry_at(node, i))->extent.count;
+		else
+			count += count_blocks(node_at(child_at(node, i), fs), fs);
+	}
+	return count;
+}
+
+uint32_t extent_tree_blocks(a1fs_inode *inode, fs_ctx *fs)
+{
+	return count_blocks(root_of(inode), fs);
+}
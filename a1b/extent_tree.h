@@ -0,0 +1,110 @@
+/**
+ * Extent trees (see a1fs_et_header).
+ *
+ * A tree also records where each extent starts in the file, so a file with a
+ * tree can have holes: ranges of blocks that no extent holds, and that read
+ * as zeros. A sparse file is converted to a tree by its first hole.
+ *
+ * An inode holds up to A1FS_MAX_EXTENTS extents in the inode and its indirect
+ * block. A file that needs more (e.g. one grown a few blocks at a time on an
+ * aged, fragmented image) is converted to an extent tree. The root node then
+ * takes the place of the extents array in the inode. Index nodes and leaves
+ * are one block each. A lookup or insertion reads one node per level, and the
+ * number of extents is only limited by the free space.
+ *
+ * The caller holds the inode's lock. Nodes are allocated and freed through
+ * the allocation groups, which lock themselves.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Move the extents of an inode into an extent tree, and free its indirect
+ * block. This happens when the inode has A1FS_MAX_EXTENTS of them, or when a
+ * hole needs to be left before an extent (the extents of an inode without a
+ * tree cover the start of the file with no gaps).
+ *
+ * @return  0 on success; -ENOSPC if the leaves can't be reserved (see
+ *          reserve_metadata()), in which case the inode is not modified.
+ */
+int extent_tree_convert(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Translate a block number within a file to a block number on the disk.
+ *
+ * @param contig  if not NULL, receives the number of blocks from file_block to
+ *                the end of its extent.
+ * @return        the data block number; -1 if no extent holds file_block.
+ */
+long extent_tree_lookup(a1fs_inode *inode, uint32_t file_block, uint32_t *contig, fs_ctx *fs);
+
+/**
+ * Get the extent that holds file_block, or the last one before it.
+ *
+ * @param leaf_block  if not NULL, receives the block of the leaf that holds
+ *                    (or would hold) the entry; 0 if the leaf is the root.
+ * @return            the leaf entry; NULL if no extent starts at or before
+ *                    file_block.
+ */
+a1fs_et_leaf *extent_tree_find(a1fs_inode *inode, uint32_t file_block, a1fs_blk_t *leaf_block, fs_ctx *fs);
+
+/**
+ * Find the first block at or after file_block that an extent holds, i.e. the
+ * end of the hole at file_block.
+ *
+ * @return  the block within the file; -1 if there is no extent past
+ *          file_block.
+ */
+long extent_tree_next(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs);
+
+/**
+ * Get the extent that ends the file.
+ *
+ * @param leaf_block  if not NULL, receives the block of the leaf that holds
+ *                    the entry; 0 if the leaf is the root in the inode.
+ * @return            the last leaf entry; NULL if the tree is empty.
+ */
+a1fs_et_leaf *extent_tree_last(a1fs_inode *inode, a1fs_blk_t *leaf_block, fs_ctx *fs);
+
+/** Count the nodes extent_tree_insert() allocates to add an extent at file_block. */
+uint32_t extent_tree_insert_blocks(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs);
+
+/**
+ * Bound the metadata blocks (the indirect block, and the leaves and index
+ * nodes of a tree the inode has or is converted to) that extents more extents
+ * at the end of a file can allocate, for reserving them before the extents
+ * are known, like ext4 does for delayed allocation. Counts every node the
+ * first extent could split, and one more node per half a node of entries
+ * after it at each level.
+ */
+uint32_t extent_tree_worst_blocks(a1fs_inode *inode, uint32_t extents);
+
+/**
+ * Add an extent that starts file_block blocks into the file, splitting full
+ * nodes on the way to its leaf. A full root is moved into a new block, so the
+ * tree grows one level deeper.
+ *
+ * NOTE: the caller has reserved the extent_tree_insert_blocks() new nodes with
+ * reserve_metadata().
+ */
+void extent_tree_insert(a1fs_inode *inode, uint32_t file_block, const a1fs_extent *extent, fs_ctx *fs);
+
+/**
+ * Remove the last extent (the blocks it holds are not freed). Nodes left
+ * empty are freed, and the root takes over the entries of its only child once
+ * they fit in the inode. An inode whose tree becomes empty goes back to the
+ * plain extent format.
+ */
+void extent_tree_remove_last(a1fs_inode *inode, fs_ctx *fs);
+
+/** Count the blocks taken by the nodes of the tree (the root does not take one). */
+uint32_t extent_tree_nodes(a1fs_inode *inode, fs_ctx *fs);
+
+/** Count the data blocks the extents hold; holes don't count. */
+uint32_t extent_tree_blocks(a1fs_inode *inode, fs_ctx *fs);
@@ -0,0 +1,291 @@
+/**
+ * Free extent index implementation.
+ */
+
+#include <stdlib.h>
+
+#include "free_extents.h"
+#include "bitmap.h"
+
+
+#define FREE_BY_START  0
+#define FREE_BY_LENGTH 1
+
+/** xorshift32; treap priorities only need to be uncorrelated with the keys. */
+static uint32_t next_priority(free_extents *fe)
+{
+	uint32_t x = fe->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fe->seed = x;
+	return x;
+}
+
+/** Compare two extents in the order of the given tree. Starts are unique, so this is a total order. */
+static int extent_cmp(const free_extent *a, const free_extent *b, int tree)
+{
+	if (tree == FREE_BY_LENGTH && a->count != b->count)
+		return a->count < b->count ? -1 : 1;
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return 0;
+}
+
+/** Split t into the nodes that order before key (*l) and the rest (*r). */
+static void treap_split(free_extent *t, const free_extent *key, int tree,
+                        free_extent **l, free_extent **r)
+{
+	if (t == NULL) {
+		*l = *r = NULL;
+	} else if (extent_cmp(t, key, tree) < 0) {
+		treap_split(t->right[tree], key, tree, &t->right[tree], r);
+		*l = t;
+	} else {
+		treap_split(t->left[tree], key, tree, l, &t->left[tree]);
+		*r = t;
+	}
+}
+
+/** Join two treaps where every node of l orders before every node of r. */
+static free_extent *treap_merge(free_extent *l, free_extent *r, int tree)
+{
+	if (l == NULL)
+		return r;
+	if (r == NULL)
+		return l;
+	if (l->priority > r->priority) {
+		l->right[tree] = treap_merge(l->right[tree], r, tree);
+		return l;
+	}
+	r->left[tree] = treap_merge(l, r->left[tree], tree);
+	return r;
+}
+
+static free_extent *treap_insert(free_extent *t, free_extent *x, int tree)
+{
+	if (t == NULL || x->priority > t->priority) {
+		treap_split(t, x, tree, &x->left[tree], &x->right[tree]);
+		return x;
+	}
+	if (extent_cmp(x, t, tree) < 0)
+		t->left[tree] = treap_insert(t->left[tree], x, tree);
+	else
+		t->right[tree] = treap_insert(t->right[tree], x, tree);
+	return t;
+}
+
+static free_extent *treap_erase(free_extent *t, free_extent *x, int tree)
+{
+	if (t == x)
+		return treap_merge(x->left[tree], x->right[tree], tree);
+	if (extent_cmp(x, t, tree) < 0)
+		t->left[tree] = treap_erase(t->left[tree], x, tree);
+	else
+		t->right[tree] = treap_erase(t->right[tree], x, tree);
+	return t;
+}
+
+static void link_extent(free_extents *fe, free_extent *x)
+{
+	fe->root[FREE_BY_START] = treap_insert(fe->root[FREE_BY_START], x, FREE_BY_START);
+	fe->root[FREE_BY_LENGTH] = treap_insert(fe->root[FREE_BY_LENGTH], x, FREE_BY_LENGTH);
+	fe->count += 1;
+}
+
+static void unlink_extent(free_extents *fe, free_extent *x)
+{
+	fe->root[FREE_BY_START] = treap_erase(fe->root[FREE_BY_START], x, FREE_BY_START);
+	fe->root[FREE_BY_LENGTH] = treap_erase(fe->root[FREE_BY_LENGTH], x, FREE_BY_LENGTH);
+	fe->count -= 1;
+}
+
+/** Add a new run that does not touch any run in the index. */
+static bool new_extent(free_extents *fe, uint32_t start, uint32_t count)
+{
+	free_extent *x = malloc(sizeof(free_extent));
+	if (x == NULL)
+		return false; // leaving free blocks out of the index is always safe
+	x->start = start;
+	x->count = count;
+	x->priority = next_priority(fe);
+	link_extent(fe, x);
+	return true;
+}
+
+/** The run with the largest start <= block; NULL if there is none. */
+static free_extent *floor_extent(free_extents *fe, uint32_t block)
+{
+	free_extent *t = fe->root[FREE_BY_START];
+	free_extent *best = NULL;
+	while (t != NULL) {
+		if (t->start <= block) {
+			best = t;
+			t = t->right[FREE_BY_START];
+		} else {
+			t = t->left[FREE_BY_START];
+		}
+	}
+	return best;
+}
+
+/** The run with the smallest start > block; NULL if there is none. */
+static free_extent *next_extent(free_extents *fe, uint32_t block)
+{
+	free_extent *t = fe->root[FREE_BY_START];
+	free_extent *best = NULL;
+	while (t != NULL) {
+		if (t->start > block) {
+			best = t;
+			t = t->left[FREE_BY_START];
+		} else {
+			t = t->right[FREE_BY_START];
+		}
+	}
+	return best;
+}
+
+static void destroy_tree(free_extent *t)
+{
+	while (t != NULL) {
+		destroy_tree(t->left[FREE_BY_START]);
+		free_extent *right = t->right[FREE_BY_START];
+		free(t);
+		t = right;
+	}
+}
+
+
+bool free_extents_init(free_extents *fe, const uint8_t *bitmap, uint32_t nbits)
+{
+	fe->root[FREE_BY_START] = fe->root[FREE_BY_LENGTH] = NULL;
+	fe->count = 0;
+	fe->seed = 2463534242u;
+
+	// Each free run goes from a clear bit to the next set bit
+	long run_start = bitmap_next_zero(bitmap, nbits, 0);
+	while (run_start >= 0) {
+		long run_end = bitmap_next_set(bitmap, nbits, run_start);
+		if (run_end < 0)
+			run_end = nbits;
+		if (!new_extent(fe, run_start, run_end - run_start)) {
+			free_extents_destroy(fe);
+			return false;
+		}
+		run_start = bitmap_next_zero(bitmap, nbits, run_end);
+	}
+	return true;
+}
+
+void free_extents_destroy(free_extents *fe)
+{
+	destroy_tree(fe->root[FREE_BY_START]);
+	fe->root[FREE_BY_START] = fe->root[FREE_BY_LENGTH] = NULL;
+	fe->count = 0;
+}
+
+void free_extents_add(free_extents *fe, uint32_t start, uint32_t count)
+{
+	free_extent *prev = floor_extent(fe, start);
+	free_extent *next = next_extent(fe, start);
+	bool merge_prev = prev != NULL && prev->start + prev->count == start;
+	bool merge_next = next != NULL && next->start == start + count;
+
+	if (merge_prev && merge_next) {
+		unlink_extent(fe, next);
+		unlink_extent(fe, prev);
+		prev->count += count + next->count;
+		link_extent(fe, prev);
+		free(next);
+	} else if (merge_prev) {
+		// the start is unchanged, but the node must move in the length tree
+		unlink_extent(fe, prev);
+		prev->count += count;
+		link_extent(fe, prev);
+	} else if (merge_next) {
+		unlink_extent(fe, next);
+		next->start = start;
+		next->count += count;
+		link_extent(fe, next);
+	} else {
+		new_extent(fe, start, count);
+	}
+}
+
+void free_extents_remove(free_extents *fe, uint32_t start, uint32_t count)
+{
+	uint32_t end = start + count;
+	// Trim every run that overlaps [start, end), from the highest down
+	while (true) {
+		free_extent *x = floor_extent(fe, end - 1);
+		if (x == NULL || x->start + x->count <= start)
+			return;
+		uint32_t x_end = x->start + x->count;
+		unlink_extent(fe, x);
+
+		if (x->start < start) {
+			// keep the part in front of the range in this node
+			x->count = start - x->start;
+			link_extent(fe, x);
+			if (x_end > end)
+				new_extent(fe, end, x_end - end);
+			return; // nothing below x can overlap
+		}
+		if (x_end > end) {
+			x->start = end;
+			x->count = x_end - end;
+			link_extent(fe, x);
+		} else {
+			free(x);
+		}
+	}
+}
+
+bool free_extents_best_fit(free_extents *fe, uint32_t max_blocks, a1fs_extent *extent)
+{
+	free_extent *t = fe->root[FREE_BY_LENGTH];
+	if (t == NULL)
+		return false;
+
+	free_extent *fit = NULL;
+	while (t != NULL) {
+		if (t->count >= max_blocks) {
+			fit = t; // the lowest start among the shortest runs that are long enough
+			t = t->left[FREE_BY_LENGTH];
+		} else {
+			t = t->right[FREE_BY_LENGTH];
+		}
+	}
+	if (fit != NULL) {
+		extent->start = fit->start;
+		extent->count = max_blocks;
+		return true;
+	}
+
+	// no run is long enough, so take the longest one
+	t = fe->root[FREE_BY_LENGTH];
+	while (t->right[FREE_BY_LENGTH] != NULL)
+		t = t->right[FREE_BY_LENGTH];
+	extent->start = t->start;
+	extent->count = t->count;
+	return true;
+}
+
+uint32_t free_extents_at(free_extents *fe, uint32_t start, uint32_t max_blocks)
+{
+	free_extent *x = floor_extent(fe, start);
+	if (x == NULL || x->start + x->count <= start)
+		return 0;
+	uint32_t count = x->start + x->count - start;
+	return count < max_blocks ? count : max_blocks;
+}
+
+long free_extents_first(free_extents *fe)
+{
+	free_extent *t = fe->root[FREE_BY_START];
+	if (t == NULL)
+		return -1;
+	while (t->left[FREE_BY_START] != NULL)
+		t = t->left[FREE_BY_START];
+	return t->start;
+}
@@ -0,0 +1,86 @@
+/**
+ * In-memory index of the free extents of a block bitmap.
+ *
+ * Every maximal run of free blocks is kept in two treaps: one ordered by start
+ * block (to find the run that contains or follows a block and to coalesce
+ * neighbours) and one ordered by length (for best fit). Building the index
+ * takes one pass over the bitmap at mount time. After that every query and
+ * update is O(log n) in the number of free runs, so allocating never has to
+ * scan the bitmap.
+ *
+ * Each allocation group has its own index of its own bitmap, kept in sync by
+ * set_block_range(), except that blocks freed by a journal transaction are
+ * only added once it is checkpointed (see journal_free()). A run that can't be recorded because malloc() failed is
+ * left out, so every block in the index is guaranteed to be free but a free
+ * block might be missing until the next mount.
+ *
+ * The functions are not thread safe. The caller holds the lock of the group.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** One run of free blocks; a node in both treaps. */
+typedef struct free_extent {
+	uint32_t start;
+	uint32_t count;
+	/** Random treap priority, shared by both trees. */
+	uint32_t priority;
+	/** Children, indexed by FREE_BY_START or FREE_BY_LENGTH. */
+	struct free_extent *left[2];
+	struct free_extent *right[2];
+
+} free_extent;
+
+/** The free extent index; hung off the fs context. */
+typedef struct free_extents {
+	/** Roots of the treaps, indexed by FREE_BY_START or FREE_BY_LENGTH. */
+	free_extent *root[2];
+	/** Number of free runs in the index. */
+	size_t count;
+	/** State of the priority generator. */
+	uint32_t seed;
+
+} free_extents;
+
+/**
+ * Build the index from a block bitmap.
+ *
+ * @param fe      pointer to the index to initialize.
+ * @param bitmap  the block bitmap; bit i set means block i is in use.
+ * @param nbits   number of blocks covered by the bitmap.
+ * @return        true on success; false if out of memory.
+ */
+bool free_extents_init(free_extents *fe, const uint8_t *bitmap, uint32_t nbits);
+
+/** Free all the memory held by the index. */
+void free_extents_destroy(free_extents *fe);
+
+/** Record that blocks [start, start + count) became free, merging with adjacent runs. */
+void free_extents_add(free_extents *fe, uint32_t start, uint32_t count);
+
+/** Record that blocks [start, start + count) are now in use. */
+void free_extents_remove(free_extents *fe, uint32_t start, uint32_t count);
+
+/**
+ * Pick the blocks for a new extent of at most max_blocks blocks.
+ *
+ * Uses the shortest free run that can hold all max_blocks blocks, or the
+ * longest free run if none can. The index is not modified.
+ *
+ * @param extent  receives the start and length of the chosen blocks.
+ * @return        true on success; false if there are no free blocks.
+ */
+bool free_extents_best_fit(free_extents *fe, uint32_t max_blocks, a1fs_extent *extent);
+
+/** Number of free blocks (at most max_blocks) starting at block start. */
+uint32_t free_extents_at(free_extents *fe, uint32_t start, uint32_t max_blocks);
+
+/** The lowest numbered free block; -1 if there are none. */
+long free_extents_first(free_extents *fe);
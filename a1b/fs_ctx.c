@@ -16,25 +16,188 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdlib.h>
+
 #include "fs_ctx.h"
 #include "a1fs.h" 
 
+/** Upper bound on the number of cached names (and, separately, paths). */
+#define DCACHE_MAX_ENTRIES (1 << 20)
+
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
+/** Destroy the first count allocation groups and free the array. */
+static void groups_destroy(fs_ctx *fs, uint32_t count)
 {
-	fs->image = image;
-	fs->size = size;
+	for(uint32_t g = 0; g < count; g++){
+		free_extents_destroy(&fs->groups[g].free_blocks);
+		pthread_mutex_destroy(&fs->groups[g].lock);
+	}
+	free(fs->groups);
+}
+
+/** Set up the allocation groups, indexing the free blocks of each. */
+static bool groups_init(fs_ctx *fs)
+{
+	fs->groups = calloc(fs->sb->groups_count, sizeof(alloc_group));
+	if(fs->groups == NULL)
+		return false;
+	for(uint32_t g = 0; g < fs->sb->groups_count; g++){
+		alloc_group *group = &fs->groups[g];
+		if(!free_extents_init(&group->free_blocks, group_block_bitmap(fs, g), group_blocks(fs, g))){
+			groups_destroy(fs, g);
+			return false;
+		}
+		pthread_mutex_init(&group->lock, NULL);
+		group->inode_hint = 0;
+	}
+	return true;
+}
+
+/**
+ * Give blocks freed by a journal transaction that is now checkpointed back to the free extent
+ * index of their group (see set_block_range())
+ */
+static void release_blocks(void *arg, uint32_t start, uint32_t count)
+{
+	fs_ctx *fs = arg;
+	uint32_t g = start / fs->sb->blocks_per_group;
+	bdev_release(&fs->dev, start, count); // before a new owner can get them
+	pthread_mutex_lock(&fs->groups[g].lock);
+	free_extents_add(&fs->groups[g].free_blocks, start - g * fs->sb->blocks_per_group, count);
+	pthread_mutex_unlock(&fs->groups[g].lock);
+
+	pthread_mutex_lock(&fs->space_lock);
+	fs->freed_blocks -= count;
+	pthread_mutex_unlock(&fs->space_lock);
+}
 
-	a1fs_superblock *sb = (a1fs_superblock *)(fs->image);
+
+bool fs_ctx_init(fs_ctx *fs)
+{
+	a1fs_superblock *sb = bdev_block(&fs->dev, 0);
 	fs->sb = sb;
 	if(sb->magic != A1FS_MAGIC)
 		return false; // this disk is not formatted using the file system specified
 
-	fs->inode_table = sb->inode_table; 
+	fs->group_descs = bdev_blocks(&fs->dev, sb->group_table.start, sb->group_table.count);
+	// Replay the journal first, everything below reads the (replayed) bitmaps
+	if(!journal_init(&fs->journal, &fs->dev, sb))
+		return false;
+	if(!dcache_init(&fs->dcache, DCACHE_MAX_ENTRIES)){
+		journal_destroy(&fs->journal);
+		return false;
+	}
+	if(!groups_init(fs)){
+		dcache_destroy(&fs->dcache);
+		journal_destroy(&fs->journal);
+		return false;
+	}
+	fs->extent_maps = calloc(A1FS_EXTENT_MAPS, sizeof(extent_map));
+	if(fs->extent_maps == NULL){
+		groups_destroy(fs, sb->groups_count);
+		dcache_destroy(&fs->dcache);
+		journal_destroy(&fs->journal);
+		return false;
+	}
+	for(int i = 0; i < A1FS_EXTENT_MAPS; i++)
+		pthread_mutex_init(&fs->extent_maps[i].lock, NULL);
+	dirty_ranges_init(&fs->dirty_data, &fs->dev);
+	delalloc_init(&fs->delalloc);
+	inode_refs_init(&fs->refs);
+	fs->reserved_blocks = 0;
+	fs->freed_blocks = 0;
+	fs->dir_group_hint = 0;
+
+	for(int i = 0; i < A1FS_INODE_LOCKS; i++)
+		pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	pthread_mutex_init(&fs->space_lock, NULL);
+	journal_set_release(&fs->journal, release_blocks, fs);
 	return true;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	(void)fs;
+	// Commit whatever is left while the image is still open
+	journal_destroy(&fs->journal);
+	dcache_destroy(&fs->dcache);
+	groups_destroy(fs, fs->sb->groups_count);
+	for(int i = 0; i < A1FS_EXTENT_MAPS; i++)
+		pthread_mutex_destroy(&fs->extent_maps[i].lock);
+	free(fs->extent_maps);
+	dirty_ranges_destroy(&fs->dirty_data);
+	delalloc_destroy(&fs->delalloc);
+	inode_refs_destroy(&fs->refs);
+	for(int i = 0; i < A1FS_INODE_LOCKS; i++)
+		pthread_rwlock_destroy(&fs->inode_locks[i]);
+	pthread_mutex_destroy(&fs->space_lock);
+}
+
+uint32_t group_blocks(fs_ctx *fs, uint32_t group)
+{
+	uint32_t first = group * fs->sb->blocks_per_group;
+	uint32_t left = fs->sb->blocks_count - first;
+	return left < fs->sb->blocks_per_group ? left : fs->sb->blocks_per_group;
+}
+
+a1fs_blk_t inode_table_block(fs_ctx *fs, uint32_t ino)
+{
+	uint32_t ipg = fs->sb->inodes_per_group;
+	return fs->group_descs[ino / ipg].inode_table + (ino % ipg) * sizeof(a1fs_inode) / A1FS_BLOCK_SIZE;
+}
+
+uint8_t *group_block_bitmap(fs_ctx *fs, uint32_t group)
+{
+	uint32_t blocks = (group_blocks(fs, group) + A1FS_BLOCK_SIZE * 8 - 1) / (A1FS_BLOCK_SIZE * 8);
+	return bdev_blocks(&fs->dev, fs->group_descs[group].block_bitmap, blocks);
+}
+
+uint8_t *group_inode_bitmap(fs_ctx *fs, uint32_t group)
+{
+	uint32_t blocks = (fs->sb->inodes_per_group + A1FS_BLOCK_SIZE * 8 - 1) / (A1FS_BLOCK_SIZE * 8);
+	return bdev_blocks(&fs->dev, fs->group_descs[group].inode_bitmap, blocks);
+}
+
+static pthread_rwlock_t *inode_lock(fs_ctx *fs, uint32_t ino)
+{
+	return &fs->inode_locks[ino % A1FS_INODE_LOCKS];
+}
+
+void inode_rdlock(fs_ctx *fs, uint32_t ino)
+{
+	pthread_rwlock_rdlock(inode_lock(fs, ino));
+}
+
+void inode_wrlock(fs_ctx *fs, uint32_t ino)
+{
+	pthread_rwlock_wrlock(inode_lock(fs, ino));
+	inode_dirty(fs, ino);
+}
+
+void inode_dirty(fs_ctx *fs, uint32_t ino)
+{
+	journal_dirty(&fs->journal, inode_table_block(fs, ino));
+}
+
+void inode_unlock(fs_ctx *fs, uint32_t ino)
+{
+	pthread_rwlock_unlock(inode_lock(fs, ino));
+}
+
+void inode_wrlock_pair(fs_ctx *fs, uint32_t ino1, uint32_t ino2)
+{
+	uint32_t stripe1 = ino1 % A1FS_INODE_LOCKS;
+	uint32_t stripe2 = ino2 % A1FS_INODE_LOCKS;
+	if(stripe1 == stripe2){
+		inode_wrlock(fs, ino1);
+		return;
+	}
+	inode_wrlock(fs, stripe1 < stripe2 ? ino1 : ino2);
+	inode_wrlock(fs, stripe1 < stripe2 ? ino2 : ino1);
+}
+
+void inode_unlock_pair(fs_ctx *fs, uint32_t ino1, uint32_t ino2)
+{
+	inode_unlock(fs, ino1);
+	if(ino1 % A1FS_INODE_LOCKS != ino2 % A1FS_INODE_LOCKS)
+		inode_unlock(fs, ino2);
 }
@@ -18,38 +18,129 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 #include "a1fs.h"
+#include "bdev.h"
+#include "dcache.h"
+#include "delalloc.h"
+#include "dirty_ranges.h"
+#include "free_extents.h"
+#include "inode_refs.h"
+#include "journal.h"
 
 
+/** Number of stripes in the inode lock table. */
+#define A1FS_INODE_LOCKS 1024
+
+/** Number of slots in the extent map cache. */
+#define A1FS_EXTENT_MAPS 256
+
+/**
+ * Cached logical -> physical translation for the extents of one inode.
+ *
+ * blocks[i] is the file block number at which extent i starts, and
+ * blocks[num_extents] is the number of blocks in the file, so the extent that
+ * holds a file block can be found with a binary search.
+ */
+typedef struct extent_map {
+	pthread_mutex_t lock;
+	/** False if the slot does not hold a map. */
+	bool valid;
+	uint32_t ino;
+	uint32_t num_extents;
+	uint32_t blocks[A1FS_MAX_EXTENTS + 1];
+
+} extent_map;
+
+/** Runtime state of an allocation group (see a1fs_group_desc). */
+typedef struct alloc_group {
+	/** Protects the bitmaps and descriptor of the group, free_blocks and inode_hint. */
+	pthread_mutex_t lock;
+	/** Index of the free runs in the group's block bitmap (offsets from the first block of the group). */
+	free_extents free_blocks;
+	/** Where the next search of the group's inode bitmap starts. */
+	uint32_t inode_hint;
+
+} alloc_group;
+
 /**
  * Mounted file system runtime state - "fs context".
+ *
+ * Lock hierarchy (a thread only ever acquires locks further down this list
+ * than the ones it already holds):
+ *   journal.barrier    joined with journal_start() by every operation that
+ *                      changes metadata, before it locks any inode.
+ *   inode_locks        per-inode state and, for a directory, its entries.
+ *                      Striped by inode number; when an operation needs two
+ *                      inodes it locks both with inode_wrlock_pair().
+ *   groups[].lock      one allocation group: its bitmaps, descriptor, free
+ *                      block index and inode hint. Never more than one at a
+ *                      time, so threads allocate in different groups in
+ *                      parallel.
+ *   space_lock         sb->free_blocks_count, sb->free_inodes_count,
+ *                      reserved_blocks, freed_blocks and dir_group_hint.
+ *   dcache.lock        internal to the dentry cache.
+ *   extent_maps[].lock one slot of the extent map cache; never held together
+ *                      with dcache.lock.
+ *   journal.lock       the dirty block set and the freed blocks of the
+ *                      running transaction.
+ *   dirty_data.lock    data blocks written since the last fsync().
+ *   delalloc.lock      the table of staging buffers (each buffer is
+ *                      protected by its inode's lock).
+ *   refs.lock          the references to inodes and the orphans.
+ *   dev.lock           the block cache of the pread backend; innermost.
  */
 typedef struct fs_ctx {
-	/** Pointer to the start of the image. */
-	void *image;
-	/** Image size in bytes. */
-	size_t size;
+	/** The image; every block is reached through it (see bdev.h). */
+	bdev dev;
 
 	//TODO: useful runtime state of the mounted file system should be cached
 	// here (NOT in global variables in a1fs.c)
 	a1fs_superblock *sb;
-	a1fs_extent inode_table;
+	/** The group table in the image. */
+	a1fs_group_desc *group_descs;
+	/** Allocation groups; sb->groups_count of them. */
+	alloc_group *groups;
+	/** Cache of resolved directory entries and paths. */
+	dcache dcache;
+	/** Extent maps of recently used inodes; inode i can only live in slot i % A1FS_EXTENT_MAPS. */
+	extent_map *extent_maps;
+	/** Metadata journal (disabled if the image has none). */
+	journal journal;
+	/** File data blocks written since the last fsync() of each file. */
+	dirty_ranges dirty_data;
+	/** Staged data of files with delayed allocation. */
+	delalloc delalloc;
+	/** Lookup and open references to inodes, and the removed inodes they keep (orphans). */
+	inode_refs refs;
+	/** True if appended data is staged (the delalloc option). */
+	bool delayed_alloc;
+	/** Free blocks promised to staged data or to an allocation in progress; other allocations can't use them. */
+	uint32_t reserved_blocks;
+	/** Free blocks held until the journal transaction that freed them is checkpointed (see journal_free()). */
+	uint32_t freed_blocks;
+	/** Where the search for the group of the next new directory starts. */
+	uint32_t dir_group_hint;
+	/** Seconds between journal commits (the commit option). */
+	unsigned int commit_interval;
+	/** Fault the metadata in once the threads start (the prefault option). */
+	bool prefault;
 
+	pthread_rwlock_t inode_locks[A1FS_INODE_LOCKS];
+	pthread_mutex_t space_lock;
 
 } fs_ctx;
 
 /**
  * Initialize file system context.
  *
- * @param fs     pointer to the context to initialize.
- * @param image  pointer to the start of the image.
- * @param size   image size in bytes.
- * @return       true on success; false on failure (e.g. invalid superblock).
+ * @param fs  pointer to the context to initialize; fs->dev must be open.
+ * @return    true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
+bool fs_ctx_init(fs_ctx *fs);
 
 /**
  * Destroy file system context.
@@ -57,3 +148,43 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/** Get the number of blocks in an allocation group. */
+uint32_t group_blocks(fs_ctx *fs, uint32_t group);
+
+/** Get the block of the inode table that holds an inode. */
+a1fs_blk_t inode_table_block(fs_ctx *fs, uint32_t ino);
+
+/** Get the block bitmap of an allocation group. */
+uint8_t *group_block_bitmap(fs_ctx *fs, uint32_t group);
+
+/** Get the inode bitmap of an allocation group. */
+uint8_t *group_inode_bitmap(fs_ctx *fs, uint32_t group);
+
+/** Lock an inode for reading (shared). */
+void inode_rdlock(fs_ctx *fs, uint32_t ino);
+
+/**
+ * Lock an inode for writing (exclusive). The inode's block of the inode table
+ * is recorded as dirty in the running journal transaction.
+ */
+void inode_wrlock(fs_ctx *fs, uint32_t ino);
+
+/**
+ * Record an inode's block of the inode table as modified by the running
+ * journal transaction. Only needed for an inode that is changed without
+ * being write locked, e.g. one that was just allocated.
+ */
+void inode_dirty(fs_ctx *fs, uint32_t ino);
+
+/** Unlock an inode locked with inode_rdlock() or inode_wrlock(). */
+void inode_unlock(fs_ctx *fs, uint32_t ino);
+
+/**
+ * Lock two inodes for writing, in stripe order so that two threads locking
+ * overlapping pairs can't deadlock. The inodes may share a stripe.
+ */
+void inode_wrlock_pair(fs_ctx *fs, uint32_t ino1, uint32_t ino2);
+
+/** Unlock two inodes locked with inode_wrlock_pair(). */
+void inode_unlock_pair(fs_ctx *fs, uint32_t ino1, uint32_t ino2);
@@ -0,0 +1,1464 @@
+/**
+ * CSC369 Assignment 1 - a1fs operations on inode numbers (see fs_ops.h).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_ops.h"
+#include "a1fs.h"
+#include "helpers.h"
+#include "bitmap.h"
+#include "dir_entry.h"
+#include "dir_index.h"
+#include "extent_tree.h"
+
+/** Bounds (in blocks) of the speculative preallocation past the end of appended files. */
+#define A1FS_PREALLOC_MIN 16
+#define A1FS_PREALLOC_MAX 4096
+
+/** Size of the block cache (MB) for an image with a journal mounted without the cache option. */
+#define A1FS_JOURNAL_CACHE 64
+
+
+/**
+ * Apply advice to the metadata regions of the image: the superblock and the
+ * group table, and the bitmaps and inode table at the start of every group.
+ * Each group's are one contiguous run of blocks (see mkfs.c); the journal
+ * after group 0's is left out, it is only written.
+ */
+static void advise_metadata(bdev_advice advice, fs_ctx *fs)
+{
+	uint32_t table_blocks = ceil_integer_division64((uint64_t)fs->sb->inodes_per_group * sizeof(a1fs_inode),
+	                                                A1FS_BLOCK_SIZE);
+	for (uint32_t g = 0; g < fs->sb->groups_count; g++) {
+		uint32_t start = g == 0 ? 0 : fs->group_descs[g].block_bitmap;
+		uint32_t end = fs->group_descs[g].inode_table + table_blocks;
+		bdev_advise(&fs->dev, start, end - start, advice);
+	}
+}
+
+/** Apply the huge page and access pattern options (see a1fs_opts). */
+static void advise_image(a1fs_opts *opts, fs_ctx *fs)
+{
+	// huge pages first, so that whatever is faulted in below gets them
+	if (opts->hugepage) {
+		// in the pread backend only the metadata stays in memory for long
+		if (fs->dev.backend == BDEV_MMAP)
+			bdev_advise(&fs->dev, 0, fs->sb->blocks_count, BDEV_HUGEPAGE);
+		else
+			advise_metadata(BDEV_HUGEPAGE, fs);
+	}
+	if (opts->data_advice != BDEV_NORMAL)
+		bdev_advise(&fs->dev, 0, fs->sb->blocks_count, opts->data_advice);
+	if (opts->meta_advice != opts->data_advice)
+		advise_metadata(opts->meta_advice, fs);
+}
+
+/** Check whether an image was formatted with a journal, before it is opened. */
+static bool image_has_journal(const char *path)
+{
+	a1fs_superblock sb;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false; // bdev_open() reports it
+	bool journal = pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == A1FS_MAGIC &&
+	               (sb.features & A1FS_FEATURE_JOURNAL);
+	close(fd);
+	return journal;
+}
+
+/**
+ * Check whether an inode is gone: its last link was removed and no reference keeps it as an
+ * orphan (see inode_refs.h), so it is free or about to be
+ *
+ * NOTE: the caller must hold the inode's lock
+ */
+static bool inode_removed(uint32_t ino, fs_ctx *fs)
+{
+	return get_inode(ino, fs)->links == 0 && !inode_refs_held(&fs->refs, ino);
+}
+
+/** Count an orphan in the superblock (delta 1), or one that is gone (-1), in the running transaction. */
+static void count_orphans(int delta, fs_ctx *fs)
+{
+	journal_dirty(&fs->journal, 0);
+	pthread_mutex_lock(&fs->space_lock);
+	fs->sb->orphans_count += delta;
+	pthread_mutex_unlock(&fs->space_lock);
+}
+
+/**
+ * Free the blocks and the inode of a file or directory whose last link is gone
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param ino	the inode number
+ * @param fs	the file system struct
+ * @return		0 on success; -EAGAIN if the journal transaction is full before all the blocks are
+ * 						freed, see evict_inode()
+ */
+static int free_inode(uint32_t ino, fs_ctx *fs)
+{
+	int res = truncate_inode(ino, 0, fs); // the data of a file, or the blocks of a directory and its index
+	if(res < 0)
+		return res;
+	get_inode(ino, fs)->flags &= ~A1FS_INODE_INDEXED;
+	deallocate_inode(ino, fs);
+	return 0;
+}
+
+/**
+ * Free a removed file or directory that took more than one journal transaction, continuing
+ * where free_inode() stopped, or an orphan once its last reference is gone
+ *
+ * NOTE: the caller must not be in a journal transaction
+ *
+ * @param orphan	true if the inode is counted in sb->orphans_count; it is no longer once it is free
+ */
+static void evict_inode(uint32_t ino, bool orphan, fs_ctx *fs)
+{
+	int res;
+	do{
+		journal_start(&fs->journal);
+		inode_wrlock(fs, ino);
+		res = free_inode(ino, fs);
+		if(res == 0 && orphan)
+			count_orphans(-1, fs);
+		inode_unlock(fs, ino);
+		journal_stop(&fs->journal);
+	} while(res == -EAGAIN);
+}
+
+/**
+ * Free the orphans of an image that was not unmounted cleanly: the inodes that are allocated but
+ * have no links
+ */
+static void free_orphans(fs_ctx *fs)
+{
+	uint32_t per_group = fs->sb->inodes_per_group;
+	for(uint32_t g = 0; g < fs->sb->groups_count; g++){
+		uint8_t *bitmap = group_inode_bitmap(fs, g);
+		long offset = -1;
+		while((offset = bitmap_next_set(bitmap, per_group, offset + 1)) >= 0){
+			uint32_t ino = g * per_group + offset;
+			if(get_inode(ino, fs)->links == 0)
+				evict_inode(ino, false, fs);
+		}
+	}
+	journal_start(&fs->journal);
+	journal_dirty(&fs->journal, 0);
+	fs->sb->orphans_count = 0;
+	journal_stop(&fs->journal);
+}
+
+bool mount_image(a1fs_opts *opts, fs_ctx *fs)
+{
+	// Nothing to initialize if only printing help
+	if (opts->help) return true;
+
+	// The kernel may write a page of a shared mapping back at any time, before the journal has
+	// logged it, so an image with a journal is always read and written through the cache
+	unsigned int cache = opts->cache;
+	if (cache == 0 && image_has_journal(opts->img_path))
+		cache = A1FS_JOURNAL_CACHE;
+	if (!bdev_open(&fs->dev, opts->img_path, (size_t)cache * 1024 * 1024, opts->direct, opts->uring))
+		return false;
+
+	fs->commit_interval = opts->commit;
+	fs->delayed_alloc = opts->delalloc;
+	fs->prefault = opts->prefault;
+	if (!fs_ctx_init(fs)) {
+		bdev_close(&fs->dev);
+		return false;
+	}
+	if (fs->sb->orphans_count > 0)
+		free_orphans(fs);
+	advise_image(opts, fs);
+	return true;
+}
+
+void start_fs_threads(fs_ctx *fs)
+{
+	if (fs->dev.base == NULL)
+		return;
+	if (fs->prefault)
+		advise_metadata(BDEV_POPULATE, fs);
+	if (!journal_start_thread(&fs->journal, fs->commit_interval * 1000))
+		fprintf(stderr, "Failed to start the journal commit thread\n");
+	// dirty data is written back as often as the journal commits
+	if (!bdev_start_thread(&fs->dev, fs->commit_interval * 1000))
+		fprintf(stderr, "Failed to start the writeback thread\n");
+}
+
+void unmount_image(fs_ctx *fs)
+{
+	if (fs->dev.base) {
+		// the kernel drops its references without telling us when it unmounts
+		long orphan;
+		while ((orphan = inode_refs_take_orphan(&fs->refs)) >= 0)
+			evict_inode(orphan, true, fs);
+		delalloc_buf *staged;
+		while ((staged = delalloc_any(&fs->delalloc)) != NULL)
+			allocate_staged(staged->ino, fs);
+		fs_ctx_destroy(fs); // commits the journal, so the image must still be open
+		bdev_close(&fs->dev);
+	}
+}
+
+void stat_fs(struct statvfs *st, fs_ctx *fs)
+{
+	memset(st, 0, sizeof(*st));
+	st->f_bsize   = A1FS_BLOCK_SIZE;
+	st->f_frsize  = A1FS_BLOCK_SIZE;
+	st->f_blocks = fs->sb->blocks_count; // size of file system in fragment size units
+	pthread_mutex_lock(&fs->space_lock);
+	st->f_bfree = fs->sb->free_blocks_count - fs->reserved_blocks;
+	st->f_ffree = fs->sb->free_inodes_count;
+	pthread_mutex_unlock(&fs->space_lock);
+	st->f_bavail = st->f_bfree; // They are the same
+	st->f_files = fs->sb->inodes_count;
+	st->f_favail = st->f_ffree; // They are the same
+	st->f_namemax = A1FS_NAME_MAX;
+}
+
+int stat_inode(uint32_t ino, struct stat *st, fs_ctx *fs)
+{
+	// Now we update the stat struct
+	inode_rdlock(fs, ino);
+	a1fs_inode *final_inode = get_inode(ino, fs);
+	if(inode_removed(ino, fs)){
+		inode_unlock(fs, ino);
+		return -ENOENT; // removed by another thread after we looked it up
+	}
+	st->st_ino = ino;
+	st->st_mode = final_inode->mode;
+	st->st_nlink = final_inode->links;
+	st->st_size = file_size(ino, fs); // includes staged data
+	// the blocks actually allocated: none for an inline file or a hole, and preallocated ones count
+	bool is_tree = final_inode->flags & A1FS_INODE_EXTENT_TREE;
+	uint32_t data_blocks = is_tree ? extent_tree_blocks(final_inode, fs) : inode_blocks(ino, fs);
+	uint32_t extent_blocks = is_tree ? extent_tree_nodes(final_inode, fs) : (final_inode->indirect != 0);
+	st->st_blocks = ((uint64_t)data_blocks + extent_blocks) * A1FS_BLOCK_SIZE / 512;
+	st->st_mtim = final_inode->mtime; 
+	inode_unlock(fs, ino);
+
+	return 0; 
+}
+
+int ref_inode(uint32_t ino, uint32_t *generation, fs_ctx *fs)
+{
+	int res = 0;
+	inode_rdlock(fs, ino);
+	if(inode_removed(ino, fs))
+		res = -ENOENT; // removed by another thread after we looked it up
+	else if(!inode_refs_get(&fs->refs, ino, 1, 0))
+		res = -ENOMEM;
+	else
+		*generation = get_inode(ino, fs)->generation;
+	inode_unlock(fs, ino);
+	return res;
+}
+
+void forget_inode(uint32_t ino, uint64_t nlookup, fs_ctx *fs)
+{
+	if(inode_refs_put(&fs->refs, ino, nlookup, 0))
+		evict_inode(ino, true, fs); // removed while the kernel still knew it
+}
+
+/** Number of entries read_dir() collects under the directory lock at a time. */
+#define READDIR_BATCH 32
+
+/** An entry collected by read_dir(). */
+typedef struct readdir_entry {
+	uint32_t ino;
+	/** Position of the entry within the directory (see dx_iterate_cb). */
+	uint64_t pos;
+	char name[A1FS_NAME_MAX];
+
+} readdir_entry;
+
+/** Arguments that read_dir() passes through dx_iterate() and flat_dir_iterate(). */
+typedef struct readdir_batch {
+	fs_ctx *fs;
+	uint32_t dir_ino;
+	uint32_t count;
+	readdir_entry entries[READDIR_BATCH];
+
+} readdir_batch;
+
+/** Iteration callback that collects entries until the batch is full. */
+static int readdir_collect(const char *name, uint32_t ino, uint8_t file_type, uint64_t pos, void *arg)
+{
+	(void)file_type;// the whole inode is read for the attributes anyway
+	readdir_batch *batch = (readdir_batch *)arg;
+	readdir_entry *entry = &batch->entries[batch->count++];
+	entry->ino = ino;
+	entry->pos = pos;
+	strcpy(entry->name, name);
+	// `ls -l` follows a listing with a getattr() of every entry; it resolves them from the cache
+	dcache_insert(&batch->fs->dcache, batch->dir_ino, name, ino);
+	return batch->count == READDIR_BATCH;
+}
+
+/**
+ * Call cb for the entries of a flat directory at positions >= start, in position order. The
+ * position of an entry is the byte offset of its a1fs_dentry or a1fs_dirent in the directory
+ *
+ * NOTE: the caller must hold the directory's lock
+ *
+ * @return  0 once every entry is visited, otherwise the first non-zero cb result
+ */
+static int flat_dir_iterate(a1fs_inode *dir, uint64_t start, dx_iterate_cb cb, void *arg, fs_ctx *fs){
+	bool compact = fs->sb->features & A1FS_FEATURE_DIRENT;
+	uint32_t dir_ino = get_inode_num(dir, fs);
+	uint32_t blocks = inode_blocks(dir_ino, fs);
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
+	// the blocks before the one that holds start are already listed
+	uint64_t block_pos = start / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE; // position of the first byte of block j
+	for(uint32_t i = start / A1FS_BLOCK_SIZE; i < blocks; i += curr_extent.count){
+		curr_extent.start = map_file_block(dir_ino, i, &curr_extent.count, NULL, fs);
+		for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
+			void *block = bdev_block(&fs->dev, j);
+			int res = 0;
+			if(compact){
+				for(a1fs_dirent *dirent = dirent_next(block, NULL); dirent != NULL && res == 0; dirent = dirent_next(block, dirent)){
+					uint64_t pos = block_pos + ((char *)dirent - (char *)block);
+					if(pos >= start)
+						res = cb(dirent->name, dirent->ino, dirent->file_type, pos, arg);
+				}
+			}
+			else{
+				for(uint32_t k = 0; k < A1FS_BLOCK_SIZE / sizeof(a1fs_dentry) && res == 0; k ++){
+					a1fs_dentry *curr_dentry = (a1fs_dentry *)block + k;
+					uint64_t pos = block_pos + k * sizeof(a1fs_dentry);
+					if(curr_dentry->ino > 0 && pos >= start)
+						res = cb(curr_dentry->name, curr_dentry->ino, A1FS_FT_UNKNOWN, pos, arg);
+				}
+			}
+			if(res != 0)
+				return res;
+			block_pos += A1FS_BLOCK_SIZE;
+		}
+	}
+	return 0;
+}
+
+int read_dir(uint32_t dir_ino, off_t offset, dir_filler filler, void *buf, fs_ctx *fs)
+{
+	struct stat st = {0};
+	st.st_ino = dir_ino;
+	st.st_mode = S_IFDIR;
+	if(offset < 1 && filler(buf, "." , &st, 1) != 0)
+		return 0; // the buffer is full
+	st.st_ino = 0; // the parent is not recorded
+	if(offset < 2 && filler(buf, "..", &st, 2) != 0)
+		return 0;
+
+	readdir_batch *batch = malloc(sizeof(readdir_batch));
+	if(batch == NULL)
+		return -ENOMEM;
+	batch->fs = fs;
+	batch->dir_ino = dir_ino;
+	uint64_t start = offset < 2 ? 0 : offset - 2;
+	int res = 0;
+
+	do{
+		batch->count = 0;
+		inode_rdlock(fs, dir_ino);
+		a1fs_inode *final_inode = get_inode(dir_ino, fs);
+		if(final_inode->links == 0)
+			res = -ENOENT; // removed by another thread after we looked it up
+		else if(final_inode->flags & A1FS_INODE_INDEXED)
+			dx_iterate(final_inode, start, readdir_collect, batch, fs);
+		else
+			flat_dir_iterate(final_inode, start, readdir_collect, batch, fs);
+		inode_unlock(fs, dir_ino);
+
+		for(uint32_t k = 0; k < batch->count; k++){
+			readdir_entry *entry = &batch->entries[k];
+			if(stat_inode(entry->ino, &st, fs) < 0)
+				continue; // removed since we collected it
+			if(filler(buf, entry->name, &st, entry->pos + 3) != 0)
+				goto end; // the buffer is full; the kernel asks for the rest with a new offset
+		}
+		if(batch->count > 0)
+			start = batch->entries[batch->count - 1].pos + 1;
+	}while(batch->count == READDIR_BATCH);
+
+end:
+	free(batch);
+	return res;
+}
+
+/**
+ * Get a pointer to the last block of a flat directory
+ *
+ * @param dir	the inode of the directory, which must have at least one block
+ * @param fs	the file system struct
+ */
+static void *last_dir_block(a1fs_inode *dir, fs_ctx *fs){
+	a1fs_extent *last_extent = get_final_extent(dir, fs);
+	return bdev_block(&fs->dev, last_extent->start + last_extent->count - 1);
+}
+
+/**
+ * Add an entry to one of the blocks a flat directory of a1fs_dirent records already has
+ *
+ * @param dir							the inode of the directory
+ * @param new_dir_dentry	the inode number and name of the entry
+ * @param file_type				the A1FS_FT_* type of the entry
+ * @param fs							the file system struct
+ * @return								true on success; false if no block has room for the name
+ */
+static bool insert_flat_dirent(a1fs_inode *dir, a1fs_dentry *new_dir_dentry, uint8_t file_type, fs_ctx *fs){
+	uint32_t dir_ino = get_inode_num(dir, fs);
+	uint32_t blocks = inode_blocks(dir_ino, fs);
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
+	for(uint32_t i = 0; i < blocks; i += curr_extent.count){
+		curr_extent.start = map_file_block(dir_ino, i, &curr_extent.count, NULL, fs);
+		for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
+			void *block = bdev_block(&fs->dev, j);
+			if(dirent_insert(block, new_dir_dentry->ino, new_dir_dentry->name, file_type)){
+				journal_dirty(&fs->journal, j);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * Put an entry in a free slot (ino 0) a flat directory of a1fs_dentry records has in its size
+ *
+ * @param dir							the inode of the directory
+ * @param new_dir_dentry	the entry
+ * @param fs							the file system struct
+ * @return								true on success; false if every slot is taken
+ */
+static bool insert_flat_dentry(a1fs_inode *dir, a1fs_dentry *new_dir_dentry, fs_ctx *fs){
+	uint32_t dir_ino = get_inode_num(dir, fs);
+	uint32_t blocks = inode_blocks(dir_ino, fs);
+	uint64_t slots = dir->size / sizeof(a1fs_dentry);
+	uint64_t slot = 0;
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
+	for(uint32_t i = 0; i < blocks && slot < slots; i += curr_extent.count){
+		curr_extent.start = map_file_block(dir_ino, i, &curr_extent.count, NULL, fs);
+		for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count && slot < slots; j ++){
+			a1fs_dentry *dentries = bdev_block(&fs->dev, j);
+			for(uint32_t k = 0; k < A1FS_BLOCK_SIZE / sizeof(a1fs_dentry) && slot < slots; k ++, slot ++){
+				if(dentries[k].ino == 0){
+					journal_dirty(&fs->journal, j);
+					memcpy(&dentries[k], new_dir_dentry, sizeof(a1fs_dentry));
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * write the provided dir_entry to the fs under the given target_inode/parent directory
+ *
+ * NOTE: Can assume that parent exists and is a directory, and that the caller holds its write lock
+ *
+ * @param inode_num  			the inode number of the parent
+ * @param new_dir_dentry  the entry we have to add to the parent
+ * @param is_dir 					true iff the new entry is a dir(effects parent inode modification)
+ * @param fs  						file system struct
+ * @return       					0 on success and -error
+ */
+static int add_dir_entry(uint32_t inode_num, a1fs_dentry *new_dir_dentry, bool is_dir, fs_ctx *fs){
+	a1fs_inode *parent_inode = get_inode(inode_num, fs);
+	uint8_t file_type = is_dir ? A1FS_FT_DIR : A1FS_FT_REG;
+	bool compact = fs->sb->features & A1FS_FEATURE_DIRENT;
+	int res;
+
+	// variable length records can go in any block with enough free space, fixed size ones in any
+	// slot a removed entry left
+	if(!(parent_inode->flags & A1FS_INODE_INDEXED) && (compact ?\
+		insert_flat_dirent(parent_inode, new_dir_dentry, file_type, fs) :\
+		insert_flat_dentry(parent_inode, new_dir_dentry, fs)))
+		goto added;
+
+	// a flat directory that is about to need a second block switches to the hashed format
+	if((fs->sb->features & A1FS_FEATURE_DIR_INDEX) && !(parent_inode->flags & A1FS_INODE_INDEXED) &&\
+		parent_inode->size == A1FS_BLOCK_SIZE){
+		res = dx_convert(inode_num, fs);
+		if(res < 0)
+			return res;
+	}
+
+	if(parent_inode->flags & A1FS_INODE_INDEXED){
+		res = dx_add_entry(inode_num, new_dir_dentry, file_type, fs);
+		if(res < 0)
+			return res;
+	}
+	else if(compact){
+		// every block is full, so the entry starts a new one
+		res = truncate_inode(inode_num, parent_inode->size + A1FS_BLOCK_SIZE, fs);
+		if(res < 0)
+			return res;
+		void *block = last_dir_block(parent_inode, fs);
+		journal_dirty(&fs->journal, bdev_block_num(&fs->dev, block));
+		dirent_init_block(block);
+		dirent_insert(block, new_dir_dentry->ino, new_dir_dentry->name, file_type);
+	}
+	else{
+		// otherwise we are going to have allocate another block, maybe another extent and maybe even indirect
+		// block, so we use out truncate method as it does that for us
+		res = truncate_inode(inode_num, parent_inode->size + sizeof(a1fs_dentry), fs);
+		if(res < 0){
+			return res; // we could not allocate space for whatever reason(inode table full, block table full)
+		}
+
+		// since we did truncate, there is space for this dentry
+		a1fs_extent *last_extent = get_final_extent(parent_inode, fs);
+		uint32_t last_block = last_extent->start + last_extent->count - 1; 
+		uint32_t offset_into_last_block = (parent_inode->size - sizeof(a1fs_dentry)) % A1FS_BLOCK_SIZE;
+
+		journal_dirty(&fs->journal, last_block);
+		memcpy((char *)bdev_block(&fs->dev, last_block) + offset_into_last_block, new_dir_dentry, sizeof(a1fs_dentry));
+	}
+
+added:
+	dcache_insert(&fs->dcache, inode_num, new_dir_dentry->name, new_dir_dentry->ino);
+
+	if(is_dir){
+		parent_inode->links += 1; // this should only be done if dentry is a dir 
+	}
+
+	return 0;
+}
+
+/**
+ * Remove the entry with name target_name from a flat directory of a1fs_dirent records. Blocks
+ * left empty at the end of the directory are freed, so an empty directory has size 0
+ *
+ * @param inode_num		the inode number of the parent directory
+ * @param target_name the name of the target file or directory
+ * @param fs					the file system struct
+ * 
+ * @return      	0 on success; -ENOENT if there is no such entry
+ */
+static int remove_flat_dirent(uint32_t inode_num, const char *target_name, fs_ctx *fs){
+	a1fs_inode* inode = get_inode(inode_num, fs);
+	uint32_t blocks = inode_blocks(inode_num, fs);
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
+	for(uint32_t i = 0; i < blocks; i += curr_extent.count){
+		curr_extent.start = map_file_block(inode_num, i, &curr_extent.count, NULL, fs);
+		for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
+			if(dirent_remove(bdev_block(&fs->dev, j), target_name)){
+				journal_dirty(&fs->journal, j);
+				while(inode->size > 0 && dirent_next(last_dir_block(inode, fs), NULL) == NULL)
+					truncate_inode(inode_num, inode->size - A1FS_BLOCK_SIZE, fs); // can't fail when shrinking
+				return 0;
+			}
+		}
+	}
+	return -ENOENT;
+}
+
+/**
+ * Shrink a flat directory of a1fs_dentry records past the free slots at its end
+ *
+ * @param inode_num		the inode number of the directory
+ * @param fs					the file system struct
+ */
+static void trim_flat_dir(uint32_t inode_num, fs_ctx *fs){
+	a1fs_inode* inode = get_inode(inode_num, fs);
+	uint64_t size = inode->size;
+	while(size > 0){
+		long block = get_physical_block(inode, (size - 1) / A1FS_BLOCK_SIZE, fs);
+		a1fs_dentry *last_dentry = (a1fs_dentry *)((char *)bdev_block(&fs->dev, block) + (size - sizeof(a1fs_dentry)) % A1FS_BLOCK_SIZE);
+		if(last_dentry->ino > 0)
+			break;
+		size -= sizeof(a1fs_dentry);
+	}
+	if(size < inode->size)
+		truncate_inode(inode_num, size, fs); // blocks it can't free in this transaction go with the next shrink
+}
+
+/**
+ * Remove the dentry with name target_name from a flat(not indexed) directory. The slot is left
+ * free (ino 0) so that the other entries keep their positions, which a paged readdir() resumes
+ * from; free slots at the end of the directory are given back
+ * 
+ * @param inode_num		the inode number of the parent directory
+ * @param target_name the name of the target file or directory
+ * @param fs					the file system struct
+ * 
+ * @return      	0 on success; -ENOENT if there is no such dentry
+ */
+static int remove_flat_dir_entry(uint32_t inode_num, const char *target_name, fs_ctx *fs){
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
+	a1fs_dentry *curr_dentry; // The current entry we are looking at
+
+	if(fs->sb->features & A1FS_FEATURE_DIRENT)
+		return remove_flat_dirent(inode_num, target_name, fs);
+
+	// Check every block of the directory, one run of contiguous blocks at a time
+	uint32_t blocks = inode_blocks(inode_num, fs);
+	for(uint32_t i = 0; i < blocks; i += curr_extent.count){
+		curr_extent.start = map_file_block(inode_num, i, &curr_extent.count, NULL, fs);
+
+		if(curr_extent.count > 0){
+			// this extent is valid and is not empty
+			for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
+				// Each block can fit a max of 16 dentries. Need to check if any match the target
+				for(int k = 0; k < 16; k ++){
+					curr_dentry = (a1fs_dentry *)bdev_block(&fs->dev, j) + k;
+					
+					if(curr_dentry->ino > 0 && strcmp(target_name, curr_dentry->name) == 0){
+						journal_dirty(&fs->journal, j);
+						curr_dentry->ino = 0; // a free slot, skipped by readdir and lookups
+						trim_flat_dir(inode_num, fs);
+						return 0;
+					}
+
+				}
+
+			}
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Given the parent node number, remove the dentry with name target_name
+ * 
+ * @param inode_num		the inode number of the parent directory
+ * @param target_name the name of the target file or directory
+ * @param path				the absolute path of the target; NULL if the caller did not resolve one
+ * @param is_dir 			true iff the target is a dir and not a file(effects parent inode modification)
+ * @param fs					the file system struct
+ * 
+ * NOTE: we can assume that the target exists and that the caller holds the parent's write lock
+ * @return      	0 
+ */
+static int remove_dir_entry(uint32_t inode_num, const char *target_name, const char *path, bool is_dir, fs_ctx *fs){
+	a1fs_inode* inode = get_inode(inode_num, fs);
+
+	int res;
+	if(inode->flags & A1FS_INODE_INDEXED)
+		res = dx_remove_entry(inode_num, target_name, fs);
+	else
+		res = remove_flat_dir_entry(inode_num, target_name, fs);
+	if(res < 0)
+		return res; // could not find the dentry. This is not possible due to precondition
+
+	// the inode number may be reused, so the cached name and path must go
+	dcache_remove(&fs->dcache, inode_num, target_name);
+	if(path != NULL)
+		dcache_remove_path(&fs->dcache, path);
+
+	if(is_dir){
+		inode->links -= 1; // this should only be done if dentry is a dir 
+	}
+
+	return 0;
+}
+
+long create_inode(uint32_t parent_ino, const char *last_component, mode_t mode, const char *path, fs_ctx *fs)
+{
+	if(strlen(last_component) >= A1FS_NAME_MAX)
+		return -ENAMETOOLONG;
+
+	a1fs_inode *inode = calloc(1, sizeof(a1fs_inode));
+	if(inode == NULL)
+		return -ENOMEM;
+	bool is_dir =  S_ISREG(mode) ? false : true;
+	inode->mode = mode;
+	inode->links = S_ISREG(mode) ? 1 : 2; // default links for a file or directory
+	inode->size = 0;
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+	inode->indirect = 0;
+	inode->num_extents = 0;
+	if(!is_dir && (fs->sb->features & A1FS_FEATURE_INLINE_DATA))
+		inode->flags |= A1FS_INODE_INLINE; // until it grows past A1FS_INLINE_MAX bytes
+
+	a1fs_dentry *new_dir_dentry = calloc(1, sizeof(a1fs_dentry));
+	if(new_dir_dentry == NULL){
+		free(inode);
+		return -ENOMEM;
+	}
+	strcpy(new_dir_dentry->name, last_component);
+
+	long ret = 0;
+	bool retried = false;
+retry:
+	journal_start(&fs->journal);
+	inode_wrlock(fs, parent_ino);
+
+	// the kernel looked the name up before calling us, but another thread may have created the same
+	// name or removed the parent since then
+	if(get_inode(parent_ino, fs)->links == 0){
+		ret = -ENOENT;
+		goto end;
+	}
+	if(find_dir_entry(parent_ino, last_component, fs) >= 0){
+		ret = -EEXIST;
+		goto end;
+	}
+
+	long res = allocate_inode(parent_ino, is_dir, fs); // near the parent, see allocate_inode()
+	if(res < 0){
+		ret = -ENOSPC; // can't allocate an inode as all inodes are allocated
+		goto end;
+	}	
+
+	// the inode must be initialized before the new dentry makes it reachable
+	inode_dirty(fs, res);
+	inode->generation = get_inode(res, fs)->generation + 1; // tells the new file from the old one
+	memcpy(get_inode(res, fs), inode, sizeof(a1fs_inode));
+	new_dir_dentry->ino = res;
+
+	// Modify the parent dir inode links value and add a dir entry
+	if(add_dir_entry(parent_ino, new_dir_dentry, is_dir, fs) < 0){
+		deallocate_inode(res, fs);
+		ret = -ENOSPC; // couldn't allocate a dir_entry
+		goto end;
+	}
+	if(path != NULL)
+		dcache_insert_path(&fs->dcache, path, res, dcache_generation(&fs->dcache)); // add_dir_entry already cached the name
+	ret = res;
+
+end:
+	inode_unlock(fs, parent_ino);
+	journal_stop(&fs->journal);
+	if(ret == -ENOSPC && !retried && commit_freed_blocks(fs)){
+		retried = true; // the new directory block may be one that a transaction just freed
+		goto retry;
+	}
+	free(new_dir_dentry);
+	free(inode);
+	return ret;
+}
+
+/**
+ * Resolve the entry name of a directory, and lock both for writing
+ *
+ * @param parent_ino	the inode number of the directory
+ * @param name				the name of the file or directory
+ * @param ino					receives the inode number of the file or directory
+ * @param fs					the file system struct
+ * 
+ * @return      	0 with both inodes locked; -errno if the entry does not exist(nothing is locked)
+ */
+static int lock_dir_entry(uint32_t parent_ino, const char *name, uint32_t *ino, fs_ctx *fs){
+	long child = lookup_name(parent_ino, name, fs);
+	if(child < 0)
+		return child;
+
+	inode_wrlock_pair(fs, parent_ino, child);
+	// the entry may have been removed (and the inode reused) before we got the locks
+	if(find_dir_entry(parent_ino, name, fs) != child){
+		inode_unlock_pair(fs, parent_ino, child);
+		return -ENOENT;
+	}
+
+	*ino = child;
+	return 0;
+}
+
+int remove_inode(uint32_t parent_ino, const char *name, bool is_dir, const char *path, fs_ctx *fs)
+{
+	uint32_t ino = 0;
+	bool evict = false;
+	journal_start(&fs->journal);
+	int res = lock_dir_entry(parent_ino, name, &ino, fs);
+	if(res < 0){
+		journal_stop(&fs->journal);
+		return res;
+	}
+	a1fs_inode* inode = get_inode(ino, fs);
+
+	if(is_dir != S_ISDIR(inode->mode)){
+		res = is_dir ? -ENOTDIR : -EISDIR;
+		goto end;
+	}
+	if(is_dir && (inode->flags & A1FS_INODE_INDEXED)){
+		if(!dx_is_empty(inode, fs)){
+			res = -ENOTEMPTY;
+			goto end;
+		}
+	}
+	else if(is_dir && inode->size != 0){
+		res = -ENOTEMPTY;
+		goto end;
+	}
+
+	// now we have to remove it from it's parent as a dentry and deallocate the inode
+	res = remove_dir_entry(parent_ino, name, path, is_dir, fs);
+	inode->links = 0; // so that threads that looked it up before now see that it is gone
+	if(inode_refs_orphan(&fs->refs, ino))
+		count_orphans(1, fs); // still open or known to the kernel, freed with its last reference
+	else
+		// freeing a large file can take more transactions, which start once the locks are dropped
+		evict = free_inode(ino, fs) == -EAGAIN;
+
+end:
+	inode_unlock_pair(fs, parent_ino, ino);
+	journal_stop(&fs->journal);
+	if(evict)
+		evict_inode(ino, false, fs);
+	return res;
+}
+
+int set_mtime(uint32_t ino, const struct timespec *mtime, fs_ctx *fs)
+{
+	journal_start(&fs->journal);
+	inode_wrlock(fs, ino);
+	a1fs_inode *file_inode = get_inode(ino, fs);
+
+	if(mtime == NULL || mtime->tv_nsec == UTIME_NOW)
+		clock_gettime(CLOCK_REALTIME, &file_inode->mtime);
+	
+	else if(mtime->tv_nsec != UTIME_OMIT)
+		file_inode->mtime = *mtime;
+	
+	inode_unlock(fs, ino);
+	journal_stop(&fs->journal);
+	return 0;
+}
+
+/**
+ * Record the disk blocks that hold a byte range of a file as dirty data, e.g. the zeros that
+ * extending the file wrote
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param inode_num	the inode number of the file
+ * @param pos				the file offset the range starts at
+ * @param len				the length of the range in bytes
+ * @param fs				the file system struct
+ */
+static void dirty_file_range(uint32_t inode_num, uint64_t pos, uint64_t len, fs_ctx *fs)
+{
+	uint64_t end = pos + len;
+	while(pos < end){
+		uint32_t contig;
+		long block = map_file_block(inode_num, pos / A1FS_BLOCK_SIZE, &contig, NULL, fs);
+		if(block < 0){
+			// nothing to write back for a hole
+			long next = next_data_block(inode_num, pos / A1FS_BLOCK_SIZE, fs);
+			if(next < 0)
+				break;
+			pos = (uint64_t)next * A1FS_BLOCK_SIZE;
+			continue;
+		}
+		uint32_t last = (end - 1) / A1FS_BLOCK_SIZE; // last file block of the range
+		uint32_t count = min(contig, last - pos / A1FS_BLOCK_SIZE + 1);
+		dirty_ranges_add(&fs->dirty_data, inode_num, block, count);
+		pos = (pos / A1FS_BLOCK_SIZE + count) * A1FS_BLOCK_SIZE;
+	}
+}
+
+/**
+ * truncate() and ftruncate() once the file is locked: change the size and record the zeros
+ * written by extending it
+ */
+static int truncate_file(uint32_t file_inode_num, off_t size, fs_ctx *fs)
+{
+	a1fs_inode *inode = get_inode(file_inode_num, fs);
+	if(inode_removed(file_inode_num, fs))
+		return -ENOENT;
+	int res = flush_delalloc(file_inode_num, fs); // staged data gets its blocks before the size changes
+	if(res < 0)
+		return res;
+	uint64_t old_size = inode->size;
+	res = truncate_inode(file_inode_num, size, fs);
+	if(res == 0 && (uint64_t)size > old_size)
+		dirty_file_range(file_inode_num, old_size, size - old_size, fs);
+	return res;
+}
+
+int resize_file(uint32_t ino, off_t size, fs_ctx *fs)
+{
+	int res;
+	bool retried = false;
+	do{
+		journal_start(&fs->journal);
+		inode_wrlock(fs, ino);
+		res = truncate_file(ino, size, fs);
+		inode_unlock(fs, ino);
+		journal_stop(&fs->journal);
+		if(res == -ENOSPC && !retried && commit_freed_blocks(fs)){
+			retried = true; // blocks freed by the last transactions can be used now
+			res = -EAGAIN;
+		}
+	} while(res == -EAGAIN); // the journal transaction is full, the rest goes in the next one
+	return res;
+}
+
+int allocate_file_range(uint32_t ino, int mode, off_t offset, off_t len, fs_ctx *fs)
+{
+	if(mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP; // no punching holes, zeroing or collapsing ranges
+	if(offset < 0 || len <= 0)
+		return -EINVAL;
+	uint64_t end = (uint64_t)offset + len;
+	if(ceil_integer_division64(end, A1FS_BLOCK_SIZE) > UINT32_MAX)
+		return -EFBIG;
+
+	uint32_t file_inode_num = ino;
+	int res;
+	bool retried = false;
+	do{
+		journal_start(&fs->journal);
+		inode_wrlock(fs, file_inode_num);
+		a1fs_inode *inode = get_inode(file_inode_num, fs);
+		if(inode_removed(file_inode_num, fs))
+			res = -ENOENT;
+		else
+			res = flush_delalloc(file_inode_num, fs); // staged data gets its blocks first
+		if(res == 0){
+			// the holes in the range get zeroed blocks; blocks past the end of the file are not zeroed
+			// with FALLOC_FL_KEEP_SIZE, and once the file grows past them they are zeroed like any
+			// other preallocated blocks
+			uint64_t old_size = inode->size;
+			res = allocate_range(file_inode_num, offset, end, mode & FALLOC_FL_KEEP_SIZE, fs);
+			uint64_t from = (uint64_t)offset < old_size ? (uint64_t)offset : old_size;
+			uint64_t to = end < inode->size ? end : inode->size;
+			if(to > from)
+				dirty_file_range(file_inode_num, from, to - from, fs);
+		}
+		inode_unlock(fs, file_inode_num);
+		journal_stop(&fs->journal);
+		if(res == -ENOSPC && !retried && commit_freed_blocks(fs)){
+			retried = true; // blocks freed by the last transactions can be used now
+			res = -EAGAIN;
+		}
+	} while(res == -EAGAIN); // the journal transaction is full, the rest goes in the next one
+	return res;
+}
+
+/**
+ * Ask the kernel to start paging in the part of the file that a sequential reader will
+ * ask for next: up to the end of the extent that holds pos, and at most len bytes
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param inode_num	the inode number of the file
+ * @param pos				the file offset the next read will start at
+ * @param len				the size of the last read
+ * @param cursor		the extent cursor of the open file
+ * @param fs				the file system struct
+ */
+static void prefetch_extent(uint32_t inode_num, uint64_t pos, size_t len, uint32_t *cursor, fs_ctx *fs)
+{
+	uint32_t contig;
+	long block = map_file_block(inode_num, pos / A1FS_BLOCK_SIZE, &contig, cursor, fs);
+	if(block < 0)
+		return;
+	bdev_prefetch(&fs->dev, block, min(contig, ceil_integer_division(len, A1FS_BLOCK_SIZE)));
+}
+
+/**
+ * Receives the pieces of a read from read_range(), in file order
+ *
+ * @param data	the bytes of the piece if they are in memory (inline or staged data); NULL otherwise
+ * @param pos		the offset of the piece in the image if it is on disk; -1 for a hole
+ * @param len		the length of the piece in bytes
+ * @param arg		the argument passed to read_range()
+ * @return			0 to continue; -errno to stop the read
+ */
+typedef int (*read_piece_cb)(const char *data, int64_t pos, size_t len, void *arg);
+
+/**
+ * Split a read into pieces: extents on disk, holes, inline data and staged data. Each extent is
+ * contiguous on disk, so it makes one piece however many blocks of it the read covers
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @return	the number of bytes read (less than size at the end of the file); -errno from cb
+ */
+static long read_range(uint32_t inode_num, a1fs_handle *fh, size_t size, off_t offset, read_piece_cb cb, void *arg, fs_ctx *fs)
+{
+	uint32_t *cursor = fh != NULL ? &fh->extent_cursor : NULL;
+	a1fs_inode* inode = get_inode(inode_num, fs);
+	uint64_t eof = file_size(inode_num, fs);
+	if((uint64_t)offset >= eof)
+		return 0; // read was called beyond the bounds of the file
+	if(offset + size > eof)
+		size = eof - offset; // short read at EOF
+
+	size_t copied = 0;
+	int res = 0;
+	// data staged by delayed allocation comes after the allocated part of the file
+	size_t allocated = (uint64_t)offset >= inode->size ? 0 :
+		offset + size > inode->size ? inode->size - offset : size;
+
+	// a small file is read straight from its inode
+	if(inode->flags & A1FS_INODE_INLINE && allocated > 0){
+		res = cb((char *)inode->extents + offset, -1, allocated, arg);
+		copied = allocated;
+	}
+
+	while(copied < allocated && res == 0){
+		uint64_t pos = offset + copied;
+		uint32_t contig; // blocks left in the extent that holds pos
+		long block = map_file_block(inode_num, pos / A1FS_BLOCK_SIZE, &contig, cursor, fs);
+		if(block < 0){
+			// a hole reads as zeros up to the next allocated block
+			long next = next_data_block(inode_num, pos / A1FS_BLOCK_SIZE, fs);
+			uint64_t hole_bytes = next < 0 ? allocated - copied : (uint64_t)next * A1FS_BLOCK_SIZE - pos;
+			size_t n = hole_bytes < allocated - copied ? hole_bytes : allocated - copied;
+			res = cb(NULL, -1, n, arg);
+			copied += n;
+			continue;
+		}
+
+		uint64_t extent_bytes = (uint64_t)contig * A1FS_BLOCK_SIZE - pos % A1FS_BLOCK_SIZE;
+		size_t n = extent_bytes < allocated - copied ? extent_bytes : allocated - copied;
+		res = cb(NULL, (int64_t)block * A1FS_BLOCK_SIZE + pos % A1FS_BLOCK_SIZE, n, arg);
+		copied += n;
+	}
+	if(res == 0 && copied == allocated && copied < size){
+		delalloc_buf *staged = delalloc_get(&fs->delalloc, inode_num); // eof is past inode->size, so there is one
+		res = cb(staged->data + (offset + copied - staged->start), -1, size - copied, arg);
+		copied = size;
+	}
+	if(res < 0)
+		return res;
+
+	if(fh != NULL){
+		// a streaming reader will want the rest of this extent next, so ask for it to be paged in now
+		// readers sharing one handle race on these; they are only hints, so relaxed atomics do
+		uint32_t sequential = (uint64_t)offset == __atomic_load_n(&fh->next_read, __ATOMIC_RELAXED) ?
+			__atomic_load_n(&fh->sequential_reads, __ATOMIC_RELAXED) + 1 : 0;
+		__atomic_store_n(&fh->sequential_reads, sequential, __ATOMIC_RELAXED);
+		__atomic_store_n(&fh->next_read, offset + copied, __ATOMIC_RELAXED);
+		if(sequential >= 2 && offset + copied < inode->size)
+			prefetch_extent(inode_num, offset + copied, copied, cursor, fs);
+	}
+	return copied; // how much we read
+}
+
+/** Where copy_piece() copies a read to. */
+typedef struct read_dest {
+	char *buf;
+	size_t len;
+	fs_ctx *fs;
+
+} read_dest;
+
+/** read_piece_cb of read_file(): copy the piece into the caller's buffer. */
+static int copy_piece(const char *data, int64_t pos, size_t len, void *arg)
+{
+	read_dest *dest = (read_dest *)arg;
+	if(data != NULL)
+		memcpy(dest->buf + dest->len, data, len);
+	else if(pos < 0)
+		memset(dest->buf + dest->len, 0, len);
+	else{
+		bdev *dev = &dest->fs->dev;
+		uint32_t block = pos / A1FS_BLOCK_SIZE;
+		uint32_t count = ceil_integer_division(pos % A1FS_BLOCK_SIZE + len, A1FS_BLOCK_SIZE);
+		char *blocks = bdev_get(dev, block, count, true);
+		if(blocks == NULL)
+			return -EIO;
+		memcpy(dest->buf + dest->len, blocks + pos % A1FS_BLOCK_SIZE, len);
+		bdev_put(dev, block, count, false);
+	}
+	dest->len += len;
+	return 0;
+}
+
+long read_file(uint32_t inode_num, a1fs_handle *fh, char *buf, size_t size, off_t offset, fs_ctx *fs)
+{
+	read_dest dest = { .buf = buf, .len = 0, .fs = fs };
+	inode_rdlock(fs, inode_num);
+	long res = read_range(inode_num, fh, size, offset, copy_piece, &dest, fs);
+	inode_unlock(fs, inode_num);
+	return res;
+}
+
+/** What add_piece() builds a read into. */
+typedef struct read_bufvec {
+	struct fuse_bufvec *bufv;
+	/** Number of buffers bufv has room for. */
+	size_t capacity;
+	fs_ctx *fs;
+
+} read_bufvec;
+
+/**
+ * read_piece_cb of read_file_buf(): describe the piece with a buffer. A piece on disk becomes
+ * a part of the image file, and joins the previous buffer if it continues it on disk
+ */
+static int add_piece(const char *data, int64_t pos, size_t len, void *arg)
+{
+	read_bufvec *rb = (read_bufvec *)arg;
+	struct fuse_bufvec *bufv = rb->bufv;
+	uint32_t block = 0, count = 0;
+	bool cached = false;
+	if(pos >= 0){
+		block = pos / A1FS_BLOCK_SIZE;
+		count = ceil_integer_division(pos % A1FS_BLOCK_SIZE + len, A1FS_BLOCK_SIZE);
+		// the file has stale contents of blocks that are dirty in the block cache, so those are
+		// copied; so is everything on hugetlbfs, which can't be spliced from
+		cached = rb->fs->dev.hugetlb || bdev_dirty(&rb->fs->dev, block, count);
+	}
+	if(pos >= 0 && !cached && bufv->count > 0){
+		struct fuse_buf *last = &bufv->buf[bufv->count - 1];
+		if((last->flags & FUSE_BUF_IS_FD) && last->pos + (off_t)last->size == pos){
+			last->size += len;
+			return 0;
+		}
+	}
+	if(bufv->count == rb->capacity){
+		bufv = realloc(bufv, sizeof(*bufv) + (rb->capacity * 2 - 1) * sizeof(struct fuse_buf));
+		if(bufv == NULL)
+			return -ENOMEM;
+		rb->bufv = bufv;
+		rb->capacity *= 2;
+	}
+
+	struct fuse_buf *buf = &bufv->buf[bufv->count];
+	memset(buf, 0, sizeof(*buf));
+	buf->size = len;
+	if(cached){
+		buf->fd = -1;
+		buf->mem = malloc(len);
+		if(buf->mem == NULL)
+			return -ENOMEM;
+		char *blocks = bdev_get(&rb->fs->dev, block, count, true);
+		if(blocks == NULL){
+			free(buf->mem);
+			return -EIO;
+		}
+		memcpy(buf->mem, blocks + pos % A1FS_BLOCK_SIZE, len);
+		bdev_put(&rb->fs->dev, block, count, false);
+	}
+	else if(pos >= 0){
+		buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+		buf->fd = rb->fs->dev.fd;
+		buf->pos = pos;
+	}
+	else{
+		// holes, inline and staged data are copied: they are only valid while the file is locked
+		buf->fd = -1;
+		buf->mem = data != NULL ? malloc(len) : calloc(1, len);
+		if(buf->mem == NULL)
+			return -ENOMEM;
+		if(data != NULL)
+			memcpy(buf->mem, data, len);
+	}
+	bufv->count++;
+	return 0;
+}
+
+long read_file_buf(uint32_t inode_num, a1fs_handle *fh, size_t size, off_t offset, struct fuse_bufvec **bufp, fs_ctx *fs)
+{
+	read_bufvec rb = { .bufv = malloc(sizeof(struct fuse_bufvec) + 3 * sizeof(struct fuse_buf)), .capacity = 4, .fs = fs };
+	if(rb.bufv == NULL)
+		return -ENOMEM;
+	*rb.bufv = FUSE_BUFVEC_INIT(0);
+	rb.bufv->count = 0;
+
+	long res = read_range(inode_num, fh, size, offset, add_piece, &rb, fs);
+	if(res < 0){
+		free_file_buf(rb.bufv);
+		return res;
+	}
+	if(rb.bufv->count == 0)
+		rb.bufv->count = 1; // an empty buffer, past the end of the file
+	*bufp = rb.bufv;
+	return res;
+}
+
+void free_file_buf(struct fuse_bufvec *bufv)
+{
+	for(size_t i = 0; i < bufv->count; i++)
+		free(bufv->buf[i].mem);
+	free(bufv);
+}
+
+/**
+ * Speculative preallocation: when a file that is being appended to runs out of allocated blocks,
+ * allocate about as many blocks again as it already has (between A1FS_PREALLOC_MIN and
+ * A1FS_PREALLOC_MAX) past its end, so that a stream of small appends costs one allocation per
+ * many MB instead of one per write. release() frees what was not used.
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param ino   the inode number of the file
+ * @param end   the size of the file after the write
+ * @param fh    the handle the file is written through
+ * @param fs    the file system struct
+ */
+static void preallocate_ahead(uint32_t ino, uint64_t end, a1fs_handle *fh, fs_ctx *fs)
+{
+	uint32_t want = ceil_integer_division64(end, A1FS_BLOCK_SIZE);
+	uint32_t have = inode_blocks(ino, fs);
+	if(have >= want)
+		return; // still inside the last preallocation
+	if(have < ceil_integer_division64(get_inode(ino, fs)->size, A1FS_BLOCK_SIZE))
+		return; // the file ends in a hole, which the write fills by itself
+	if((get_inode(ino, fs)->flags & A1FS_INODE_INLINE) && end <= A1FS_INLINE_MAX)
+		return; // still fits in the inode
+	uint32_t ahead = want < A1FS_PREALLOC_MIN ? A1FS_PREALLOC_MIN :
+		want > A1FS_PREALLOC_MAX ? A1FS_PREALLOC_MAX : want;
+	// the write can still get its own blocks if there is no room for more
+	int res = preallocate_blocks(ino, want + ahead, fs);
+	if(res == 0 || res == -EAGAIN)
+		fh->preallocated = true; // -EAGAIN: some of them, if the journal transaction is full
+}
+
+/**
+ * Copy the data of a write from a fuse_bufvec into the blocks that hold [offset, offset + size)
+ * of a file. A pipe that libfuse spliced the request into is read straight into the image
+ *
+ * NOTE: the caller must hold the inode's write lock, and the range must be allocated
+ *
+ * @return	the number of bytes copied; less than size only if reading src or a block failed
+ */
+static size_t copy_buf_to_file(uint32_t inode_num, struct fuse_bufvec *src, size_t size, uint64_t offset, uint32_t *cursor, fs_ctx *fs)
+{
+	size_t copied = 0; // bytes taken from src
+	size_t done = 0;
+	while(done < size){
+		uint64_t pos = offset + done;
+		uint32_t contig; // blocks left in the extent that holds pos
+		long block = map_file_block(inode_num, pos / A1FS_BLOCK_SIZE, &contig, cursor, fs);
+		if(block < 0)
+			break; // can't happen as long as the range is allocated
+
+		uint64_t extent_bytes = (uint64_t)contig * A1FS_BLOCK_SIZE - pos % A1FS_BLOCK_SIZE;
+		size_t n = extent_bytes < size - done ? extent_bytes : size - done;
+		uint32_t nblocks = ceil_integer_division(pos % A1FS_BLOCK_SIZE + n, A1FS_BLOCK_SIZE);
+		bool whole = pos % A1FS_BLOCK_SIZE == 0 && n % A1FS_BLOCK_SIZE == 0;
+		char *blocks = bdev_get(&fs->dev, block, nblocks, !whole);
+		if(blocks == NULL)
+			break; // reading the blocks in failed
+		char *dst = blocks + pos % A1FS_BLOCK_SIZE;
+		size_t got = 0;
+		if(copied == done){
+			struct fuse_bufvec dst_buf = FUSE_BUFVEC_INIT(n);
+			dst_buf.buf[0].mem = dst;
+			ssize_t res = fuse_buf_copy(&dst_buf, src, 0);
+			got = res < 0 ? 0 : res;
+			copied += got;
+		}
+		// the blocks may be new, so what src could not fill must not keep their old contents
+		memset(dst + got, 0, n - got);
+		bdev_put(&fs->dev, block, nblocks, true);
+		dirty_ranges_add(&fs->dirty_data, inode_num, block, nblocks);
+		done += n;
+	}
+	return copied;
+}
+
+/**
+ * write_data() for as much of a write as the journal transaction has room for
+ *
+ * @param copy				receives the data of src if it had to be read into memory; the caller frees it
+ * @param copy_size	receives the number of bytes in copy
+ * @return			the number of bytes written, fewer than size if the space ran out or the journal
+ * 							transaction is full (see journal_needs_restart()); -errno on error
+ */
+static long write_part(uint32_t inode_num, a1fs_handle *fh, const char *buf, struct fuse_bufvec *src,
+                       size_t size, off_t offset, char **copy, size_t *copy_size, fs_ctx *fs)
+{
+	uint32_t *cursor = fh != NULL ? &fh->extent_cursor : NULL;
+	journal_start(&fs->journal);
+	inode_wrlock(fs, inode_num);
+	a1fs_inode* inode = get_inode(inode_num, fs);
+	if(inode_removed(inode_num, fs)){
+		inode_unlock(fs, inode_num);
+		journal_stop(&fs->journal);
+		return -ENOENT; // removed by another thread after we looked it up
+	}
+
+	// staging and inline data need the data in memory; libfuse would have read it in for write() too
+	if(buf == NULL && ((fs->delayed_alloc && offset + size > inode->size) || (inode->flags & A1FS_INODE_INLINE))){
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = *copy = malloc(size);
+		ssize_t res = *copy == NULL ? -ENOMEM : fuse_buf_copy(&dst, src, 0);
+		if(res < 0){
+			inode_unlock(fs, inode_num);
+			journal_stop(&fs->journal);
+			return res;
+		}
+		buf = *copy;
+		size = *copy_size = res;
+	}
+
+	// with delayed allocation, the part of the write past the allocated end of the file is staged
+	size_t direct = size;
+	if(fs->delayed_alloc && offset + size > inode->size){
+		long res = stage_write(inode_num, buf, size, offset, fs);
+		if(res < 0){
+			inode_unlock(fs, inode_num);
+			journal_stop(&fs->journal);
+			return res;
+		}
+		direct = res;
+	}
+
+	// a file that keeps growing at its end (e.g. a log) gets blocks past the end ahead of time
+	if(fh != NULL)
+		fh->appends = (uint64_t)offset == inode->size ? fh->appends + 1 : 0;
+
+	// allocate all the blocks we need (holes in the range and past the end) before copying anything
+	if(direct > 0){
+			uint64_t old_size = inode->size;
+			if(fh != NULL && fh->appends >= 2 && offset + direct > old_size)
+				preallocate_ahead(inode_num, offset + direct, fh, fs);
+			long res = prepare_write(inode_num, offset, offset + direct, fs);
+			if (res < 0){
+				inode_unlock(fs, inode_num);
+				journal_stop(&fs->journal);
+				return res; // error. prob a ENOSPC error 
+			}
+			if((uint64_t)offset > old_size)
+				dirty_file_range(inode_num, old_size, offset - old_size, fs); // the zeroed part of the gap
+			// out of space for the metadata of a hole, or the journal transaction is full: a short
+			// write. What was staged past the range stays staged and is staged again with the rest
+			if((size_t)res < direct)
+				direct = size = res;
+	}
+
+	long written = size;
+	size_t copied = buf != NULL ? copy_to_file(inode_num, buf, direct, offset, cursor, fs) :
+		copy_buf_to_file(inode_num, src, direct, offset, cursor, fs);
+	if(copied < direct)
+		written = -EIO; // reading the request or a block of the file failed
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+
+	inode_unlock(fs, inode_num);
+	journal_stop(&fs->journal);
+	return written;
+}
+
+/**
+ * write_file() and write_file_buf(): the data comes from buf, or from src if buf is NULL. A write
+ * that allocates more than one journal transaction has room for is done in parts
+ */
+static long write_data(uint32_t inode_num, a1fs_handle *fh, const char *buf, struct fuse_bufvec *src,
+                       size_t size, off_t offset, fs_ctx *fs)
+{
+	char *copy = NULL;
+	size_t copy_size = 0;
+	size_t written = 0;
+	bool retried = false; // blocks freed by the last transactions were made available
+	while(true){
+		long res = write_part(inode_num, fh, buf, src, size - written, offset + written, &copy, &copy_size, fs);
+		if(buf == NULL && copy != NULL){
+			// src was read into memory, the rest of the write comes from there
+			buf = copy;
+			src = NULL;
+			size = written + copy_size;
+		}
+		if(res == -EAGAIN)
+			continue; // staged data took the room of the transaction, see flush_delalloc()
+		if(res == -ENOSPC && !retried && commit_freed_blocks(fs)){
+			retried = true;
+			continue;
+		}
+		if(res < 0){
+			free(copy);
+			return written > 0 ? (long)written : res;
+		}
+		written += res;
+		if(written == size)
+			break;
+		if(!journal_needs_restart(&fs->journal)){
+			// out of space: the rest is written only if a commit makes freed blocks available
+			if(retried || !commit_freed_blocks(fs))
+				break;
+			retried = true;
+		}
+		if(buf != NULL)
+			buf += res;
+	}
+	free(copy);
+	return written;
+}
+
+long write_file(uint32_t inode_num, a1fs_handle *fh, const char *buf, size_t size, off_t offset, fs_ctx *fs)
+{
+	return write_data(inode_num, fh, buf, NULL, size, offset, fs);
+}
+
+long write_file_buf(uint32_t inode_num, a1fs_handle *fh, struct fuse_bufvec *src, off_t offset, fs_ctx *fs)
+{
+	return write_data(inode_num, fh, NULL, src, fuse_buf_size(src), offset, fs);
+}
+
+
+
+int flush_file(uint32_t ino, fs_ctx *fs)
+{
+	int res = allocate_staged(ino, fs);
+	dirty_ranges_sync(&fs->dirty_data, ino);
+	return res;
+}
+
+int sync_file(uint32_t ino, fs_ctx *fs)
+{
+	int res = flush_file(ino, fs);
+	if(res < 0)
+		return res;
+	return journal_commit(&fs->journal);
+}
+
+int open_inode(uint32_t ino, a1fs_handle **fhp, fs_ctx *fs)
+{
+	a1fs_handle *fh = calloc(1, sizeof(a1fs_handle));
+	if(fh == NULL)
+		return -ENOMEM;
+	fh->ino = ino;
+
+	int res = 0;
+	inode_rdlock(fs, ino);
+	if(inode_removed(ino, fs))
+		res = -ENOENT; // removed by another thread after we looked it up
+	else if(!inode_refs_get(&fs->refs, ino, 0, 1))
+		res = -ENOMEM;
+	inode_unlock(fs, ino);
+	if(res < 0){
+		free(fh);
+		return res;
+	}
+	*fhp = fh;
+	return 0;
+}
+
+void release_file(a1fs_handle *fh, fs_ctx *fs)
+{
+	allocate_staged(fh->ino, fs); // normally already done by flush()
+	if(fh->preallocated){
+		// give back the blocks speculatively allocated past the end of the file
+		int res = 0;
+		do{
+			journal_start(&fs->journal);
+			inode_wrlock(fs, fh->ino);
+			if(get_inode(fh->ino, fs)->links > 0)
+				res = trim_preallocation(fh->ino, fs);
+			inode_unlock(fs, fh->ino);
+			journal_stop(&fs->journal);
+		} while(res == -EAGAIN); // the journal transaction is full, the rest goes in the next one
+	}
+	if(inode_refs_put(&fs->refs, fh->ino, 0, 1))
+		evict_inode(fh->ino, true, fs); // removed while it was open
+	free(fh);
+}
+
+int64_t seek_file(uint32_t ino, int64_t offset, bool hole, fs_ctx *fs)
+{
+	if(offset < 0)
+		return -ENXIO;
+	inode_rdlock(fs, ino);
+	int64_t res = seek_data_hole(ino, offset, hole, fs);
+	inode_unlock(fs, ino);
+	return res;
+}
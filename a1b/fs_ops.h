@@ -0,0 +1,215 @@
+/**
+ * File system operations on inode numbers.
+ *
+ * The FUSE callbacks of both front ends are thin wrappers around these:
+ * a1fs.c serves the high-level path API and resolves every path with
+ * path_lookup(), while a1fs_ll.c serves the low-level API, where the kernel
+ * keeps the inode numbers it looked up and passes them with every request.
+ *
+ * Unless noted otherwise an operation takes the journal transaction and the
+ * inode locks it needs, and returns 0 on success or -errno on error like the
+ * FUSE callbacks.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_common.h>
+
+#include "fs_ctx.h"
+#include "handle.h"
+#include "options.h"
+
+
+/**
+ * Receives the entries of read_dir(); same as fuse_fill_dir_t.
+ *
+ * @param buf   the buffer passed to read_dir().
+ * @param name  the name of the entry.
+ * @param st    the attributes of the entry (st_ino is the a1fs inode number;
+ *              0, which is not the number of the parent, for "..").
+ * @param off   the offset to pass to read_dir() to continue after the entry.
+ * @return      non-zero if the buffer is full.
+ */
+typedef int (*dir_filler)(void *buf, const char *name, const struct stat *st, off_t off);
+
+/**
+ * Open the image and initialize the file system context, freeing the orphans
+ * left by a crash. Does nothing if only printing help.
+ *
+ * @return  true on success; false on failure.
+ */
+bool mount_image(a1fs_opts *opts, fs_ctx *fs);
+
+/**
+ * Start the background threads of the file system. Called from the FUSE init()
+ * callback: it runs after FUSE has daemonized (forked), so threads started
+ * before would not survive into the process that serves requests. If the
+ * commit thread can't be started, transactions are still committed when they
+ * grow large and at unmount. This is also where the prefault option faults the
+ * metadata in, since fork() doesn't copy the page tables of a shared mapping.
+ */
+void start_fs_threads(fs_ctx *fs);
+
+/** Free the orphans, allocate staged data, commit the journal and close the image, if it is open. */
+void unmount_image(fs_ctx *fs);
+
+/** Fill in file system statistics (statvfs()). */
+void stat_fs(struct statvfs *st, fs_ctx *fs);
+
+/**
+ * Fill in a struct stat from an inode. st_ino is the a1fs inode number.
+ *
+ * @return  0 on success; -ENOENT if the inode was removed.
+ */
+int stat_inode(uint32_t ino, struct stat *st, fs_ctx *fs);
+
+/**
+ * Take a lookup reference to an inode for the kernel (a1fs_ll), which keeps it
+ * from being freed until forget_inode() drops it, even once it is removed.
+ *
+ * @param generation  receives the generation of the inode, which tells it from
+ *                    earlier files that had the same inode number.
+ * @return            0 on success; -ENOENT if the inode was removed; -ENOMEM.
+ */
+int ref_inode(uint32_t ino, uint32_t *generation, fs_ctx *fs);
+
+/** Drop nlookup lookup references; the last one frees the inode if it was removed. */
+void forget_inode(uint32_t ino, uint64_t nlookup, fs_ctx *fs);
+
+/**
+ * List a directory, starting after the entry that filler() got offset for; 0
+ * to start over. The offset of "." is 1, of ".." 2, and of an entry at
+ * position pos (see dx_iterate_cb) pos + 3. Every entry comes with its
+ * attributes, read from its inode.
+ *
+ * Entries are collected a batch at a time under the directory's read lock;
+ * their inodes are read after it is released, so a writer of the directory
+ * never waits for a whole listing.
+ */
+int read_dir(uint32_t dir_ino, off_t offset, dir_filler filler, void *buf, fs_ctx *fs);
+
+/**
+ * Create a file or directory.
+ *
+ * @param parent_ino  the directory to create it in.
+ * @param name        the name of the new entry.
+ * @param mode        the mode, S_IFREG or S_IFDIR included.
+ * @param path        the absolute path of the new entry, which is cached for
+ *                    path_lookup(); NULL if the caller has no path.
+ * @return            the inode number of the new file or directory; -EEXIST,
+ *                    -ENAMETOOLONG, -ENOMEM or -ENOSPC on error.
+ */
+long create_inode(uint32_t parent_ino, const char *name, mode_t mode, const char *path, fs_ctx *fs);
+
+/**
+ * Remove a file (unlink()) or an empty directory (rmdir()) and free its inode.
+ * An inode that is still open or known to the kernel (see ref_inode()) is
+ * kept as an orphan until its last reference is dropped; the orphans of an
+ * image that was not unmounted cleanly are freed at the next mount.
+ *
+ * @param path  the absolute path of the entry, which is dropped from the
+ *              path cache; NULL if the caller has no path.
+ * @return      0 on success; -ENOENT, -ENOTEMPTY, -ENOTDIR or -EISDIR on error.
+ */
+int remove_inode(uint32_t parent_ino, const char *name, bool is_dir, const char *path, fs_ctx *fs);
+
+/**
+ * Set the modification time of a file or directory.
+ *
+ * @param mtime  the new time; NULL or UTIME_NOW for the current time, and
+ *               UTIME_OMIT to leave it.
+ */
+int set_mtime(uint32_t ino, const struct timespec *mtime, fs_ctx *fs);
+
+/** Change the size of a file (truncate()). A file that grows gets a hole. */
+int resize_file(uint32_t ino, off_t size, fs_ctx *fs);
+
+/**
+ * Allocate the holes in a range of a file (fallocate() modes 0 and
+ * FALLOC_FL_KEEP_SIZE).
+ *
+ * @return  0 on success; -EINVAL, -EFBIG, -ENOSPC or -EOPNOTSUPP on error.
+ */
+int allocate_file_range(uint32_t ino, int mode, off_t offset, off_t len, fs_ctx *fs);
+
+/**
+ * Read from a file (pread()). Holes read as zeros.
+ *
+ * @param fh  the handle the file is read through; NULL if there is none.
+ * @return    the number of bytes read, which is less than size only at the end
+ *            of the file.
+ */
+long read_file(uint32_t ino, a1fs_handle *fh, char *buf, size_t size, off_t offset, fs_ctx *fs);
+
+/**
+ * Read from a file without copying its data: *bufp receives buffers that
+ * point at the image file (fs->dev.fd) for the parts of the range on disk,
+ * so libfuse can splice them to the kernel. Holes, inline and staged data,
+ * and blocks that are dirty in the block cache (see bdev_dirty()) come in
+ * memory buffers.
+ *
+ * NOTE: the caller holds the inode's read lock until the data has been copied
+ * out of the buffers, or the blocks may be freed and reused under the reply
+ * by a concurrent truncate() or unlink(). Only a1fs_ll can: it replies before
+ * it unlocks. The high-level API replies after read_buf() returns, so a1fs
+ * reads with read_file() instead.
+ *
+ * @param bufp  receives the buffers, which free_file_buf() frees.
+ * @return      the number of bytes read; -ENOMEM or -EIO.
+ */
+long read_file_buf(uint32_t ino, a1fs_handle *fh, size_t size, off_t offset, struct fuse_bufvec **bufp, fs_ctx *fs);
+
+/** Free the buffers made by read_file_buf() (libfuse does it for read_buf()). */
+void free_file_buf(struct fuse_bufvec *bufv);
+
+/**
+ * Write to a file (pwrite()), extending it if the write ends past its end.
+ *
+ * @param fh  the handle the file is written through; NULL if there is none.
+ * @return    the number of bytes written; -errno on error.
+ */
+long write_file(uint32_t ino, a1fs_handle *fh, const char *buf, size_t size, off_t offset, fs_ctx *fs);
+
+/**
+ * write_file() with the data in buffers from libfuse. A request that libfuse
+ * spliced into a pipe is read from the pipe straight into the blocks,
+ * without a copy in between.
+ */
+long write_file_buf(uint32_t ino, a1fs_handle *fh, struct fuse_bufvec *src, off_t offset, fs_ctx *fs);
+
+/** Allocate the staged data of a file and write its dirty data back (flush()). */
+int flush_file(uint32_t ino, fs_ctx *fs);
+
+/** flush_file() and commit the journal (fsync()). */
+int sync_file(uint32_t ino, fs_ctx *fs);
+
+/**
+ * Open a file: make a handle for it (see handle.h), which keeps the inode from
+ * being freed until release_file(), even once it is removed.
+ *
+ * @param fhp  receives the handle.
+ * @return     0 on success; -ENOENT if the inode was removed; -ENOMEM.
+ */
+int open_inode(uint32_t ino, a1fs_handle **fhp, fs_ctx *fs);
+
+/**
+ * Release a handle: allocate staged data, trim preallocated blocks and free fh.
+ * The last reference to a removed file frees it.
+ */
+void release_file(a1fs_handle *fh, fs_ctx *fs);
+
+/**
+ * Find the next data (SEEK_DATA) or hole (SEEK_HOLE) of a file at or after
+ * offset.
+ *
+ * @return  the offset; -ENXIO if there is none.
+ */
+int64_t seek_file(uint32_t ino, int64_t offset, bool hole, fs_ctx *fs);
@@ -0,0 +1,29 @@
+/**
+ * Per-open file state.
+ *
+ * open() and create() allocate an a1fs_handle and store it in
+ * fuse_file_info->fh; release() frees it. I/O on an open file then goes
+ * straight to the inode without resolving the path again.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+typedef struct a1fs_handle {
+	/** Inode number of the open file. */
+	uint32_t ino;
+	/** Index of the extent that held the last block translated (see map_file_block()). */
+	uint32_t extent_cursor;
+	/** File offset right after the end of the last read. */
+	uint64_t next_read;
+	/** Number of back to back reads that each started where the previous one ended. */
+	uint32_t sequential_reads;
+	/** Number of back to back writes that each started at the end of the file. */
+	uint32_t appends;
+	/** Whether writes through this handle preallocated blocks past the end of the file. */
+	bool preallocated;
+
+} a1fs_handle;
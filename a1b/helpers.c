@@ -3,7 +3,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -12,6 +11,24 @@
 #include "a1fs.h"
 #include "fs_ctx.h"
 #include "options.h"
+#include "helpers.h"
+#include "bitmap.h"
+#include "dir_entry.h"
+#include "dir_index.h"
+#include "extent_tree.h"
+
+/** Maximum number of bytes staged for one file before its blocks are allocated. */
+#define A1FS_DELALLOC_MAX (8 * 1024 * 1024)
+
+/** Most bytes zero_file_range() zeroes at a time. */
+#define A1FS_ZERO_CHUNK (1024 * 1024)
+
+/**
+ * Journal credits for allocating or freeing one extent: the superblock, a group descriptor and a
+ * bitmap block, the block that holds the extent, and the extent tree nodes a split (or a merge)
+ * adds or frees on every level, with the blocks that record their allocation
+ */
+#define A1FS_EXTENT_CREDITS 32
 
 uint32_t min(uint32_t num1, uint32_t num2){
 		return num1 < num2 ? num1: num2;
@@ -25,6 +42,10 @@ uint32_t ceil_integer_division(uint32_t num1, uint32_t num2){
 	return  num1 % num2 != 0 ? num1 / num2 + 1 : num1 / num2;
 }
 
+uint64_t ceil_integer_division64(uint64_t num1, uint64_t num2){
+	return  num1 % num2 != 0 ? num1 / num2 + 1 : num1 / num2;
+}
+
 /**
  * Given the parent ino, scan the dentries for the the entry  
  * @param inode_num		the inode number of the parent directory
@@ -34,31 +55,43 @@ uint32_t ceil_integer_division(uint32_t num1, uint32_t num2){
  * NOTE:							we can assume that no two dentries have the same name
  * @return      			the inode number of the target dentry or -error(eg ENOtENT ENOTDIR)
  */
-long find_dir_entry(uint32_t inode_num, char *target_name, fs_ctx *fs){
+long find_dir_entry(uint32_t inode_num, const char *target_name, fs_ctx *fs){
 	// We can calculate the number of entries this directory has
-	a1fs_inode* inode = (a1fs_inode *)(fs->image + fs->inode_table.start * A1FS_BLOCK_SIZE + inode_num * sizeof(a1fs_inode));
-	a1fs_extent *curr_extent; 
+	a1fs_inode* inode = get_inode(inode_num, fs);
+	a1fs_extent curr_extent; // a run of blocks that are contiguous on disk
 	a1fs_dentry *curr_dentry; // The current entry we are looking at
 
 	if(S_ISREG(inode->mode))
 		return -ENOTDIR; // can't apply find_dir_entry on a file
 
+	if(inode->flags & A1FS_INODE_INDEXED)
+		return dx_find_entry(inode, target_name, fs);
+
+	if(fs->sb->features & A1FS_FEATURE_DIRENT){
+		// every block is filled with variable length records
+		uint32_t blocks = inode_blocks(inode_num, fs);
+		for(uint32_t i = 0; i < blocks; i += curr_extent.count){
+			curr_extent.start = map_file_block(inode_num, i, &curr_extent.count, NULL, fs);
+			for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
+				a1fs_dirent *dirent = dirent_find(bdev_block(&fs->dev, j), target_name);
+				if(dirent != NULL)
+					return dirent->ino;
+			}
+		}
+		return -ENOENT;
+	}
 
-	// First we check the 10 direct extent blocks then the indirect block 
-	// We are checking 522 which is more than needed
-	for(uint32_t i = 0; i < inode->num_extents; i++){
-		if(i < 10)
-			curr_extent = &inode->extents[i];
-		else
-			curr_extent = (a1fs_extent *) (fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (i - 10) * sizeof(a1fs_extent));
-		// if the count is <= 0 is implies that there is no in use extent in that location
+	// Check every block of the directory, one run of contiguous blocks at a time
+	uint32_t blocks = inode_blocks(inode_num, fs);
+	for(uint32_t i = 0; i < blocks; i += curr_extent.count){
+		curr_extent.start = map_file_block(inode_num, i, &curr_extent.count, NULL, fs);
 
-		if(curr_extent->count > 0){
+		if(curr_extent.count > 0){
 			// this extent is valid and is not empty
-			for (a1fs_blk_t j = curr_extent->start; j < curr_extent->start + curr_extent->count; j ++){
+			for (a1fs_blk_t j = curr_extent.start; j < curr_extent.start + curr_extent.count; j ++){
 				// Each block can fit a max of 16 dentries. Need to check if any match the target
 				for(int k = 0; k < 16; k ++){
-					curr_dentry = (a1fs_dentry *) (fs->image + j * A1FS_BLOCK_SIZE + k * sizeof(a1fs_dentry));
+					curr_dentry = (a1fs_dentry *)bdev_block(&fs->dev, j) + k;
 					
 					if(curr_dentry->ino > 0 && strcmp(target_name, curr_dentry->name) == 0)
 						return curr_dentry->ino; // we have found the target directory
@@ -72,6 +105,28 @@ long find_dir_entry(uint32_t inode_num, char *target_name, fs_ctx *fs){
 }
 
 
+/**
+ * Look up a name in a directory, through the dentry cache
+ *
+ * @param dir_ino	the inode number of the directory
+ * @param name		the name of the entry
+ * @param fs			the file system struct
+ *
+ * @return				the inode number of the entry or -error (eg. ENOENT, ENOTDIR)
+ */
+long lookup_name(uint32_t dir_ino, const char *name, fs_ctx *fs){
+	long child = dcache_lookup(&fs->dcache, dir_ino, name);
+	if(child >= 0)
+		return child;
+	// cache the name while the directory is locked so a concurrent remove can't be missed
+	inode_rdlock(fs, dir_ino);
+	child = find_dir_entry(dir_ino, name, fs);
+	if(child >= 0)
+		dcache_insert(&fs->dcache, dir_ino, name, child);
+	inode_unlock(fs, dir_ino);
+	return child;
+}
+
 /**
  * Return the inode number corresponding to the given path
  * @param path	the absolute path of the file or directory
@@ -84,36 +139,73 @@ long path_lookup(const char *path, fs_ctx *fs){
 	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
 	if(path[0] != '/') {
 		return -ENOTDIR; // there is not refernce to the root node in the path
-  }
-
-	char *path_copy = calloc(strlen(path), sizeof(char));
-  strcpy(path_copy, &path[1]); // we do not include the root dir in our path as we know it exists
-	char *stringp = strsep(&path_copy, "/");
-	long curr_node = 0; // root node
+	}
 
-	while(path_copy != NULL){
-		if(strlen(stringp) >= A1FS_NAME_MAX)
-			return -ENAMETOOLONG; 
+	// most callbacks are for a path we have already resolved
+	uint64_t generation;
+	long curr_node = dcache_lookup_path(&fs->dcache, path, &generation);
+	if(curr_node >= 0)
+		return curr_node;
+
+	char *path_copy = strdup(&path[1]); // we do not include the root dir in our path as we know it exists
+	if(path_copy == NULL)
+		return -ENOMEM;
+	char *rest = path_copy;
+	char *stringp;
+	curr_node = 0; // root node
+
+	while((stringp = strsep(&rest, "/")) != NULL){
+		if(strcmp(stringp, "") == 0)
+			continue; // the path is the root node
+		if(strlen(stringp) >= A1FS_NAME_MAX){
+			curr_node = -ENAMETOOLONG;
+			break;
+		}
 
-		curr_node = find_dir_entry(curr_node, stringp, fs);
-		if (curr_node < 0){
-				return curr_node; // error
+		long child = lookup_name(curr_node, stringp, fs);
+		if(child < 0){
+			curr_node = child; // error
+			break;
 		}
-		stringp = strsep(&path_copy, "/");
+		curr_node = child;
 	}
 
-	// now we are in on the last element of the path
 	free(path_copy);
-  if(strlen(stringp) >= A1FS_NAME_MAX)
-			return -ENAMETOOLONG; 
-	if(strcmp(stringp, "") != 0){
-			curr_node = find_dir_entry(curr_node, stringp, fs);	// the path is not the root node
-	}
-
+	if(curr_node >= 0)
+		dcache_insert_path(&fs->dcache, path, curr_node, generation);
 	return curr_node; // could be an error message or a valid inode number
 }
 
 
+/**
+ * Return the inode with the given inode number
+ * @param inode_num		the inode number
+ * @param fs					the file system struct
+ * 
+ * @return      			pointer to the inode in the inode table
+ */
+a1fs_inode *get_inode(uint32_t inode_num, fs_ctx *fs){
+	a1fs_inode *block = bdev_block(&fs->dev, inode_table_block(fs, inode_num));
+	return block + inode_num % fs->sb->inodes_per_group % (A1FS_BLOCK_SIZE / sizeof(a1fs_inode));
+}
+
+/**
+ * Return the extent at the given index of the inode's extent list
+ *
+ * NOTE: not for an inode with an extent tree (A1FS_INODE_EXTENT_TREE)
+ *
+ * @param inode				the inode of a file or dir
+ * @param index				index of the extent. The first 10 live in the inode, the rest in the indirect block
+ * @param fs					the file system struct
+ * 
+ * @return      			pointer to the extent in the inode or in the indirect block
+ */
+a1fs_extent *get_extent(a1fs_inode *inode, uint32_t index, fs_ctx *fs){
+	if(index < 10)
+		return &inode->extents[index];
+	return (a1fs_extent *)bdev_block(&fs->dev, inode->indirect) + (index - 10);
+}
+
 /**
  * Given the file inode, return the last extent of that inode
  * @param file_inode	the inode of a file or dir
@@ -123,107 +215,461 @@ long path_lookup(const char *path, fs_ctx *fs){
  * @return      			the final extent of the file
  */
 a1fs_extent * get_final_extent(a1fs_inode * file_inode, fs_ctx *fs){
-	a1fs_extent *final_extent;
-	if (file_inode->num_extents <= 10){
-		final_extent = &file_inode->extents[file_inode->num_extents - 1];
+	if(file_inode->flags & A1FS_INODE_EXTENT_TREE)
+		return &extent_tree_last(file_inode, NULL, fs)->extent;
+	return get_extent(file_inode, file_inode->num_extents - 1, fs);
+}
+
+/**
+ * Get the inode number of an inode in the inode table
+ * @param inode	the inode of a file or dir
+ * @param fs		the file system struct
+ * 
+ * @return      the inode number
+ */
+uint32_t get_inode_num(a1fs_inode *inode, fs_ctx *fs){
+	// the inode table of a group is inside the group
+	uint32_t block = bdev_block_num(&fs->dev, inode);
+	uint32_t group = block / fs->sb->blocks_per_group;
+	uint32_t per_block = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+	uint32_t in_block = (uintptr_t)inode % A1FS_BLOCK_SIZE / sizeof(a1fs_inode); // blocks are block aligned in memory
+	return group * fs->sb->inodes_per_group + (block - fs->group_descs[group].inode_table) * per_block + in_block;
+}
+
+/**
+ * Fill an extent map slot with the extents of an inode, which must not have an extent tree
+ *
+ * NOTE: the caller holds map->lock
+ */
+static void build_extent_map(extent_map *map, uint32_t ino, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	map->blocks[0] = 0;
+	for(uint32_t i = 0; i < inode->num_extents; i++)
+		map->blocks[i + 1] = map->blocks[i] + get_extent(inode, i, fs)->count;
+	map->num_extents = inode->num_extents;
+	map->ino = ino;
+	map->valid = true;
+}
+
+/**
+ * Bring the cached extent map of an inode (if any) up to date after its last extent
+ * grew or shrank, or an extent was added at or removed from the end
+ *
+ * NOTE: the caller must hold the inode's write lock
+ *
+ * @param inode	the inode whose extents changed
+ * @param fs		the file system struct
+ */
+void update_extent_map(a1fs_inode *inode, fs_ctx *fs){
+	uint32_t ino = get_inode_num(inode, fs);
+	extent_map *map = &fs->extent_maps[ino % A1FS_EXTENT_MAPS];
+
+	pthread_mutex_lock(&map->lock);
+	if(map->valid && map->ino == ino){
+		uint32_t n = inode->num_extents;
+		if(n + 1 >= map->num_extents && n <= map->num_extents + 1){
+			// only the last extent can differ from what the map already has
+			map->num_extents = n;
+			if(n > 0)
+				map->blocks[n] = map->blocks[n - 1] + get_extent(inode, n - 1, fs)->count;
+		}
+		else
+			map->valid = false;
 	}
+	pthread_mutex_unlock(&map->lock);
+}
 
-	else
-		final_extent = (a1fs_extent *) (fs->image + file_inode->indirect * sizeof(A1FS_BLOCK_SIZE) + \
-			(file_inode->num_extents - 10 - 1) * sizeof(a1fs_extent));
-	
-	return final_extent;
+/**
+ * Drop the cached extent map of an inode, e.g. because the inode was freed
+ * @param ino		the inode number
+ * @param fs		the file system struct
+ */
+void invalidate_extent_map(uint32_t ino, fs_ctx *fs){
+	extent_map *map = &fs->extent_maps[ino % A1FS_EXTENT_MAPS];
+	pthread_mutex_lock(&map->lock);
+	if(map->ino == ino)
+		map->valid = false;
+	pthread_mutex_unlock(&map->lock);
 }
 
 /**
- * Flip the bit to either 0 or 1 for the given bitmap at the given location
+ * Translate a block number within a file to a block number on the disk with a binary search
+ * of the inode's (cached) extent map
+ *
+ * NOTE: the caller must hold the inode's lock
  *
- * @param bitmap_block	the data block number of the bitmap
- * @param offset				the number of bits into the bitmap	
- * @param fs						the file system struct
- * @param set						false to flip to 0 and true to flip bit to 1		
+ * @param ino					the inode number of a file or dir
+ * @param file_block	the number of blocks into the file
+ * @param contig			if not NULL, receives the number of blocks from file_block to the
+ * 										end of its extent, i.e. that are contiguous on disk
+ * @param cursor			if not NULL, the index of the extent to try before searching (e.g. the one
+ * 										used by the previous call on the same open file); receives the extent used
+ * @param fs					the file system struct
+ * 
+ * @return      			the data block number or -1 if the block is in a hole (or the file is not that long)
+ */
+long map_file_block(uint32_t ino, uint32_t file_block, uint32_t *contig, uint32_t *cursor, fs_ctx *fs){
+	extent_map *map = &fs->extent_maps[ino % A1FS_EXTENT_MAPS];
+	long block = -1;
+
+	// an extent tree is searched as it is; it can have more extents than a map holds
+	a1fs_inode *inode = get_inode(ino, fs);
+	if(inode->flags & A1FS_INODE_EXTENT_TREE)
+		return extent_tree_lookup(inode, file_block, contig, fs);
+
+	pthread_mutex_lock(&map->lock);
+	if(!map->valid || map->ino != ino)
+		build_extent_map(map, ino, fs);
+
+	if(file_block < map->blocks[map->num_extents]){
+		uint32_t lo = 0;
+		uint32_t hi = map->num_extents;
+		// sequential I/O stays in the same extent or moves on to the next one
+		if(cursor != NULL && *cursor < map->num_extents && map->blocks[*cursor] <= file_block){
+			if(file_block < map->blocks[*cursor + 1])
+				lo = hi = *cursor;
+			else if(*cursor + 1 < map->num_extents && file_block < map->blocks[*cursor + 2])
+				lo = hi = *cursor + 1;
+			else
+				lo = *cursor;
+		}
+		// find the last extent that starts at or before file_block
+		while(hi - lo > 1){
+			uint32_t mid = lo + (hi - lo) / 2;
+			if(map->blocks[mid] <= file_block)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		block = get_extent(get_inode(ino, fs), lo, fs)->start + (file_block - map->blocks[lo]);
+		if(contig != NULL)
+			*contig = map->blocks[lo + 1] - file_block;
+		if(cursor != NULL)
+			*cursor = lo;
+	}
+	pthread_mutex_unlock(&map->lock);
+
+	return block;
+}
+
+/**
+ * Translate a block number within a file to a block number on the disk
+ * @param inode				the inode of a file or dir
+ * @param file_block	the number of blocks into the file
+ * @param fs					the file system struct
  * 
+ * @return      			the data block number or -1 if the file is not that long
  */
+long get_physical_block(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs){
+	return map_file_block(get_inode_num(inode, fs), file_block, NULL, NULL, fs);
+}
 
-void set_bitmap(uint32_t bitmap_block, uint32_t offset, fs_ctx *fs , bool set){
-	int x = 0;
-	if(set)
-		x = 1;
+/**
+ * Get the block of the group table that holds the descriptor of a group
+ */
+static a1fs_blk_t group_desc_block(uint32_t group, fs_ctx *fs){
+	return fs->sb->group_table.start + group * sizeof(a1fs_group_desc) / A1FS_BLOCK_SIZE;
+}
 
-	if(x == 0){
-		if(bitmap_block == fs->sb->block_bitmap.start)
-			fs->sb->free_blocks_count += 1;
-		else
-			fs->sb->free_inodes_count += 1;
+/**
+ * Get the allocation group of an inode, where its data blocks are allocated first
+ */
+static uint32_t inode_group(a1fs_inode *inode, fs_ctx *fs){
+	return get_inode_num(inode, fs) / fs->sb->inodes_per_group;
+}
+
+/**
+ * Mark the blocks [start, start + count) as used or free in the block bitmap of their group and
+ * update the free counts once for the whole range. Newly allocated data blocks are not zeroed
+ *
+ * NOTE: the caller must hold the lock of the group, and the range must not leave the group
+ * NOTE: every block in the range must currently be in the opposite state, and blocks marked as
+ *       used must have been reserved with reserve_blocks() (the reservation is used up)
+ *
+ * @param start		the first block of the range
+ * @param count		the number of blocks
+ * @param fs			the file system struct
+ * @param used		true to mark the blocks as used and false to mark them as free
+ */
+void set_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs, bool used){
+	uint32_t group = start / fs->sb->blocks_per_group;
+	uint32_t offset = start - group * fs->sb->blocks_per_group; // bit in the group's bitmap
+	a1fs_group_desc *desc = &fs->group_descs[group];
+	uint8_t *bitmap = group_block_bitmap(fs, group);
+
+	// the superblock, the group descriptor and every bitmap block the range touches
+	journal_dirty(&fs->journal, 0);
+	journal_dirty(&fs->journal, group_desc_block(group, fs));
+	for(uint32_t b = offset / (A1FS_BLOCK_SIZE * 8); b <= (offset + count - 1) / (A1FS_BLOCK_SIZE * 8); b++)
+		journal_dirty(&fs->journal, desc->block_bitmap + b);
+
+	// keep the free extent index of the group in sync with its bitmap
+	if(used){
+		bitmap_set_range(bitmap, offset, count);
+		desc->free_blocks_count -= count;
+		free_extents_remove(&fs->groups[group].free_blocks, offset, count);
+	}
+	// with a journal, freed blocks stay out of the index (and can't be reserved) until the
+	// transaction that frees them is checkpointed, see journal_free(); the bitmap and the counts
+	// change now so that the transaction frees them on disk
+	bool held = false;
+	if(!used){
+		bitmap_clear_range(bitmap, offset, count);
+		desc->free_blocks_count += count;
+		held = journal_free(&fs->journal, start, count);
+		if(!held){
+			bdev_release(&fs->dev, start, count);
+			free_extents_add(&fs->groups[group].free_blocks, offset, count);
+		}
 	}
 
+	pthread_mutex_lock(&fs->space_lock);
+	if(used){
+		fs->sb->free_blocks_count -= count;
+		fs->reserved_blocks -= count;
+	}
 	else{
-		if(bitmap_block == fs->sb->block_bitmap.start)
-			fs->sb->free_blocks_count -= 1;
-		else
-			fs->sb->free_inodes_count -= 1;
+		fs->sb->free_blocks_count += count;
+		if(held)
+			fs->freed_blocks += count;
 	}
-	
-	// modify a byte and the re write
-	char byte = ((char *)fs->image)[bitmap_block * A1FS_BLOCK_SIZE + offset / 8];
-	if(set)
-		byte = byte | (1 << offset % 8); // flip bit to 1
-	else
-		byte = byte & ~(1 << offset % 8); // flip bit to 0
+	pthread_mutex_unlock(&fs->space_lock);
 
+	// newly allocated blocks are not zeroed here; truncate_inode() zeroes them once they become part
+	// of a file, so blocks preallocated past the end of a file cost nothing until they are used
+}
 
-	memcpy(fs->image + bitmap_block * A1FS_BLOCK_SIZE + offset / 8, &byte, sizeof(char));
-	memcpy(fs->image, fs->sb, sizeof(a1fs_superblock));
+/**
+ * Free the blocks [start, start + count), which must all be in one group
+ *
+ * @param start		the first block of the range
+ * @param count		the number of blocks
+ * @param fs			the file system struct
+ */
+void free_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs){
+	alloc_group *group = &fs->groups[start / fs->sb->blocks_per_group];
+	pthread_mutex_lock(&group->lock);
+	set_block_range(start, count, fs, false);
+	pthread_mutex_unlock(&group->lock);
+}
 
-	if(set && fs->sb->block_bitmap.start == bitmap_block){
-		memset(fs->image + offset * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);// nulls the entire block
+/**
+ * Mark an inode as used or free in the inode bitmap of its group and update the free counts
+ *
+ * NOTE: the caller must hold the lock of the inode's group
+ */
+static void set_inode_used(uint32_t inode_num, fs_ctx *fs, bool used){
+	uint32_t group = inode_num / fs->sb->inodes_per_group;
+	uint32_t offset = inode_num % fs->sb->inodes_per_group;
+	a1fs_group_desc *desc = &fs->group_descs[group];
+	uint8_t *bitmap = group_inode_bitmap(fs, group);
+
+	journal_dirty(&fs->journal, 0);
+	journal_dirty(&fs->journal, group_desc_block(group, fs));
+	journal_dirty(&fs->journal, desc->inode_bitmap + offset / (A1FS_BLOCK_SIZE * 8));
+
+	if(used){
+		bitmap_set_range(bitmap, offset, 1);
+		desc->free_inodes_count -= 1;
+	}
+	else{
+		bitmap_clear_range(bitmap, offset, 1);
+		desc->free_inodes_count += 1;
 	}
-	
-} 
+
+	pthread_mutex_lock(&fs->space_lock);
+	if(used)
+		fs->sb->free_inodes_count -= 1;
+	else
+		fs->sb->free_inodes_count += 1;
+	pthread_mutex_unlock(&fs->space_lock);
+}
 
 
 /**
- * find the first unused inode in the inode table
- * @param fs  file system struct
+ * Pick the group for a new directory: the next one (in turn) with at least the average number of
+ * free inodes and free blocks, so that directories (and the files that go in them) spread over
+ * the groups and threads working in different directories allocate from different groups
+ */
+static uint32_t directory_group(fs_ctx *fs){
+	uint32_t groups = fs->sb->groups_count;
+	pthread_mutex_lock(&fs->space_lock);
+	uint32_t avg_inodes = fs->sb->free_inodes_count / groups;
+	uint32_t avg_blocks = fs->sb->free_blocks_count / groups;
+	uint32_t start = fs->dir_group_hint++ % groups;
+	pthread_mutex_unlock(&fs->space_lock);
+
+	for(uint32_t i = 0; i < groups; i++){
+		uint32_t g = (start + i) % groups;
+		pthread_mutex_lock(&fs->groups[g].lock);
+		a1fs_group_desc *desc = &fs->group_descs[g];
+		bool roomy = desc->free_inodes_count > 0 && desc->free_inodes_count >= avg_inodes &&
+			desc->free_blocks_count >= avg_blocks;
+		pthread_mutex_unlock(&fs->groups[g].lock);
+		if(roomy)
+			return g;
+	}
+	return start; // allocate_inode() looks for a free inode from there
+}
+
+/**
+ * find an unused inode and mark it as used. A file goes in the group of its parent directory when
+ * it has a free inode, so that the inodes of a directory (and, through them, their data) stay close
+ * together. A directory goes in a group with plenty of free space instead
+ * @param parent  the inode number of the parent directory
+ * @param is_dir  true if the inode is for a directory
+ * @param fs      file system struct
  * @return       the inode allocated on success;
  *               -1 on error
  */
 
-long allocate_inode(fs_ctx *fs){
-	// loop over the inode bitmap
-	uint32_t curr_block = 0;
-	char curr_byte;
-	while(curr_block < fs->sb->inodes_count){
-		curr_byte = ((char *)fs->image)[fs->sb->inode_bitmap.start * A1FS_BLOCK_SIZE + (curr_block) / 8];
-		for(int i = curr_block % 8; i < 8 && curr_block < fs->sb->inodes_count; i++){ 
-			// loop from last_block + 1 to 7 as that represents the 8 bits in byte
-			if((curr_byte & (1 << i)) == 0){
-				return curr_block;
-			}
-			curr_block += 1;
+long allocate_inode(uint32_t parent, bool is_dir, fs_ctx *fs){
+	uint32_t ipg = fs->sb->inodes_per_group;
+	uint32_t home = is_dir ? directory_group(fs) : parent / ipg;
+
+	for(uint32_t i = 0; i < fs->sb->groups_count; i++){
+		uint32_t g = (home + i) % fs->sb->groups_count;
+		alloc_group *group = &fs->groups[g];
+		pthread_mutex_lock(&group->lock);
+		long offset = -1;
+		if(fs->group_descs[g].free_inodes_count > 0){
+			offset = bitmap_find_zero(group_inode_bitmap(fs, g), ipg, group->inode_hint);
+		}
+		if(offset >= 0){
+			// reserve it before dropping the lock so no other thread gets the same inode
+			set_inode_used(g * ipg + offset, fs, true);
+			group->inode_hint = offset + 1; // the next search starts where this one ended
 		}
+		pthread_mutex_unlock(&group->lock);
+		if(offset >= 0)
+			return g * ipg + offset;
+	}
+
+	return -1; // every inode table is full
+}
+
+/**
+ * Mark an inode as unused in the inode bitmap
+ * @param inode_num  the inode to free
+ * @param fs  			 file system struct
+ */
+void deallocate_inode(uint32_t inode_num, fs_ctx *fs){
+	alloc_group *group = &fs->groups[inode_num / fs->sb->inodes_per_group];
+	pthread_mutex_lock(&group->lock);
+	set_inode_used(inode_num, fs, false);
+	pthread_mutex_unlock(&group->lock);
+	invalidate_extent_map(inode_num, fs); // the inode number will be reused
+	dirty_ranges_forget(&fs->dirty_data, inode_num);
+
+	// data staged for the file is dropped with it
+	delalloc_buf *staged = delalloc_get(&fs->delalloc, inode_num);
+	if(staged != NULL){
+		unreserve_blocks(staged->reserved, fs);
+		delalloc_remove(&fs->delalloc, staged);
 	}
+}
 
-	return -1; // inode table is full
+/**
+ * Allocate one block for an inode's metadata (its indirect block or an extent tree node), in the
+ * group of the inode if it has a free block
+ *
+ * NOTE: the block must have been reserved with reserve_blocks()
+ *
+ * @param inode  the inode the block is for
+ * @param fs     file system struct
+ * @return       the block on success;
+ *               -1 if there are no free blocks
+ */
+long allocate_block(a1fs_inode *inode, fs_ctx *fs){
+	uint32_t home = inode_group(inode, fs);
+	for(uint32_t i = 0; i < fs->sb->groups_count; i++){
+		uint32_t g = (home + i) % fs->sb->groups_count;
+		alloc_group *group = &fs->groups[g];
+		pthread_mutex_lock(&group->lock);
+		long block = free_extents_first(&group->free_blocks);
+		if(block >= 0){
+			block += g * fs->sb->blocks_per_group;
+			set_block_range(block, 1, fs, true);
+		}
+		pthread_mutex_unlock(&group->lock);
+		if(block >= 0)
+			return block;
+	}
+	return -1;
 }
 
-long allocate_block(fs_ctx *fs){
-	// loop over the inode bitmap
-	uint32_t curr_block = 0;
-	char curr_byte;
-	while(curr_block < fs->sb->blocks_count){
-		curr_byte = ((char *)fs->image)[fs->sb->block_bitmap.start * A1FS_BLOCK_SIZE + (curr_block) / 8];
-		for(int i = curr_block % 8; i < 8 && curr_block < fs->sb->blocks_count; i++){ 
-			// loop from last_block + 1 to 7 as that represents the 8 bits in byte
-			if((curr_byte & (1 << i)) == 0){
-				return curr_block;
+/**
+ * Allocate the blocks for a new extent of at most max_blocks blocks. The first group (starting
+ * with the group of the inode) that has a free run of max_blocks blocks gives its shortest such
+ * run; if no group has one, the first group with free blocks gives its longest run
+ *
+ * NOTE: the blocks must have been reserved with reserve_blocks()
+ *
+ * @param max_blocks	the maximum number of blocks we want the extent to have
+ * @param home				the group to search first
+ * @param extent			receives the blocks allocated
+ * @param fs					the file system struct
+ * @return						true on success; false if there are no free blocks
+ */
+static bool claim_extent(uint32_t max_blocks, uint32_t home, a1fs_extent *extent, fs_ctx *fs){
+	for(int pass = 0; pass < 2; pass++){
+		for(uint32_t i = 0; i < fs->sb->groups_count; i++){
+			uint32_t g = (home + i) % fs->sb->groups_count;
+			alloc_group *group = &fs->groups[g];
+			pthread_mutex_lock(&group->lock);
+			bool found = free_extents_best_fit(&group->free_blocks, max_blocks, extent) &&
+				(pass == 1 || extent->count >= max_blocks);
+			if(found){
+				extent->start += g * fs->sb->blocks_per_group;
+				set_block_range(extent->start, extent->count, fs, true);
 			}
-			curr_block += 1;
+			pthread_mutex_unlock(&group->lock);
+			if(found)
+				return true;
 		}
 	}
+	return false;
+}
 
-	return -1;
+/**
+ * Allocate the free run (if any) that starts right after an extent, up to max_blocks blocks
+ *
+ * NOTE: the blocks must have been reserved with reserve_blocks()
+ *
+ * @return	the number of blocks allocated
+ */
+static uint32_t claim_after(const a1fs_extent *extent, uint32_t max_blocks, fs_ctx *fs){
+	uint32_t next_block = extent->start + extent->count;
+	uint32_t count = 0;
+	if(next_block < fs->sb->blocks_count){
+		// a run at the start of the next group is never free, its bitmaps are there
+		uint32_t g = next_block / fs->sb->blocks_per_group;
+		pthread_mutex_lock(&fs->groups[g].lock);
+		count = free_extents_at(&fs->groups[g].free_blocks, next_block - g * fs->sb->blocks_per_group, max_blocks);
+		if(count > 0)
+			set_block_range(next_block, count, fs, true);
+		pthread_mutex_unlock(&fs->groups[g].lock);
+	}
+	return count;
+}
 
+/**
+ * Record the block that holds an extent of an inode as modified, if it is the indirect block
+ * or an extent tree leaf (the inode itself is recorded when it is write locked)
+ *
+ * @param inode	the inode of a file or dir
+ * @param index	index of the extent; the last one for an inode with an extent tree
+ * @param fs		the file system struct
+ */
+static void dirty_extent(a1fs_inode *inode, uint32_t index, fs_ctx *fs){
+	if(inode->flags & A1FS_INODE_EXTENT_TREE){
+		a1fs_blk_t leaf;
+		extent_tree_last(inode, &leaf, fs);
+		if(leaf != 0)
+			journal_dirty(&fs->journal, leaf);
+	}
+	else if(index >= 10)
+		journal_dirty(&fs->journal, inode->indirect);
 }
 
 /**
@@ -237,46 +683,41 @@ long allocate_block(fs_ctx *fs){
  * @return      		the number of blocks that extent was extended by
  */
 uint32_t extend_extent(uint32_t max_blocks, a1fs_inode *inode, a1fs_extent *extent, fs_ctx *fs){
-	uint32_t last_block = extent->start + extent->count - 1;
-	char byte;
-	int cont = 0; 
-
-	// find the byte in the bitmap where we start looking for contig blocks
-	uint32_t curr_block = last_block + 1;
-	uint32_t count = 0;
-
-	while(curr_block < fs->sb->blocks_count && cont == 0){
-		byte = ((char *)fs->image)[fs->sb->block_bitmap.start * A1FS_BLOCK_SIZE + (curr_block) / 8];
-		for(int i = curr_block % 8; i < 8 && curr_block < fs->sb->blocks_count; i++){ 
-			// loop from curr_block to 7 as that represents the 8 bits in byte
-			if((byte & (1 << i)) == 0){
-				set_bitmap(fs->sb->block_bitmap.start, curr_block, fs, true);
-				count += 1;
-			}
-			else{
-				cont = 1; // we have found the maximum blocks by which we can extend our inode
-				break;
-			}
-			if(count >= max_blocks){
-				cont = 1; // so that we can break out of the outer while loop
-				break; // we don't care about if we can find a longer extent
-			}
-
-			curr_block += 1;
-		}
-	}
+	uint32_t count = claim_after(extent, max_blocks, fs);
 
 	// Update the extent a re-write it back to the disk
 	extent->count += count;
-	if (inode->num_extents <= 10)
-		inode->extents[inode->num_extents - 1] = *extent; // don't need to write to disk
-	else
-		memcpy(fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (inode->num_extents - 10 - 1)\
-			 * sizeof(a1fs_extent), extent, sizeof(a1fs_extent));
+	*get_final_extent(inode, fs) = *extent;
+	dirty_extent(inode, inode->num_extents - 1, fs);
+	update_extent_map(inode, fs);
 
 	return count;
 }
 
+/**
+ * Allocate an extent of at most max_blocks blocks (and at least 1) that starts file_block blocks
+ * into a file with an extent tree. The range must be a hole
+ *
+ * NOTE: the data blocks must have been reserved with reserve_blocks(). The tree nodes the extent
+ *       may need are reserved here
+ *
+ * @return	the number of blocks that newly allocated extent has; -ENOSPC if it can't be allocated
+ */
+static long allocate_extent_at(uint32_t max_blocks, a1fs_inode *inode, uint32_t file_block, fs_ctx *fs){
+	uint32_t meta = extent_tree_insert_blocks(inode, file_block, fs);
+	if(meta > 0 && !reserve_metadata(inode, meta, fs))
+		return -ENOSPC;
+
+	a1fs_extent extent;
+	if(!claim_extent(max_blocks, inode_group(inode, fs), &extent, fs)){
+		unreserve_blocks(meta, fs);
+		return -ENOSPC;
+	}
+	extent_tree_insert(inode, file_block, &extent, fs);
+	inode->num_extents += 1;
+	return extent.count;
+}
+
 /**
  * Allocate one extent with maximum max_blocks number of blocks and at least 1 block
  *
@@ -284,112 +725,698 @@ uint32_t extend_extent(uint32_t max_blocks, a1fs_inode *inode, a1fs_extent *exte
  * @param inode				the file's inode which we want to extend
  * @param fs					the file system struct
  * 
- * NOTE: 							Assumed that there is at least one free block
+ * NOTE: 							the data blocks must have been reserved with reserve_blocks(). The indirect
+ * 										block or extent tree nodes the extent may need are reserved here
  * @return      			the number of blocks that newly allocated extent has
  * 										-error if extent can't be allocated
  */
 long allocate_extent(uint32_t max_blocks, a1fs_inode *inode, fs_ctx *fs){
-	/* find starting block for the longest contigious number of blocks(but <= max_blocks)
-	and call extend_block */ 
-	char curr_byte; // the current byte in the bitmap we are looking at
+	if(inode->flags & A1FS_INODE_EXTENT_TREE){
+		// the new extent starts where the last one ends
+		a1fs_et_leaf *last = extent_tree_last(inode, NULL, fs);
+		return allocate_extent_at(max_blocks, inode, last == NULL ? 0 : last->file_block + last->extent.count, fs);
+	}
+
+	uint32_t meta = inode->num_extents == 10 && inode->indirect == 0; // an 11th extent also needs the indirect block
+	if(meta > 0 && !reserve_metadata(inode, meta, fs))
+		return -ENOSPC;
+
+	/* use the shortest free run that fits max_blocks, or the longest free run if none does */
 	a1fs_extent longest_extent;
-	a1fs_extent curr_extent;
+	if(!claim_extent(max_blocks, inode_group(inode, fs), &longest_extent, fs)){
+		unreserve_blocks(meta, fs);
+		return -ENOSPC;
+	}
+	
+	inode->num_extents += 1; // we have created a new extent
 
-	longest_extent.start = 0;
-	longest_extent.count = 0;
-	curr_extent.start = 0;
-	curr_extent.count = 0;
+	if(meta > 0){
+		long res = allocate_block(inode, fs);
+		if(res < 0){
+			inode->num_extents -= 1;
+			free_block_range(longest_extent.start, longest_extent.count, fs);
+			unreserve_blocks(meta, fs);
+			return -ENOSPC;
+		}
+		inode->indirect = res;
+	}
 
-	int cont = 0; //continue variable
-	uint32_t curr_block = 0;
-	while(curr_block < fs->sb->blocks_count && cont == 0){
-		curr_byte = ((char *)fs->image)[fs->sb->block_bitmap.start * A1FS_BLOCK_SIZE + curr_block / 8];
-		for(int i = 0; i < 8 && curr_block < fs->sb->blocks_count; i++){
+	*get_final_extent(inode, fs) = longest_extent;
+	dirty_extent(inode, inode->num_extents - 1, fs);
+	update_extent_map(inode, fs);
 
-			if((curr_byte & (1 << i)) == 0) 
-				curr_extent.count += 1;
 
-			else{
-				if(curr_extent.count > longest_extent.count){
-					longest_extent = curr_extent;
-				}
-				curr_extent.count = 0;
-				curr_extent.start = curr_block + 1;
-			}
+	return longest_extent.count;
+}
 
-			if(curr_extent.count >= max_blocks){
-				longest_extent = curr_extent;
-				cont = 1; // so that we can break out of the outer while loop
-				break; // we don't care about if we can find a longer extent
-			}
 
-			curr_block += 1;
+/**
+ * deallocate up to max_blocks blocks from the end of the last extent of the file in one
+ * step and update the inode or indirect block with the modified extent. Also modify the super block 
+ * @param max_blocks	the maximum number of blocks to deallocate
+ * @param inode  			the inode of which whose last blocks we want to deallocate
+ * @param fs		 			the file system struct
+ * @return       			the number of blocks deallocated
+ */
+uint32_t deallocate_blocks(uint32_t max_blocks, a1fs_inode *inode, fs_ctx *fs){
+	a1fs_extent *final_extent = get_final_extent(inode, fs);
+	uint32_t count = min(max_blocks, final_extent->count);
+
+	// neeed to update block bitmap to show that the tail of the extent is now free to use
+	free_block_range(final_extent->start + final_extent->count - count, count, fs);
+	final_extent->count -= count;
+	dirty_extent(inode, inode->num_extents - 1, fs);
+
+	// final_extent points into the inode, the indirect block or a tree leaf so it is already updated
+	if(final_extent->count == 0){
+		if(inode->flags & A1FS_INODE_EXTENT_TREE)
+			extent_tree_remove_last(inode, fs);
+		inode->num_extents -= 1; // this could mean that the indirect block is not in use which we take care in truncate
+	}
+	update_extent_map(inode, fs);
+
+	return count;
+}
+
+/**
+ * Get the number of blocks of a file up to the end of its last extent. That is the number of
+ * blocks allocated to it unless it has holes, and can be more than its size needs if blocks
+ * were preallocated past the end of the file
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param ino		the inode number
+ * @param fs		the file system struct
+ */
+uint32_t inode_blocks(uint32_t ino, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	if(inode->flags & A1FS_INODE_EXTENT_TREE){
+		a1fs_et_leaf *last = extent_tree_last(inode, NULL, fs);
+		return last == NULL ? 0 : last->file_block + last->extent.count;
+	}
+
+	extent_map *map = &fs->extent_maps[ino % A1FS_EXTENT_MAPS];
+	pthread_mutex_lock(&map->lock);
+	if(!map->valid || map->ino != ino)
+		build_extent_map(map, ino, fs);
+	uint32_t blocks = map->blocks[map->num_extents];
+	pthread_mutex_unlock(&map->lock);
+	return blocks;
+}
+
+/**
+ * Find the first block of a file at or after file block b that is allocated, i.e. the end of
+ * the hole at b
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param ino		the inode number
+ * @param b			the block within the file
+ * @param fs		the file system struct
+ * @return			the block within the file; -1 if no block past b is allocated
+ */
+long next_data_block(uint32_t ino, uint32_t b, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	if(inode->flags & A1FS_INODE_INLINE)
+		return -1;
+	if(inode->flags & A1FS_INODE_EXTENT_TREE)
+		return extent_tree_next(inode, b, fs);
+	// the extents of an inode without a tree cover the start of the file
+	return b < inode_blocks(ino, fs) ? (long)b : -1;
+}
+
+/**
+ * Count the blocks in [first, last) of a file that are not allocated
+ *
+ * NOTE: the caller must hold the inode's lock
+ */
+static uint32_t unallocated_blocks(uint32_t ino, uint32_t first, uint32_t last, fs_ctx *fs){
+	uint32_t count = 0;
+	for(uint32_t b = first; b < last; ){
+		uint32_t contig;
+		if(map_file_block(ino, b, &contig, NULL, fs) >= 0){
+			b += contig;
+			continue;
 		}
+		long next = next_data_block(ino, b, fs);
+		uint32_t end = next < 0 || next > last ? last : next;
+		count += end - b;
+		b = end;
 	}
+	return count;
+}
 
-	
+/**
+ * Free the indirect block of an inode once its extents fit in the inode
+ */
+static void release_indirect(a1fs_inode *inode, fs_ctx *fs){
+	if(inode->num_extents <= 10 && inode->indirect != 0){
+		free_block_range(inode->indirect, 1, fs);
+		inode->indirect = 0; // not using an indirect block
+	}
+}
 
-	// we should now loop over extent blocks and allocate them
-	curr_block = longest_extent.start;
-	while(curr_block < longest_extent.start + longest_extent.count){
-		curr_byte = ((char *)fs->image)[fs->sb->block_bitmap.start * A1FS_BLOCK_SIZE + (curr_block) / 8];
-		for(int i = curr_block % 8; i < 8 && curr_block < longest_extent.start + longest_extent.count; i++){ 
-			// don't even need if statement because we verified it above
-			if((curr_byte & (1 << i)) == 0){
-				set_bitmap(fs->sb->block_bitmap.start, curr_block, fs, true);
-				curr_block += 1;
-			}
+/**
+ * Free the last count blocks of an inode, and its indirect block once the extents fit in the inode
+ */
+static void free_tail_blocks(a1fs_inode *inode, uint32_t count, fs_ctx *fs){
+	while(count > 0)
+		count -= deallocate_blocks(count, inode, fs);
+	release_indirect(inode, fs);
+}
+
+/**
+ * Free the blocks of a file from file block want on. Unlike free_tail_blocks(), holes in the
+ * range are skipped. Freeing stops early if the journal transaction has no room for the next
+ * extent; the file is consistent at that point, and calling this again continues
+ *
+ * @param ino		the inode number of the file
+ * @param want	the number of blocks to keep
+ * @param fs		the file system struct
+ * @return			true if all of them are freed; false if it stopped early
+ */
+static bool free_blocks_past(uint32_t ino, uint32_t want, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	while(inode->num_extents > 0){
+		uint32_t end = inode_blocks(ino, fs);
+		uint32_t count = get_final_extent(inode, fs)->count;
+		if(end <= want)
+			break;
+		if(!journal_extend(&fs->journal, A1FS_EXTENT_CREDITS))
+			return false;
+		// the last extent starts at end - count, and only its part past want goes
+		deallocate_blocks(end - count >= want ? count : end - want, inode, fs);
+	}
+	release_indirect(inode, fs);
+	return true;
+}
+
+/**
+ * Allocate count more blocks at the end of an inode, extending its last extent first. The blocks
+ * are not zeroed. Allocating stops early if the journal transaction has no room for the next
+ * extent
+ *
+ * NOTE: the caller must have reserved the count blocks with reserve_blocks(). What is not used
+ *       is given back, so the reservation is gone when this returns, even on error
+ *
+ * @return	the number of blocks allocated, count unless it stopped early; -ENOSPC if there is not
+ * 					enough space, in which case nothing is allocated
+ */
+static long add_tail_blocks(a1fs_inode *inode, uint32_t count, fs_ctx *fs){
+	uint32_t added = 0;
+	if(!journal_extend(&fs->journal, A1FS_EXTENT_CREDITS)){
+		unreserve_blocks(count, fs);
+		return 0;
+	}
+	if(inode->num_extents > 0)
+		added = extend_extent(count, inode, get_final_extent(inode, fs), fs);
+	while(added < count){
+		if(added > 0 && !journal_extend(&fs->journal, A1FS_EXTENT_CREDITS)){
+			unreserve_blocks(count - added, fs);
+			return added;
+		}
+		long res = 0;
+		// an inode that runs out of room for extents moves them to an extent tree
+		if(!(inode->flags & A1FS_INODE_EXTENT_TREE) && inode->num_extents == A1FS_MAX_EXTENTS)
+			res = extent_tree_convert(inode, fs);
+		if(res == 0)
+			res = allocate_extent(count - added, inode, fs);
+		if(res < 0){
+			free_tail_blocks(inode, added, fs); // undo
+			unreserve_blocks(count - added, fs);
+			return res;
 		}
+		added += res;
 	}
-	
-	// can assume there is a free block to for a indirect block if needed
-	inode->num_extents += 1; // we have created a new extent
+	return added;
+}
 
-	if(inode->num_extents == 10){
-		long res = allocate_block(fs); // can assume this is will return a valid block due to check we made in truncate
-		inode->indirect = res;
-		set_bitmap(fs->sb->block_bitmap.start, res, fs, true);
+/**
+ * Zero the allocated bytes in [from, to) of a file; holes already read as zeros
+ *
+ * NOTE: the caller must hold the inode's write lock
+ */
+static void zero_file_range(uint32_t ino, uint64_t from, uint64_t to, fs_ctx *fs){
+	while(from < to){
+		uint32_t contig;
+		long block = map_file_block(ino, from / A1FS_BLOCK_SIZE, &contig, NULL, fs);
+		if(block < 0){
+			long next = next_data_block(ino, from / A1FS_BLOCK_SIZE, fs);
+			if(next < 0)
+				break;
+			from = (uint64_t)next * A1FS_BLOCK_SIZE;
+			continue;
+		}
+		uint64_t extent_bytes = (uint64_t)contig * A1FS_BLOCK_SIZE - from % A1FS_BLOCK_SIZE;
+		uint64_t n = extent_bytes < to - from ? extent_bytes : to - from;
+		if(n > A1FS_ZERO_CHUNK)
+			n = A1FS_ZERO_CHUNK; // don't pin a huge range in the block cache at once
+		uint32_t nblocks = ceil_integer_division(from % A1FS_BLOCK_SIZE + n, A1FS_BLOCK_SIZE);
+		bool whole = from % A1FS_BLOCK_SIZE == 0 && n % A1FS_BLOCK_SIZE == 0;
+		char *data = bdev_get(&fs->dev, block, nblocks, !whole);
+		if(data == NULL)
+			break; // reported by bdev_get()
+		memset(data + from % A1FS_BLOCK_SIZE, 0, n);
+		bdev_put(&fs->dev, block, nblocks, true);
+		from += n;
 	}
+}
 
+/**
+ * Move the data of an inline file (see A1FS_INODE_INLINE) into a data block, so that the file
+ * can grow past A1FS_INLINE_MAX bytes. An empty file just stops being inline
+ *
+ * NOTE: the caller must hold the inode's write lock and, for a non-empty file, have reserved a block
+ *       with reserve_blocks(); the reservation is gone when this returns, even on error
+ *
+ * @param ino	the inode number of the file
+ * @param fs	the file system struct
+ * @return		0 on success; -ENOSPC if there is no free block, or -EAGAIN if the journal transaction
+ * 						has no room for it, in which case the file stays inline
+ */
+static int move_inline_data(uint32_t ino, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	char data[A1FS_INLINE_MAX];
+	memcpy(data, inode->extents, inode->size);
+	memset(inode->extents, 0, sizeof(inode->extents)); // it holds extents from now on
+	inode->flags &= ~A1FS_INODE_INLINE;
+	if(inode->size == 0)
+		return 0;
+
+	long res = add_tail_blocks(inode, 1, fs);
+	if(res <= 0){
+		memcpy(inode->extents, data, inode->size);
+		inode->flags |= A1FS_INODE_INLINE;
+		return res < 0 ? res : -EAGAIN;
+	}
+	copy_to_file(ino, data, inode->size, 0, NULL, fs);
+	return 0;
+}
 
-	if (inode->num_extents <= 10)
-		inode->extents[inode->num_extents - 1] = longest_extent; // don't need to write to disk
-	else
-		memcpy(fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (inode->num_extents - 10 - 1)\
-			 * sizeof(a1fs_extent), &longest_extent, sizeof(a1fs_extent));
+/**
+ * Allocate blocks at the end of a file until it has want blocks. The data of an inline file is
+ * moved into its first block
+ *
+ * NOTE: the caller must hold the inode's write lock and have reserved the blocks the file is short
+ *       of with reserve_blocks(); the reservation is gone when this returns, even on error
+ *
+ * @return	0 on success; -ENOSPC if there is not enough space, in which case nothing is allocated;
+ * 					-EAGAIN if the journal transaction has no room for all the blocks, in which case
+ * 					some may be allocated and calling this again in a new transaction continues
+ */
+static int grow_inode(uint32_t ino, uint32_t want, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	if(inode->flags & A1FS_INODE_INLINE){
+		uint32_t moved = inode->size > 0; // blocks of the reservation move_inline_data() takes
+		int res = move_inline_data(ino, fs);
+		if(res < 0){
+			unreserve_blocks(want - moved, fs);
+			return res;
+		}
+	}
+	uint32_t have = inode_blocks(ino, fs);
+	if(want <= have)
+		return 0;
+	long res = add_tail_blocks(inode, want - have, fs);
+	if(res < 0)
+		return res;
+	return (uint32_t)res < want - have ? -EAGAIN : 0;
+}
 
+/**
+ * Give back release reserved blocks and reserve needed blocks in one step, so that no other
+ * allocation can take the blocks in between
+ *
+ * @return	true on success; false if fewer than needed unreserved blocks are free, in which case
+ * 					the release blocks are still given back
+ */
+static bool exchange_reservation(uint32_t release, uint32_t needed, fs_ctx *fs){
+	pthread_mutex_lock(&fs->space_lock);
+	fs->reserved_blocks -= release;
+	bool ok = fs->sb->free_blocks_count - fs->reserved_blocks - fs->freed_blocks >= needed;
+	if(ok)
+		fs->reserved_blocks += needed;
+	pthread_mutex_unlock(&fs->space_lock);
+	return ok;
+}
 
-	return longest_extent.count;
+/**
+ * Allocate the blocks [b, b + n) of a file, which are a hole. A hole that is not at the end of
+ * the file takes an extent tree, which records where each extent starts
+ *
+ * NOTE: the caller must hold the inode's write lock and have reserved the n blocks with
+ *       reserve_blocks(); what is not used is given back
+ *
+ * @return	the number of blocks allocated from b on; fewer than n if there is not enough space,
+ * 					or if the journal transaction has no room for the next extent
+ */
+static uint32_t fill_hole(uint32_t ino, uint32_t b, uint32_t n, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	if(b == inode_blocks(ino, fs)){
+		long res = add_tail_blocks(inode, n, fs);
+		return res < 0 ? 0 : res;
+	}
+	if(!journal_extend(&fs->journal, A1FS_EXTENT_CREDITS)){
+		unreserve_blocks(n, fs);
+		return 0;
+	}
+	if(!(inode->flags & A1FS_INODE_EXTENT_TREE) && extent_tree_convert(inode, fs) < 0){
+		unreserve_blocks(n, fs);
+		return 0;
+	}
+
+	// the extent before the hole grows into it when the blocks after it are free
+	uint32_t done = 0;
+	a1fs_blk_t leaf_block;
+	a1fs_et_leaf *prev = b > 0 ? extent_tree_find(inode, b - 1, &leaf_block, fs) : NULL;
+	if(prev != NULL && prev->file_block + prev->extent.count == b){
+		done = claim_after(&prev->extent, n, fs);
+		prev->extent.count += done;
+		if(leaf_block != 0)
+			journal_dirty(&fs->journal, leaf_block);
+	}
+	while(done < n){
+		if(done > 0 && !journal_extend(&fs->journal, A1FS_EXTENT_CREDITS))
+			break;
+		long res = allocate_extent_at(n - done, inode, b + done, fs);
+		if(res < 0)
+			break;
+		done += res;
+	}
+	unreserve_blocks(n - done, fs);
+	return done;
 }
 
+/**
+ * Allocate the holes of a file in [from, to) (and the block of an inline file that grows past
+ * A1FS_INLINE_MAX) so that the range can be written, and zero what becomes part of the file
+ * without being written
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param ino			the inode number of the file
+ * @param from		the start of the range in bytes
+ * @param to			the end of the range in bytes
+ * @param write		whether the caller writes [from, to) next, so it does not need zeroing
+ * @param grow		whether the file grows to to bytes if it is smaller
+ * @param release	the number of blocks reserved for the file that are given back
+ * @param fs			the file system struct
+ * @return				the number of bytes from from on that are allocated, which is less than
+ * 								to - from if some metadata block could not be allocated or the journal
+ * 								transaction is full (see journal_needs_restart()); -ENOSPC or -EAGAIN if
+ * 								none is
+ */
+static long fill_range(uint32_t ino, uint64_t from, uint64_t to, bool write, bool grow, uint32_t release, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	uint64_t old_size = inode->size;
+	if((inode->flags & A1FS_INODE_INLINE) && to <= A1FS_INLINE_MAX){
+		unreserve_blocks(release, fs);
+		if(grow && to > old_size){
+			memset((char *)inode->extents + old_size, 0, to - old_size);
+			inode->size = to;
+		}
+		return to - from;
+	}
+
+	// all the blocks are reserved upfront, so running out of space is found before any is allocated
+	uint32_t first = from / A1FS_BLOCK_SIZE;
+	uint32_t last = ceil_integer_division64(to, A1FS_BLOCK_SIZE);
+	uint32_t moved = (inode->flags & A1FS_INODE_INLINE) && old_size > 0; // its data needs a block
+	// the data goes into block 0, which unallocated_blocks() already counts if the range starts there
+	uint32_t reserved = unallocated_blocks(ino, first, last, fs) + (moved && first > 0);
+	if((release > 0 || reserved > 0) && !exchange_reservation(release, reserved, fs))
+		return -ENOSPC; // blocks reserved for staged data don't count
+	if(inode->flags & A1FS_INODE_INLINE){
+		reserved -= moved;
+		int res = move_inline_data(ino, fs);
+		if(res < 0){
+			unreserve_blocks(reserved, fs);
+			return res;
+		}
+	}
+	// allocated bytes between the end of the file and the range may hold stale data
+	uint64_t new_size = grow && to > old_size ? to : old_size;
+	if(grow && !write)
+		zero_file_range(ino, old_size, to, fs);
+	else if(grow && from > old_size)
+		zero_file_range(ino, old_size, from, fs);
+
+	uint64_t end = to;
+	for(uint32_t b = first; b < last; ){
+		uint32_t contig;
+		if(map_file_block(ino, b, &contig, NULL, fs) >= 0){
+			b += contig;
+			continue;
+		}
+		long next = next_data_block(ino, b, fs);
+		uint32_t n = next < 0 || next > last ? last - b : next - b;
+		reserved -= n;
+		uint32_t got = fill_hole(ino, b, n, fs);
+
+		// new blocks are zeroed where they are part of the file but not written
+		uint64_t start = (uint64_t)b * A1FS_BLOCK_SIZE;
+		uint64_t stop = (uint64_t)(b + got) * A1FS_BLOCK_SIZE;
+		if(stop > new_size)
+			stop = new_size;
+		if(write){
+			if(start < from)
+				zero_file_range(ino, start, from < stop ? from : stop, fs);
+			if(to < stop)
+				zero_file_range(ino, to > start ? to : start, stop, fs);
+		}
+		else if(start < stop)
+			zero_file_range(ino, start, stop, fs);
+
+		b += got;
+		if(got < n){
+			unreserve_blocks(reserved, fs);
+			end = (uint64_t)b * A1FS_BLOCK_SIZE;
+			if(end <= from)
+				return journal_needs_restart(&fs->journal) ? -EAGAIN : -ENOSPC;
+			if(end > to)
+				end = to;
+			break;
+		}
+	}
+
+	if(grow && end > old_size)
+		inode->size = end;
+	return end - from;
+}
 
 /**
- * deallocate the last block of the file and update the inode or indirect block
- * with the modified extent. Also modify the super block 
- * @param inode  the inode of which whose last block we want to deallocate
- * @param fs		 the file system struct
- * @return       the number of blocks deallocated
+ * Allocate what a write to [from, to) of a file needs, zero what it leaves uncovered in new
+ * blocks, and grow the file to to bytes if it is smaller
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param ino		the inode number of the file
+ * @param from	the file offset of the write
+ * @param to		the end of the write
+ * @param fs		the file system struct
+ * @return			the number of bytes of the write that can be copied (fewer if the space ran out
+ * 							or the journal transaction is full, see fill_range()); -ENOSPC or -EAGAIN if
+ * 							none can
  */
-int deallocate_block( a1fs_inode *inode, fs_ctx *fs){
-	a1fs_extent *final_extent = get_final_extent(inode, fs);
-	uint32_t final_block = final_extent->start + final_extent->count - 1; // the last block
+long prepare_write(uint32_t ino, uint64_t from, uint64_t to, fs_ctx *fs){
+	return fill_range(ino, from, to, true, true, 0, fs);
+}
 
-	// neeed to update block bitmap to show that final_block is now free to use
-	set_bitmap(fs->sb->block_bitmap.start, final_block, fs, false);
-	final_extent->count -= 1;
+/**
+ * Allocate the holes of a file in [from, to) with zeroed blocks (fallocate)
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param ino				the inode number of the file
+ * @param from			the start of the range in bytes
+ * @param to				the end of the range in bytes
+ * @param keep_size	whether the size stays the same when the range goes past the end of the file
+ * @param fs				the file system struct
+ * @return					0 on success; -ENOSPC if not enough free space; -EAGAIN if the journal
+ * 									transaction is full, in which case calling this again in a new transaction
+ * 									allocates the rest
+ */
+int allocate_range(uint32_t ino, uint64_t from, uint64_t to, bool keep_size, fs_ctx *fs){
+	long res = fill_range(ino, from, to, false, !keep_size, 0, fs);
+	if(res < 0)
+		return res;
+	if((uint64_t)res < to - from)
+		return journal_needs_restart(&fs->journal) ? -EAGAIN : -ENOSPC;
+	return 0;
+}
 
-	// have to rewrite this extent back to the disk
-	if (inode->num_extents <= 10)
-		inode->extents[inode->num_extents - 1] = *final_extent; // we will write inode to disk in truncate
-	else
-		memcpy(fs->image + inode->indirect * sizeof(A1FS_BLOCK_SIZE) + (inode->num_extents - 10 - 1)\
-			 * sizeof(a1fs_extent), final_extent, sizeof(a1fs_extent));
+/**
+ * Change the size of a file or directory. Supports both extending and shrinking.
+ * A file that is extended gets a hole at the end, which reads as zeros; blocks
+ * are allocated as it is written. A directory gets its blocks right away.
+ *
+ * NOTE: the caller must hold the inode's write lock
+ *
+ * @param file_inode_num	the inode number of the file or directory
+ * @param size						new size in bytes
+ * @param fs							the file system struct
+ * 
+ * @return      				0 on success; -ENOSPC if not enough free space; -EAGAIN if the journal
+ * 											transaction is full, in which case the file is consistent (a file that
+ * 											shrinks already has its new size, with blocks past the end like
+ * 											preallocated ones) and calling this again in a new transaction continues
+ */
+int truncate_inode(uint32_t file_inode_num, uint64_t size, fs_ctx *fs){
+	a1fs_inode *file_inode = get_inode(file_inode_num, fs);
+	if((file_inode->flags & A1FS_INODE_INLINE) && size <= A1FS_INLINE_MAX){
+		if(size == file_inode->size)
+			return 0; // the size is not modified
+		if(size > file_inode->size)
+			memset((char *)file_inode->extents + file_inode->size, 0, size - file_inode->size);
+		file_inode->size = size;
+		clock_gettime(CLOCK_REALTIME, &file_inode->mtime);
+		return 0;
+	}
 
-	if(final_extent->count == 0){
-		inode->num_extents -= 1; // this could mean that the indirect block is not in use which we take care in truncate
+	uint32_t have = inode_blocks(file_inode_num, fs); // none for an inline file
+	uint32_t want = ceil_integer_division64(size, A1FS_BLOCK_SIZE);
+
+	if(size <= file_inode->size){
+		// the size goes first, so that freeing the blocks can take more than one transaction
+		if(size < file_inode->size){
+			file_inode->size = size;
+			clock_gettime(CLOCK_REALTIME, &file_inode->mtime);
+		}
+		// blocks past the new end, preallocated ones included, are freed
+		if(want < have && !free_blocks_past(file_inode_num, want, fs))
+			return -EAGAIN;
+		return 0;
 	}
+	
+	// have to extend the file size
+	else{
+		// the data of an inline file still needs its block, and a directory needs all of them
+		uint32_t needed = (file_inode->flags & A1FS_INODE_INLINE) && file_inode->size > 0;
+		if(S_ISDIR(file_inode->mode))
+			needed = want > have ? want - have : 0;
+		if(needed > 0 && !reserve_blocks(needed, fs))
+			return -ENOSPC;
+		int res = S_ISDIR(file_inode->mode) ? grow_inode(file_inode_num, want, fs) : 0;
+		if(res == 0 && (file_inode->flags & A1FS_INODE_INLINE))
+			res = move_inline_data(file_inode_num, fs);
+		if(res < 0)
+			return res; // not enough data blocks (or extents) for the new size of file
+		// the bytes that become part of the file, and the rest of its last block, can hold stale
+		// data (of a shrunk file, or preallocated blocks that were never written)
+		zero_file_range(file_inode_num, file_inode->size, (uint64_t)want * A1FS_BLOCK_SIZE, fs);
+	}
+	
+	file_inode->size = size;
+	clock_gettime(CLOCK_REALTIME, &file_inode->mtime); // update the modification time
+
+	return 0;
+}
+
+/**
+ * Set aside free blocks for data that will be allocated later, so that allocating it can't fail
+ * for lack of space
+ *
+ * @param count	the number of blocks
+ * @param fs		the file system struct
+ * 
+ * @return      true on success; false if fewer than count unreserved blocks are free
+ */
+bool reserve_blocks(uint32_t count, fs_ctx *fs){
+	return exchange_reservation(0, count, fs);
+}
+
+/**
+ * Give back blocks reserved with reserve_blocks() that will not be allocated
+ *
+ * @param count	the number of blocks
+ * @param fs		the file system struct
+ */
+void unreserve_blocks(uint32_t count, fs_ctx *fs){
+	if(count == 0)
+		return;
+	pthread_mutex_lock(&fs->space_lock);
+	fs->reserved_blocks -= count;
+	pthread_mutex_unlock(&fs->space_lock);
+}
 
-	return 1; // just deallocated 1 block
+/**
+ * After an operation ran out of space: if blocks freed by journal transactions are waiting for a
+ * commit before they can be reused (see set_block_range()), commit now so that a retry finds them
+ *
+ * NOTE: the caller must not be in a journal transaction
+ *
+ * @param fs	the file system struct
+ * @return		true if the operation should be tried again
+ */
+bool commit_freed_blocks(fs_ctx *fs){
+	return journal_has_freed(&fs->journal) && journal_commit(&fs->journal) == 0;
+}
+
+/**
+ * Reserve the indirect block or extent tree nodes an allocation for a file needs. While the file's
+ * staged data is flushed, they come out of the metadata part of its reservation first (see
+ * flush_delalloc()), so a flush can't run out of space for them
+ *
+ * NOTE: the caller must hold the inode's write lock
+ *
+ * @param inode	the inode the blocks are for
+ * @param count	the number of blocks
+ * @param fs		the file system struct
+ * 
+ * @return      true on success; false if fewer than count blocks are left for it
+ */
+bool reserve_metadata(a1fs_inode *inode, uint32_t count, fs_ctx *fs){
+	delalloc_buf *staged = fs->delayed_alloc ? delalloc_get(&fs->delalloc, get_inode_num(inode, fs)) : NULL;
+	uint32_t taken = staged != NULL ? min(count, staged->meta) : 0;
+	if(!reserve_blocks(count - taken, fs))
+		return false;
+	if(taken > 0){
+		staged->meta -= taken;
+		staged->reserved -= taken;
+	}
+	return true;
+}
+
+/**
+ * Allocate blocks past the end of a file without changing its size, so that later writes that
+ * extend the file find their blocks already allocated. The blocks are not zeroed
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param file_inode_num	the inode number of the file
+ * @param blocks					the number of blocks the file should have allocated
+ * @param fs							the file system struct
+ * 
+ * @return      				0 on success (or if the file already has that many blocks); -ENOSPC if
+ * 											not enough free space, in which case nothing is allocated; -EAGAIN if
+ * 											the journal transaction is full, in which case some may be
+ */
+int preallocate_blocks(uint32_t file_inode_num, uint32_t blocks, fs_ctx *fs){
+	uint32_t have = inode_blocks(file_inode_num, fs); // none for an inline file
+	if(blocks <= have)
+		return 0;
+	if(!reserve_blocks(blocks - have, fs))
+		return -ENOSPC;
+	return grow_inode(file_inode_num, blocks, fs); // blocks past the end of an inline file need extents
+}
+
+/**
+ * Free the blocks allocated past the end of a file by preallocate_blocks()
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param file_inode_num	the inode number of the file
+ * @param fs							the file system struct
+ * @return								0 on success; -EAGAIN if the journal transaction is full, in which
+ * 												case calling this again in a new transaction frees the rest
+ */
+int trim_preallocation(uint32_t file_inode_num, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(file_inode_num, fs);
+	uint32_t have = inode_blocks(file_inode_num, fs);
+	uint32_t want = ceil_integer_division64(inode->size, A1FS_BLOCK_SIZE);
+	if(want < have && !free_blocks_past(file_inode_num, want, fs))
+		return -EAGAIN;
+	return 0;
 }
 
 /**
@@ -423,3 +1450,260 @@ void set_parent_path(char *path){
 		ptr[0] = '\0'; // removes the last component of the path to give the path of the parent node
 
 }
+
+/**
+ * Get the size of a file, including data staged by delayed allocation
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param ino	the inode number of the file
+ * @param fs	the file system struct
+ */
+uint64_t file_size(uint32_t ino, fs_ctx *fs){
+	if(fs->delayed_alloc){
+		delalloc_buf *staged = delalloc_get(&fs->delalloc, ino);
+		if(staged != NULL)
+			return staged->start + staged->len;
+	}
+	return get_inode(ino, fs)->size;
+}
+
+/**
+ * Find where the data or the hole that starts at or after an offset of a file begins
+ * (SEEK_DATA and SEEK_HOLE). The end of the file counts as a hole, and data staged by
+ * delayed allocation counts as data
+ *
+ * NOTE: the caller must hold the inode's lock
+ *
+ * @param ino			the inode number of the file
+ * @param offset	the offset to search from
+ * @param hole		whether to look for a hole rather than data
+ * @param fs			the file system struct
+ * @return				the offset; -ENXIO if offset is past the end of the file, or there is no data past it
+ */
+int64_t seek_data_hole(uint32_t ino, uint64_t offset, bool hole, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(ino, fs);
+	uint64_t size = file_size(ino, fs);
+	if(offset >= size)
+		return -ENXIO;
+	if(offset >= inode->size || (inode->flags & A1FS_INODE_INLINE))
+		return hole ? size : offset; // staged data (or inline data) runs to the end of the file
+
+	uint32_t b = offset / A1FS_BLOCK_SIZE;
+	uint32_t contig;
+	if(!hole){
+		if(map_file_block(ino, b, &contig, NULL, fs) >= 0)
+			return offset;
+		long next = next_data_block(ino, b, fs);
+		uint64_t pos = next < 0 ? inode->size : (uint64_t)next * A1FS_BLOCK_SIZE;
+		if(pos < inode->size)
+			return pos;
+		return size > inode->size ? (int64_t)inode->size : -ENXIO;
+	}
+	while((uint64_t)b * A1FS_BLOCK_SIZE < inode->size && map_file_block(ino, b, &contig, NULL, fs) >= 0)
+		b += contig;
+	uint64_t pos = (uint64_t)b * A1FS_BLOCK_SIZE;
+	if(pos >= inode->size)
+		return size;
+	return pos > offset ? pos : offset;
+}
+
+/**
+ * Copy data into the allocated blocks of a file and record them as dirty
+ *
+ * NOTE: the caller must hold the inode's write lock, and [offset, offset + size) must be within
+ * the allocated size of the file
+ *
+ * @param inode_num	the inode number of the file
+ * @param buf				the data
+ * @param size			the number of bytes to copy
+ * @param offset		the file offset to copy to
+ * @param cursor		the extent cursor of the open file; NULL if there is none
+ * @param fs				the file system struct
+ * @return					the number of bytes copied; less than size only if reading a block in failed
+ */
+size_t copy_to_file(uint32_t inode_num, const char *buf, size_t size, uint64_t offset, uint32_t *cursor, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(inode_num, fs);
+	if(inode->flags & A1FS_INODE_INLINE){
+		// the data is part of the inode. Without a journal flush() writes its block of the inode table
+		// like a data block; with one the block may only reach the image through the log, which the
+		// inode_wrlock() of the caller already added it to
+		memcpy((char *)inode->extents + offset, buf, size);
+		if(!fs->journal.enabled)
+			dirty_ranges_add(&fs->dirty_data, inode_num, inode_table_block(fs, inode_num), 1);
+		return size;
+	}
+
+	// Each extent is contiguous on disk, so copy the whole overlap with the request at once
+	size_t copied = 0;
+	while(copied < size){
+		uint64_t pos = offset + copied;
+		uint32_t contig; // blocks left in the extent that holds pos
+		long block = map_file_block(inode_num, pos / A1FS_BLOCK_SIZE, &contig, cursor, fs);
+		if(block < 0)
+			break; // can't happen as long as the range is allocated
+
+		uint64_t extent_bytes = (uint64_t)contig * A1FS_BLOCK_SIZE - pos % A1FS_BLOCK_SIZE;
+		size_t n = extent_bytes < size - copied ? extent_bytes : size - copied;
+		uint32_t nblocks = ceil_integer_division(pos % A1FS_BLOCK_SIZE + n, A1FS_BLOCK_SIZE);
+		// blocks that are overwritten entirely don't have to be read in first
+		bool whole = pos % A1FS_BLOCK_SIZE == 0 && n % A1FS_BLOCK_SIZE == 0;
+		char *data = bdev_get(&fs->dev, block, nblocks, !whole);
+		if(data == NULL)
+			break; // reading the blocks in failed
+		memcpy(data + pos % A1FS_BLOCK_SIZE, buf + copied, n);
+		bdev_put(&fs->dev, block, nblocks, true);
+		dirty_ranges_add(&fs->dirty_data, inode_num, block, nblocks);
+		copied += n;
+	}
+	return copied;
+}
+
+/**
+ * Get the number of data blocks the data staged for a file needs when it ends at end: the blocks
+ * the file does not have yet
+ */
+static uint32_t staged_blocks(uint32_t inode_num, const delalloc_buf *staged, uint64_t end, fs_ctx *fs){
+	uint32_t want = ceil_integer_division64(end, A1FS_BLOCK_SIZE);
+	// blocks before the staged data are either allocated or a hole that stays
+	uint32_t have = max(inode_blocks(inode_num, fs), staged->start / A1FS_BLOCK_SIZE);
+	return want > have ? want - have : 0;
+}
+
+/**
+ * Get the number of blocks to reserve for the data staged for a file when it ends at end: its data
+ * blocks, plus the most metadata blocks they can need on a fragmented image, where each of them
+ * may end up in an extent of its own (see extent_tree_worst_blocks())
+ */
+static uint32_t staged_reservation(uint32_t inode_num, const delalloc_buf *staged, uint64_t end, fs_ctx *fs){
+	uint32_t data = staged_blocks(inode_num, staged, end, fs);
+	return data + extent_tree_worst_blocks(get_inode(inode_num, fs), data);
+}
+
+/**
+ * Allocate blocks for the data staged for a file and copy the data into them. The file gets
+ * its final size in one allocation, so it lands in as few extents as the free space allows
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param inode_num	the inode number of the file
+ * @param fs				the file system struct
+ * @return					0 on success (or if nothing was staged); -EAGAIN if the journal transaction
+ * 									is full, in which case what is not allocated yet stays staged; -errno on
+ * 									other errors, in which case the staged data is lost
+ */
+int flush_delalloc(uint32_t inode_num, fs_ctx *fs){
+	delalloc_buf *staged = delalloc_get(&fs->delalloc, inode_num);
+	if(staged == NULL)
+		return 0;
+	uint64_t len = staged->len;
+	// fill_range() takes the data part of the reservation; the allocations take the indirect block
+	// and tree nodes they need out of the rest (see reserve_metadata())
+	uint32_t data = min(staged_blocks(inode_num, staged, staged->start + len, fs), staged->reserved);
+	staged->meta = staged->reserved - data;
+	staged->reserved = staged->meta;
+	long res = fill_range(inode_num, staged->start, staged->start + len, true, true, data, fs);
+	staged->meta = 0;
+	if(res > 0)
+		copy_to_file(inode_num, staged->data, res, staged->start, NULL, fs);
+	if(res == -EAGAIN || (res >= 0 && (uint64_t)res < len && journal_needs_restart(&fs->journal))){
+		// fill_range() gave the data part back; the rest keeps its blocks reserved, and the metadata
+		// left over (topped up if the bound for the rest is larger, which the flush can go without)
+		if(res > 0)
+			delalloc_consume(staged, res);
+		data = staged_blocks(inode_num, staged, staged->start + staged->len, fs);
+		if(reserve_blocks(data, fs)){
+			staged->reserved += data;
+			uint32_t needed = staged_reservation(inode_num, staged, staged->start + staged->len, fs);
+			if(needed > staged->reserved && reserve_blocks(needed - staged->reserved, fs))
+				staged->reserved = needed;
+			return -EAGAIN;
+		}
+		res = -ENOSPC;
+	}
+	unreserve_blocks(staged->reserved, fs); // the metadata blocks the allocation did not need
+	delalloc_remove(&fs->delalloc, staged);
+	if(res < 0)
+		return res;
+	return (uint64_t)res < len ? -ENOSPC : 0;
+}
+
+/**
+ * flush_delalloc() for callers that hold no locks (flush, release and unmount)
+ *
+ * @param inode_num	the inode number of the file
+ * @param fs				the file system struct
+ * @return					0 on success; -errno on error
+ */
+int allocate_staged(uint32_t inode_num, fs_ctx *fs){
+	if(!fs->delayed_alloc || delalloc_get(&fs->delalloc, inode_num) == NULL)
+		return 0;
+	int res;
+	do{
+		journal_start(&fs->journal);
+		inode_wrlock(fs, inode_num);
+		res = flush_delalloc(inode_num, fs);
+		inode_unlock(fs, inode_num);
+		journal_stop(&fs->journal);
+	} while(res == -EAGAIN); // the rest goes in the next transaction
+	return res;
+}
+
+/**
+ * Stage the part of a write that is past the allocated end of a file (delayed allocation)
+ *
+ * NOTE: the caller must hold the inode's write lock and be in a journal transaction
+ *
+ * @param inode_num	the inode number of the file
+ * @param buf				the data
+ * @param size			the size of the write
+ * @param offset		the file offset of the write
+ * @param fs				the file system struct
+ * @return					the number of bytes at the start of the write that were not staged and must
+ * 									be written to allocated blocks (all of them if the write is too large to
+ * 									stage); -errno on error
+ */
+long stage_write(uint32_t inode_num, const char *buf, size_t size, uint64_t offset, fs_ctx *fs){
+	a1fs_inode *inode = get_inode(inode_num, fs);
+	delalloc_buf *staged = delalloc_get(&fs->delalloc, inode_num);
+	uint64_t end = offset + size;
+
+	// Don't let the buffer grow without bound, or fill a hole the write leaves after it with
+	// zeros; allocate what is staged so far
+	if(staged != NULL && (end - staged->start > A1FS_DELALLOC_MAX || offset > staged->start + staged->len)){
+		int res = flush_delalloc(inode_num, fs);
+		if(res < 0)
+			return res;
+		staged = NULL;
+	}
+	if(end <= inode->size || (staged == NULL && (end - inode->size > A1FS_DELALLOC_MAX || offset > inode->size)))
+		return size; // nothing to stage, a write big enough to get a large extent by itself, or one past a hole
+
+	if(staged == NULL){
+		staged = delalloc_create(&fs->delalloc, inode_num, inode->size);
+		if(staged == NULL)
+			return -ENOMEM;
+	}
+
+	// Reserve the blocks the file will need
+	uint64_t new_size = staged->start + staged->len > end ? staged->start + staged->len : end;
+	uint32_t needed = staged_reservation(inode_num, staged, new_size, fs);
+	if(needed > staged->reserved){
+		if(!reserve_blocks(needed - staged->reserved, fs)){
+			if(staged->len == 0)
+				delalloc_remove(&fs->delalloc, staged);
+			return -ENOSPC;
+		}
+		staged->reserved = needed;
+	}
+
+	uint64_t from = offset > inode->size ? offset : inode->size;
+	if(!delalloc_stage(staged, buf + (from - offset), end - from, from)){
+		if(staged->len == 0){
+			unreserve_blocks(staged->reserved, fs);
+			delalloc_remove(&fs->delalloc, staged);
+		}
+		return -ENOMEM;
+	}
+	return from - offset;
+}
@@ -1,19 +1,49 @@
+#pragma once
+
 #include "fs_ctx.h"
 
 uint32_t ceil_integer_division(uint32_t num1, uint32_t num2);
+uint64_t ceil_integer_division64(uint64_t num1, uint64_t num2);
 uint32_t min(uint32_t num1, uint32_t num2);
 uint32_t max(uint32_t num1, uint32_t num2);
 
-long find_dir_entry(uint32_t inode_num, char *target_name, fs_ctx *fs);
+long find_dir_entry(uint32_t inode_num, const char *target_name, fs_ctx *fs);
+long lookup_name(uint32_t dir_ino, const char *name, fs_ctx *fs);
 long path_lookup(const char *path, fs_ctx *fs);
 
+a1fs_inode *get_inode(uint32_t inode_num, fs_ctx *fs);
+a1fs_extent *get_extent(a1fs_inode *inode, uint32_t index, fs_ctx *fs);
 a1fs_extent * get_final_extent(a1fs_inode * file_inode, fs_ctx *fs);
+long get_physical_block(a1fs_inode *inode, uint32_t file_block, fs_ctx *fs);
+uint32_t get_inode_num(a1fs_inode *inode, fs_ctx *fs);
+long map_file_block(uint32_t ino, uint32_t file_block, uint32_t *contig, uint32_t *cursor, fs_ctx *fs);
+void update_extent_map(a1fs_inode *inode, fs_ctx *fs);
+void invalidate_extent_map(uint32_t ino, fs_ctx *fs);
 uint32_t extend_extent(uint32_t max_blocks, a1fs_inode *inode, a1fs_extent *extent, fs_ctx *fs);
 long allocate_extent(uint32_t max_blocks, a1fs_inode *inode, fs_ctx *fs);
-int deallocate_block(a1fs_inode *inode, fs_ctx *fs);
+uint32_t deallocate_blocks(uint32_t max_blocks, a1fs_inode *inode, fs_ctx *fs);
+uint32_t inode_blocks(uint32_t ino, fs_ctx *fs);
+long next_data_block(uint32_t ino, uint32_t b, fs_ctx *fs);
+int truncate_inode(uint32_t file_inode_num, uint64_t size, fs_ctx *fs);
+long prepare_write(uint32_t ino, uint64_t from, uint64_t to, fs_ctx *fs);
+int allocate_range(uint32_t ino, uint64_t from, uint64_t to, bool keep_size, fs_ctx *fs);
+bool reserve_blocks(uint32_t count, fs_ctx *fs);
+void unreserve_blocks(uint32_t count, fs_ctx *fs);
+bool commit_freed_blocks(fs_ctx *fs);
+bool reserve_metadata(a1fs_inode *inode, uint32_t count, fs_ctx *fs);
+int preallocate_blocks(uint32_t file_inode_num, uint32_t blocks, fs_ctx *fs);
+int trim_preallocation(uint32_t file_inode_num, fs_ctx *fs);
+uint64_t file_size(uint32_t ino, fs_ctx *fs);
+int64_t seek_data_hole(uint32_t ino, uint64_t offset, bool hole, fs_ctx *fs);
+size_t copy_to_file(uint32_t inode_num, const char *buf, size_t size, uint64_t offset, uint32_t *cursor, fs_ctx *fs);
+int flush_delalloc(uint32_t inode_num, fs_ctx *fs);
+int allocate_staged(uint32_t inode_num, fs_ctx *fs);
+long stage_write(uint32_t inode_num, const char *buf, size_t size, uint64_t offset, fs_ctx *fs);
 
 char* get_last_component(const char *abs_path);
 void set_parent_path(char *path);
-long allocate_inode(fs_ctx *fs);
-long allocate_block(fs_ctx *fs);
-void set_bitmap(uint32_t bitmap_block, uint32_t offset, fs_ctx *fs , bool set);
+long allocate_inode(uint32_t parent, bool is_dir, fs_ctx *fs);
+void deallocate_inode(uint32_t inode_num, fs_ctx *fs);
+long allocate_block(a1fs_inode *inode, fs_ctx *fs);
+void set_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs, bool used);
+void free_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs);
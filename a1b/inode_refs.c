@@ -0,0 +1,111 @@
+/**
+ * Inode reference table implementation.
+ */
+
+#include <stdlib.h>
+
+#include "inode_refs.h"
+
+
+static inode_ref **find_slot(inode_refs *refs, uint32_t ino)
+{
+	inode_ref **slot = &refs->buckets[ino % INODE_REFS_BUCKETS];
+	while (*slot != NULL && (*slot)->ino != ino)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+
+void inode_refs_init(inode_refs *refs)
+{
+	pthread_mutex_init(&refs->lock, NULL);
+	for (int i = 0; i < INODE_REFS_BUCKETS; i++)
+		refs->buckets[i] = NULL;
+}
+
+void inode_refs_destroy(inode_refs *refs)
+{
+	for (int i = 0; i < INODE_REFS_BUCKETS; i++) {
+		inode_ref *ref = refs->buckets[i];
+		while (ref != NULL) {
+			inode_ref *next = ref->next;
+			free(ref);
+			ref = next;
+		}
+	}
+	pthread_mutex_destroy(&refs->lock);
+}
+
+bool inode_refs_get(inode_refs *refs, uint32_t ino, uint64_t lookups, uint32_t opens)
+{
+	pthread_mutex_lock(&refs->lock);
+	inode_ref **slot = find_slot(refs, ino);
+	if (*slot == NULL) {
+		*slot = calloc(1, sizeof(inode_ref));
+		if (*slot == NULL) {
+			pthread_mutex_unlock(&refs->lock);
+			return false;
+		}
+		(*slot)->ino = ino;
+	}
+	(*slot)->lookups += lookups;
+	(*slot)->opens += opens;
+	pthread_mutex_unlock(&refs->lock);
+	return true;
+}
+
+bool inode_refs_put(inode_refs *refs, uint32_t ino, uint64_t lookups, uint32_t opens)
+{
+	bool last = false;
+	pthread_mutex_lock(&refs->lock);
+	inode_ref **slot = find_slot(refs, ino);
+	inode_ref *ref = *slot;
+	if (ref != NULL) {
+		ref->lookups -= lookups < ref->lookups ? lookups : ref->lookups;
+		ref->opens -= opens < ref->opens ? opens : ref->opens;
+		if (ref->lookups == 0 && ref->opens == 0) {
+			last = ref->orphan;
+			*slot = ref->next;
+			free(ref);
+		}
+	}
+	pthread_mutex_unlock(&refs->lock);
+	return last;
+}
+
+bool inode_refs_held(inode_refs *refs, uint32_t ino)
+{
+	pthread_mutex_lock(&refs->lock);
+	bool held = *find_slot(refs, ino) != NULL;
+	pthread_mutex_unlock(&refs->lock);
+	return held;
+}
+
+bool inode_refs_orphan(inode_refs *refs, uint32_t ino)
+{
+	pthread_mutex_lock(&refs->lock);
+	inode_ref *ref = *find_slot(refs, ino);
+	if (ref != NULL)
+		ref->orphan = true;
+	pthread_mutex_unlock(&refs->lock);
+	return ref != NULL;
+}
+
+long inode_refs_take_orphan(inode_refs *refs)
+{
+	long ino = -1;
+	pthread_mutex_lock(&refs->lock);
+	for (int i = 0; i < INODE_REFS_BUCKETS && ino < 0; i++) {
+		for (inode_ref **slot = &refs->buckets[i]; *slot != NULL; slot = &(*slot)->next) {
+			if ((*slot)->orphan) {
+				inode_ref *ref = *slot;
+				ino = ref->ino;
+				*slot = ref->next;
+				free(ref);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&refs->lock);
+	return ino;
+}
@@ -0,0 +1,82 @@
+/**
+ * References to inodes held from outside the file system.
+ *
+ * The kernel keeps an inode number for as long as it has a lookup count on it
+ * (a1fs_ll: every entry reply adds one, forget() drops them), and an open file
+ * keeps its inode number until release(). A file removed while it is
+ * referenced can't be freed yet, or its inode and blocks would be reused under
+ * the references: it becomes an orphan instead, with no name and no links,
+ * and is freed when the last reference goes away.
+ *
+ * Only inodes with references are in the table. inode_refs.lock is an
+ * innermost lock; references are only taken, and inodes only made orphans,
+ * under the lock of the inode (see ref_inode() and remove_inode()).
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Number of hash buckets (inodes are chained within a bucket). */
+#define INODE_REFS_BUCKETS 1024
+
+/** The references to one inode. */
+typedef struct inode_ref {
+	uint32_t ino;
+	/** Lookup count of the kernel. */
+	uint64_t lookups;
+	/** Number of open handles. */
+	uint32_t opens;
+	/** True once the inode was removed; it is freed with its last reference. */
+	bool orphan;
+	struct inode_ref *next;
+
+} inode_ref;
+
+typedef struct inode_refs {
+	pthread_mutex_t lock;
+	inode_ref *buckets[INODE_REFS_BUCKETS];
+
+} inode_refs;
+
+/** Initialize an empty table. */
+void inode_refs_init(inode_refs *refs);
+
+/** Free every entry (the inodes of orphans are not freed). */
+void inode_refs_destroy(inode_refs *refs);
+
+/**
+ * Take references to an inode.
+ *
+ * @return  true on success; false if out of memory.
+ */
+bool inode_refs_get(inode_refs *refs, uint32_t ino, uint64_t lookups, uint32_t opens);
+
+/**
+ * Drop references to an inode; more than it holds drops them all.
+ *
+ * @return  true if that was the last reference to an orphan, which the caller
+ *          must now free; false otherwise.
+ */
+bool inode_refs_put(inode_refs *refs, uint32_t ino, uint64_t lookups, uint32_t opens);
+
+/** Check whether an inode has references. */
+bool inode_refs_held(inode_refs *refs, uint32_t ino);
+
+/**
+ * Make an inode that was just removed an orphan if it has references.
+ *
+ * @return  true if it is now an orphan; false if it can be freed right away.
+ */
+bool inode_refs_orphan(inode_refs *refs, uint32_t ino);
+
+/**
+ * Remove any orphan from the table, with whatever references it has left, e.g.
+ * to free them all at unmount.
+ *
+ * @return  the inode number of the orphan; -1 if there is none.
+ */
+long inode_refs_take_orphan(inode_refs *refs);
@@ -0,0 +1,547 @@
+/**
+ * Write-ahead metadata journal implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "journal.h"
+
+
+#define JOURNAL_INIT_DIRTY 256
+#define JOURNAL_INIT_FREED 64
+
+/** Blocks the operation running on this thread may still dirty (see journal_start()). */
+static __thread uint32_t op_credits;
+/** journal_extend() failed in the operation this thread started last. */
+static __thread bool op_restart;
+
+static void *block_addr(journal *j, uint32_t block)
+{
+	return bdev_block(j->dev, block);
+}
+
+static a1fs_journal_header *journal_header(journal *j)
+{
+	return block_addr(j, j->region.start);
+}
+
+/** The i-th block of the log (the log starts right after the header). */
+static void *log_block(journal *j, uint32_t i)
+{
+	return block_addr(j, j->region.start + 1 + i);
+}
+
+/** Number of log blocks needed for a transaction with n images. */
+static uint32_t log_blocks_needed(uint32_t n)
+{
+	uint32_t descriptors = (n + A1FS_JOURNAL_DESC_MAX - 1) / A1FS_JOURNAL_DESC_MAX;
+	return n + descriptors + 1; // + 1 for the commit block
+}
+
+/** Flush blocks in place, one bdev_sync() per run of consecutive block numbers. */
+static void sync_blocks(journal *j, const uint32_t *blocks, uint32_t n)
+{
+	uint32_t i = 0;
+	while (i < n) {
+		uint32_t run = 1;
+		while (i + run < n && blocks[i + run] == blocks[i] + run)
+			run++;
+		bdev_sync(j->dev, blocks[i], run);
+		i += run;
+	}
+}
+
+/**
+ * Check whether the log holds a complete transaction with the header's
+ * sequence number.
+ *
+ * @return  true if it does; false if the log is empty or the commit block is missing.
+ */
+static bool log_committed(journal *j)
+{
+	uint64_t sequence = journal_header(j)->sequence;
+	uint32_t log_size = j->region.count - 1;
+	uint32_t pos = 0;
+	while (pos < log_size) {
+		a1fs_journal_descriptor *desc = log_block(j, pos);
+		if (desc->magic != A1FS_JOURNAL_MAGIC || desc->sequence != sequence)
+			return false;
+		if (desc->type == A1FS_JOURNAL_COMMIT)
+			return true;
+		if (desc->type != A1FS_JOURNAL_DESCRIPTOR || desc->count > A1FS_JOURNAL_DESC_MAX)
+			return false;
+		pos += 1 + desc->count;
+	}
+	return false;
+}
+
+/** Copy the images of the committed transaction in the log back in place. */
+static bool replay(journal *j)
+{
+	uint32_t pos = 0;
+	while (true) {
+		a1fs_journal_descriptor *desc = log_block(j, pos);
+		if (desc->type == A1FS_JOURNAL_COMMIT)
+			break;
+		for (uint32_t k = 0; k < desc->count; k++) {
+			uint32_t home = desc->blocks[k];
+			if (home >= j->blocks_count ||
+			    (home >= j->region.start && home < j->region.start + j->region.count))
+				return false; // never write outside the image or over the journal itself
+			memcpy(block_addr(j, home), log_block(j, pos + 1 + k), A1FS_BLOCK_SIZE);
+			bdev_sync(j->dev, home, 1);
+		}
+		pos += 1 + desc->count;
+	}
+	return true;
+}
+
+/** Write a transaction to the log and wait until it is committed on disk. */
+static void write_log(journal *j, const uint32_t *blocks, const char *images, uint32_t n, uint64_t sequence)
+{
+	uint32_t pos = 0;
+	for (uint32_t i = 0; i < n; i += A1FS_JOURNAL_DESC_MAX) {
+		uint32_t count = n - i < A1FS_JOURNAL_DESC_MAX ? n - i : A1FS_JOURNAL_DESC_MAX;
+		a1fs_journal_descriptor *desc = log_block(j, pos);
+		memset(desc, 0, A1FS_BLOCK_SIZE);
+		desc->magic = A1FS_JOURNAL_MAGIC;
+		desc->type = A1FS_JOURNAL_DESCRIPTOR;
+		desc->sequence = sequence;
+		desc->count = count;
+		memcpy(desc->blocks, &blocks[i], count * sizeof(uint32_t));
+		pos++;
+		for (uint32_t k = 0; k < count; k++)
+			memcpy(log_block(j, pos++), images + (size_t)(i + k) * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+	}
+	// The descriptors and images must be on disk before the commit block
+	bdev_sync(j->dev, j->region.start + 1, pos);
+
+	a1fs_journal_descriptor *commit = log_block(j, pos);
+	memset(commit, 0, A1FS_BLOCK_SIZE);
+	commit->magic = A1FS_JOURNAL_MAGIC;
+	commit->type = A1FS_JOURNAL_COMMIT;
+	commit->sequence = sequence;
+	bdev_sync(j->dev, j->region.start + 1 + pos, 1);
+}
+
+/** Discard the transaction in the log (it has been checkpointed). */
+static void advance_sequence(journal *j)
+{
+	journal_header(j)->sequence += 1;
+	bdev_sync(j->dev, j->region.start, 1);
+}
+
+static uint32_t hash_block(uint32_t key, uint32_t cap)
+{
+	return (key * 2654435761u) & (cap - 1);
+}
+
+static bool set_contains(const uint32_t *set, uint32_t cap, uint32_t block)
+{
+	uint32_t key = block == 0 ? UINT32_MAX : block;
+	for (uint32_t i = hash_block(key, cap); set[i] != 0; i = (i + 1) & (cap - 1)) {
+		if (set[i] == key)
+			return true;
+	}
+	return false;
+}
+
+/** Insert into the dirty set. Returns false if the block was already there. */
+static bool set_insert(uint32_t *set, uint32_t cap, uint32_t block)
+{
+	uint32_t key = block == 0 ? UINT32_MAX : block;
+	for (uint32_t i = hash_block(key, cap);; i = (i + 1) & (cap - 1)) {
+		if (set[i] == key)
+			return false;
+		if (set[i] == 0) {
+			set[i] = key;
+			return true;
+		}
+	}
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void *commit_thread(void *arg)
+{
+	journal *j = arg;
+	pthread_mutex_lock(&j->lock);
+	while (!j->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += j->interval_ms / 1000;
+		deadline.tv_nsec += (long)(j->interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!j->stopping) {
+			if (pthread_cond_timedwait(&j->wakeup, &j->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		bool work = j->ndirty > 0 && !j->stopping;
+		pthread_mutex_unlock(&j->lock);
+		if (work)
+			journal_commit(j);
+		pthread_mutex_lock(&j->lock);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+
+bool journal_init(journal *j, bdev *dev, a1fs_superblock *sb)
+{
+	memset(j, 0, sizeof(journal));
+	j->dev = dev;
+	j->blocks_count = sb->blocks_count;
+	j->enabled = sb->features & A1FS_FEATURE_JOURNAL;
+
+	if (j->enabled) {
+		j->region = sb->journal;
+		if (j->region.count < A1FS_JOURNAL_MIN_BLOCKS) {
+			fprintf(stderr, "The journal has fewer than %d blocks\n", A1FS_JOURNAL_MIN_BLOCKS);
+			return false;
+		}
+		if (journal_header(j)->magic != A1FS_JOURNAL_MAGIC)
+			return false;
+
+		// Largest transaction that fits in the log
+		uint32_t log_size = j->region.count - 1;
+		j->max_blocks = log_size - 1;
+		while (j->max_blocks > 0 && log_blocks_needed(j->max_blocks) > log_size)
+			j->max_blocks--;
+
+		if (log_committed(j)) {
+			if (!replay(j))
+				return false;
+			advance_sequence(j);
+		}
+	}
+
+	// With a journal a transaction never has more than max_blocks blocks, so
+	// everything a commit needs is allocated here and never grows
+	j->dirty_cap = j->enabled ? j->max_blocks : JOURNAL_INIT_DIRTY;
+	j->set_cap = 2 * JOURNAL_INIT_DIRTY;
+	while (j->set_cap < 2 * j->dirty_cap)
+		j->set_cap *= 2;
+	j->dirty = malloc(j->dirty_cap * sizeof(uint32_t));
+	j->dirty_set = calloc(j->set_cap, sizeof(uint32_t));
+	if (j->enabled) {
+		j->commit_blocks = malloc(j->max_blocks * sizeof(uint32_t));
+		j->images = aligned_alloc(A1FS_BLOCK_SIZE, (size_t)j->max_blocks * A1FS_BLOCK_SIZE);
+	}
+	if (j->dirty == NULL || j->dirty_set == NULL ||
+	    (j->enabled && (j->commit_blocks == NULL || j->images == NULL))) {
+		free(j->dirty);
+		free(j->dirty_set);
+		free(j->commit_blocks);
+		free(j->images);
+		j->dirty = NULL;
+		return false;
+	}
+
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	// a steady stream of operations must not starve the commit
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&j->barrier, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&j->commit_lock, NULL);
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->wakeup, NULL);
+	return true;
+}
+
+bool journal_start_thread(journal *j, unsigned int interval_ms)
+{
+	if (!j->enabled)
+		return true;
+	j->interval_ms = interval_ms;
+	if (pthread_create(&j->thread, NULL, commit_thread, j) != 0)
+		return false;
+	j->thread_running = true;
+	return true;
+}
+
+void journal_set_release(journal *j, journal_release_fn release, void *arg)
+{
+	j->release = release;
+	j->release_arg = arg;
+}
+
+void journal_destroy(journal *j)
+{
+	if (j->dirty == NULL)
+		return; // never initialized
+	if (j->thread_running) {
+		pthread_mutex_lock(&j->lock);
+		j->stopping = true;
+		pthread_cond_signal(&j->wakeup);
+		pthread_mutex_unlock(&j->lock);
+		pthread_join(j->thread, NULL);
+		j->thread_running = false;
+	}
+	journal_commit(j);
+
+	free(j->dirty);
+	free(j->dirty_set);
+	free(j->commit_blocks);
+	free(j->images);
+	free(j->freed);
+	free(j->commit_freed);
+	pthread_rwlock_destroy(&j->barrier);
+	pthread_mutex_destroy(&j->commit_lock);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->wakeup);
+	j->dirty = NULL;
+}
+
+void journal_start(journal *j)
+{
+	if (!j->enabled)
+		return;
+	// Don't let the running transaction outgrow the log; an operation that
+	// finds too little room for its credits commits it before joining the next
+	pthread_mutex_lock(&j->lock);
+	while (j->ndirty + j->reserved + JOURNAL_OP_CREDITS > j->max_blocks) {
+		pthread_mutex_unlock(&j->lock);
+		journal_commit(j);
+		pthread_mutex_lock(&j->lock);
+	}
+	j->reserved += JOURNAL_OP_CREDITS;
+	pthread_mutex_unlock(&j->lock);
+	op_credits = JOURNAL_OP_CREDITS;
+	op_restart = false;
+
+	pthread_rwlock_rdlock(&j->barrier);
+}
+
+void journal_stop(journal *j)
+{
+	if (!j->enabled)
+		return;
+	// what the operation did not use goes back to the transaction
+	pthread_mutex_lock(&j->lock);
+	j->reserved -= op_credits;
+	pthread_mutex_unlock(&j->lock);
+	op_credits = 0;
+	pthread_rwlock_unlock(&j->barrier);
+}
+
+bool journal_extend(journal *j, uint32_t credits)
+{
+	if (!j->enabled || op_credits >= credits)
+		return true;
+	pthread_mutex_lock(&j->lock);
+	uint32_t more = credits - op_credits;
+	bool room = j->ndirty + j->reserved + more <= j->max_blocks;
+	if (room) {
+		j->reserved += more;
+		op_credits = credits;
+	}
+	pthread_mutex_unlock(&j->lock);
+	if (!room)
+		op_restart = true;
+	return room;
+}
+
+bool journal_needs_restart(journal *j)
+{
+	(void)j;
+	return op_restart;
+}
+
+/** journal_dirty() without a journal: the list grows as needed. */
+static void track_dirty(journal *j, uint32_t block)
+{
+	if (set_contains(j->dirty_set, j->set_cap, block))
+		return;
+	if (2 * (j->ndirty + 1) > j->set_cap) {
+		// grow the set (and the list with it), keeping the load factor <= 1/2
+		uint32_t set_cap = 2 * j->set_cap;
+		uint32_t *set = calloc(set_cap, sizeof(uint32_t));
+		uint32_t *dirty = realloc(j->dirty, set_cap / 2 * sizeof(uint32_t));
+		if (set != NULL && dirty != NULL) {
+			for (uint32_t i = 0; i < j->ndirty; i++)
+				set_insert(set, set_cap, dirty[i]);
+			free(j->dirty_set);
+			j->dirty_set = set;
+			j->set_cap = set_cap;
+			j->dirty_cap = set_cap / 2;
+		} else {
+			free(set);
+		}
+		if (dirty != NULL)
+			j->dirty = dirty;
+	}
+	if (2 * (j->ndirty + 1) > j->set_cap) {
+		// out of memory: make room by flushing the tracked blocks in place now
+		sync_blocks(j, j->dirty, j->ndirty);
+		j->ndirty = 0;
+		memset(j->dirty_set, 0, j->set_cap * sizeof(uint32_t));
+	}
+	set_insert(j->dirty_set, j->set_cap, block);
+	j->dirty[j->ndirty++] = block;
+}
+
+/** journal_dirty() with a journal: a new block takes one of the running operation's credits. */
+static void log_dirty(journal *j, uint32_t block)
+{
+	if (set_contains(j->dirty_set, j->set_cap, block))
+		return;
+	if (op_credits > 0) {
+		op_credits--;
+		j->reserved--;
+	} else if (j->ndirty + j->reserved >= j->max_blocks) {
+		// the operation dirtied more blocks than it asked for, and the log is full
+		if (!j->failed)
+			fprintf(stderr, "A transaction outgrew the journal, nothing is committed any more\n");
+		j->failed = true;
+		return;
+	}
+	set_insert(j->dirty_set, j->set_cap, block);
+	j->dirty[j->ndirty++] = block;
+}
+
+void journal_dirty(journal *j, uint32_t block)
+{
+	pthread_mutex_lock(&j->lock);
+	if (j->enabled)
+		log_dirty(j, block);
+	else
+		track_dirty(j, block);
+	pthread_mutex_unlock(&j->lock);
+}
+
+bool journal_free(journal *j, uint32_t start, uint32_t count)
+{
+	if (!j->enabled)
+		return false;
+	pthread_mutex_lock(&j->lock);
+	a1fs_extent *last = j->nfreed > 0 ? &j->freed[j->nfreed - 1] : NULL;
+	if (last != NULL && last->start == start + count) {
+		// truncating frees the tail of an extent a piece at a time, from the end
+		last->start = start;
+		last->count += count;
+	} else if (last != NULL && last->start + last->count == start) {
+		last->count += count;
+	} else {
+		if (j->nfreed == j->freed_cap) {
+			uint32_t cap = j->freed_cap > 0 ? 2 * j->freed_cap : JOURNAL_INIT_FREED;
+			a1fs_extent *freed = realloc(j->freed, cap * sizeof(a1fs_extent));
+			if (freed != NULL) {
+				j->freed = freed;
+				j->freed_cap = cap;
+			}
+		}
+		if (j->nfreed == j->freed_cap) {
+			// out of memory: the blocks are lost until the next mount
+			pthread_mutex_unlock(&j->lock);
+			return true;
+		}
+		j->freed[j->nfreed++] = (a1fs_extent){ .start = start, .count = count };
+	}
+	j->held += count;
+	pthread_mutex_unlock(&j->lock);
+	return true;
+}
+
+bool journal_has_freed(journal *j)
+{
+	if (!j->enabled)
+		return false;
+	pthread_mutex_lock(&j->lock);
+	bool freed = j->held > 0;
+	pthread_mutex_unlock(&j->lock);
+	return freed;
+}
+
+/** journal_commit() without a journal: flush the dirty blocks in place. */
+static void flush_dirty(journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	uint32_t n = j->ndirty;
+	uint32_t *blocks = malloc(n * sizeof(uint32_t) + 1);
+	if (blocks != NULL)
+		memcpy(blocks, j->dirty, n * sizeof(uint32_t));
+	else
+		sync_blocks(j, j->dirty, n); // out of memory: flush them from the list itself
+	j->ndirty = 0;
+	memset(j->dirty_set, 0, j->set_cap * sizeof(uint32_t));
+	pthread_mutex_unlock(&j->lock);
+
+	if (blocks != NULL) {
+		qsort(blocks, n, sizeof(uint32_t), block_cmp);
+		sync_blocks(j, blocks, n);
+		free(blocks);
+	}
+}
+
+int journal_commit(journal *j)
+{
+	// Commits are serialized so that a caller that finds nothing left to do
+	// returns only after the commit that took its blocks is on disk
+	pthread_mutex_lock(&j->commit_lock);
+	if (!j->enabled) {
+		flush_dirty(j);
+		pthread_mutex_unlock(&j->commit_lock);
+		return 0;
+	}
+
+	// Wait for the operations in the running transaction to finish and copy
+	// the blocks they dirtied while nothing else can change them
+	pthread_rwlock_wrlock(&j->barrier);
+	pthread_mutex_lock(&j->lock);
+	uint32_t n = j->ndirty;
+	uint32_t *blocks = j->commit_blocks;
+	memcpy(blocks, j->dirty, n * sizeof(uint32_t));
+	j->ndirty = 0;
+	memset(j->dirty_set, 0, j->set_cap * sizeof(uint32_t));
+	// the next transaction frees into the list of the last commit, which has been released
+	a1fs_extent *freed = j->freed;
+	uint32_t nfreed = j->nfreed;
+	uint32_t freed_cap = j->freed_cap;
+	j->freed = j->commit_freed;
+	j->freed_cap = j->commit_freed_cap;
+	j->nfreed = 0;
+	j->commit_freed = freed;
+	j->commit_freed_cap = freed_cap;
+	bool failed = j->failed;
+	pthread_mutex_unlock(&j->lock);
+
+	qsort(blocks, n, sizeof(uint32_t), block_cmp);
+	for (uint32_t i = 0; i < n && !failed; i++)
+		memcpy(j->images + (size_t)i * A1FS_BLOCK_SIZE, block_addr(j, blocks[i]), A1FS_BLOCK_SIZE);
+	pthread_rwlock_unlock(&j->barrier);
+
+	if (n > 0 && !failed) {
+		write_log(j, blocks, j->images, n, journal_header(j)->sequence);
+		bdev_checkpoint(j->dev, blocks, j->images, n); // exactly what was logged
+		advance_sequence(j);
+	}
+	// Only now that nothing replays the old metadata can the freed blocks get a new owner. If the
+	// journal failed they never do, since the metadata that frees them is never committed
+	if (!failed) {
+		uint64_t released = 0;
+		for (uint32_t i = 0; i < nfreed; i++) {
+			if (j->release != NULL)
+				j->release(j->release_arg, freed[i].start, freed[i].count);
+			released += freed[i].count;
+		}
+		pthread_mutex_lock(&j->lock);
+		j->held -= released;
+		pthread_mutex_unlock(&j->lock);
+	}
+	pthread_mutex_unlock(&j->commit_lock);
+	return failed ? -EIO : 0;
+}
@@ -0,0 +1,201 @@
+/**
+ * Write-ahead metadata journal.
+ *
+ * Every callback that changes metadata runs between journal_start() and
+ * journal_stop(), and every metadata block it modifies (superblock, group
+ * table, bitmaps, inode tables, indirect blocks, extent tree nodes, directory
+ * blocks) is recorded with journal_dirty(). The dirty blocks of all the
+ * operations that ran since the last commit form one transaction. A commit
+ * thread periodically quiesces new operations just long enough to copy the
+ * dirty blocks, then writes the copies to the log, waits for them to reach the
+ * disk, writes the commit block, and finally flushes the blocks in place (the
+ * checkpoint). Operations that run concurrently are therefore batched into one
+ * group commit.
+ *
+ * At mount, a committed transaction that was not fully checkpointed is copied
+ * back in place. The log only ever holds one transaction, so replay takes time
+ * proportional to that transaction, not to the size of the image.
+ *
+ * Nothing may reach the image in place before it is logged, so an image with a
+ * journal is always mounted with the pread backend (see bdev.h): with a shared
+ * mapping the kernel could write a modified metadata page back at any time.
+ *
+ * A transaction never outgrows the log. Every operation gets
+ * JOURNAL_OP_CREDITS blocks of the log when it joins the transaction
+ * (journal_start() commits first if they are not free), which covers the
+ * operations that modify a bounded number of blocks. Operations that free or
+ * allocate an unbounded number of extents (truncate, fallocate, large writes,
+ * removing a large file) ask for more with journal_extend() before each
+ * extent. When the log is full they stop at a consistent point, and continue
+ * in the next transaction after journal_stop() and journal_start(). If an
+ * operation dirties more blocks than it asked for and the log has no room
+ * left, the journal fails: from then on commits (and fsync()) return an error
+ * instead of writing blocks without logging them.
+ *
+ * Data blocks of regular files are not journaled. Blocks freed by a
+ * transaction are therefore not reused before it is checkpointed: until then a
+ * crash replays metadata that still points at them, and data written into them
+ * by a new owner would show up in the old one (a directory block, an extent
+ * tree node, or the file that was truncated). journal_free() holds them, and
+ * the commit hands them to the release callback once the transaction is in
+ * place.
+ *
+ * On an image without a journal the dirty blocks are still tracked, and
+ * journal_commit() just flushes them in place, so fsync() only writes the
+ * metadata blocks that actually changed.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "bdev.h"
+
+
+/** Blocks every operation may dirty without calling journal_extend(). */
+#define JOURNAL_OP_CREDITS 64
+
+/** Gets the blocks [start, start + count) freed by a transaction once they can be reused. */
+typedef void (*journal_release_fn)(void *arg, uint32_t start, uint32_t count);
+
+typedef struct journal {
+	/** False if the image has no journal; only dirty block tracking is then active. */
+	bool enabled;
+	bdev *dev;
+	/** The journal region (header block followed by the log). */
+	a1fs_extent region;
+	/** Number of blocks in the image, for validating logged block numbers. */
+	uint32_t blocks_count;
+	/** Largest number of dirty blocks a transaction can have and still fit in the log. */
+	uint32_t max_blocks;
+	/** A transaction outgrew the log, nothing is committed any more. */
+	bool failed;
+
+	/** Held shared by every running operation and exclusively while a commit copies the dirty blocks. */
+	pthread_rwlock_t barrier;
+	/** Only one commit at a time. */
+	pthread_mutex_t commit_lock;
+
+	/** Protects everything below. Innermost lock. */
+	pthread_mutex_t lock;
+	/** Block numbers dirtied by the running transaction, in the order they were first dirtied. */
+	uint32_t *dirty;
+	uint32_t ndirty;
+	uint32_t dirty_cap;
+	/** Open addressing set of the same block numbers (0 marks a free slot; block 0 is stored as UINT32_MAX). */
+	uint32_t *dirty_set;
+	uint32_t set_cap;
+	/** Blocks the running operations may still dirty (ndirty + reserved <= max_blocks). */
+	uint32_t reserved;
+	/** Block ranges freed by the running transaction (see journal_free()). */
+	a1fs_extent *freed;
+	uint32_t nfreed;
+	uint32_t freed_cap;
+	/** Blocks in freed and commit_freed, i.e. freed but not released yet. */
+	uint64_t held;
+	/** Signalled when the journal is shutting down. */
+	pthread_cond_t wakeup;
+	bool stopping;
+
+	/**
+	 * What a commit copies the dirty blocks into, allocated for max_blocks
+	 * blocks up front so that a commit never runs out of memory (NULL without
+	 * a journal).
+	 */
+	uint32_t *commit_blocks;
+	char *images;
+	/** The ranges freed by the transaction being committed; swapped with freed. */
+	a1fs_extent *commit_freed;
+	uint32_t commit_freed_cap;
+	/** Gets the freed ranges once their transaction is checkpointed. */
+	journal_release_fn release;
+	void *release_arg;
+
+	/** Commit thread and how often it commits. */
+	pthread_t thread;
+	bool thread_running;
+	unsigned int interval_ms;
+
+} journal;
+
+/**
+ * Set up the journal of a mounted image and replay a committed transaction if
+ * there is one.
+ *
+ * @param j      the journal to initialize.
+ * @param dev    the image.
+ * @param sb     the superblock (inside the image).
+ * @return       true on success; false if the journal is corrupt or out of memory.
+ */
+bool journal_init(journal *j, bdev *dev, a1fs_superblock *sb);
+
+/**
+ * Start the commit thread. Must be called after FUSE has daemonized.
+ *
+ * @param interval_ms  time between commits in milliseconds.
+ * @return             true on success; false if the thread can't be created.
+ */
+bool journal_start_thread(journal *j, unsigned int interval_ms);
+
+/** Set the callback that gets the blocks freed by a transaction once they can be reused. */
+void journal_set_release(journal *j, journal_release_fn release, void *arg);
+
+/** Stop the commit thread, commit anything left and free the journal. */
+void journal_destroy(journal *j);
+
+/**
+ * Join the running transaction, with JOURNAL_OP_CREDITS blocks to dirty. Must
+ * be called before taking any inode lock, and must not be nested.
+ */
+void journal_start(journal *j);
+
+/** Leave the running transaction. */
+void journal_stop(journal *j);
+
+/**
+ * Make sure the running operation can dirty credits more blocks.
+ *
+ * @return  true on success; false if the transaction has no room for them, in
+ *          which case the operation must stop (see journal_needs_restart()).
+ */
+bool journal_extend(journal *j, uint32_t credits);
+
+/**
+ * Check whether journal_extend() failed in the last operation this thread
+ * started, i.e. whether it stopped early and the rest of it must be done in a
+ * new transaction.
+ */
+bool journal_needs_restart(journal *j);
+
+/** Record that a metadata block is modified by the running transaction. */
+void journal_dirty(journal *j, uint32_t block);
+
+/**
+ * Hold blocks [start, start + count) freed by the running transaction until
+ * it is committed and checkpointed, then give them to the release callback.
+ * If the range can't be recorded (out of memory) it is never released, so the
+ * blocks are lost until the next mount instead of being reused too early.
+ *
+ * @return  true if the blocks are held; false if the image has no journal, in
+ *          which case they can be reused right away.
+ */
+bool journal_free(journal *j, uint32_t start, uint32_t count);
+
+/**
+ * Check whether freed blocks are waiting for a commit to release them, i.e.
+ * whether journal_commit() would make more blocks available.
+ */
+bool journal_has_freed(journal *j);
+
+/**
+ * Commit the running transaction now and wait until it is on disk (without a
+ * journal: flush the dirty metadata blocks in place).
+ * Must not be called between journal_start() and journal_stop().
+ *
+ * @return  0 on success; -EIO if the journal failed.
+ */
+int journal_commit(journal *j);
@@ -21,6 +21,19 @@
 #include <stddef.h>
 
 
+/**
+ * Open a file for reading and writing and check its size.
+ *
+ * File size must be a non-zero multiple of the block_size.
+ *
+ * @param path        image file path.
+ * @param block_size  file system block size.
+ * @param size        pointer to the variable that will be set to file size.
+ * @return            the file descriptor on success; -1 on failure, which is
+ *                    reported on stderr.
+ */
+int open_file(const char *path, size_t block_size, size_t *size);
+
 /**
  * Map the whole file into memory for reading and writing.
  *
@@ -29,7 +42,20 @@
  * @param path        image file path.
  * @param block_size  file system block size.
  * @param size        pointer to the variable that will be set to file size.
+ * @param fd          if not NULL, receives a file descriptor of the file
+ *                    that the caller closes; otherwise the file is only
+ *                    kept open by the mapping.
  * @return            pointer to the file mapping in memory on success;
  *                    NULL on failure.
  */
-void *map_file(const char *path, size_t block_size, size_t *size);
+void *map_file(const char *path, size_t block_size, size_t *size, int *fd);
+
+/**
+ * Write part of a file mapping back to the file and wait for it to finish.
+ *
+ * The range is widened to whole pages as msync() requires.
+ *
+ * @param addr  start of the range (inside a mapping made by map_file()).
+ * @param len   length of the range in bytes.
+ */
+void sync_mapping(void *addr, size_t len);
@@ -25,8 +25,9 @@
 #include <time.h>
 
 #include "a1fs.h"
+#include "bitmap.h"
 #include "map.h"
-#include "helpers.c"
+#include "helpers.h"
 
 
 /** Command line options. */
@@ -42,9 +43,22 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Index large directories by name hash. */
+	bool dir_index;
+	/** Store the data of small files in their inodes. */
+	bool inline_data;
+	/** Use variable length directory entries. */
+	bool dirent;
+	/** Number of journal blocks (0 for no journal). */
+	size_t n_journal;
+	/** Number of blocks in each allocation group. */
+	size_t blocks_per_group;
 
 } mkfs_opts;
 
+/** Blocks in a group by default: as many as one block of the block bitmap covers. */
+#define DEFAULT_BLOCKS_PER_GROUP ((size_t)A1FS_BLOCK_SIZE * 8)
+
 static const char *help_str = "\
 Usage: %s options image\n\
 \n\
@@ -56,24 +70,34 @@ Options:\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
+    -d      index large directories by name hash\n\
+    -s      store the data of small files in their inodes\n\
+    -c      use compact (variable length) directory entries\n\
+    -j num  reserve num blocks for a metadata journal (at least %d)\n\
+    -g num  number of blocks in each allocation group (default %zu)\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_JOURNAL_MIN_BLOCKS, DEFAULT_BLOCKS_PER_GROUP);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:hfvzdscj:g:")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
 			case 'z': opts->zero  = true; break;
+			case 'd': opts->dir_index = true; break;
+			case 's': opts->inline_data = true; break;
+			case 'c': opts->dirent = true; break;
+			case 'j': opts->n_journal = strtoul(optarg, NULL, 10); break;
+			case 'g': opts->blocks_per_group = strtoul(optarg, NULL, 10); break;
 
 			case '?': return false;
 			default : assert(false);
@@ -90,6 +114,16 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->n_journal != 0 && opts->n_journal < A1FS_JOURNAL_MIN_BLOCKS) {
+		fprintf(stderr, "The journal needs at least %d blocks\n", A1FS_JOURNAL_MIN_BLOCKS);
+		return false;
+	}
+	if (opts->blocks_per_group == 0)
+		opts->blocks_per_group = DEFAULT_BLOCKS_PER_GROUP;
+	if (opts->blocks_per_group > UINT32_MAX) {
+		fprintf(stderr, "Invalid number of blocks per group\n");
+		return false;
+	}
 	return true;
 }
 
@@ -107,21 +141,47 @@ static bool a1fs_is_present(void *image)
 }
 
 
+/** Number of blocks of metadata at the start of every group: its bitmaps and inode table. */
+static uint32_t group_metadata_blocks(const a1fs_superblock *sb)
+{
+	return ceil_integer_division(sb->blocks_per_group, A1FS_BLOCK_SIZE * 8) +
+	       ceil_integer_division(sb->inodes_per_group, A1FS_BLOCK_SIZE * 8) +
+	       ceil_integer_division64((uint64_t)sb->inodes_per_group * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
+}
+
 /**
- * helper function to initalize the block bitmap field in the super block
- *
- * NOTE: Must update mtime of the root directory.
+ * helper function to divide the image into allocation groups (see a1fs_group_desc). A last group
+ * too small to hold its metadata and a data block is left out of the file system
  *
- * @param 	The superblock struct	
+ * @param sb	the superblock, with blocks_count, blocks_per_group and journal.count set
+ * @param n_inodes	the number of inodes requested; rounded up to a multiple of the group count
  * @return	true on success;
- * 					false on error, e.g. total blocks needed to format disk it more than possible
+ * 					false on error, e.g. the metadata does not fit into the groups
  */
+static bool layout_groups(a1fs_superblock *sb, size_t n_inodes)
+{
+	for (;;) {
+		sb->groups_count = ceil_integer_division(sb->blocks_count, sb->blocks_per_group);
+		uint64_t per_group = (n_inodes + sb->groups_count - 1) / sb->groups_count;
+		if (per_group * sb->groups_count > UINT32_MAX)
+			return false;
+		sb->inodes_per_group = per_group;
+		sb->inodes_count = per_group * sb->groups_count;
+		sb->group_table.start = 1;
+		sb->group_table.count = ceil_integer_division64((uint64_t)sb->groups_count * sizeof(a1fs_group_desc),
+		                                                A1FS_BLOCK_SIZE);
+
+		uint32_t last = sb->blocks_count - (sb->groups_count - 1) * sb->blocks_per_group;
+		if (sb->groups_count > 1 && last < group_metadata_blocks(sb) + 1) {
+			sb->blocks_count -= last;
+			continue;
+		}
+		break;
+	}
 
-bool init_block_bitmap(a1fs_superblock *sb){
-	sb->block_bitmap.count = ceil_integer_division(sb->blocks_count, A1FS_BLOCK_SIZE * 8);
-	if(1 + sb->inode_bitmap.count + sb->inode_table.count + sb->block_bitmap.count > sb->blocks_count)
-		return false;
-	return true;
+	// group 0 also holds the superblock, the group table and the journal
+	uint64_t first_group = sb->blocks_count < sb->blocks_per_group ? sb->blocks_count : sb->blocks_per_group;
+	return 1 + (uint64_t)sb->group_table.count + group_metadata_blocks(sb) + sb->journal.count + 1 <= first_group;
 }
 
 
@@ -140,36 +200,68 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 {
 	memset(image, 0, size); // to ensure that our disk can be properly formatted
 
-	char byte;
 	// initialize the super block
 	a1fs_superblock *sb = calloc(1, sizeof(a1fs_superblock));
 	sb->magic = A1FS_MAGIC;
 	sb->size = size;
-	sb->inodes_count = opts->n_inodes;
 	sb->blocks_count = sb->size / A1FS_BLOCK_SIZE; // don't have to ceil I know size if block aligned
 
-	sb->inode_bitmap.start = 1;
-	sb->inode_bitmap.count = ceil_integer_division(sb->inodes_count, A1FS_BLOCK_SIZE * 8);
-	sb->block_bitmap.start = 1 + sb->inode_bitmap.count;
-	sb->inode_table.count = ceil_integer_division(sb->inodes_count * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
+	sb->blocks_per_group = opts->blocks_per_group;
+	sb->journal.count = opts->n_journal;
 
-	if(!init_block_bitmap(sb)){
-		return false; // can't find format the required number of blocks for bitmap into the disk image
+	if(!layout_groups(sb, opts->n_inodes)){
+		free(sb);
+		return false; // can't fit the metadata of the groups into the disk image
 	}
-	sb->inode_table.start = sb->block_bitmap.start + sb->block_bitmap.count;
 
-	sb->free_inodes_count = sb->inodes_count - 1; // -1 because we are going to create one for root dir of the file system
-	sb->free_blocks_count = sb->blocks_count - 1 - sb->inode_bitmap.count - sb->block_bitmap.count - sb->inode_table.count;
-	sb->first_data_block = sb->inode_table.start + sb->inode_table.count;
+	// Each group starts with its bitmaps and inode table, whose blocks are marked as used
+	a1fs_group_desc *descs = image + sb->group_table.start * A1FS_BLOCK_SIZE;
+	uint32_t bitmap_blocks = ceil_integer_division(sb->blocks_per_group, A1FS_BLOCK_SIZE * 8);
+	uint32_t inode_bitmap_blocks = ceil_integer_division(sb->inodes_per_group, A1FS_BLOCK_SIZE * 8);
+	uint32_t inode_table_blocks = ceil_integer_division64((uint64_t)sb->inodes_per_group * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
+	for(uint32_t g = 0; g < sb->groups_count; g++){
+		a1fs_blk_t first = g * sb->blocks_per_group;
+		uint32_t blocks = sb->blocks_count - first < sb->blocks_per_group ? sb->blocks_count - first : sb->blocks_per_group;
+		a1fs_blk_t next = g == 0 ? sb->group_table.start + sb->group_table.count : first;
+
+		descs[g].block_bitmap = next;
+		descs[g].inode_bitmap = descs[g].block_bitmap + bitmap_blocks;
+		descs[g].inode_table = descs[g].inode_bitmap + inode_bitmap_blocks;
+		next = descs[g].inode_table + inode_table_blocks;
+		if(g == 0){
+			sb->journal.start = opts->n_journal ? next : 0;
+			next += sb->journal.count;
+			sb->first_data_block = next;
+		}
 
-	memcpy(image, sb, sizeof(a1fs_superblock));
+		bitmap_set_range(image + descs[g].block_bitmap * A1FS_BLOCK_SIZE, 0, next - first);
+		descs[g].free_blocks_count = blocks - (next - first);
+		descs[g].free_inodes_count = sb->inodes_per_group;
+		sb->free_blocks_count += descs[g].free_blocks_count;
+	}
 
-	// need to flip the bits in data block bitmap to signal allocated blocks
-	for(uint32_t i = 0; i < 1 + sb->inode_bitmap.count + sb->block_bitmap.count + sb->inode_table.count; i++){
-		byte = ((char *)image)[sb->block_bitmap.start * A1FS_BLOCK_SIZE + i / 8];
-		byte = byte | (1 << (i % 8));
-		memcpy(image + sb->block_bitmap.start * A1FS_BLOCK_SIZE + (i / 8), &byte, sizeof(char));
+	// -1 because we are going to create one for root dir of the file system
+	descs[0].free_inodes_count -= 1;
+	sb->free_inodes_count = sb->inodes_count - 1;
+
+	if(opts->dir_index)
+		sb->features |= A1FS_FEATURE_DIR_INDEX;
+	if(opts->inline_data)
+		sb->features |= A1FS_FEATURE_INLINE_DATA;
+	if(opts->dirent)
+		sb->features |= A1FS_FEATURE_DIRENT;
+	if(opts->n_journal){
+		sb->features |= A1FS_FEATURE_JOURNAL;
+		// An empty log: no block of it carries the header's sequence number yet
+		a1fs_journal_header *header = image + sb->journal.start * A1FS_BLOCK_SIZE;
+		header->magic = A1FS_JOURNAL_MAGIC;
+		header->sequence = 1;
 	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	sb->hash_seed = now.tv_sec ^ now.tv_nsec ^ getpid(); // only needs to differ between images
+
+	memcpy(image, sb, sizeof(a1fs_superblock));
 
 	// we must now create the root dir inode and write to the disk image
 	struct a1fs_inode *root_dir_inode = calloc(1,  sizeof(a1fs_inode));
@@ -180,10 +272,9 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	root_dir_inode->indirect = 0; // no indirect block yet
 	root_dir_inode->num_extents = 0; // no extents allocated yet
 
-	memcpy(image + sb->inode_table.start * A1FS_BLOCK_SIZE, root_dir_inode, sizeof(a1fs_inode));
-	byte = ((char *)image)[sb->inode_bitmap.start * A1FS_BLOCK_SIZE];
-	byte = byte | (1 << 0);
-	memcpy(image + sb->inode_bitmap.start * A1FS_BLOCK_SIZE, &byte, sizeof(char));
+	// the root dir is inode 0, the first inode of group 0
+	memcpy(image + descs[0].inode_table * A1FS_BLOCK_SIZE, root_dir_inode, sizeof(a1fs_inode));
+	bitmap_set_range(image + descs[0].inode_bitmap * A1FS_BLOCK_SIZE, 0, 1);
 
 	free(sb);
 	free(root_dir_inode);
@@ -207,7 +298,7 @@ int main(int argc, char *argv[])
 
 	// Map image file into memory
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size, NULL);
 	if (image == NULL) return 1;
 
 	// Check if overwriting existing file system
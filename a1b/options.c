@@ -28,9 +28,45 @@
 
 #define A1FS_OPT(t, p) { t, offsetof(a1fs_opts, p), 1 }
 
+// Keys of the options opt_proc() parses itself
+enum {
+	KEY_META_ADVICE,
+	KEY_DATA_ADVICE,
+};
+
+// Bounds and default for the max_read option
+#define A1FS_MIN_MAX_READ     4096
+#define A1FS_MAX_MAX_READ     (1024 * 1024)
+#define A1FS_DEFAULT_MAX_READ (128 * 1024)
+
+// Bounds and default for the max_write option
+#define A1FS_MIN_MAX_WRITE     4096
+#define A1FS_MAX_MAX_WRITE     (1024 * 1024)
+#define A1FS_DEFAULT_MAX_WRITE (128 * 1024)
+
+// Bounds and default for the commit option
+#define A1FS_MIN_COMMIT     1
+#define A1FS_MAX_COMMIT     3600
+#define A1FS_DEFAULT_COMMIT 5
+
+// Bounds for the cache option (MB)
+#define A1FS_MIN_CACHE 4
+#define A1FS_MAX_CACHE (1024 * 1024)
+
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("max_read=%u", max_read),
+	A1FS_OPT("max_write=%u", max_write),
+	A1FS_OPT("commit=%u", commit),
+	A1FS_OPT("delalloc", delalloc),
+	A1FS_OPT("cache=%u", cache),
+	A1FS_OPT("direct", direct),
+	A1FS_OPT("uring", uring),
+	A1FS_OPT("prefault", prefault),
+	A1FS_OPT("hugepage", hugepage),
+	FUSE_OPT_KEY("meta_advice=", KEY_META_ADVICE),
+	FUSE_OPT_KEY("data_advice=", KEY_DATA_ADVICE),
 	FUSE_OPT_END
 };
 
@@ -38,14 +74,59 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are served by multiple threads; pass -s to use only one.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o max_read=N          largest read request in bytes\n\
+                           (4096 - 1048576, default 131072)\n\
+    -o max_write=N         largest write request in bytes; the kernel may\n\
+                           cap it at 131072 (4096 - 1048576, default 131072)\n\
+    -o commit=N            seconds between journal commits on images made\n\
+                           with mkfs.a1fs -j (1 - 3600, default 5)\n\
+    -o delalloc            delay block allocation for appended data until\n\
+                           the file is flushed, synced or closed\n\
+    -o cache=N             read and write the image with pread()/pwrite()\n\
+                           through an N MB cache of file data instead of\n\
+                           mapping it (4 - 1048576, default: map it;\n\
+                           64 on images made with mkfs.a1fs -j, which\n\
+                           are never mapped)\n\
+    -o direct              with cache, bypass the page cache (O_DIRECT)\n\
+    -o uring               with cache, batch reads and writes through\n\
+                           io_uring and read ahead into the cache\n\
+    -o prefault            fault the metadata (superblock, group table,\n\
+                           bitmaps, inode tables) in at mount\n\
+    -o hugepage            back the image mapping with transparent huge\n\
+                           pages (with cache: the metadata)\n\
+    -o meta_advice=MODE    access pattern of the metadata: normal (default),\n\
+                           random, sequential or willneed (read it ahead\n\
+                           at mount)\n\
+    -o data_advice=MODE    access pattern of the rest of the image (same\n\
+                           modes)\n\
+\n\
+An image on a hugetlbfs mount is mapped with huge pages without any option.\n\
+\n\
 ";
 
+/** Parse the MODE of an advice option; -1 if it is not one. */
+static int parse_advice(const char *mode)
+{
+	static const char *names[] = {
+		[BDEV_NORMAL]     = "normal",
+		[BDEV_RANDOM]     = "random",
+		[BDEV_SEQUENTIAL] = "sequential",
+		[BDEV_WILLNEED]   = "willneed",
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(mode, names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
 // Callback for fuse_opt_parse()
 static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 {
@@ -56,6 +137,18 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 		opts->img_path = strdup(arg);
 		return 0;
 	}
+	if (key == KEY_META_ADVICE || key == KEY_DATA_ADVICE) {
+		int advice = parse_advice(strchr(arg, '=') + 1);
+		if (advice < 0) {
+			fprintf(stderr, "Invalid advice in %s\n", arg);
+			return -1;
+		}
+		if (key == KEY_META_ADVICE)
+			opts->meta_advice = advice;
+		else
+			opts->data_advice = advice;
+		return 0;
+	}
 	return 1;
 }
 
@@ -74,13 +167,50 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
+	if (opts->max_read == 0) opts->max_read = A1FS_DEFAULT_MAX_READ;
+	if (opts->max_read < A1FS_MIN_MAX_READ || opts->max_read > A1FS_MAX_MAX_READ) {
+		fprintf(stderr, "max_read must be between %d and %d\n",
+		        A1FS_MIN_MAX_READ, A1FS_MAX_MAX_READ);
+		return false;
+	}
+
+	if (opts->max_write == 0) opts->max_write = A1FS_DEFAULT_MAX_WRITE;
+	if (opts->max_write < A1FS_MIN_MAX_WRITE || opts->max_write > A1FS_MAX_MAX_WRITE) {
+		fprintf(stderr, "max_write must be between %d and %d\n",
+		        A1FS_MIN_MAX_WRITE, A1FS_MAX_MAX_WRITE);
+		return false;
+	}
+
+	if (opts->commit == 0) opts->commit = A1FS_DEFAULT_COMMIT;
+	if (opts->commit < A1FS_MIN_COMMIT || opts->commit > A1FS_MAX_COMMIT) {
+		fprintf(stderr, "commit must be between %d and %d\n",
+		        A1FS_MIN_COMMIT, A1FS_MAX_COMMIT);
+		return false;
+	}
+
+	if (opts->cache != 0 && (opts->cache < A1FS_MIN_CACHE || opts->cache > A1FS_MAX_CACHE)) {
+		fprintf(stderr, "cache must be between %d and %d\n",
+		        A1FS_MIN_CACHE, A1FS_MAX_CACHE);
+		return false;
+	}
+	if (opts->direct && opts->cache == 0) {
+		fprintf(stderr, "direct requires the cache option\n");
+		return false;
+	}
+	if (opts->uring && opts->cache == 0) {
+		fprintf(stderr, "uring requires the cache option\n");
+		return false;
+	}
+
+	// Reads and writes can span any number of blocks; let the kernel send (and
+	// read ahead) up to max_read bytes at a time, and write up to max_write.
+	// Without big_writes the kernel splits every write into 4K requests.
+	char opt[128];
+	snprintf(opt, sizeof(opt), "max_read=%u,max_readahead=%u,max_write=%u%s",
+	         opts->max_read, opts->max_read, opts->max_write,
+	         opts->max_write > A1FS_MIN_MAX_WRITE ? ",big_writes" : "");
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, opt);
 
 	return true;
 }
@@ -22,6 +22,8 @@
 
 #include <fuse_opt.h>
 
+#include "bdev.h"
+
 
 /** a1fs command line options. */
 typedef struct a1fs_opts {
@@ -29,6 +31,27 @@ typedef struct a1fs_opts {
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Maximum size of a read request in bytes. */
+	unsigned int max_read;
+	/** Maximum size of a write request in bytes. */
+	unsigned int max_write;
+	/** Stage appended data and allocate its blocks at flush/fsync/release time. */
+	int delalloc;
+	/** Seconds between journal commits. */
+	unsigned int commit;
+	/** Size of the block cache in MB; 0 to map the image instead (see bdev.h). */
+	unsigned int cache;
+	/** Read and write the image with O_DIRECT (with cache only). */
+	int direct;
+	/** Read and write the image through io_uring (with cache only). */
+	int uring;
+	/** Fault the metadata of the image in at mount. */
+	int prefault;
+	/** Use transparent huge pages for the image (the metadata with cache). */
+	int hugepage;
+	/** Access pattern of the metadata and of the data blocks (BDEV_NORMAL to BDEV_WILLNEED). */
+	bdev_advice meta_advice;
+	bdev_advice data_advice;
 
 } a1fs_opts;
 
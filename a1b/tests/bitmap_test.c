@@ -0,0 +1,105 @@
+/**
+ * Bitmap search: the 256 bit search on CPUs with AVX2 and the 64 bit one must
+ * both find what a bit by bit search finds, on random bitmaps with runs of
+ * used and free entries long enough to skip whole chunks, runs that start and
+ * end across 64 and 256 bit boundaries, and sizes that end in a partial word
+ * or byte (whose bits past the end are garbage). Each bitmap is allocated with
+ * exactly its size, so a search that reads past the end shows up under ASan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "bitmap.h"
+
+#define ROUNDS 300
+/** Largest bitmap, in bits. */
+#define MAX_BITS 4200
+
+
+static bool bit(const uint8_t *bitmap, uint32_t i)
+{
+	return bitmap[i / 8] & (1 << (i % 8));
+}
+
+/**
+ * What a bit by bit search finds from each bit: next[set][from] for from in
+ * [0, nbits], the last one being -1.
+ */
+static void reference(const uint8_t *bitmap, uint32_t nbits, long *next[2])
+{
+	next[0][nbits] = next[1][nbits] = -1;
+	for (uint32_t i = nbits; i-- > 0; ) {
+		next[bit(bitmap, i)][i] = i;
+		next[!bit(bitmap, i)][i] = next[!bit(bitmap, i)][i + 1];
+	}
+}
+
+/** Fill a bitmap with runs of set and clear bits, mostly short ones, some of several chunks. */
+static void random_runs(uint8_t *bitmap, uint32_t nbits, uint32_t nbytes)
+{
+	for (uint32_t i = 0; i < nbytes; i++)
+		bitmap[i] = (uint8_t)rand(); // and the bits past nbits stay garbage
+	bool set = rand() % 2;
+	for (uint32_t i = 0; i < nbits; ) {
+		uint32_t run = rand() % 4 == 0 ? 1 + rand() % 1100 : 1 + rand() % 70;
+		if (run > nbits - i)
+			run = nbits - i;
+		if (set)
+			bitmap_set_range(bitmap, i, run);
+		else
+			bitmap_clear_range(bitmap, i, run);
+		i += run;
+		set = !set;
+	}
+}
+
+/** Every search from every bit, with and without AVX2, against the bit by bit one. */
+static void check_all(const uint8_t *bitmap, uint32_t nbits)
+{
+	static long zero[MAX_BITS + 1], set[MAX_BITS + 1];
+	long *next[2] = { zero, set };
+	reference(bitmap, nbits, next);
+	long first_zero = zero[0];
+	for (int avx2 = 0; avx2 < 2; avx2++) {
+		bitmap_use_avx2(avx2);
+		for (uint32_t from = 0; from <= nbits; from++) {
+			// find_zero() wraps around to bit 0
+			long wrapped = zero[from] >= 0 || from == nbits ? zero[from % nbits] :
+			               first_zero < from ? first_zero : -1;
+			if (!CHECK(bitmap_next_zero(bitmap, nbits, from) == zero[from]) ||
+			    !CHECK(bitmap_next_set(bitmap, nbits, from) == set[from]) ||
+			    !CHECK(bitmap_find_zero(bitmap, nbits, from) == wrapped)) {
+				printf("bitmap_test: %u bits, from %u, avx2 %d\n", nbits, from, avx2);
+				break;
+			}
+		}
+	}
+	bitmap_use_avx2(true);
+}
+
+int main(void)
+{
+	srand(1);
+	for (int round = 0; round < ROUNDS; round++) {
+		// sizes around whole chunks and words as well as anything else
+		uint32_t nbits = round % 3 == 0 ? 256 * (1 + rand() % 16) + rand() % 3 - 1 :
+		                 round % 3 == 1 ? 64 * (1 + rand() % 64) + rand() % 9 - 4 : 1 + rand() % MAX_BITS;
+		uint32_t nbytes = (nbits + 7) / 8;
+		uint8_t *bitmap = malloc(nbytes);
+		random_runs(bitmap, nbits, nbytes);
+		check_all(bitmap, nbits);
+
+		// all used but the last bit (or none at all): the whole bitmap is skipped
+		bitmap_set_range(bitmap, 0, nbits);
+		check_all(bitmap, nbits);
+		bitmap_clear_range(bitmap, nbits - 1, 1);
+		check_all(bitmap, nbits);
+		bitmap_clear_range(bitmap, 0, nbits);
+		check_all(bitmap, nbits);
+		free(bitmap);
+	}
+	return test_report("bitmap_test");
+}
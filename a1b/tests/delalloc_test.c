@@ -0,0 +1,334 @@
+/**
+ * Delayed allocation: two files appended to in small interleaved writes must
+ * each end up in one extent once they are flushed, read back the same before
+ * and after the flush, and keep their data across truncates of the staged
+ * part, sparse appends, release and unmount with data still staged. Staged
+ * blocks are reserved (they don't show as free) but not allocated, and
+ * everything is given back once the files are removed. On a full image whose
+ * free space is all single blocks, the flush of a file staged until write()
+ * fails finds room for the indirect block and extent tree its extents need,
+ * so none of the data write() accepted is lost.
+ *
+ * Without delayed allocation, blocks are allocated ahead instead:
+ * fallocate() with FALLOC_FL_KEEP_SIZE allocates blocks past the end of a
+ * file without changing its size, which a remount keeps, and the blocks
+ * speculatively preallocated for a file that is appended to are freed when it
+ * is released.
+ */
+
+#include <errno.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/delalloc_test.img"
+/** Bytes appended per write; not a multiple of the block size. */
+#define CHUNK 1000
+#define CHUNKS 600
+#define SIZE (CHUNK * CHUNKS)
+/** Size of the image that is filled. */
+#define FULL_SIZE (8 << 20)
+
+
+static fs_ctx fs;
+
+static void pattern(char *buf, size_t len, int id)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(id * 17 + i % 253);
+}
+
+/** Number of extents the allocated blocks of a file are in. */
+static int count_extents(uint32_t ino)
+{
+	int extents = 0;
+	inode_rdlock(&fs, ino);
+	uint32_t blocks = inode_blocks(ino, &fs);
+	for (uint32_t b = 0; b < blocks; extents++) {
+		uint32_t contig;
+		if (map_file_block(ino, b, &contig, NULL, &fs) < 0)
+			break;
+		b += contig;
+	}
+	inode_unlock(&fs, ino);
+	return extents;
+}
+
+static bool staged(uint32_t ino)
+{
+	return delalloc_get(&fs.delalloc, ino) != NULL;
+}
+
+/** Check the whole contents of a file against what it should hold. */
+static void check_contents(const char *path, const char *expect, size_t size)
+{
+	a1fs_handle *fh = test_open(path, &fs);
+	if (!CHECK(fh != NULL))
+		return;
+	struct stat st;
+	CHECK(stat_inode(fh->ino, &st, &fs) == 0 && st.st_size == (off_t)size);
+	char *back = malloc(size + 1);
+	CHECK(read_file(fh->ino, fh, back, size + 1, 0, &fs) == (long)size);
+	CHECK(memcmp(expect, back, size) == 0);
+	free(back);
+	release_file(fh, &fs);
+}
+
+static void run(const char *mkfs_args)
+{
+	printf("delalloc_test: mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 16 << 20, 256, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.delalloc = true;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now, before;
+	test_free_counts(&fs, &blocks, &inodes);
+
+	char *a = malloc(SIZE), *b = malloc(SIZE);
+	pattern(a, SIZE, 1);
+	pattern(b, SIZE, 2);
+	long ino_a = test_create("/a", S_IFREG | 0644, &fs);
+	long ino_b = test_create("/b", S_IFREG | 0644, &fs);
+	CHECK(ino_a > 0 && ino_b > 0);
+	a1fs_handle *fa = test_open("/a", &fs), *fb = test_open("/b", &fs);
+
+	// interleaved appends only stage the data
+	for (int i = 0; i < CHUNKS; i++) {
+		CHECK(write_file(ino_a, fa, a + i * CHUNK, CHUNK, (off_t)i * CHUNK, &fs) == CHUNK);
+		CHECK(write_file(ino_b, fb, b + i * CHUNK, CHUNK, (off_t)i * CHUNK, &fs) == CHUNK);
+	}
+	CHECK(staged(ino_a) && staged(ino_b));
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks - blocks_now >= 2 * (SIZE / A1FS_BLOCK_SIZE)); // reserved
+	CHECK(fs.sb->free_blocks_count >= blocks_now);
+	check_contents("/a", a, SIZE);
+
+	// an overwrite of staged data stays staged
+	memcpy(a + 5000, "overwritten", 11);
+	CHECK(write_file(ino_a, fa, "overwritten", 11, 5000, &fs) == 11);
+	check_contents("/a", a, SIZE);
+
+	// one extent each, whatever order the appends came in
+	CHECK(flush_file(ino_a, &fs) == 0);
+	CHECK(flush_file(ino_b, &fs) == 0);
+	CHECK(!staged(ino_a) && !staged(ino_b));
+	CHECK(count_extents(ino_a) == 1);
+	CHECK(count_extents(ino_b) == 1);
+	check_contents("/a", a, SIZE);
+	check_contents("/b", b, SIZE);
+
+	// a write past a hole is not staged, the append after it is; then cut the staged data
+	size_t sparse = SIZE + 3 * A1FS_BLOCK_SIZE + 10, end = sparse + CHUNK;
+	char *c = calloc(1, sparse + 4 * CHUNK);
+	memcpy(c, b, SIZE);
+	memcpy(c + sparse, a, CHUNK);
+	CHECK(write_file(ino_b, fb, a, CHUNK, sparse, &fs) == CHUNK);
+	CHECK(!staged(ino_b));
+	memcpy(c + end, b, CHUNK);
+	CHECK(write_file(ino_b, fb, b, CHUNK, end, &fs) == CHUNK);
+	CHECK(staged(ino_b));
+	check_contents("/b", c, end + CHUNK);
+	end += CHUNK / 2;
+	CHECK(resize_file(ino_b, end, &fs) == 0);
+	check_contents("/b", c, end);
+
+	// release and unmount allocate what is still staged
+	CHECK(write_file(ino_a, fa, b, CHUNK, SIZE, &fs) == CHUNK);
+	release_file(fa, &fs);
+	CHECK(!staged(ino_a));
+	memcpy(c + end, b, CHUNK);
+	CHECK(write_file(ino_b, fb, b, CHUNK, end, &fs) == CHUNK);
+	end += CHUNK;
+	release_file(fb, &fs);
+	CHECK(!staged(ino_b));
+	before = fs.sb->free_blocks_count;
+	fb = test_open("/b", &fs);
+	memcpy(c + end, a, CHUNK);
+	CHECK(write_file(ino_b, fb, a, CHUNK, end, &fs) == CHUNK);
+	end += CHUNK;
+	free(fb); // never released
+	CHECK(staged(ino_b));
+	CHECK(fs.sb->free_blocks_count == before);
+	test_unmount(&fs);
+
+	CHECK(test_mount(&fs, &opts));
+	char *a2 = malloc(SIZE + CHUNK);
+	memcpy(a2, a, SIZE);
+	memcpy(a2 + SIZE, b, CHUNK);
+	check_contents("/a", a2, SIZE + CHUNK);
+	check_contents("/b", c, end);
+	CHECK(test_remove("/a", false, &fs) == 0);
+	CHECK(test_remove("/b", false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+	free(a);
+	free(a2);
+	free(b);
+	free(c);
+}
+
+/** Fill the image with staged appends to a file that gets an extent per block. */
+static void full(const char *mkfs_args)
+{
+	printf("delalloc_test: full image, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, FULL_SIZE, 64, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	CHECK(test_create("/keep", S_IFREG | 0644, &fs) > 0); // the root directory keeps its block
+	test_free_counts(&fs, &blocks, &inodes);
+
+	// two files that take every other block, then one of them goes: the free space is all holes of one block
+	char *data = malloc(FULL_SIZE);
+	pattern(data, FULL_SIZE, 3);
+	long ino_x = test_create("/x", S_IFREG | 0644, &fs);
+	long ino_y = test_create("/y", S_IFREG | 0644, &fs);
+	CHECK(ino_x > 0 && ino_y > 0);
+	for (off_t off = 0; ; off += A1FS_BLOCK_SIZE) {
+		if (write_file(ino_x, NULL, data, A1FS_BLOCK_SIZE, off, &fs) != A1FS_BLOCK_SIZE ||
+		    write_file(ino_y, NULL, data, A1FS_BLOCK_SIZE, off, &fs) != A1FS_BLOCK_SIZE)
+			break;
+	}
+	CHECK(test_remove("/y", false, &fs) == 0);
+	test_unmount(&fs);
+
+	opts.delalloc = true;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	long ino_z = test_create("/z", S_IFREG | 0644, &fs);
+	a1fs_handle *fz = test_open("/z", &fs);
+	if (!CHECK(ino_z > 0 && fz != NULL))
+		return;
+	size_t size = 0;
+	while (size + CHUNK <= FULL_SIZE) {
+		long res = write_file(ino_z, fz, data + size, CHUNK, size, &fs);
+		if (res > 0)
+			size += res;
+		if (res != CHUNK)
+			break;
+	}
+	CHECK(size > (size_t)A1FS_MAX_EXTENTS * A1FS_BLOCK_SIZE);
+	CHECK(staged(ino_z));
+	CHECK(flush_file(ino_z, &fs) == 0);
+	CHECK(!staged(ino_z));
+	CHECK(count_extents(ino_z) > (int)A1FS_MAX_EXTENTS);
+	CHECK(fs.reserved_blocks == 0);
+	check_contents("/z", data, size);
+	release_file(fz, &fs);
+	test_unmount(&fs);
+
+	CHECK(test_mount(&fs, &opts));
+	check_contents("/z", data, size);
+	CHECK(test_remove("/x", false, &fs) == 0);
+	CHECK(test_remove("/z", false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+	free(data);
+}
+
+/** Number of blocks allocated to a file, preallocated ones and metadata included. */
+static uint64_t allocated(long ino)
+{
+	struct stat st;
+	if (!CHECK(stat_inode(ino, &st, &fs) == 0))
+		return 0;
+	return st.st_blocks / (A1FS_BLOCK_SIZE / 512);
+}
+
+/** Blocks allocated past the end of files, with fallocate() and by appends. */
+static void preallocation(const char *mkfs_args)
+{
+	printf("delalloc_test: preallocation, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 16 << 20, 256, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	CHECK(test_create("/keep", S_IFREG | 0644, &fs) > 0); // the root directory keeps its block
+	test_free_counts(&fs, &blocks, &inodes);
+	char *a = malloc(SIZE);
+	pattern(a, SIZE, 1);
+
+	// FALLOC_FL_KEEP_SIZE: blocks past the end, the size stays
+	long ino_k = test_create("/k", S_IFREG | 0644, &fs);
+	if (!CHECK(ino_k > 0))
+		return;
+	CHECK(allocate_file_range(ino_k, FALLOC_FL_KEEP_SIZE, 0, 10 * A1FS_BLOCK_SIZE, &fs) == 0);
+	check_contents("/k", a, 0);
+	CHECK(allocated(ino_k) == 10);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks - 10);
+	CHECK(write_file(ino_k, NULL, a, 5000, 0, &fs) == 5000); // into the blocks already there
+	CHECK(allocated(ino_k) == 10);
+	// and past a hole
+	CHECK(allocate_file_range(ino_k, FALLOC_FL_KEEP_SIZE, 14 * A1FS_BLOCK_SIZE, 2 * A1FS_BLOCK_SIZE, &fs) == 0);
+	check_contents("/k", a, 5000);
+	CHECK(allocated(ino_k) == 12);
+	test_unmount(&fs);
+	CHECK(test_mount(&fs, &opts));
+	check_contents("/k", a, 5000);
+	CHECK(allocated(ino_k) == 12);
+	// growing into them later reads zeros past the old end
+	char *k = calloc(1, 16 * A1FS_BLOCK_SIZE);
+	memcpy(k, a, 5000);
+	CHECK(resize_file(ino_k, 16 * A1FS_BLOCK_SIZE, &fs) == 0);
+	check_contents("/k", k, 16 * A1FS_BLOCK_SIZE);
+	CHECK(allocated(ino_k) == 12);
+	free(k);
+
+	// appends preallocate blocks past the end, release gives back those not written
+	long ino_p = test_create("/p", S_IFREG | 0644, &fs);
+	a1fs_handle *fp = test_open("/p", &fs);
+	if (!CHECK(ino_p > 0 && fp != NULL))
+		return;
+	size_t size = 0;
+	for (int i = 0; i < 20; i++, size += CHUNK)
+		CHECK(write_file(ino_p, fp, a + size, CHUNK, size, &fs) == CHUNK);
+	uint32_t used = ceil_integer_division64(size, A1FS_BLOCK_SIZE);
+	CHECK(allocated(ino_p) > used);
+	release_file(fp, &fs);
+	CHECK(allocated(ino_p) == used);
+	check_contents("/p", a, size);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks - 12 - used);
+	test_unmount(&fs);
+
+	CHECK(test_mount(&fs, &opts));
+	CHECK(allocated(ino_p) == used);
+	check_contents("/p", a, size);
+	CHECK(test_remove("/k", false, &fs) == 0);
+	CHECK(test_remove("/p", false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+	free(a);
+}
+
+int main(void)
+{
+	run("");
+	run("-d -s -j 256");
+	full("");
+	full("-d -s -j 256");
+	preallocation("");
+	preallocation("-s -j 256");
+	remove(IMG);
+	return test_report("delalloc_test");
+}
@@ -0,0 +1,383 @@
+/**
+ * Hash-indexed directories: enough entries go into one directory for its
+ * leaves to split until the root needs a second index level. Every name must
+ * then be found through the index (not the dentry cache), listed exactly once
+ * (also when the listing is read a few entries at a time), still be there
+ * after a remount, and be gone once removed.
+ *
+ * A flat directory that spans a few blocks is listed a page at a time while
+ * the entries already listed are removed, which must not make the listing skip
+ * any; the slots they leave are reused.
+ *
+ * An indexed directory that holds two names with the same hash is listed one
+ * entry at a time while each entry listed is removed: removing the first of
+ * the two must not move the other to a position the listing is already past.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "dir_index.h"
+#include "helpers.h"
+
+#define IMG "tests/dir_index_test.img"
+/**
+ * More than the root alone can index with 16 fixed size dentries per leaf;
+ * compact dirents fit enough of these names per leaf to stay at one level.
+ */
+#define ENTRIES 10000
+
+
+static fs_ctx fs;
+static long inos[ENTRIES];
+
+static void entry_path(char *path, size_t size, int i)
+{
+	snprintf(path, size, "/d/entry-%05d-with-a-longer-name", i);
+}
+
+/** Look a name up in the directory itself, bypassing the dentry cache. */
+static long find(uint32_t dir, int i)
+{
+	char path[64];
+	entry_path(path, sizeof(path), i);
+	inode_rdlock(&fs, dir);
+	long ino = find_dir_entry(dir, get_last_component(path), &fs);
+	inode_unlock(&fs, dir);
+	return ino;
+}
+
+/** What count_entries() collects. */
+typedef struct listing {
+	/** Times each entry was listed. */
+	int seen[ENTRIES];
+	int others;
+	/** Entries to take per read_dir() call before reporting a full buffer; 0 for no limit. */
+	int page;
+	int taken;
+	off_t last_off;
+
+} listing;
+
+static int count_entries(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)st;
+	listing *l = buf;
+	if (l->page > 0 && l->taken == l->page)
+		return 1;
+	int i;
+	if (sscanf(name, "entry-%05d", &i) == 1 && i >= 0 && i < ENTRIES)
+		l->seen[i]++;
+	else
+		l->others++;
+	l->taken++;
+	l->last_off = off;
+	return 0;
+}
+
+/** List the directory page entries at a time and check that exactly the live entries come back once. */
+static void check_listing(uint32_t dir, int page, bool (*live)(int))
+{
+	listing *l = calloc(1, sizeof(listing));
+	l->page = page;
+	off_t off = 0;
+	do {
+		l->taken = 0;
+		CHECK(read_dir(dir, off, count_entries, l, &fs) == 0);
+		off = l->last_off;
+	} while (page > 0 && l->taken == page);
+
+	CHECK(l->others == 2); // "." and ".."
+	int wrong = 0;
+	for (int i = 0; i < ENTRIES; i++)
+		wrong += l->seen[i] != (live(i) ? 1 : 0);
+	CHECK(wrong == 0);
+	free(l);
+}
+
+static bool all(int i)
+{
+	(void)i;
+	return true;
+}
+
+static bool odd(int i)
+{
+	return i % 2 == 1;
+}
+
+static void run(const char *mkfs_args, unsigned int levels)
+{
+	printf("dir_index_test: mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 64 << 20, ENTRIES + 100, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	test_free_counts(&fs, &blocks, &inodes);
+
+	long dir = test_create("/d", S_IFDIR | 0755, &fs);
+	CHECK(dir > 0);
+	char path[64];
+	for (int i = 0; i < ENTRIES; i++) {
+		entry_path(path, sizeof(path), i);
+		inos[i] = test_create(path, S_IFREG | 0644, &fs);
+		CHECK(inos[i] > 0);
+	}
+	CHECK(test_create(path, S_IFREG | 0644, &fs) == -EEXIST);
+
+	a1fs_inode *inode = get_inode(dir, &fs);
+	CHECK(inode->flags & A1FS_INODE_INDEXED);
+	a1fs_dx_root *root = bdev_block(&fs.dev, get_physical_block(inode, 0, &fs));
+	CHECK(root->magic == A1FS_DX_MAGIC);
+	CHECK(root->levels == levels);
+	CHECK(root->num_entries == ENTRIES);
+
+	int missing = 0;
+	for (int i = 0; i < ENTRIES; i++)
+		missing += find(dir, i) != inos[i];
+	CHECK(missing == 0);
+	check_listing(dir, 0, all);
+	check_listing(dir, 37, all);
+
+	// the index is on disk
+	test_unmount(&fs);
+	CHECK(test_mount(&fs, &opts));
+	missing = 0;
+	for (int i = 0; i < ENTRIES; i++)
+		missing += find(dir, i) != inos[i];
+	CHECK(missing == 0);
+
+	for (int i = 0; i < ENTRIES; i += 2) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_remove(path, false, &fs) == 0);
+	}
+	int wrong = 0;
+	for (int i = 0; i < ENTRIES; i++)
+		wrong += find(dir, i) != (i % 2 ? inos[i] : -ENOENT);
+	CHECK(wrong == 0);
+	check_listing(dir, 0, odd);
+	check_listing(dir, 37, odd);
+
+	CHECK(test_remove("/d", true, &fs) == -ENOTEMPTY);
+	for (int i = 1; i < ENTRIES; i += 2) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_remove(path, false, &fs) == 0);
+	}
+	CHECK(test_remove("/d", true, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+/** Entries of the flat directory: a few blocks of fixed size dentries. */
+#define FLAT_ENTRIES 200
+
+static void flat(const char *mkfs_args)
+{
+	printf("dir_index_test: flat, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 4 << 20, FLAT_ENTRIES + 10, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	test_free_counts(&fs, &blocks, &inodes);
+	long dir = test_create("/d", S_IFDIR | 0755, &fs);
+	CHECK(dir > 0);
+	char path[64];
+	for (int i = 0; i < FLAT_ENTRIES; i++) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	}
+	a1fs_inode *inode = get_inode(dir, &fs);
+	CHECK(!(inode->flags & A1FS_INODE_INDEXED));
+	CHECK(inode->size > A1FS_BLOCK_SIZE);
+
+	// like `rm -r`: remove what each page of the listing returned before reading the next
+	listing *l = calloc(1, sizeof(listing));
+	l->page = 10;
+	off_t off = 0;
+	int removed = 0;
+	do {
+		l->taken = 0;
+		CHECK(read_dir(dir, off, count_entries, l, &fs) == 0);
+		off = l->last_off;
+		for (int i = 0; i < FLAT_ENTRIES; i++) {
+			if (l->seen[i] == 1) {
+				entry_path(path, sizeof(path), i);
+				CHECK(test_remove(path, false, &fs) == 0);
+				l->seen[i]++;
+				removed++;
+			}
+		}
+	} while (l->taken == l->page);
+	CHECK(removed == FLAT_ENTRIES);
+	free(l);
+	CHECK(inode->size == 0);
+
+	// removed entries leave slots that new ones take
+	for (int i = 0; i < FLAT_ENTRIES; i++) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	}
+	uint64_t size = inode->size;
+	for (int i = 0; i < FLAT_ENTRIES; i += 2) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_remove(path, false, &fs) == 0);
+	}
+	CHECK(inode->size == size);
+	for (int i = 0; i < FLAT_ENTRIES; i += 2) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	}
+	CHECK(inode->size == size);
+	for (int i = 0; i < FLAT_ENTRIES; i++)
+		CHECK(find(dir, i) > 0);
+
+	for (int i = 0; i < FLAT_ENTRIES; i++) {
+		entry_path(path, sizeof(path), i);
+		CHECK(test_remove(path, false, &fs) == 0);
+	}
+	CHECK(test_remove("/d", true, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+/** Entries of the directory with a hash collision, enough for it to be indexed with compact dirents. */
+#define COLLIDE_ENTRIES 1000
+/** Names hashed to find two with the same hash; a few collisions are expected among 2^18. */
+#define CANDIDATES (1 << 18)
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** The u-th candidate name: random letters, which FNV-1a spreads better than a counter. */
+static void candidate(char *name, size_t size, uint32_t u)
+{
+	uint64_t x = (uint64_t)u * 0x9e3779b97f4a7c15ull + 1;
+	size_t len = size - 1 < 12 ? size - 1 : 12;
+	for (size_t i = 0; i < len; i++) {
+		x ^= x >> 29;
+		x *= 0xbf58476d1ce4e5b9ull;
+		name[i] = 'a' + (x >> 32) % 26;
+	}
+	name[len] = '\0';
+}
+
+/** Find two names with the same dx_hash() on the mounted image (the hash is seeded by mkfs). */
+static bool find_collision(char *a, char *b, size_t size)
+{
+	uint64_t *hashes = malloc(CANDIDATES * sizeof(uint64_t));
+	char name[16];
+	for (uint32_t u = 0; u < CANDIDATES; u++) {
+		candidate(name, sizeof(name), u);
+		hashes[u] = (uint64_t)dx_hash(name, &fs) << 32 | u;
+	}
+	qsort(hashes, CANDIDATES, sizeof(uint64_t), u64_cmp);
+	bool found = false;
+	for (uint32_t k = 1; k < CANDIDATES && !found; k++) {
+		if (hashes[k] >> 32 == hashes[k - 1] >> 32) {
+			candidate(a, size, (uint32_t)hashes[k - 1]);
+			candidate(b, size, (uint32_t)hashes[k]);
+			found = strcmp(a, b) != 0;
+		}
+	}
+	free(hashes);
+	return found;
+}
+
+/** What take_one() collects: the first entry read_dir() returns (the names here are short). */
+typedef struct one_entry {
+	char name[16];
+	off_t off;
+	bool taken;
+
+} one_entry;
+
+static int take_one(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)st;
+	one_entry *e = buf;
+	if (e->taken)
+		return 1;
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	e->off = off;
+	e->taken = true;
+	return 0;
+}
+
+static void collide(const char *mkfs_args)
+{
+	printf("dir_index_test: collision, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 16 << 20, COLLIDE_ENTRIES + 10, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	char a[16], b[16], path[64];
+	if (!CHECK(find_collision(a, b, sizeof(a)))) {
+		test_unmount(&fs);
+		return;
+	}
+	long dir = test_create("/d", S_IFDIR | 0755, &fs);
+	CHECK(dir > 0);
+	for (int i = 0; i < COLLIDE_ENTRIES - 2; i++) {
+		snprintf(path, sizeof(path), "/d/f%04d", i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	}
+	snprintf(path, sizeof(path), "/d/%s", a);
+	CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	snprintf(path, sizeof(path), "/d/%s", b);
+	CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	CHECK(get_inode(dir, &fs)->flags & A1FS_INODE_INDEXED);
+
+	one_entry e;
+	off_t off = 0;
+	int removed = 0, seen_a = 0, seen_b = 0;
+	for (;;) {
+		e.taken = false;
+		CHECK(read_dir(dir, off, take_one, &e, &fs) == 0);
+		if (!e.taken)
+			break;
+		off = e.off;
+		if (strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0)
+			continue;
+		seen_a += strcmp(e.name, a) == 0;
+		seen_b += strcmp(e.name, b) == 0;
+		snprintf(path, sizeof(path), "/d/%s", e.name);
+		CHECK(test_remove(path, false, &fs) == 0);
+		removed++;
+	}
+	CHECK(seen_a == 1);
+	CHECK(seen_b == 1);
+	CHECK(removed == COLLIDE_ENTRIES);
+	CHECK(test_remove("/d", true, &fs) == 0);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	run("-d", 1);
+	run("-d -c", 0);
+	flat("");
+	flat("-c");
+	collide("-d");
+	collide("-d -c");
+	remove(IMG);
+	return test_report("dir_index_test");
+}
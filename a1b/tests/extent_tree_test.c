@@ -0,0 +1,149 @@
+/**
+ * Extent trees: two files appended to a block at a time in turn get an extent
+ * per block, far more than the inode and its indirect block hold, so both are
+ * converted to trees that grow two levels of index nodes. A sparse file gets
+ * its tree from its first hole, and filling holes inserts extents in the
+ * middle of it. Every block must read back what was written to it, also
+ * after a remount, and truncating the files must free the nodes with the
+ * data until they are back to the plain extent format.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "helpers.h"
+#include "extent_tree.h"
+
+#define IMG "tests/extent_tree_test.img"
+/** Extents of each file: more than A1FS_MAX_EXTENTS, and than a root of leaves can index. */
+#define EXTENTS 4000
+
+
+static fs_ctx fs;
+
+/** A block that tells which file and block it belongs to. */
+static void pattern(char *buf, int file, uint32_t block)
+{
+	for (size_t i = 0; i < A1FS_BLOCK_SIZE; i++)
+		buf[i] = (char)(file * 71 + block * 13 + i % 239);
+}
+
+static a1fs_et_header *root(uint32_t ino)
+{
+	return (a1fs_et_header *)get_inode(ino, &fs)->extents;
+}
+
+/** Write one block of a file without a handle, so that nothing is preallocated for it. */
+static void write_block(uint32_t ino, int file, uint32_t block)
+{
+	char buf[A1FS_BLOCK_SIZE];
+	pattern(buf, file, block);
+	CHECK(write_file(ino, NULL, buf, sizeof(buf), (off_t)block * A1FS_BLOCK_SIZE, &fs) == sizeof(buf));
+}
+
+/**
+ * Check the blocks of a file below end: every stride-th one holds its
+ * pattern, the others are holes.
+ *
+ * @return  the number of blocks that don't read back right.
+ */
+static int check_blocks(uint32_t ino, int file, uint32_t end, uint32_t stride)
+{
+	char expect[A1FS_BLOCK_SIZE], got[A1FS_BLOCK_SIZE];
+	int wrong = 0;
+	for (uint32_t b = 0; b < end; b++) {
+		if (b % stride == 0)
+			pattern(expect, file, b);
+		else
+			memset(expect, 0, sizeof(expect));
+		if (read_file(ino, NULL, got, sizeof(got), (off_t)b * A1FS_BLOCK_SIZE, &fs) != sizeof(got) ||
+		    memcmp(expect, got, sizeof(got)) != 0)
+			wrong++;
+	}
+	return wrong;
+}
+
+static uint32_t data_blocks(uint32_t ino)
+{
+	inode_rdlock(&fs, ino);
+	uint32_t blocks = extent_tree_blocks(get_inode(ino, &fs), &fs);
+	inode_unlock(&fs, ino);
+	return blocks;
+}
+
+static void run(const char *mkfs_args)
+{
+	printf("extent_tree_test: mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 64 << 20, 64, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	test_free_counts(&fs, &blocks, &inodes);
+
+	// every block of one file is followed on disk by a block of the other
+	long a = test_create("/a", S_IFREG | 0644, &fs);
+	long b = test_create("/b", S_IFREG | 0644, &fs);
+	for (uint32_t k = 0; k < EXTENTS; k++) {
+		write_block(a, 0, k);
+		write_block(b, 1, k);
+	}
+	CHECK(get_inode(a, &fs)->flags & A1FS_INODE_EXTENT_TREE);
+	CHECK(root(a)->magic == A1FS_ET_MAGIC);
+	CHECK(root(a)->depth == 2);
+	CHECK(data_blocks(a) == EXTENTS);
+
+	// a hole, then holes filled in the middle of the tree
+	long s = test_create("/sparse", S_IFREG | 0644, &fs);
+	for (uint32_t k = 0; k < EXTENTS; k += 2)
+		write_block(s, 2, 2 * k);
+	CHECK(get_inode(s, &fs)->flags & A1FS_INODE_EXTENT_TREE);
+	for (uint32_t k = 1; k < EXTENTS; k += 2)
+		write_block(s, 2, 2 * k);
+	CHECK(root(s)->depth >= 1);
+	CHECK(data_blocks(s) == EXTENTS);
+	struct stat st;
+	CHECK(stat_inode(s, &st, &fs) == 0 && st.st_size == (off_t)(2 * EXTENTS - 1) * A1FS_BLOCK_SIZE);
+
+	CHECK(check_blocks(a, 0, EXTENTS, 1) == 0);
+	CHECK(check_blocks(b, 1, EXTENTS, 1) == 0);
+	CHECK(check_blocks(s, 2, 2 * EXTENTS - 1, 2) == 0);
+	test_unmount(&fs);
+
+	CHECK(test_mount(&fs, &opts));
+	CHECK(check_blocks(a, 0, EXTENTS, 1) == 0);
+	CHECK(check_blocks(s, 2, 2 * EXTENTS - 1, 2) == 0);
+
+	// shrinking removes extents from the end and frees the nodes left empty
+	CHECK(resize_file(a, (off_t)EXTENTS / 2 * A1FS_BLOCK_SIZE, &fs) == 0);
+	CHECK(data_blocks(a) == EXTENTS / 2);
+	CHECK(check_blocks(a, 0, EXTENTS / 2, 1) == 0);
+	CHECK(resize_file(a, 100 * A1FS_BLOCK_SIZE, &fs) == 0);
+	CHECK(root(a)->depth == 1);
+	CHECK(check_blocks(a, 0, 100, 1) == 0);
+	CHECK(resize_file(a, 0, &fs) == 0);
+	CHECK(!(get_inode(a, &fs)->flags & A1FS_INODE_EXTENT_TREE));
+	write_block(a, 0, 0);
+	CHECK(check_blocks(a, 0, 1, 1) == 0);
+
+	CHECK(test_remove("/a", false, &fs) == 0);
+	CHECK(test_remove("/b", false, &fs) == 0);
+	CHECK(test_remove("/sparse", false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	run("");
+	run("-s -j 256");
+	remove(IMG);
+	return test_report("extent_tree_test");
+}
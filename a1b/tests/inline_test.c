@@ -0,0 +1,169 @@
+/**
+ * Inline data (mkfs -s): a small file keeps its data in the inode and takes no
+ * block, and moves it into a block when it grows past A1FS_INLINE_MAX bytes,
+ * by a write that ends past it (right at the boundary, or past a hole) or by a
+ * truncate. The contents and the number of allocated blocks must be the same
+ * before and after a remount, also once a converted file is truncated back
+ * below the boundary and grown again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/inline_test.img"
+#define B A1FS_BLOCK_SIZE
+/** Largest file of the test. */
+#define MAX_SIZE (3 * B + 7)
+
+
+static fs_ctx fs;
+
+/** What a file of the test should hold. */
+typedef struct expect {
+	const char *path;
+	long ino;
+	char data[MAX_SIZE];
+	size_t size;
+	/** Blocks allocated to it. */
+	uint64_t blocks;
+	bool inline_data;
+
+} expect;
+
+static void pattern(char *buf, size_t len, int id)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(id * 13 + i % 241 + 1); // never 0, so zeroing shows
+}
+
+/** Write len bytes of the file's pattern at offset, and expect them. */
+static void write_at(expect *e, size_t offset, size_t len)
+{
+	char buf[MAX_SIZE];
+	pattern(buf, len, (int)e->ino);
+	CHECK(write_file(e->ino, NULL, buf, len, offset, &fs) == (long)len);
+	memcpy(e->data + offset, buf, len);
+	if (offset + len > e->size)
+		e->size = offset + len;
+	CHECK(flush_file(e->ino, &fs) == 0); // staged data gets its blocks now
+}
+
+/** Truncate the file, and expect zeros where it grows. */
+static void truncate_to(expect *e, size_t size)
+{
+	CHECK(resize_file(e->ino, size, &fs) == 0);
+	if (size > e->size)
+		memset(e->data + e->size, 0, size - e->size);
+	e->size = size;
+}
+
+static void check(const expect *e)
+{
+	struct stat st;
+	if (!CHECK(stat_inode(e->ino, &st, &fs) == 0))
+		return;
+	CHECK(st.st_size == (off_t)e->size);
+	CHECK((uint64_t)st.st_blocks == e->blocks * (B / 512));
+	CHECK(!(get_inode(e->ino, &fs)->flags & A1FS_INODE_INLINE) == !e->inline_data);
+
+	char back[MAX_SIZE + 1];
+	a1fs_handle *fh = test_open(e->path, &fs);
+	if (!CHECK(fh != NULL))
+		return;
+	CHECK(read_file(e->ino, fh, back, sizeof(back), 0, &fs) == (long)e->size);
+	CHECK(memcmp(e->data, back, e->size) == 0);
+	release_file(fh, &fs);
+}
+
+static void run(const char *mkfs_args, bool delalloc)
+{
+	printf("inline_test: mkfs %s%s\n", mkfs_args, delalloc ? ", delalloc" : "");
+	if (!CHECK(test_mkfs(IMG, 4 << 20, 64, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.delalloc = delalloc;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	CHECK(test_create("/keep", S_IFREG | 0644, &fs) > 0); // the root directory keeps its block
+	test_free_counts(&fs, &blocks, &inodes);
+
+	static expect files[4] = { { .path = "/a" }, { .path = "/b" }, { .path = "/c" }, { .path = "/d" } };
+	for (int i = 0; i < 4; i++) {
+		expect *e = &files[i];
+		e->ino = test_create(e->path, S_IFREG | 0644, &fs);
+		if (!CHECK(e->ino > 0))
+			return;
+		memset(e->data, 0, sizeof(e->data));
+		e->size = 0;
+		e->blocks = 0;
+		e->inline_data = true;
+	}
+
+	// a: a write that ends past the boundary, then a truncate back below it and up again
+	expect *a = &files[0];
+	write_at(a, 0, 50);
+	check(a);
+	write_at(a, 50, 100);
+	a->blocks = 1;
+	a->inline_data = false;
+	check(a);
+	truncate_to(a, 60);
+	check(a); // stays in its block
+	truncate_to(a, MAX_SIZE);
+	check(a); // the rest is a hole
+
+	// b: a truncate past the boundary
+	expect *b = &files[1];
+	write_at(b, 0, 70);
+	truncate_to(b, 200);
+	b->blocks = 1;
+	b->inline_data = false;
+	check(b);
+
+	// c: full, then one byte more
+	expect *c = &files[2];
+	write_at(c, 0, A1FS_INLINE_MAX);
+	check(c);
+	write_at(c, A1FS_INLINE_MAX, 1);
+	c->blocks = 1;
+	c->inline_data = false;
+	check(c);
+
+	// d: a write past a hole; the file gets an extent tree
+	expect *d = &files[3];
+	write_at(d, 0, 40);
+	write_at(d, 2 * B + 10, 10);
+	d->blocks = 2;
+	d->inline_data = false;
+	check(d);
+
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks - 5);
+	test_unmount(&fs);
+	CHECK(test_mount(&fs, &opts));
+	for (int i = 0; i < 4; i++)
+		check(&files[i]);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks - 5);
+
+	for (int i = 0; i < 4; i++)
+		CHECK(test_remove(files[i].path, false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	run("-s", false);
+	run("-s -j 256", true);
+	remove(IMG);
+	return test_report("inline_test");
+}
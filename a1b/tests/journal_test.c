@@ -0,0 +1,410 @@
+/**
+ * Metadata journal: a crash after a transaction was committed to the log but
+ * before it was checkpointed must be replayed at mount, and a transaction
+ * whose commit block did not make it to disk must not be. The crash is
+ * simulated on a copy of the image taken right after the commit, by putting
+ * back the metadata blocks of the transaction as they were before it.
+ *
+ * Blocks freed by a transaction must not get a new owner before it commits:
+ * a crash before the commit brings back the metadata that still points at
+ * them, and the data of the new owner would show up in the old one. Once
+ * they are reused for file data, the data must be written back like any
+ * other, even in a block that used to be metadata.
+ *
+ * Operations that dirty far more blocks than the log holds (a large
+ * fallocate(), truncate, write and remove on an image with tiny groups) must
+ * be split over several transactions instead of failing the journal.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/journal_test.img"
+#define BEFORE "tests/journal_test.before.img"
+#define CRASH "tests/journal_test.crash.img"
+#define FILES 20
+#define OLD_BLOCKS 16
+#define DIR_FILES 10
+
+
+static fs_ctx fs;
+static char block[A1FS_BLOCK_SIZE];
+
+static bool read_block(int fd, uint32_t b, void *buf)
+{
+	return pread(fd, buf, A1FS_BLOCK_SIZE, (off_t)b * A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE;
+}
+
+static bool write_block(int fd, uint32_t b, const void *buf)
+{
+	return pwrite(fd, buf, A1FS_BLOCK_SIZE, (off_t)b * A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE;
+}
+
+static bool copy_image(const char *from, const char *to)
+{
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	bool ok = in >= 0 && out >= 0;
+	for (uint32_t b = 0; ok && read_block(in, b, block); b++)
+		ok = write_block(out, b, block);
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	return ok;
+}
+
+/** The journal region of an image and the sequence number in its header. */
+static a1fs_extent journal_region(int fd, uint64_t *sequence)
+{
+	a1fs_superblock sb;
+	a1fs_extent none = {0, 0};
+	if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || !read_block(fd, sb.journal.start, block))
+		return none;
+	*sequence = ((a1fs_journal_header *)block)->sequence;
+	return sb.journal;
+}
+
+/**
+ * Turn the image taken right after a commit into the image of a crash before
+ * the checkpoint: the home blocks the log lists get their contents from
+ * before the transaction back, and the header takes back the sequence number
+ * of the transaction. With torn, the commit block is lost as well.
+ *
+ * @return  the number of blocks put back; -1 on error.
+ */
+static int make_crash_image(bool torn)
+{
+	if (!copy_image(IMG, CRASH))
+		return -1;
+	int fd = open(CRASH, O_RDWR), before = open(BEFORE, O_RDONLY);
+	int restored = -1;
+	uint64_t sequence;
+	a1fs_extent region = journal_region(fd, &sequence);
+	a1fs_journal_descriptor *desc = malloc(A1FS_BLOCK_SIZE);
+	uint32_t pos = 0;
+	if (region.count == 0)
+		goto out;
+
+	restored = 0;
+	while (read_block(fd, region.start + 1 + pos, desc) && desc->magic == A1FS_JOURNAL_MAGIC) {
+		if (desc->type == A1FS_JOURNAL_COMMIT) {
+			if (torn) {
+				memset(desc, 0, A1FS_BLOCK_SIZE);
+				write_block(fd, region.start + 1 + pos, desc);
+			}
+			sequence = desc->sequence;
+			break;
+		}
+		for (uint32_t k = 0; k < desc->count; k++) {
+			if (!read_block(before, desc->blocks[k], block) || !write_block(fd, desc->blocks[k], block)) {
+				restored = -1;
+				goto out;
+			}
+			restored++;
+		}
+		pos += 1 + desc->count;
+	}
+	read_block(fd, region.start, block);
+	((a1fs_journal_header *)block)->sequence = sequence;
+	write_block(fd, region.start, block);
+
+out:
+	free(desc);
+	close(fd);
+	close(before);
+	return restored;
+}
+
+static void pattern(char *buf, size_t len, int i)
+{
+	for (size_t k = 0; k < len; k++)
+		buf[k] = (char)(i * 13 + k % 241);
+}
+
+static size_t length_of(int i)
+{
+	return 100 + (size_t)i * 2000;
+}
+
+static void check_files(bool present)
+{
+	char path[32], *buf = malloc(length_of(FILES)), *back = malloc(length_of(FILES));
+	CHECK((path_lookup("/a", &fs) >= 0) == present);
+	CHECK((path_lookup("/gone", &fs) == -ENOENT));
+	for (int i = 0; present && i < FILES; i++) {
+		snprintf(path, sizeof(path), "/a/f%d", i);
+		a1fs_handle *fh = test_open(path, &fs);
+		if (!CHECK(fh != NULL))
+			continue;
+		size_t n = length_of(i);
+		pattern(buf, n, i);
+		CHECK(read_file(fh->ino, fh, back, length_of(FILES), 0, &fs) == (long)n);
+		CHECK(memcmp(buf, back, n) == 0);
+		release_file(fh, &fs);
+	}
+	free(buf);
+	free(back);
+}
+
+/** Change the image in one transaction and check that a crash right after its commit is replayed. */
+static void replay(const char *mkfs_args)
+{
+	printf("journal_test: replay, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 16 << 20, 256, mkfs_args)) || !CHECK(copy_image(IMG, BEFORE)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.commit = 3600; // nothing is committed behind the test's back
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	test_free_counts(&fs, &blocks, &inodes);
+
+	CHECK(test_create("/a", S_IFDIR | 0755, &fs) > 0);
+	CHECK(test_create("/gone", S_IFREG | 0644, &fs) > 0);
+	char path[32], *buf = malloc(length_of(FILES));
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "/a/f%d", i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+		a1fs_handle *fh = test_open(path, &fs);
+		if (!CHECK(fh != NULL))
+			continue;
+		size_t n = length_of(i);
+		pattern(buf, n, i);
+		CHECK(write_file(fh->ino, fh, buf, n, 0, &fs) == (long)n);
+		CHECK(flush_file(fh->ino, &fs) == 0);
+		release_file(fh, &fs);
+	}
+	free(buf);
+	CHECK(test_remove("/gone", false, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+
+	int fd = open(IMG, O_RDONLY);
+	uint64_t first, sequence;
+	journal_region(fd, &first);
+	CHECK(journal_commit(&fs.journal) == 0);
+	journal_region(fd, &sequence);
+	close(fd);
+	CHECK(sequence == first + 1); // exactly one transaction
+	int restored = make_crash_image(false);
+	CHECK(restored > 0);
+	CHECK(make_crash_image(true) == restored);
+	test_unmount(&fs);
+
+	// committed: everything is back after the replay, and stays there
+	make_crash_image(false);
+	opts.img_path = CRASH;
+	for (int mount = 0; mount < 2; mount++) {
+		if (!CHECK(test_mount(&fs, &opts)))
+			return;
+		check_files(true);
+		uint64_t b, n;
+		test_free_counts(&fs, &b, &n);
+		CHECK(b == blocks_now);
+		CHECK(n == inodes_now);
+		test_unmount(&fs);
+	}
+
+	// torn: the image is as it was before the transaction
+	make_crash_image(true);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	check_files(false);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+/** Add the physical blocks of the first count blocks of a file to blocks; returns the new total. */
+static int file_blocks(uint32_t ino, uint32_t count, uint32_t *blocks, int n)
+{
+	for (uint32_t b = 0; b < count; b++) {
+		uint32_t contig;
+		long block = map_file_block(ino, b, &contig, NULL, &fs);
+		if (CHECK(block >= 0))
+			blocks[n++] = block;
+	}
+	return n;
+}
+
+static long write_new(const char *path, size_t len, int i, bool flush)
+{
+	char *buf = malloc(len);
+	pattern(buf, len, i);
+	long ino = test_create(path, S_IFREG | 0644, &fs);
+	a1fs_handle *fh = test_open(path, &fs);
+	if (CHECK(fh != NULL)) {
+		CHECK(write_file(ino, fh, buf, len, 0, &fs) == (long)len);
+		if (flush)
+			CHECK(flush_file(ino, &fs) == 0); // the data goes to disk now, the metadata does not
+		release_file(fh, &fs);
+	}
+	free(buf);
+	return ino;
+}
+
+/**
+ * Free the blocks of a file and a directory, write new files that would fit
+ * best in them, and crash before the transaction that freed them commits.
+ */
+static void reuse(const char *mkfs_args)
+{
+	printf("journal_test: reuse, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 16 << 20, 256, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.commit = 3600; // nothing is committed behind the test's back
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+
+	char path[32];
+	long dir = test_create("/dir", S_IFDIR | 0755, &fs);
+	for (int i = 0; i < DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "/dir/e%d", i);
+		CHECK(test_create(path, S_IFREG | 0644, &fs) > 0);
+	}
+	size_t old_len = OLD_BLOCKS * A1FS_BLOCK_SIZE;
+	long old = write_new("/old", old_len, 1, true);
+	write_new("/fence", A1FS_BLOCK_SIZE, 2, true); // keeps the blocks of /old apart from the free space after them
+	CHECK(journal_commit(&fs.journal) == 0);
+
+	uint32_t freed[OLD_BLOCKS + 1], used[OLD_BLOCKS + 2];
+	int nfreed = file_blocks(old, OLD_BLOCKS, freed, 0);
+	nfreed = file_blocks(dir, 1, freed, nfreed);
+	CHECK(test_remove("/old", false, &fs) == 0);
+	for (int i = 0; i < DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "/dir/e%d", i);
+		CHECK(test_remove(path, false, &fs) == 0);
+	}
+	CHECK(test_remove("/dir", true, &fs) == 0);
+
+	// the shortest free runs that fit are the ones just freed
+	int nused = file_blocks(write_new("/new", old_len, 3, true), OLD_BLOCKS, used, 0);
+	nused = file_blocks(write_new("/small", A1FS_BLOCK_SIZE, 4, true), 1, used, nused);
+	for (int i = 0; i < nused; i++) {
+		for (int k = 0; k < nfreed; k++)
+			CHECK(used[i] != freed[k]);
+	}
+	CHECK(copy_image(IMG, CRASH)); // crash before the transaction that freed them commits
+
+	// once committed they are reused, and data written into the old directory block is not
+	// flushed, so it reaches the disk only if the block is written back like any data block
+	CHECK(journal_commit(&fs.journal) == 0);
+	long late = write_new("/late", old_len + A1FS_BLOCK_SIZE, 5, false);
+	nused = file_blocks(late, OLD_BLOCKS + 1, used, 0);
+	bool reused = false;
+	for (int i = 0; i < nused; i++)
+		reused |= used[i] == freed[nfreed - 1];
+	CHECK(reused);
+	test_unmount(&fs);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	char *buf = malloc(old_len + A1FS_BLOCK_SIZE), *back = malloc(old_len + A1FS_BLOCK_SIZE);
+	pattern(buf, old_len + A1FS_BLOCK_SIZE, 5);
+	a1fs_handle *fh = test_open("/late", &fs);
+	if (CHECK(fh != NULL)) {
+		CHECK(read_file(fh->ino, fh, back, old_len + A1FS_BLOCK_SIZE, 0, &fs) == (long)(old_len + A1FS_BLOCK_SIZE));
+		CHECK(memcmp(buf, back, old_len + A1FS_BLOCK_SIZE) == 0);
+		release_file(fh, &fs);
+	}
+	test_unmount(&fs);
+
+	opts.img_path = CRASH;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	CHECK(path_lookup("/new", &fs) == -ENOENT);
+	for (int i = 0; i < DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "/dir/e%d", i);
+		CHECK(path_lookup(path, &fs) > 0);
+	}
+	pattern(buf, old_len, 1);
+	fh = test_open("/old", &fs);
+	if (CHECK(fh != NULL)) {
+		CHECK(read_file(fh->ino, fh, back, old_len, 0, &fs) == (long)old_len);
+		CHECK(memcmp(buf, back, old_len) == 0);
+		release_file(fh, &fs);
+	}
+	free(buf);
+	free(back);
+	test_unmount(&fs);
+}
+
+/** Change far more blocks in one operation than the log holds. */
+static void split(const char *mkfs_args)
+{
+	printf("journal_test: split, mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 128 << 20, 256, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now, empty;
+	test_free_counts(&fs, &blocks, &inodes);
+
+	long ino = test_create("/big", S_IFREG | 0644, &fs);
+	CHECK(ino > 0);
+	test_free_counts(&fs, &empty, &inodes_now);
+	off_t len = 100 << 20;
+	CHECK(allocate_file_range(ino, 0, 0, len, &fs) == 0);
+	struct stat st;
+	CHECK(stat_inode(ino, &st, &fs) == 0 && st.st_size == len);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(empty - blocks_now >= (uint64_t)len / A1FS_BLOCK_SIZE);
+	CHECK(resize_file(ino, 0, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == empty);
+
+	// one write that needs an extent and a bitmap block in every group it spans
+	size_t size = 40 << 20;
+	char *buf = malloc(size), *back = malloc(size);
+	pattern(buf, size, 7);
+	CHECK(allocate_file_range(ino, 0, 0, len / 2, &fs) == 0);
+	long other = test_create("/other", S_IFREG | 0644, &fs);
+	a1fs_handle *fh = test_open("/other", &fs);
+	CHECK(write_file(other, fh, buf, size, 0, &fs) == (long)size);
+	CHECK(read_file(other, fh, back, size, 0, &fs) == (long)size);
+	CHECK(memcmp(buf, back, size) == 0);
+	release_file(fh, &fs);
+	free(buf);
+	free(back);
+
+	CHECK(test_remove("/big", false, &fs) == 0);
+	CHECK(test_remove("/other", false, &fs) == 0);
+	CHECK(journal_commit(&fs.journal) == 0);
+	CHECK(!fs.journal.failed);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+
+	CHECK(test_mount(&fs, &opts));
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	replay("-j 256");
+	replay("-d -s -c -j 256");
+	reuse("-j 256");
+	reuse("-d -s -j 256");
+	split("-j 128 -g 256");
+	split("-d -s -j 128 -g 256");
+	remove(IMG);
+	remove(BEFORE);
+	remove(CRASH);
+	return test_report("journal_test");
+}
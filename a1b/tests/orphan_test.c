@@ -0,0 +1,172 @@
+/**
+ * Orphans: a file removed while it is open, or while the kernel holds a lookup
+ * reference to it (ref_inode()), keeps its inode and blocks and can still be
+ * read and written until the last reference is dropped, which frees them. An
+ * inode number that is reused gets a new generation. An image copied while it
+ * had an orphan, as a crash would leave it, gets the orphan freed at mount.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/orphan_test.img"
+#define CRASH "tests/orphan_test.crash.img"
+#define SIZE (5 * A1FS_BLOCK_SIZE + 123)
+
+
+static fs_ctx fs;
+
+static bool copy_image(const char *from, const char *to)
+{
+	char block[A1FS_BLOCK_SIZE];
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	bool ok = in >= 0 && out >= 0;
+	ssize_t n;
+	while (ok && (n = read(in, block, sizeof(block))) > 0)
+		ok = write(out, block, n) == n;
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	return ok;
+}
+
+static uint32_t generation(uint32_t ino)
+{
+	uint32_t gen = 0;
+	CHECK(ref_inode(ino, &gen, &fs) == 0);
+	forget_inode(ino, 1, &fs);
+	return gen;
+}
+
+static void run(const char *mkfs_args)
+{
+	printf("orphan_test: mkfs %s\n", mkfs_args);
+	if (!CHECK(test_mkfs(IMG, 4 << 20, 64, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.commit = 3600; // nothing is committed behind the test's back
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+	uint64_t blocks, inodes, blocks_now, inodes_now, used, left;
+	CHECK(test_create("/keep", S_IFREG | 0644, &fs) > 0); // the root directory keeps its block
+	test_free_counts(&fs, &blocks, &inodes);
+
+	// removed while open: still there through the handle
+	char *data = malloc(SIZE), *back = malloc(SIZE);
+	for (size_t i = 0; i < SIZE; i++)
+		data[i] = (char)(i % 251);
+	long f = test_create("/f", S_IFREG | 0644, &fs);
+	a1fs_handle *fh = test_open("/f", &fs);
+	if (!CHECK(f > 0 && fh != NULL))
+		return;
+	CHECK(write_file(f, fh, data, SIZE, 0, &fs) == SIZE);
+	CHECK(flush_file(f, &fs) == 0);
+	test_free_counts(&fs, &used, &inodes_now);
+	CHECK(test_remove("/f", false, &fs) == 0);
+	CHECK(path_lookup("/f", &fs) == -ENOENT);
+	CHECK(fs.sb->orphans_count == 1);
+	test_free_counts(&fs, &left, &inodes_now);
+	CHECK(left == used);
+	CHECK(inodes_now == inodes - 1);
+	struct stat st;
+	CHECK(stat_inode(f, &st, &fs) == 0 && st.st_nlink == 0 && st.st_size == SIZE);
+	CHECK(read_file(f, fh, back, SIZE, 0, &fs) == SIZE && memcmp(data, back, SIZE) == 0);
+	CHECK(write_file(f, fh, "again", 5, SIZE, &fs) == 5);
+	CHECK(resize_file(f, A1FS_BLOCK_SIZE, &fs) == 0);
+	CHECK(read_file(f, fh, back, SIZE, 0, &fs) == A1FS_BLOCK_SIZE && memcmp(data, back, A1FS_BLOCK_SIZE) == 0);
+
+	// another open handle and a lookup reference keep it too; the last one to go frees it
+	uint32_t gen;
+	CHECK(ref_inode(f, &gen, &fs) == 0);
+	a1fs_handle *fh2 = NULL;
+	CHECK(open_inode(f, &fh2, &fs) == 0);
+	release_file(fh, &fs);
+	release_file(fh2, &fs);
+	CHECK(stat_inode(f, &st, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(inodes_now == inodes - 1);
+	forget_inode(f, 1, &fs);
+	CHECK(stat_inode(f, &st, &fs) == -ENOENT);
+	CHECK(open_inode(f, &fh, &fs) == -ENOENT);
+	CHECK(fs.sb->orphans_count == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+
+	// a removed file without references is freed right away, and its number gets a new generation
+	CHECK(test_create("/d", S_IFDIR | 0755, &fs) > 0);
+	long g = test_create("/d/g", S_IFREG | 0644, &fs);
+	uint32_t old = generation(g);
+	CHECK(test_remove("/d/g", false, &fs) == 0);
+	CHECK(fs.sb->orphans_count == 0);
+	long reused = -1;
+	char path[32];
+	for (int i = 0; i < 64 && reused != g; i++) {
+		snprintf(path, sizeof(path), "/d/n%d", i);
+		reused = test_create(path, S_IFREG | 0644, &fs);
+		if (!CHECK(reused > 0))
+			break;
+	}
+	if (CHECK(reused == g))
+		CHECK(generation(g) != old);
+	for (int i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path), "/d/n%d", i);
+		test_remove(path, false, &fs);
+	}
+	CHECK(test_remove("/d", true, &fs) == 0);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+
+	// a crash with an orphan: the image as it is on disk once the removal is committed
+	f = test_create("/f", S_IFREG | 0644, &fs);
+	fh = test_open("/f", &fs);
+	CHECK(write_file(f, fh, data, SIZE, 0, &fs) == SIZE);
+	CHECK(flush_file(f, &fs) == 0);
+	CHECK(test_remove("/f", false, &fs) == 0);
+	CHECK(journal_commit(&fs.journal) == 0);
+	CHECK(fs.sb->orphans_count == 1);
+	CHECK(copy_image(IMG, CRASH));
+	test_unmount(&fs); // frees the orphan, the handle is never released
+	free(fh);
+
+	CHECK(test_mount(&fs, &opts));
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	CHECK(fs.sb->orphans_count == 0);
+	test_unmount(&fs);
+
+	opts.img_path = CRASH;
+	for (int mount = 0; mount < 2; mount++) {
+		if (!CHECK(test_mount(&fs, &opts)))
+			break;
+		test_free_counts(&fs, &blocks_now, &inodes_now);
+		CHECK(blocks_now == blocks);
+		CHECK(inodes_now == inodes);
+		CHECK(fs.sb->orphans_count == 0);
+		CHECK(path_lookup("/f", &fs) == -ENOENT);
+		test_unmount(&fs);
+	}
+	free(data);
+	free(back);
+}
+
+int main(void)
+{
+	run("-j 256");
+	run("-d -s -j 256");
+	remove(IMG);
+	remove(CRASH);
+	return test_report("orphan_test");
+}
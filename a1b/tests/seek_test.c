@@ -0,0 +1,119 @@
+/**
+ * SEEK_DATA and SEEK_HOLE (seek_file(), which both FUSE front ends offer as
+ * A1FS_IOC_SEEK_DATA and A1FS_IOC_SEEK_HOLE): data and holes must be found
+ * in a dense file, a sparse one, one that ends in a hole, an inline one and
+ * one with data staged by delayed allocation, with the end of the file
+ * counting as a hole and ENXIO at or past it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/seek_test.img"
+#define B A1FS_BLOCK_SIZE
+
+
+static fs_ctx fs;
+
+static int64_t data(long ino, int64_t offset)
+{
+	return seek_file(ino, offset, false, &fs);
+}
+
+static int64_t hole(long ino, int64_t offset)
+{
+	return seek_file(ino, offset, true, &fs);
+}
+
+static void write_at(long ino, off_t offset, size_t size)
+{
+	char *buf = malloc(size);
+	memset(buf, 'x', size);
+	CHECK(write_file(ino, NULL, buf, size, offset, &fs) == (long)size);
+	free(buf);
+}
+
+static void run(const char *mkfs_args, bool delalloc)
+{
+	printf("seek_test: mkfs %s%s\n", mkfs_args, delalloc ? ", delalloc" : "");
+	if (!CHECK(test_mkfs(IMG, 4 << 20, 64, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.delalloc = delalloc;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+
+	// empty: no data, and nothing to seek in
+	long f = test_create("/empty", S_IFREG | 0644, &fs);
+	CHECK(data(f, 0) == -ENXIO);
+	CHECK(hole(f, 0) == -ENXIO);
+	CHECK(data(f, -1) == -ENXIO);
+
+	// dense: data up to the end, which is the only hole
+	f = test_create("/dense", S_IFREG | 0644, &fs);
+	off_t size = 3 * B + 100;
+	write_at(f, 0, size);
+	CHECK(flush_file(f, &fs) == 0);
+	CHECK(data(f, 0) == 0);
+	CHECK(data(f, 2 * B + 7) == 2 * B + 7);
+	CHECK(hole(f, 0) == size);
+	CHECK(hole(f, size - 1) == size);
+	CHECK(data(f, size) == -ENXIO);
+	CHECK(hole(f, size) == -ENXIO);
+
+	// sparse: blocks 0, 5-6 and part of 20
+	f = test_create("/sparse", S_IFREG | 0644, &fs);
+	write_at(f, 0, B);
+	write_at(f, 5 * B, 2 * B);
+	write_at(f, 20 * B, 10);
+	CHECK(flush_file(f, &fs) == 0);
+	size = 20 * B + 10;
+	CHECK(data(f, 0) == 0);
+	CHECK(hole(f, 0) == B);
+	CHECK(hole(f, 100) == B);
+	CHECK(data(f, B) == 5 * B);
+	CHECK(data(f, 3 * B + 1) == 5 * B);
+	CHECK(data(f, 5 * B + 100) == 5 * B + 100);
+	CHECK(hole(f, 5 * B) == 7 * B);
+	CHECK(hole(f, 3 * B) == 3 * B);
+	CHECK(data(f, 7 * B) == 20 * B);
+	CHECK(hole(f, 20 * B) == size);
+	CHECK(data(f, size) == -ENXIO);
+
+	// ending in a hole: no data past the last block that has some
+	CHECK(resize_file(f, 30 * B, &fs) == 0);
+	CHECK(hole(f, 20 * B) == 21 * B);
+	CHECK(data(f, 21 * B) == -ENXIO);
+	CHECK(hole(f, 25 * B) == 25 * B);
+
+	// appended data (staged with delalloc) is data until the end
+	write_at(f, 30 * B, 50);
+	size = 30 * B + 50;
+	CHECK(data(f, 21 * B) == 30 * B);
+	CHECK(hole(f, 30 * B) == size);
+	CHECK(flush_file(f, &fs) == 0);
+	CHECK(data(f, 21 * B) == 30 * B);
+	CHECK(hole(f, 30 * B) == size);
+
+	// small (inline with mkfs -s): all data
+	f = test_create("/small", S_IFREG | 0644, &fs);
+	write_at(f, 0, 40);
+	CHECK(data(f, 10) == 10);
+	CHECK(hole(f, 10) == 40);
+	CHECK(data(f, 40) == -ENXIO);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	run("", false);
+	run("-s -j 256", true);
+	remove(IMG);
+	return test_report("seek_test");
+}
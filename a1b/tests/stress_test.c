@@ -0,0 +1,292 @@
+/**
+ * Concurrency stress test: threads create, write, read, list and remove files
+ * and directories in shared directories at the same time. Every file has one
+ * writer, so its contents can be checked; a shared file is written by all of
+ * them at disjoint offsets. Once everything is removed, the free block and
+ * inode counts must be back where they started, also after a remount.
+ *
+ * The uring run does the I/O of the cache through io_uring (or through the
+ * pread() fallback where it is not available), and also reads a file back
+ * after read-ahead has been started for every other block of it, so there are
+ * more reads in flight than the ring has room for, and unmounts with
+ * read-ahead still in flight.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+#define IMG "tests/stress_test.img"
+#define THREADS 8
+#define ITERATIONS 300
+/** Files each thread cycles through in a shared directory. */
+#define FILES 7
+/** Bytes each thread owns in the shared file. */
+#define SLICE (64 * 1024)
+/** Size of the file read back after read-ahead. */
+#define PREFETCH_SIZE (8 << 20)
+
+
+static fs_ctx fs;
+
+/** Fill a buffer with a pattern that identifies the thread and the iteration. */
+static void pattern(char *buf, size_t len, long id, int it)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(id * 31 + it * 7 + i % 251);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name;
+	(void)st;
+	(void)off;
+	(*(int *)buf)++;
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	char dir[32], path[64], sub[64];
+	size_t len = 3 * A1FS_BLOCK_SIZE + 100;
+	char *buf = malloc(len), *back = malloc(len);
+	a1fs_handle *shared = test_open("/shared", &fs);
+	CHECK(shared != NULL);
+
+	for (int it = 0; it < ITERATIONS; it++) {
+		// two directories everyone works in, which come and go
+		snprintf(dir, sizeof(dir), "/s%ld", id % 2);
+		long res = test_create(dir, S_IFDIR | 0755, &fs);
+		CHECK(res >= 0 || res == -EEXIST);
+
+		snprintf(path, sizeof(path), "%s/f%ld_%d", dir, id, it % FILES);
+		res = test_create(path, S_IFREG | 0644, &fs);
+		if (res == -ENOENT)
+			continue; // the directory was removed in between
+		CHECK(res >= 0 || res == -EEXIST);
+
+		a1fs_handle *fh = test_open(path, &fs);
+		if (fh == NULL)
+			continue; // the directory was removed in between
+		size_t n = 1 + (size_t)(it * 997) % len;
+		pattern(buf, n, id, it);
+		CHECK(resize_file(fh->ino, 0, &fs) == 0);
+		CHECK(write_file(fh->ino, fh, buf, n, 0, &fs) == (long)n);
+		CHECK(read_file(fh->ino, fh, back, len, 0, &fs) == (long)n);
+		CHECK(memcmp(buf, back, n) == 0);
+		if (it % 5 == 0)
+			CHECK(sync_file(fh->ino, &fs) == 0);
+		release_file(fh, &fs);
+
+		// this thread's slice of the shared file
+		pattern(buf, A1FS_BLOCK_SIZE, id, it);
+		off_t off = id * SLICE + (it % (SLICE / A1FS_BLOCK_SIZE)) * A1FS_BLOCK_SIZE;
+		CHECK(write_file(shared->ino, shared, buf, A1FS_BLOCK_SIZE, off, &fs) == A1FS_BLOCK_SIZE);
+		CHECK(read_file(shared->ino, shared, back, A1FS_BLOCK_SIZE, off, &fs) == A1FS_BLOCK_SIZE);
+		CHECK(memcmp(buf, back, A1FS_BLOCK_SIZE) == 0);
+
+		long dir_ino = path_lookup(dir, &fs);
+		if (dir_ino >= 0) {
+			int entries = 0;
+			res = read_dir(dir_ino, 0, count_entry, &entries, &fs);
+			CHECK(res == 0 || res == -ENOENT);
+		}
+
+		snprintf(sub, sizeof(sub), "%s/d%ld", dir, id);
+		if (test_create(sub, S_IFDIR | 0755, &fs) >= 0)
+			CHECK(test_remove(sub, true, &fs) == 0);
+
+		struct stat st;
+		res = path_lookup(path, &fs);
+		if (res >= 0) {
+			int r = stat_inode(res, &st, &fs);
+			CHECK(r == -ENOENT || (r == 0 && S_ISREG(st.st_mode)));
+		}
+		if (it % 3 == 0) {
+			res = test_remove(path, false, &fs);
+			CHECK(res == 0 || res == -ENOENT);
+		}
+		if (it % 50 == 49) {
+			res = test_remove(dir, true, &fs);
+			CHECK(res == 0 || res == -ENOTEMPTY || res == -ENOENT);
+		}
+	}
+	release_file(shared, &fs);
+	free(buf);
+	free(back);
+	return NULL;
+}
+
+/** Run the workers on a mounted image and check the shared file. */
+static void run_workers(void)
+{
+	CHECK(test_create("/shared", S_IFREG | 0644, &fs) >= 0);
+	pthread_t threads[THREADS];
+	for (long i = 0; i < THREADS; i++)
+		CHECK(pthread_create(&threads[i], NULL, worker, (void *)i) == 0);
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	// the last block each thread wrote to every position of its slice
+	a1fs_handle *fh = test_open("/shared", &fs);
+	char expect[A1FS_BLOCK_SIZE], got[A1FS_BLOCK_SIZE];
+	for (long id = 0; id < THREADS; id++) {
+		for (int it = ITERATIONS - SLICE / A1FS_BLOCK_SIZE; it < ITERATIONS; it++) {
+			pattern(expect, sizeof(expect), id, it);
+			off_t off = id * SLICE + (it % (SLICE / A1FS_BLOCK_SIZE)) * A1FS_BLOCK_SIZE;
+			CHECK(read_file(fh->ino, fh, got, sizeof(got), off, &fs) == sizeof(got));
+			CHECK(memcmp(expect, got, sizeof(got)) == 0);
+		}
+	}
+	release_file(fh, &fs);
+}
+
+/** Remove what the workers left behind. */
+static void clean_up(void)
+{
+	char path[64];
+	for (int d = 0; d < 2; d++) {
+		for (int id = 0; id < THREADS; id++) {
+			for (int k = 0; k < FILES; k++) {
+				snprintf(path, sizeof(path), "/s%d/f%d_%d", d, id, k);
+				test_remove(path, false, &fs);
+			}
+		}
+		snprintf(path, sizeof(path), "/s%d", d);
+		int res = test_remove(path, true, &fs);
+		CHECK(res == 0 || res == -ENOENT);
+	}
+	CHECK(test_remove("/shared", false, &fs) == 0);
+}
+
+/** Physical block of each block of a file, or NULL on error. */
+static long *file_blocks(uint32_t ino, uint32_t count)
+{
+	long *blocks = malloc(count * sizeof(long));
+	inode_rdlock(&fs, ino);
+	for (uint32_t b = 0; blocks != NULL && b < count; b++)
+		blocks[b] = map_file_block(ino, b, NULL, NULL, &fs);
+	inode_unlock(&fs, ino);
+	return blocks;
+}
+
+/** Read every other block of a file into the cache. */
+static void read_every_other(const long *blocks, uint32_t count)
+{
+	for (uint32_t b = 0; b < count; b += 2) {
+		CHECK(blocks[b] >= 0 && bdev_get(&fs.dev, blocks[b], 1, true) != NULL);
+		bdev_put(&fs.dev, blocks[b], 1, false);
+	}
+}
+
+/**
+ * Read a file back with every other block of it in the cache, so that each of
+ * the others is a read of its own: once after read-ahead was started for all of
+ * them, and once with bdev_get() of its extents, which are one batch of more
+ * reads than the ring has room for. Then start read-ahead again and unmount
+ * right away.
+ */
+static void prefetch_read(a1fs_opts *opts)
+{
+	char *data = malloc(PREFETCH_SIZE), *back = malloc(PREFETCH_SIZE);
+	pattern(data, PREFETCH_SIZE, THREADS, 0);
+	long ino = test_create("/prefetch", S_IFREG | 0644, &fs);
+	a1fs_handle *fh = test_open("/prefetch", &fs);
+	if (!CHECK(ino > 0 && fh != NULL))
+		return;
+	CHECK(write_file(ino, fh, data, PREFETCH_SIZE, 0, &fs) == PREFETCH_SIZE);
+	release_file(fh, &fs);
+	test_unmount(&fs);
+
+	uint32_t count = PREFETCH_SIZE / A1FS_BLOCK_SIZE;
+	for (int mount = 0; mount < 3; mount++) {
+		if (!CHECK(test_mount(&fs, opts)))
+			break;
+		long *blocks = file_blocks(ino, count);
+		if (!CHECK(blocks != NULL))
+			break;
+		if (mount == 0) {
+			read_every_other(blocks, count);
+			for (uint32_t b = 0; b < count; b++)
+				bdev_prefetch(&fs.dev, blocks[b], 1);
+			fh = test_open("/prefetch", &fs);
+			CHECK(read_file(ino, fh, back, PREFETCH_SIZE, 0, &fs) == PREFETCH_SIZE);
+			CHECK(memcmp(data, back, PREFETCH_SIZE) == 0);
+			release_file(fh, &fs);
+		} else if (mount == 1) {
+			read_every_other(blocks, count);
+			for (uint32_t b = 0, run; b < count; b += run) {
+				for (run = 1; b + run < count && blocks[b + run] == blocks[b] + run; run++)
+					;
+				char *got = bdev_get(&fs.dev, blocks[b], run, true);
+				if (CHECK(got != NULL)) {
+					CHECK(memcmp(data + (size_t)b * A1FS_BLOCK_SIZE, got, (size_t)run * A1FS_BLOCK_SIZE) == 0);
+					bdev_put(&fs.dev, blocks[b], run, false);
+				}
+			}
+		} else {
+			for (uint32_t b = 0; b < count; b++)
+				bdev_prefetch(&fs.dev, blocks[b], 1);
+		}
+		free(blocks);
+		test_unmount(&fs); // the last time with the reads still in flight
+	}
+
+	CHECK(test_mount(&fs, opts));
+	fh = test_open("/prefetch", &fs);
+	CHECK(read_file(ino, fh, back, PREFETCH_SIZE, 0, &fs) == PREFETCH_SIZE);
+	CHECK(memcmp(data, back, PREFETCH_SIZE) == 0);
+	release_file(fh, &fs);
+	CHECK(test_remove("/prefetch", false, &fs) == 0);
+	free(data);
+	free(back);
+}
+
+static void stress(const char *mkfs_args, bool delalloc, unsigned int cache, bool uring)
+{
+	printf("stress_test: mkfs %s%s%s%s\n", mkfs_args, delalloc ? ", delalloc" : "", cache ? ", cache" : "",
+	       uring ? ", uring" : "");
+	if (!CHECK(test_mkfs(IMG, 64 << 20, 4096, mkfs_args)))
+		return;
+	a1fs_opts opts;
+	test_opts(&opts, IMG);
+	opts.delalloc = delalloc;
+	opts.cache = cache;
+	opts.uring = uring;
+	if (!CHECK(test_mount(&fs, &opts)))
+		return;
+
+	uint64_t blocks, inodes, blocks_now, inodes_now;
+	test_free_counts(&fs, &blocks, &inodes);
+	run_workers();
+	clean_up();
+	if (uring)
+		prefetch_read(&opts);
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+
+	// and the same on disk
+	CHECK(test_mount(&fs, &opts));
+	test_free_counts(&fs, &blocks_now, &inodes_now);
+	CHECK(blocks_now == blocks);
+	CHECK(inodes_now == inodes);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	stress("", false, 0, false);
+	stress("-d -g 2048", false, 0, false);
+	stress("-d -s -c -j 1024", true, 16, false);
+	stress("-d -j 1024", false, 16, true);
+	remove(IMG);
+	return test_report("stress_test");
+}
@@ -0,0 +1,124 @@
+/**
+ * Helpers shared by the a1fs tests (see test_util.h).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "helpers.h"
+
+/** Seconds between journal commits in tests; the default of the option parser is 5. */
+#define TEST_COMMIT 1
+
+
+int test_failures = 0;
+
+bool test_check(bool ok, const char *what, const char *file, int line)
+{
+	if (!ok) {
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+		test_failures++;
+	}
+	return ok;
+}
+
+bool test_mkfs(const char *img, size_t size, uint32_t inodes, const char *args)
+{
+	int fd = open(img, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		perror(img);
+		return false;
+	}
+	bool ok = ftruncate(fd, size) == 0;
+	close(fd);
+	if (!ok) {
+		perror(img);
+		return false;
+	}
+
+	char cmd[512];
+	snprintf(cmd, sizeof(cmd), "./mkfs.a1fs -f -i %u %s %s", inodes, args, img);
+	if (system(cmd) != 0) {
+		fprintf(stderr, "%s failed\n", cmd);
+		return false;
+	}
+	return true;
+}
+
+void test_opts(a1fs_opts *opts, const char *img)
+{
+	memset(opts, 0, sizeof(a1fs_opts));
+	opts->img_path = img;
+	opts->commit = TEST_COMMIT;
+}
+
+bool test_mount(fs_ctx *fs, a1fs_opts *opts)
+{
+	memset(fs, 0, sizeof(fs_ctx));
+	if (!mount_image(opts, fs))
+		return false;
+	start_fs_threads(fs);
+	return true;
+}
+
+void test_unmount(fs_ctx *fs)
+{
+	unmount_image(fs);
+}
+
+/** Resolve the parent directory of a path. */
+static long parent_of(const char *path, fs_ctx *fs)
+{
+	char parent[strlen(path) + 1];
+	strcpy(parent, path);
+	set_parent_path(parent);
+	return path_lookup(parent, fs);
+}
+
+long test_create(const char *path, mode_t mode, fs_ctx *fs)
+{
+	long parent = parent_of(path, fs);
+	if (parent < 0)
+		return parent;
+	return create_inode(parent, get_last_component(path), mode, path, fs);
+}
+
+int test_remove(const char *path, bool is_dir, fs_ctx *fs)
+{
+	long parent = parent_of(path, fs);
+	if (parent < 0)
+		return parent;
+	return remove_inode(parent, get_last_component(path), is_dir, path, fs);
+}
+
+a1fs_handle *test_open(const char *path, fs_ctx *fs)
+{
+	long ino = path_lookup(path, fs);
+	if (ino < 0)
+		return NULL;
+	a1fs_handle *fh;
+	return open_inode(ino, &fh, fs) == 0 ? fh : NULL;
+}
+
+void test_free_counts(fs_ctx *fs, uint64_t *blocks, uint64_t *inodes)
+{
+	struct statvfs st;
+	stat_fs(&st, fs);
+	*blocks = st.f_bfree;
+	*inodes = st.f_ffree;
+}
+
+int test_report(const char *name)
+{
+	if (test_failures == 0) {
+		printf("%s: passed\n", name);
+		return 0;
+	}
+	printf("%s: %d check(s) failed\n", name, test_failures);
+	return 1;
+}
@@ -0,0 +1,71 @@
+/**
+ * Helpers shared by the a1fs tests.
+ *
+ * A test formats an image with mkfs.a1fs, mounts it in-process with
+ * mount_image() and drives the file system through the operations of
+ * fs_ops.h, the layer both FUSE front ends are built on; no FUSE mount is
+ * needed. Tests are run from the a1b directory (make test), where mkfs.a1fs is
+ * built.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs_ctx.h"
+#include "fs_ops.h"
+#include "options.h"
+
+
+/** Count a failed check and report where it is; evaluates to cond. */
+#define CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+/** Number of failed checks so far. */
+extern int test_failures;
+
+bool test_check(bool ok, const char *what, const char *file, int line);
+
+/**
+ * Create (or truncate) an image file and format it with mkfs.a1fs.
+ *
+ * @param img    the image file.
+ * @param size   its size in bytes, a multiple of the block size.
+ * @param inodes the number of inodes.
+ * @param args   extra mkfs.a1fs options (e.g. "-d -j 256"); "" for none.
+ * @return       true on success.
+ */
+bool test_mkfs(const char *img, size_t size, uint32_t inodes, const char *args);
+
+/** Fill in the options of a mount with the defaults of the option parser. */
+void test_opts(a1fs_opts *opts, const char *img);
+
+/** Mount an image and start the background threads like the FUSE init() callback. */
+bool test_mount(fs_ctx *fs, a1fs_opts *opts);
+
+/** Unmount an image mounted with test_mount(). */
+void test_unmount(fs_ctx *fs);
+
+/**
+ * Create a file or directory by path (like the high-level front end does).
+ *
+ * @return  the inode number; -errno on error.
+ */
+long test_create(const char *path, mode_t mode, fs_ctx *fs);
+
+/** Remove a file or an empty directory by path. */
+int test_remove(const char *path, bool is_dir, fs_ctx *fs);
+
+/** Open a file by path; the handle is closed with release_file(). */
+a1fs_handle *test_open(const char *path, fs_ctx *fs);
+
+/** Free blocks and inodes, for checking that nothing leaked. */
+void test_free_counts(fs_ctx *fs, uint64_t *blocks, uint64_t *inodes);
+
+/**
+ * Print the result of a test program.
+ *
+ * @return  the exit status: 0 if every check passed.
+ */
+int test_report(const char *name);
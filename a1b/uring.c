@@ -0,0 +1,313 @@
+/**
+ * io_uring engine implementation.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Record the result of a request. A uring_submit_wait() request counts its
+ * batch down; a uring_submit() one goes on the done list, whose callbacks the
+ * caller runs once it has released r->lock.
+ */
+static void finish(uring_req *req, int res, uring_req **done)
+{
+	if (req == NULL)
+		return; // the wakeup of uring_destroy()
+	req->res = res;
+	if (req->left != NULL) {
+		(*req->left)--;
+	} else {
+		req->next = *done;
+		*done = req;
+	}
+}
+
+static void run_done(uring_req *done)
+{
+	while (done != NULL) {
+		uring_req *next = done->next;
+		done->done(done);
+		done = next;
+	}
+}
+
+/**
+ * Hand the queued entries to the kernel. If that fails for a reason other
+ * than a transient one, they are taken back and fail with -EIO. The caller
+ * holds r->lock.
+ */
+static void flush(uring *r, uring_req **done)
+{
+	while (r->sq_pending > 0) {
+		int ret = sys_io_uring_enter(r->fd, r->sq_pending, 0, 0);
+		if (ret > 0) {
+			r->sq_pending -= ret;
+			continue;
+		}
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+			continue;
+
+		perror("io_uring_enter");
+		// the kernel has not looked at these yet (no SQPOLL), so they can be taken back
+		unsigned int tail = *r->sq_tail;
+		for (unsigned int i = tail - r->sq_pending; i != tail; i++) {
+			struct io_uring_sqe *sqe = &r->sqes[r->sq_array[i & r->sq_mask]];
+			r->inflight--;
+			finish((uring_req *)(uintptr_t)sqe->user_data, -EIO, done);
+		}
+		__atomic_store_n(r->sq_tail, tail - r->sq_pending, __ATOMIC_RELEASE);
+		r->sq_pending = 0;
+		pthread_cond_broadcast(&r->reaped);
+	}
+}
+
+/**
+ * Fill in a submission queue entry for a request (a no-op if req is NULL),
+ * waiting for room in the completion queue first. The caller holds r->lock.
+ */
+static void queue_req(uring *r, uring_req *req, uring_req **done)
+{
+	while (r->inflight >= r->cq_entries) {
+		flush(r, done);
+		pthread_cond_wait(&r->reaped, &r->lock);
+	}
+	if (r->sq_pending == r->sq_entries)
+		flush(r, done);
+
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx = tail & r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)req;
+	if (req == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+	} else {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+		switch (req->op) {
+		case URING_READ:
+		case URING_WRITE:
+			sqe->opcode = req->op == URING_READ ? IORING_OP_READ : IORING_OP_WRITE;
+			sqe->addr = (uintptr_t)req->buf;
+			sqe->len = req->len;
+			sqe->off = req->off;
+			break;
+		case URING_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->flags |= IOSQE_IO_DRAIN;
+			break;
+		}
+	}
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->sq_pending++;
+	r->inflight++;
+}
+
+/** Take the completions off the completion queue. The caller holds r->lock. */
+static uring_req *reap(uring *r)
+{
+	uring_req *done = NULL;
+	unsigned int head = *r->cq_head;
+	unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		r->inflight--;
+		finish((uring_req *)(uintptr_t)cqe->user_data, cqe->res, &done);
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+static void *completion_thread(void *arg)
+{
+	uring *r = arg;
+	pthread_mutex_lock(&r->lock);
+	while (!r->stopping || r->inflight > 0) {
+		pthread_mutex_unlock(&r->lock);
+		if (sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			usleep(1000); // don't spin on a persistent error
+		}
+		pthread_mutex_lock(&r->lock);
+		uring_req *done = reap(r);
+		pthread_cond_broadcast(&r->reaped);
+		if (done != NULL) {
+			pthread_mutex_unlock(&r->lock);
+			run_done(done);
+			pthread_mutex_lock(&r->lock);
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static void unmap_rings(uring *r)
+{
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != NULL)
+		munmap(r->sq_ring, r->sq_ring_size);
+}
+
+/** Map the rings of a ring descriptor that io_uring_setup() returned. */
+static bool map_rings(uring *r, const struct io_uring_params *p)
+{
+	r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p->features & IORING_FEAT_SINGLE_MMAP;
+	if (single && r->cq_ring_size > r->sq_ring_size)
+		r->sq_ring_size = r->cq_ring_size;
+
+	void *sq = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return false;
+	r->sq_ring = sq;
+	if (single) {
+		r->cq_ring = sq;
+	} else {
+		void *cq = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return false;
+		r->cq_ring = cq;
+	}
+	r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  r->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	r->sqes = sqes;
+
+	uint8_t *sqr = r->sq_ring;
+	r->sq_head = (unsigned int *)(sqr + p->sq_off.head);
+	r->sq_tail = (unsigned int *)(sqr + p->sq_off.tail);
+	r->sq_array = (unsigned int *)(sqr + p->sq_off.array);
+	r->sq_mask = *(unsigned int *)(sqr + p->sq_off.ring_mask);
+	r->sq_entries = p->sq_entries;
+
+	uint8_t *cqr = r->cq_ring;
+	r->cq_head = (unsigned int *)(cqr + p->cq_off.head);
+	r->cq_tail = (unsigned int *)(cqr + p->cq_off.tail);
+	r->cqes = (struct io_uring_cqe *)(cqr + p->cq_off.cqes);
+	r->cq_mask = *(unsigned int *)(cqr + p->cq_off.ring_mask);
+	r->cq_entries = p->cq_entries;
+	return true;
+}
+
+
+bool uring_init(uring *r, unsigned int entries, int file_fd)
+{
+	memset(r, 0, sizeof(uring));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return false;
+
+	if (!map_rings(r, &p) || sys_io_uring_register(r->fd, IORING_REGISTER_FILES, &file_fd, 1) < 0) {
+		unmap_rings(r);
+		close(r->fd);
+		r->fd = -1;
+		return false;
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->reaped, NULL);
+	if (pthread_create(&r->thread, NULL, completion_thread, r) != 0) {
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->reaped);
+		unmap_rings(r);
+		close(r->fd);
+		r->fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void uring_destroy(uring *r)
+{
+	if (r->fd < 0)
+		return;
+
+	// The completion thread exits once nothing is in flight; the no-op makes
+	// sure it returns from io_uring_enter() to find that out
+	uring_req *done = NULL;
+	pthread_mutex_lock(&r->lock);
+	r->stopping = true;
+	queue_req(r, NULL, &done);
+	flush(r, &done);
+	pthread_mutex_unlock(&r->lock);
+	run_done(done);
+	pthread_join(r->thread, NULL);
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->reaped);
+	unmap_rings(r);
+	close(r->fd);
+	r->fd = -1;
+}
+
+bool uring_submit_wait(uring *r, uring_req *reqs, unsigned int n)
+{
+	unsigned int left = n;
+	uring_req *done = NULL;
+	pthread_mutex_lock(&r->lock);
+	for (unsigned int i = 0; i < n; i++) {
+		reqs[i].left = &left;
+		queue_req(r, &reqs[i], &done);
+	}
+	flush(r, &done);
+	while (left > 0)
+		pthread_cond_wait(&r->reaped, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	run_done(done);
+
+	bool ok = true;
+	for (unsigned int i = 0; i < n; i++) {
+		if (reqs[i].op == URING_FSYNC)
+			ok &= reqs[i].res == 0;
+		else
+			ok &= reqs[i].res >= 0 && (size_t)reqs[i].res == reqs[i].len;
+	}
+	return ok;
+}
+
+void uring_submit(uring *r, uring_req *req)
+{
+	uring_req *done = NULL;
+	req->left = NULL;
+	pthread_mutex_lock(&r->lock);
+	queue_req(r, req, &done);
+	flush(r, &done);
+	pthread_mutex_unlock(&r->lock);
+	run_done(done);
+}
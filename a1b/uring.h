@@ -0,0 +1,127 @@
+/**
+ * Asynchronous I/O on the image file with io_uring.
+ *
+ * A small engine on top of the raw system calls (io_uring_setup(2),
+ * io_uring_enter(2), io_uring_register(2)); liburing is not needed. The image
+ * file is registered as fixed file 0, so the kernel doesn't look the
+ * descriptor up for every request.
+ *
+ * Any thread can submit requests; a batch of them costs one io_uring_enter()
+ * however many there are. Completions are reaped by a thread the engine
+ * starts, which either wakes the thread waiting for the batch
+ * (uring_submit_wait()) or calls the request's done callback
+ * (uring_submit()).
+ *
+ * The buffers are not registered: the pread backend of the block device layer
+ * (see bdev.h) reads blocks into a reservation the size of the image, and
+ * registering it would pin all of it in memory.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef enum uring_op {
+	URING_READ,
+	URING_WRITE,
+	/** fdatasync() of the file once every request submitted before it has completed. */
+	URING_FSYNC,
+
+} uring_op;
+
+typedef struct uring_req {
+	uring_op op;
+	void *buf;
+	size_t len;
+	uint64_t off;
+	/** Bytes transferred (0 for URING_FSYNC) or -errno, once complete. */
+	int res;
+	/**
+	 * Called by the completion thread, with no lock held, when a request of
+	 * uring_submit() completes.
+	 */
+	void (*done)(struct uring_req *req);
+	void *arg;
+
+	// Private to the engine
+	/** Requests of the same uring_submit_wait() batch that have not completed. */
+	unsigned int *left;
+	struct uring_req *next;
+
+} uring_req;
+
+typedef struct uring {
+	/** The ring descriptor; -1 if the engine is not running. */
+	int fd;
+
+	// Submission queue
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	/** Entries filled in since the last io_uring_enter(). */
+	unsigned int sq_pending;
+
+	// Completion queue
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/** Protects the submission queue, inflight and stopping. */
+	pthread_mutex_t lock;
+	/** Signalled when the completion thread has reaped completions. */
+	pthread_cond_t reaped;
+	/** Requests submitted and not reaped yet; kept within cq_entries so the completion queue never overflows. */
+	unsigned int inflight;
+	pthread_t thread;
+	bool stopping;
+
+} uring;
+
+/**
+ * Set up a ring, register the file and start the completion thread.
+ *
+ * @param entries  size of the submission queue (rounded up to a power of 2 by
+ *                 the kernel).
+ * @param file_fd  the file all requests are for.
+ * @return         true on success; false if io_uring is not available (e.g.
+ *                 an old kernel or a seccomp filter), leaving r->fd at -1.
+ */
+bool uring_init(uring *r, unsigned int entries, int file_fd);
+
+/**
+ * Wait for the requests in flight, stop the completion thread and tear the
+ * ring down. Does nothing if the engine is not running.
+ */
+void uring_destroy(uring *r);
+
+/**
+ * Submit a batch of requests and wait until all of them have completed.
+ *
+ * A request of a read or write can complete with a short count like pread()
+ * and pwrite(); the caller checks res of each one.
+ *
+ * @return  true if every request transferred all of its bytes (succeeded for
+ *          URING_FSYNC); false otherwise.
+ */
+bool uring_submit_wait(uring *r, uring_req *reqs, unsigned int n);
+
+/**
+ * Submit one request without waiting for it; req->done is called when it
+ * completes. req must stay valid until then.
+ */
+void uring_submit(uring *r, uring_req *req);